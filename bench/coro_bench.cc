@@ -0,0 +1,58 @@
+#include <benchmark/benchmark.h>
+
+#include <asio.hpp>
+
+#include "coro/asio_task.h"
+#include "coro/task.h"
+
+namespace socks {
+
+namespace {
+
+// The same loop of `n` awaits of a coroutine that completes right away,
+// as Task with its frames from the FramePool, and as asio::awaitable with
+// asio's recycling allocator. Both run on an io_context, started by a post.
+
+Task<int> TaskValue(int value) { co_return value; }
+
+Task<int> TaskLoop(int n) {
+  int sum{0};
+  for (int i = 0; i < n; ++i) sum += co_await TaskValue(i);
+  co_return sum;
+}
+
+asio::awaitable<int> AwaitableValue(int value) { co_return value; }
+
+asio::awaitable<int> AwaitableLoop(int n) {
+  int sum{0};
+  for (int i = 0; i < n; ++i) sum += co_await AwaitableValue(i);
+  co_return sum;
+}
+
+void BM_TaskAwait(benchmark::State &state) {
+  asio::io_context ctx;
+  const auto n = static_cast<int>(state.range(0));
+  for (auto _ : state) {
+    AsyncRun(ctx, TaskLoop(n), asio::detached);
+    ctx.run();
+    ctx.restart();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_TaskAwait)->Arg(1)->Arg(64);
+
+void BM_AwaitableAwait(benchmark::State &state) {
+  asio::io_context ctx;
+  const auto n = static_cast<int>(state.range(0));
+  for (auto _ : state) {
+    asio::co_spawn(ctx, AwaitableLoop(n), asio::detached);
+    ctx.run();
+    ctx.restart();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_AwaitableAwait)->Arg(1)->Arg(64);
+
+}  // namespace
+
+}  // namespace socks
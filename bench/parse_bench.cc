@@ -0,0 +1,114 @@
+#include <benchmark/benchmark.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <string>
+
+#include "tunnel/entities.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+constexpr std::string_view kGet =
+    "GET http://example.com/index.html HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: curl/7.79.1\r\n"
+    "Accept: */*\r\n"
+    "Proxy-Connection: Keep-Alive\r\n\r\n";
+
+constexpr std::string_view kConnect =
+    "CONNECT example.com:443 HTTP/1.1\r\n"
+    "Host: example.com:443\r\n"
+    "User-Agent: curl/7.79.1\r\n\r\n";
+
+// what a browser sends, cookies included
+std::string BrowserGet() {
+  std::string head =
+      "GET http://www.example.com/assets/app.js?v=3 HTTP/1.1\r\n"
+      "Host: www.example.com\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:99.0) Gecko/20100101 "
+      "Firefox/99.0\r\n"
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;"
+      "q=0.8\r\n"
+      "Accept-Language: en-US,en;q=0.5\r\n"
+      "Accept-Encoding: gzip, deflate\r\n"
+      "Referer: http://www.example.com/\r\n"
+      "Connection: keep-alive\r\n";
+  head += "Cookie: ";
+  for (int i = 0; i < 16; ++i) head += fmt::format("k{}=v{}; ", i, i);
+  head += "\r\n\r\n";
+  return head;
+}
+
+void BM_ParseGet(benchmark::State &state) {
+  for (auto _ : state) {
+    auto entity = RequestEntity::Parse(kGet);
+    benchmark::DoNotOptimize(entity);
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          static_cast<int64_t>(kGet.size()));
+}
+BENCHMARK(BM_ParseGet);
+
+void BM_ParseConnect(benchmark::State &state) {
+  for (auto _ : state) {
+    auto entity = RequestEntity::Parse(kConnect);
+    benchmark::DoNotOptimize(entity);
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          static_cast<int64_t>(kConnect.size()));
+}
+BENCHMARK(BM_ParseConnect);
+
+void BM_ParseBrowserGet(benchmark::State &state) {
+  const auto head = BrowserGet();
+  for (auto _ : state) {
+    auto entity = RequestEntity::Parse(head);
+    benchmark::DoNotOptimize(entity);
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          static_cast<int64_t>(head.size()));
+}
+BENCHMARK(BM_ParseBrowserGet);
+
+// The head arrives in pieces of `range(0)` bytes and is parsed on the way,
+// as a session does.
+void BM_FeedInPieces(benchmark::State &state) {
+  const auto head = BrowserGet();
+  const auto piece = static_cast<size_t>(state.range(0));
+  for (auto _ : state) {
+    RequestParser parser;
+    for (size_t size = piece;; size += piece) {
+      const auto status =
+          parser.Feed({head.data(), std::min(size, head.size())});
+      if (status != RequestParser::Status::kPartial) break;
+    }
+    benchmark::DoNotOptimize(parser.Entity());
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          static_cast<int64_t>(head.size()));
+}
+BENCHMARK(BM_FeedInPieces)->Arg(64)->Arg(512)->Arg(4096);
+
+void BM_UriAbsolute(benchmark::State &state) {
+  constexpr std::string_view kUri = "http://www.example.com:8080/a/b?c=d";
+  for (auto _ : state) {
+    auto uri = Uri::Parse(kUri);
+    benchmark::DoNotOptimize(uri);
+  }
+}
+BENCHMARK(BM_UriAbsolute);
+
+void BM_UriAuthority(benchmark::State &state) {
+  constexpr std::string_view kUri = "www.example.com:443";
+  for (auto _ : state) {
+    auto uri = Uri::Parse(kUri);
+    benchmark::DoNotOptimize(uri);
+  }
+}
+BENCHMARK(BM_UriAuthority);
+
+}  // namespace
+
+}  // namespace socks::tunnel
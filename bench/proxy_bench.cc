@@ -0,0 +1,497 @@
+// Runs an HttpProxy in process against a local origin stand-in and drives
+// one workload through it, e.g.
+//
+//   proxy_bench --workload=get --connections=64 --seconds=10
+//
+// connect  downloads `bulk` bytes through every CONNECT tunnel
+// get      keep-alive GETs of `size` bytes, back to back per connection
+// storm    one GET per connection, measures the accept rate
+// idle     opens idle tunnels and reports the memory each one costs
+//
+// `delay` and `loss` impair the origin: every response waits `delay`, and
+// with probability `loss` a retransmission timeout on top, which is what a
+// lost segment costs a tcp flow. Real packet loss needs netem on lo, e.g.
+// `tc qdisc add dev lo root netem delay 10ms loss 1%`.
+
+#include <asio.hpp>
+#include <charconv>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "observer/metrics.h"
+#include "tunnel/http_proxy.h"
+#include "utility/log.h"
+#include "utility/trace.h"
+
+namespace socks::bench {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// what a lost segment stalls a flow for, the minimum rto of linux
+constexpr auto kRto = std::chrono::milliseconds{200};
+constexpr size_t kChunk = 64 * 1024;
+
+struct BenchConfig {
+  std::string workload{"get"};
+  size_t connections{64};
+  std::chrono::seconds duration{10};
+  // io threads of the clients, and of the proxy where 0 is one per core
+  size_t threads{2};
+  size_t proxy_threads{0};
+  // response body of get and storm, download of each connect tunnel
+  size_t size{1024};
+  uint64_t bulk{uint64_t{1} << 30};
+  std::chrono::milliseconds delay{0};
+  double loss{0};
+  uint16_t port{18999};
+  tunnel::ZeroCopyMode zero_copy{tunnel::ZeroCopyMode::kNone};
+  tunnel::IoBackend io_backend{tunnel::IoBackend::kEpoll};
+  // scrape the proxy while it runs, 0 disables it
+  uint16_t metrics_port{0};
+  // admission control of the proxy, 0 is unlimited
+  size_t max_connections{0};
+  // binary trace of the proxy sessions, empty disables it
+  std::string trace;
+  // response cache of the proxy in bytes, 0 disables it, the origin then
+  // marks its responses as fresh for a minute
+  size_t cache{0};
+  // chains the proxy through as many parent proxies, on the ports after
+  // its own
+  size_t parents{0};
+};
+
+template <typename T>
+bool ParseNumber(std::string_view s, T &value) {
+  const auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+  return ec == std::errc{} && end == s.data() + s.size();
+}
+
+bool ParseArgs(int argc, char **argv, BenchConfig &config) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg{argv[i]};
+    const auto eq = arg.find('=');
+    if (!arg.starts_with("--") || eq == std::string_view::npos) return false;
+    const auto name = arg.substr(2, eq - 2);
+    const auto value = arg.substr(eq + 1);
+    int64_t n{0};
+    bool ok{true};
+    if (name == "workload") {
+      config.workload = value;
+    } else if (name == "connections") {
+      ok = ParseNumber(value, config.connections);
+    } else if (name == "seconds") {
+      ok = ParseNumber(value, n);
+      config.duration = std::chrono::seconds{n};
+    } else if (name == "threads") {
+      ok = ParseNumber(value, config.threads) && config.threads > 0;
+    } else if (name == "proxy-threads") {
+      ok = ParseNumber(value, config.proxy_threads);
+    } else if (name == "size") {
+      ok = ParseNumber(value, config.size);
+    } else if (name == "bulk") {
+      ok = ParseNumber(value, config.bulk);
+    } else if (name == "delay-ms") {
+      ok = ParseNumber(value, n);
+      config.delay = std::chrono::milliseconds{n};
+    } else if (name == "loss") {
+      ok = ParseNumber(value, config.loss);
+    } else if (name == "port") {
+      ok = ParseNumber(value, config.port);
+    } else if (name == "metrics-port") {
+      ok = ParseNumber(value, config.metrics_port);
+    } else if (name == "max-connections") {
+      ok = ParseNumber(value, config.max_connections);
+    } else if (name == "trace") {
+      config.trace = value;
+    } else if (name == "cache") {
+      ok = ParseNumber(value, config.cache);
+    } else if (name == "parents") {
+      ok = ParseNumber(value, config.parents);
+    } else if (name == "zero-copy") {
+      if (value == "splice") {
+        config.zero_copy = tunnel::ZeroCopyMode::kSplice;
+      } else if (value == "sockmap") {
+        config.zero_copy = tunnel::ZeroCopyMode::kSockMap;
+      } else {
+        ok = value == "none";
+      }
+    } else if (name == "io-backend") {
+      if (value == "uring") {
+        config.io_backend = tunnel::IoBackend::kIoUring;
+      } else {
+        ok = value == "epoll";
+      }
+    } else {
+      ok = false;
+    }
+    if (!ok) return false;
+  }
+  return config.workload == "connect" || config.workload == "get" ||
+         config.workload == "storm" || config.workload == "idle";
+}
+
+size_t ResidentBytes() {
+#ifdef __linux__
+  std::ifstream statm{"/proc/self/statm"};
+  size_t pages{0};
+  size_t resident{0};
+  statm >> pages >> resident;
+  return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+  return 0;
+#endif
+}
+
+// Answers `GET /bytes/<n>` with n bytes, keeps connections alive unless the
+// request asks for close.
+class Origin : NonCopyable {
+ public:
+  Origin(const BenchConfig &config, size_t threads)
+      : config_{config},
+        acceptor_{ctx_, {asio::ip::address_v4::loopback(), 0}},
+        work_{ctx_.get_executor()} {
+    co_spawn(ctx_, Accept(), asio::detached);
+    for (size_t i = 0; i < threads; ++i) {
+      threads_.emplace_back([this] { ctx_.run(); });
+    }
+  }
+  ~Origin() {
+    ctx_.stop();
+    for (auto &thread : threads_) thread.join();
+  }
+
+  [[nodiscard]] uint16_t Port() const {
+    return acceptor_.local_endpoint().port();
+  }
+
+ private:
+  asio::awaitable<void> Accept() {
+    while (true) {
+      auto socket = co_await acceptor_.async_accept(asio::use_awaitable);
+      socket.set_option(asio::ip::tcp::no_delay(true));
+      co_spawn(ctx_, Serve(std::move(socket)), asio::detached);
+    }
+  }
+
+  asio::awaitable<void> Serve(asio::ip::tcp::socket socket) {
+    static const std::vector<char> kZeros(kChunk);
+    std::minstd_rand random{std::random_device{}()};
+    asio::steady_timer timer{ctx_};
+    std::string in;
+    try {
+      while (true) {
+        const auto len = co_await asio::async_read_until(
+            socket, asio::dynamic_buffer(in), "\r\n\r\n", asio::use_awaitable);
+        const std::string_view head{in.data(), len};
+        uint64_t size{0};
+        const auto at = head.find("/bytes/");
+        if (at != std::string_view::npos) {
+          const auto digits = head.substr(at + 7);
+          std::from_chars(digits.data(), digits.data() + digits.size(), size);
+        }
+        const bool close = head.find("Connection: close") != head.npos;
+        in.erase(0, len);
+
+        auto wait = config_.delay;
+        if (config_.loss > 0 &&
+            std::uniform_real_distribution<>{}(random) < config_.loss) {
+          wait += kRto;
+        }
+        if (wait.count() > 0) {
+          timer.expires_after(wait);
+          co_await timer.async_wait(asio::use_awaitable);
+        }
+
+        const auto response = fmt::format(
+            "HTTP/1.1 200 OK\r\nContent-Length: {}\r\n{}{}\r\n", size,
+            config_.cache > 0 ? "Cache-Control: max-age=60\r\n" : "",
+            close ? "Connection: close\r\n" : "");
+        co_await asio::async_write(socket, asio::buffer(response),
+                                   asio::use_awaitable);
+        while (size > 0) {
+          const auto n = std::min<uint64_t>(size, kZeros.size());
+          co_await asio::async_write(socket, asio::buffer(kZeros.data(), n),
+                                     asio::use_awaitable);
+          size -= n;
+        }
+        if (close) break;
+      }
+    } catch (const asio::system_error &) {
+      // the client went away, e.g. a tunnel cut at the deadline
+    }
+    asio::error_code err;
+    socket.shutdown(asio::socket_base::shutdown_both, err);
+  }
+
+  const BenchConfig &config_;
+  asio::io_context ctx_;
+  asio::ip::tcp::acceptor acceptor_;
+  asio::executor_work_guard<asio::io_context::executor_type> work_;
+  std::vector<std::thread> threads_;
+};
+
+// The connections of one client thread, results are read after the join.
+struct Worker : NonCopyable {
+  asio::io_context ctx{1};
+  // in us
+  Histogram latency;
+  uint64_t requests{0};
+  uint64_t bytes{0};
+  uint64_t errors{0};
+  std::thread thread;
+};
+
+class LoadGenerator : NonCopyable {
+ public:
+  LoadGenerator(const BenchConfig &config, uint16_t origin)
+      : config_{config},
+        proxy_{asio::ip::address_v4::loopback(), config.port},
+        origin_{fmt::format("127.0.0.1:{}", origin)} {
+    for (size_t i = 0; i < config.threads; ++i) {
+      workers_.emplace_back(std::make_unique<Worker>());
+    }
+  }
+
+  void Run() {
+    if (config_.workload == "idle") {
+      RunIdle();
+      return;
+    }
+    const auto start = Clock::now();
+    deadline_ = start + config_.duration;
+    for (size_t i = 0; i < config_.connections; ++i) {
+      auto &worker = *workers_[i % workers_.size()];
+      co_spawn(worker.ctx, Client(worker), asio::detached);
+    }
+    RunWorkers();
+    Report(std::chrono::duration<double>(Clock::now() - start).count());
+  }
+
+ private:
+  asio::awaitable<void> Client(Worker &worker) {
+    try {
+      if (config_.workload == "connect") {
+        co_await Bulk(worker);
+      } else if (config_.workload == "get") {
+        co_await Gets(worker);
+      } else {
+        while (Clock::now() < deadline_) co_await Storm(worker);
+      }
+    } catch (const asio::system_error &e) {
+      ++worker.errors;
+      SPDLOG_DEBUG("[bench] client failed, e={}", e.what());
+    }
+  }
+
+  asio::awaitable<asio::ip::tcp::socket> Open(Worker &worker) {
+    asio::ip::tcp::socket socket{worker.ctx};
+    co_await socket.async_connect(proxy_, asio::use_awaitable);
+    socket.set_option(asio::ip::tcp::no_delay(true));
+    co_return socket;
+  }
+
+  asio::awaitable<void> Tunnel(asio::ip::tcp::socket &socket) {
+    const auto request =
+        fmt::format("CONNECT {0} HTTP/1.1\r\nHost: {0}\r\n\r\n", origin_);
+    co_await asio::async_write(socket, asio::buffer(request),
+                               asio::use_awaitable);
+    std::string head;
+    co_await asio::async_read_until(socket, asio::dynamic_buffer(head),
+                                    "\r\n\r\n", asio::use_awaitable);
+  }
+
+  // Sends a GET of `size` bytes and reads the response, `in` keeps bytes
+  // read past it. The latency is taken from `begin` on.
+  asio::awaitable<void> Exchange(asio::ip::tcp::socket &socket,
+                                 std::string_view target, bool close,
+                                 std::string &in, Worker &worker,
+                                 Clock::time_point begin) {
+    const auto request = fmt::format(
+        "GET {}/bytes/{} HTTP/1.1\r\nHost: {}\r\n{}\r\n", target,
+        config_.size, origin_, close ? "Connection: close\r\n" : "");
+    co_await asio::async_write(socket, asio::buffer(request),
+                               asio::use_awaitable);
+    const auto head = co_await asio::async_read_until(
+        socket, asio::dynamic_buffer(in), "\r\n\r\n", asio::use_awaitable);
+    const auto total = head + config_.size;
+    if (in.size() < total) {
+      const auto have = in.size();
+      in.resize(total);
+      co_await asio::async_read(socket,
+                                asio::buffer(in.data() + have, total - have),
+                                asio::use_awaitable);
+    }
+    in.erase(0, total);
+    worker.latency.Record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                              begin)
+            .count()));
+    ++worker.requests;
+    worker.bytes += config_.size;
+  }
+
+  asio::awaitable<void> Gets(Worker &worker) {
+    auto socket = co_await Open(worker);
+    const auto target = "http://" + origin_;
+    std::string in;
+    while (Clock::now() < deadline_) {
+      co_await Exchange(socket, target, false, in, worker, Clock::now());
+    }
+  }
+
+  asio::awaitable<void> Storm(Worker &worker) {
+    const auto begin = Clock::now();
+    auto socket = co_await Open(worker);
+    std::string in;
+    // the latency covers the connect as well
+    co_await Exchange(socket, "http://" + origin_, true, in, worker, begin);
+  }
+
+  asio::awaitable<void> Bulk(Worker &worker) {
+    auto socket = co_await Open(worker);
+    co_await Tunnel(socket);
+    const auto request = fmt::format(
+        "GET /bytes/{} HTTP/1.1\r\nHost: {}\r\n\r\n", config_.bulk, origin_);
+    co_await asio::async_write(socket, asio::buffer(request),
+                               asio::use_awaitable);
+    std::vector<char> buf(kChunk);
+    uint64_t left = config_.bulk;
+    while (left > 0 && Clock::now() < deadline_) {
+      const auto n = co_await socket.async_read_some(asio::buffer(buf),
+                                                     asio::use_awaitable);
+      // the response head is counted as well, it's a few bytes in a gigabyte
+      left -= std::min<uint64_t>(left, n);
+      worker.bytes += n;
+    }
+    ++worker.requests;
+  }
+
+  // Idle tunnels are held by the proxy without buffers, what each one costs
+  // is the session state. Kernel socket memory isn't part of the rss.
+  void RunIdle() {
+    std::vector<asio::ip::tcp::socket> sockets;
+    sockets.reserve(config_.connections);
+    const auto before = ResidentBytes();
+    auto &worker = *workers_.front();
+    co_spawn(
+        worker.ctx,
+        [this, &worker, &sockets]() -> asio::awaitable<void> {
+          for (size_t i = 0; i < config_.connections; ++i) {
+            auto socket = co_await Open(worker);
+            co_await Tunnel(socket);
+            sockets.emplace_back(std::move(socket));
+          }
+        },
+        asio::detached);
+    worker.ctx.run();
+    // let the proxy settle, e.g. free the head buffers of the sessions
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    const auto after = ResidentBytes();
+    fmt::print(
+        "workload=idle connections={} rss_before={}KiB rss_after={}KiB "
+        "per_connection={}B\n",
+        sockets.size(), before / 1024, after / 1024,
+        sockets.empty() ? 0 : (after - std::min(after, before)) / sockets.size());
+  }
+
+  void RunWorkers() {
+    for (auto &worker : workers_) {
+      worker->thread = std::thread{[&ctx = worker->ctx] { ctx.run(); }};
+    }
+    for (auto &worker : workers_) worker->thread.join();
+  }
+
+  void Report(double seconds) const {
+    HistogramSnapshot latency;
+    uint64_t requests{0};
+    uint64_t bytes{0};
+    uint64_t errors{0};
+    for (const auto &worker : workers_) {
+      worker->latency.AddTo(latency);
+      requests += worker->requests;
+      bytes += worker->bytes;
+      errors += worker->errors;
+    }
+    fmt::print(
+        "workload={} connections={} seconds={:.1f} requests={} errors={}\n"
+        "rate={:.0f}/s throughput={:.1f}MiB/s\n",
+        config_.workload, config_.connections, seconds, requests, errors,
+        static_cast<double>(requests) / seconds,
+        static_cast<double>(bytes) / seconds / (1024 * 1024));
+    if (latency.count > 0) {
+      fmt::print("latency_us p50={} p90={} p99={} p999={} max={}\n",
+                 latency.Quantile(0.5), latency.Quantile(0.9),
+                 latency.Quantile(0.99), latency.Quantile(0.999),
+                 latency.Quantile(1));
+    }
+  }
+
+  const BenchConfig &config_;
+  const asio::ip::tcp::endpoint proxy_;
+  const std::string origin_;
+  Clock::time_point deadline_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+}  // namespace
+
+}  // namespace socks::bench
+
+int main(int argc, char **argv) {
+  using namespace socks;
+  bench::BenchConfig config;
+  if (!bench::ParseArgs(argc, argv, config)) {
+    std::cerr << "usage: proxy_bench [--workload=connect|get|storm|idle]\n"
+                 "  [--connections=N] [--seconds=N] [--threads=N]\n"
+                 "  [--proxy-threads=N] [--size=BYTES] [--bulk=BYTES]\n"
+                 "  [--delay-ms=N] [--loss=P] [--port=N]\n"
+                 "  [--zero-copy=none|splice|sockmap] [--metrics-port=N]\n"
+                 "  [--max-connections=N] [--io-backend=epoll|uring]\n"
+                 "  [--trace=PATH] [--cache=BYTES] [--parents=N]\n";
+    return 1;
+  }
+  InitAsyncLogger();
+  spdlog::set_level(spdlog::level::warn);
+  if (!config.trace.empty() && !StartTracing({.path = config.trace})) {
+    return 1;
+  }
+
+  bench::Origin origin{config, 2};
+  std::vector<std::shared_ptr<tunnel::HttpProxy>> parents;
+  tunnel::ParentConfig parent_config;
+  for (size_t i = 0; i < config.parents; ++i) {
+    const auto port = static_cast<uint16_t>(config.port + 1 + i);
+    parents.emplace_back(tunnel::HttpProxy::Create(tunnel::HttpProxyConfig{
+        .port = port, .frontend = {.threads = 1}}));
+    parents.back()->Start();
+    parent_config.parents.push_back({.host = "127.0.0.1", .port = port});
+  }
+  // the timeouts would cut the connections of the idle workload
+  const auto proxy = tunnel::HttpProxy::Create(tunnel::HttpProxyConfig{
+      .port = config.port,
+      .frontend = {.threads = config.proxy_threads,
+                   .io_backend = config.io_backend,
+                   .zero_copy = config.zero_copy,
+                   .timeouts = {.header = std::chrono::seconds{0},
+                                .idle = std::chrono::seconds{0}},
+                   .metrics = {.port = config.metrics_port},
+                   .admission = {.max_connections = config.max_connections}},
+      .cache = {.capacity = config.cache},
+      .parent = parent_config});
+  proxy->Start();
+
+  bench::LoadGenerator{config, origin.Port()}.Run();
+  StopTracing();
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include "channel/congestion.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace socks::quic {
+
+namespace {
+
+constexpr size_t kInitialWindow = 10;
+constexpr size_t kMinWindow = 2;
+
+double Seconds(Clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+}  // namespace
+
+void RttEstimator::Update(Clock::duration latest, Clock::duration ack_delay) {
+  latest_ = latest;
+  if (!sampled_) {
+    sampled_ = true;
+    min_ = smoothed_ = latest;
+    var_ = latest / 2;
+    return;
+  }
+  min_ = std::min(min_, latest);
+  // the peer's ack delay only counts as far as it keeps the sample above
+  // the minimum
+  auto adjusted = latest;
+  if (latest >= min_ + ack_delay) adjusted -= ack_delay;
+  const auto diff = smoothed_ > adjusted ? smoothed_ - adjusted
+                                         : adjusted - smoothed_;
+  var_ = (var_ * 3 + diff) / 4;
+  smoothed_ = (smoothed_ * 7 + adjusted) / 8;
+}
+
+Cubic::Cubic(size_t max_datagram)
+    : mss_{max_datagram},
+      cwnd_{kInitialWindow * max_datagram},
+      ssthresh_{SIZE_MAX} {}
+
+void Cubic::OnAck(size_t bytes, Clock::time_point sent, Clock::time_point now,
+                  const RttEstimator &rtt) {
+  // acks of packets sent during recovery don't grow the window
+  if (sent <= recovery_) return;
+  if (InSlowStart()) {
+    cwnd_ += bytes;
+    return;
+  }
+
+  if (epoch_ == Clock::time_point{}) {
+    epoch_ = now;
+    w_est_ = Segments(cwnd_);
+    if (w_max_ < w_est_) {
+      // grown past the old maximum without loss, start the curve here
+      w_max_ = w_est_;
+      k_ = 0;
+    }
+  }
+  const auto cwnd = Segments(cwnd_);
+  const auto t = Seconds(now - epoch_ + rtt.Smoothed());
+  const auto target = std::clamp(kC * std::pow(t - k_, 3) + w_max_, cwnd,
+                                 cwnd * 1.5);
+  w_est_ += 3 * (1 - kBeta) / (1 + kBeta) * Segments(bytes) / cwnd;
+
+  if (w_est_ > target) {
+    cwnd_ = static_cast<size_t>(w_est_ * mss_);
+    return;
+  }
+  // grows by (target - cwnd) / cwnd segments per acked segment
+  acked_ += bytes;
+  const auto step = static_cast<size_t>(
+      static_cast<double>(mss_) * (target - cwnd) / cwnd *
+      Segments(acked_));
+  if (step > 0) {
+    cwnd_ += step;
+    acked_ = 0;
+  }
+}
+
+void Cubic::OnLoss(Clock::time_point sent, Clock::time_point now) {
+  if (sent <= recovery_) return;
+  recovery_ = now;
+  epoch_ = {};
+  acked_ = 0;
+
+  const auto cwnd = Segments(cwnd_);
+  // fast convergence, a flow that lost ground releases some to newcomers
+  w_max_ = cwnd < w_max_ ? cwnd * (1 + kBeta) / 2 : cwnd;
+  cwnd_ = std::max(static_cast<size_t>(cwnd_ * kBeta), kMinWindow * mss_);
+  ssthresh_ = cwnd_;
+  k_ = std::cbrt(w_max_ * (1 - kBeta) / kC);
+}
+
+void Cubic::OnPersistentCongestion() {
+  cwnd_ = kMinWindow * mss_;
+  epoch_ = {};
+  acked_ = 0;
+}
+
+}  // namespace socks::quic
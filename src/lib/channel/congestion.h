@@ -0,0 +1,73 @@
+#ifndef QUIC_SOCKS_CHANNEL_CONGESTION_H_
+#define QUIC_SOCKS_CHANNEL_CONGESTION_H_
+
+#include <chrono>
+#include <cstddef>
+
+namespace socks::quic {
+
+using Clock = std::chrono::steady_clock;
+
+// Round trip time estimates, RFC 9002 section 5.
+class RttEstimator {
+ public:
+  void Update(Clock::duration latest, Clock::duration ack_delay);
+
+  [[nodiscard]] Clock::duration Smoothed() const { return smoothed_; }
+  [[nodiscard]] Clock::duration Var() const { return var_; }
+  [[nodiscard]] Clock::duration Latest() const { return latest_; }
+  [[nodiscard]] Clock::duration Min() const { return min_; }
+  [[nodiscard]] bool Sampled() const { return sampled_; }
+
+ private:
+  static constexpr Clock::duration kInitial = std::chrono::milliseconds{333};
+
+  Clock::duration smoothed_{kInitial};
+  Clock::duration var_{kInitial / 2};
+  Clock::duration latest_{kInitial};
+  Clock::duration min_{kInitial};
+  bool sampled_{false};
+};
+
+// CUBIC congestion control, RFC 9438, with the Reno friendly region and fast
+// convergence. Windows are in bytes.
+class Cubic {
+ public:
+  explicit Cubic(size_t max_datagram);
+
+  [[nodiscard]] size_t Window() const { return cwnd_; }
+  [[nodiscard]] bool InSlowStart() const { return cwnd_ < ssthresh_; }
+
+  void OnAck(size_t bytes, Clock::time_point sent, Clock::time_point now,
+             const RttEstimator &rtt);
+  // A loss of a packet sent at `sent`, losses of packets sent before the
+  // current recovery period started don't reduce the window again.
+  void OnLoss(Clock::time_point sent, Clock::time_point now);
+  // No acknowledgement for several probe timeouts in a row.
+  void OnPersistentCongestion();
+
+ private:
+  static constexpr double kC = 0.4;
+  static constexpr double kBeta = 0.7;
+
+  [[nodiscard]] double Segments(size_t bytes) const {
+    return static_cast<double>(bytes) / static_cast<double>(mss_);
+  }
+
+  size_t mss_;
+  size_t cwnd_;
+  size_t ssthresh_;
+  // window before the last reduction, and when the window regrows to it
+  double w_max_{0};
+  double k_{0};
+  // Reno friendly estimate, in segments
+  double w_est_{0};
+  // bytes acked toward the next one segment increase in slow Reno growth
+  size_t acked_{0};
+  Clock::time_point epoch_{};
+  Clock::time_point recovery_{};
+};
+
+}  // namespace socks::quic
+
+#endif  // QUIC_SOCKS_CHANNEL_CONGESTION_H_
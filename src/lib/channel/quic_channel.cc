@@ -1,3 +1,1360 @@
 #include "quic_channel.h"
 
-#include "coro/task.h"
\ No newline at end of file
+#include <algorithm>
+#include <asio.hpp>
+#include <cstring>
+#include <random>
+
+#include "utility/log.h"
+
+namespace socks {
+
+using quic::Clock;
+using quic::FrameType;
+using quic::PacketType;
+using quic::TransportError;
+
+namespace {
+
+// acknowledge every second ack eliciting packet, or after this long
+constexpr size_t kAckEvery = 2;
+constexpr auto kMaxAckDelay = std::chrono::milliseconds{25};
+constexpr size_t kMaxAckRanges = 32;
+// packet and time thresholds of loss detection, RFC 9002 section 6.1
+constexpr uint64_t kPacketThreshold = 3;
+constexpr auto kGranularity = std::chrono::milliseconds{1};
+// consecutive probe timeouts taken as persistent congestion
+constexpr size_t kPersistentPto = 3;
+// type, id, offset and length of a STREAM frame at their largest
+constexpr size_t kStreamOverhead = 1 + 8 + 8 + 4;
+constexpr size_t kTokenSize = 16;
+
+uint64_t Random64() {
+  thread_local std::mt19937_64 engine{std::random_device{}()};
+  return engine();
+}
+
+std::string VarintFrame(std::initializer_list<uint64_t> fields) {
+  std::string frame(fields.size() * 8, '\0');
+  quic::Writer writer{frame};
+  for (const auto field : fields) writer.Varint(field);
+  frame.resize(writer.Size());
+  return frame;
+}
+
+std::string PathFrame(FrameType type, uint64_t data) {
+  std::string frame(9, '\0');
+  quic::Writer writer{frame};
+  writer.U8(static_cast<uint8_t>(type));
+  writer.U64(data);
+  return frame;
+}
+
+template <typename T>
+uint64_t Type(T type) {
+  return static_cast<uint64_t>(type);
+}
+
+// Compares in time independent of where the keys differ.
+bool SameKey(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) return false;
+  unsigned char diff{0};
+  for (size_t i = 0; i < a.size(); ++i) diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+}  // namespace
+
+QuicStream::QuicStream(std::shared_ptr<QuicChannel> channel, uint64_t id,
+                       uint64_t send_limit, uint64_t recv_window)
+    : channel_{std::move(channel)},
+      id_{id},
+      send_limit_{send_limit},
+      recv_window_{recv_window},
+      recv_limit_{recv_window} {}
+
+bool QuicStream::HasSendable() const {
+  if (reset_sent_) return false;
+  return !send_lost_.Empty() ||
+         (send_next_ < SendEnd() && send_next_ < send_limit_) ||
+         (fin_ && !fin_sent_ && send_next_ == SendEnd());
+}
+
+void QuicStream::Wake() {
+  readable_.NotifyAll();
+  writable_.NotifyAll();
+}
+
+asio::awaitable<size_t> QuicStream::AsyncReadSome(asio::mutable_buffer buf) {
+  const auto channel = channel_;
+  while (true) {
+    if (recv_head_ < recv_buf_.size()) {
+      const auto len = std::min(buf.size(), recv_buf_.size() - recv_head_);
+      std::memcpy(buf.data(), recv_buf_.data() + recv_head_, len);
+      recv_head_ += len;
+      if (recv_head_ == recv_buf_.size()) {
+        recv_buf_.clear();
+        recv_head_ = 0;
+      } else if (recv_head_ >= recv_buf_.size() / 2) {
+        recv_buf_.erase(0, recv_head_);
+        recv_head_ = 0;
+      }
+      recv_read_ += len;
+      channel->OnStreamRead(*this, len);
+      co_return len;
+    }
+    if (reset_received_ || stop_sent_) {
+      throw asio::system_error{asio::error::connection_reset};
+    }
+    if (recv_final_ != kUnknown && recv_read_ == recv_final_) {
+      channel->MaybeRetire(*this);
+      co_return 0;
+    }
+    if (channel->Closed()) throw asio::system_error{channel->error_};
+    co_await readable_.Wait();
+  }
+}
+
+asio::awaitable<void> QuicStream::AsyncWrite(asio::const_buffer data) {
+  const auto channel = channel_;
+  const auto *p = static_cast<const char *>(data.data());
+  auto left = data.size();
+  while (left > 0) {
+    if (channel->Closed()) throw asio::system_error{channel->error_};
+    if (reset_sent_ || stop_received_) {
+      throw asio::system_error{asio::error::connection_reset};
+    }
+    if (fin_) throw asio::system_error{asio::error::shut_down};
+
+    const auto buffered = SendEnd() - send_base_;
+    if (buffered >= channel->config_.stream_window) {
+      co_await writable_.Wait();
+      continue;
+    }
+    const auto len = std::min<uint64_t>(
+        left, channel->config_.stream_window - buffered);
+    send_buf_.insert(send_buf_.end(), p, p + len);
+    p += len;
+    left -= len;
+    channel->QueueStream(*this);
+    channel->ScheduleFlush();
+  }
+}
+
+void QuicStream::Shutdown() {
+  if (fin_ || reset_sent_ || channel_->Closed()) return;
+  fin_ = true;
+  channel_->QueueStream(*this);
+  channel_->ScheduleFlush();
+}
+
+void QuicStream::Reset() {
+  if (channel_->Closed()) return;
+  if (!SendDone()) {
+    channel_->QueueControl(VarintFrame(
+        {Type(FrameType::kResetStream), id_, 0, send_next_}));
+    reset_sent_ = true;
+    send_buf_.clear();
+    send_head_ = 0;
+    send_lost_.Clear();
+  }
+  if (!RecvDone()) {
+    channel_->QueueControl(
+        VarintFrame({Type(FrameType::kStopSending), id_, 0}));
+    stop_sent_ = true;
+    // whatever arrived and was not read returns to the connection window
+    channel_->OnConnRead(recv_highest_ - recv_read_);
+    recv_buf_.clear();
+    recv_head_ = 0;
+    recv_chunks_.clear();
+  }
+  Wake();
+  channel_->ScheduleFlush();
+  channel_->MaybeRetire(*this);
+}
+
+QuicChannel::QuicChannel(const asio::any_io_executor &executor,
+                         const QuicConfig &config, bool client)
+    : executor_{executor},
+      config_{config},
+      client_{client},
+      local_cid_{Random64()},
+      peer_cid_{Random64()},
+      next_local_stream_{client ? 0u : 1u},
+      next_peer_stream_{client ? 1u : 0u},
+      local_max_streams_{config.max_streams},
+      local_max_data_{config.conn_window},
+      cc_{config.max_datagram},
+      timer_{executor} {
+  local_params_.idle_timeout_ms = config_.idle_timeout.count();
+  local_params_.max_datagram = config_.max_datagram;
+  local_params_.max_data = config_.conn_window;
+  local_params_.max_stream_data = config_.stream_window;
+  local_params_.max_streams = config_.max_streams;
+  if (client_) local_params_.psk = config_.psk;
+  last_received_ = Clock::now();
+}
+
+QuicChannel::~QuicChannel() {
+  if (client_ && socket_) socket_->Close();
+}
+
+asio::awaitable<std::shared_ptr<QuicChannel>> QuicChannel::AsyncConnect(
+    const asio::ip::udp::endpoint &server, QuicConfig config,
+    std::optional<QuicTicket> ticket) {
+  const auto executor = co_await asio::this_coro::executor;
+  std::shared_ptr<QuicChannel> channel{new QuicChannel(executor, config, true)};
+  const bool early = ticket.has_value();
+  channel->StartClient(server, std::move(ticket));
+  if (!early) {
+    while (channel->state_ == State::kHandshake) {
+      co_await channel->established_.Wait();
+    }
+    if (channel->state_ == State::kClosed) {
+      throw asio::system_error{channel->error_};
+    }
+  }
+  co_return channel;
+}
+
+void QuicChannel::StartClient(const asio::ip::udp::endpoint &server,
+                              std::optional<QuicTicket> ticket) {
+  peer_ = server;
+  initial_cid_ = peer_cid_;
+  socket_ = std::make_shared<UdpBatch>(
+      executor_, asio::ip::udp::endpoint{server.protocol(), 0},
+      config_.max_datagram, config_.offload);
+  if (ticket) {
+    // streams go out under the limits the server gave last time
+    token_ = std::move(ticket->token);
+    peer_params_ = ticket->params;
+    peer_max_data_ = peer_params_.max_data;
+    peer_max_streams_ = peer_params_.max_streams;
+    early_data_ = true;
+  }
+  hello_pending_ = true;
+  SPDLOG_DEBUG("[quic] connecting, server={}:{}, early_data={}",
+               server.address().to_string(), server.port(), early_data_);
+  co_spawn(executor_, Receive(socket_), asio::detached);
+  Flush();
+}
+
+void QuicChannel::StartServer(std::shared_ptr<UdpBatch> socket,
+                              const asio::ip::udp::endpoint &peer,
+                              uint64_t dcid) {
+  socket_ = std::move(socket);
+  peer_ = peer;
+  initial_cid_ = dcid;
+}
+
+asio::awaitable<void> QuicChannel::Receive(std::shared_ptr<UdpBatch> socket) {
+  const auto self = shared_from_this();
+  try {
+    while (state_ != State::kClosed) {
+      const auto datagrams = co_await socket->AsyncReceive();
+      const auto now = Clock::now();
+      for (const auto &datagram : datagrams) {
+        OnDatagram(datagram.peer, datagram.data, now);
+      }
+      Flush();
+    }
+  } catch (const asio::system_error &e) {
+  }
+}
+
+asio::awaitable<std::shared_ptr<QuicStream>> QuicChannel::AsyncOpen() {
+  const auto self = shared_from_this();
+  while (next_local_stream_ / 4 >= peer_max_streams_) {
+    if (state_ == State::kClosed) throw asio::system_error{error_};
+    co_await open_ready_.Wait();
+  }
+  if (state_ == State::kClosed) throw asio::system_error{error_};
+  auto stream = CreateStream(next_local_stream_);
+  next_local_stream_ += 4;
+  co_return stream;
+}
+
+asio::awaitable<std::shared_ptr<QuicStream>> QuicChannel::AsyncAccept() {
+  const auto self = shared_from_this();
+  while (accepted_.empty()) {
+    if (state_ == State::kClosed) throw asio::system_error{error_};
+    co_await accept_ready_.Wait();
+  }
+  auto stream = std::move(accepted_.front());
+  accepted_.pop_front();
+  co_return stream;
+}
+
+void QuicChannel::Close() {
+  CloseWithError(TransportError::kNoError, "");
+}
+
+void QuicChannel::Migrate() {
+  if (!client_ || state_ == State::kClosed) return;
+  const auto old = socket_;
+  socket_ = std::make_shared<UdpBatch>(
+      executor_, asio::ip::udp::endpoint{peer_.protocol(), 0},
+      config_.max_datagram, config_.offload);
+  old->Close();
+  SPDLOG_INFO("[quic] migrated, local={}", socket_->LocalEndpoint().port());
+  co_spawn(executor_, Receive(socket_), asio::detached);
+  // tells the server about the new address right away
+  ping_pending_ = true;
+  Flush();
+}
+
+QuicStats QuicChannel::Stats() const {
+  auto stats = stats_;
+  stats.rtt =
+      std::chrono::duration_cast<std::chrono::microseconds>(rtt_.Smoothed());
+  stats.cwnd = cc_.Window();
+  stats.bytes_in_flight = bytes_in_flight_;
+  return stats;
+}
+
+std::shared_ptr<QuicStream> QuicChannel::CreateStream(uint64_t id) {
+  auto stream = std::make_shared<QuicStream>(
+      shared_from_this(), id, peer_params_.max_stream_data,
+      config_.stream_window);
+  streams_.emplace(id, stream);
+  return stream;
+}
+
+void QuicChannel::OnDatagram(const asio::ip::udp::endpoint &from,
+                             std::string_view data, Clock::time_point now) {
+  // a client only ever talks to its server
+  if (client_ && from != peer_) return;
+  while (!data.empty() && state_ != State::kClosed) {
+    const auto header = quic::ParsePacket(data);
+    if (!header) return;
+    if (header->dcid != local_cid_ &&
+        (client_ || header->dcid != initial_cid_)) {
+      continue;
+    }
+    const auto pn = quic::DecodePacketNumber(largest_received_, header->pn);
+    if (received_.Contains(pn) ||
+        (!received_.Empty() && pn < received_.Get().begin()->first)) {
+      continue;
+    }
+    // 0-RTT packets of a client without a valid ticket are dropped, the
+    // client sends their data again once it learns
+    if (header->type == PacketType::kZeroRtt &&
+        (client_ || !early_accepted_)) {
+      continue;
+    }
+    if (!OnPacket(*header, pn, from, now)) return;
+  }
+}
+
+bool QuicChannel::OnPacket(const quic::Header &header, uint64_t pn,
+                           const asio::ip::udp::endpoint &from,
+                           Clock::time_point now) {
+  last_received_ = now;
+  ++stats_.packets_received;
+  if (header.type == PacketType::kInitial && !hello_received_) {
+    peer_cid_ = header.scid;
+    if (!client_) token_ = header.token;
+  }
+
+  bool ack_eliciting{false};
+  quic::Reader reader{header.payload};
+  while (!reader.Empty() && reader.Ok()) {
+    const auto type = reader.Varint();
+    if (type > 0xff) {
+      CloseWithError(TransportError::kFrameEncoding, "unknown frame");
+      return false;
+    }
+    if (type != Type(FrameType::kPadding) && type != Type(FrameType::kAck)) {
+      ack_eliciting = true;
+    }
+    switch (static_cast<FrameType>(type)) {
+      case FrameType::kPadding:
+      case FrameType::kPing:
+      case FrameType::kHandshakeDone:
+        break;
+      case FrameType::kAck:
+        if (!OnAck(reader, now)) return false;
+        break;
+      case FrameType::kResetStream: {
+        const auto id = reader.Varint();
+        reader.Varint();
+        const auto final_size = reader.Varint();
+        if (reader.Ok() && !OnResetStream(id, final_size)) return false;
+        break;
+      }
+      case FrameType::kStopSending: {
+        const auto id = reader.Varint();
+        reader.Varint();
+        auto error{TransportError::kNoError};
+        auto *stream = reader.Ok() ? StreamOf(id, &error) : nullptr;
+        if (error != TransportError::kNoError) {
+          CloseWithError(error, "stop sending");
+          return false;
+        }
+        if (stream == nullptr) break;
+        if (!stream->SendDone()) {
+          QueueControl(VarintFrame(
+              {Type(FrameType::kResetStream), id, 0, stream->send_next_}));
+          stream->reset_sent_ = true;
+          stream->send_buf_.clear();
+          stream->send_head_ = 0;
+          stream->send_lost_.Clear();
+        }
+        stream->stop_received_ = true;
+        stream->Wake();
+        MaybeRetire(*stream);
+        break;
+      }
+      case FrameType::kCrypto: {
+        const auto offset = reader.Varint();
+        const auto hello = reader.Bytes(reader.Varint());
+        if (reader.Ok() && offset == 0 && !hello_received_ &&
+            !OnHello(hello)) {
+          return false;
+        }
+        break;
+      }
+      case FrameType::kNewToken: {
+        const auto token = reader.Bytes(reader.Varint());
+        if (client_ && reader.Ok()) {
+          ticket_ = QuicTicket{std::string{token}, peer_params_};
+        }
+        break;
+      }
+      case FrameType::kMaxData:
+        peer_max_data_ = std::max(peer_max_data_, reader.Varint());
+        break;
+      case FrameType::kMaxStreamData: {
+        const auto id = reader.Varint();
+        const auto limit = reader.Varint();
+        auto error{TransportError::kNoError};
+        auto *stream = reader.Ok() ? StreamOf(id, &error) : nullptr;
+        if (error != TransportError::kNoError) {
+          CloseWithError(error, "max stream data");
+          return false;
+        }
+        if (stream != nullptr && limit > stream->send_limit_) {
+          stream->send_limit_ = limit;
+          QueueStream(*stream);
+        }
+        break;
+      }
+      case FrameType::kMaxStreams: {
+        const auto limit = reader.Varint();
+        if (limit > peer_max_streams_) {
+          peer_max_streams_ = limit;
+          open_ready_.NotifyAll();
+        }
+        break;
+      }
+      case FrameType::kPathChallenge:
+        QueueControl(PathFrame(FrameType::kPathResponse, reader.U64()));
+        break;
+      case FrameType::kPathResponse:
+        if (reader.U64() == challenge_ && probing_) {
+          SPDLOG_INFO("[quic] peer migrated, from={}:{}, to={}:{}",
+                      peer_.address().to_string(), peer_.port(),
+                      probing_->address().to_string(), probing_->port());
+          peer_ = *probing_;
+          probing_.reset();
+        }
+        break;
+      case FrameType::kConnectionClose: {
+        const auto error = reader.Varint();
+        reader.Varint();
+        const auto reason = reader.Bytes(reader.Varint());
+        SPDLOG_DEBUG("[quic] closed by peer, error={}, reason={}", error,
+                     reason);
+        Terminate(asio::error::connection_aborted);
+        return false;
+      }
+      default:
+        if ((type & ~Type(0x07)) == Type(FrameType::kStream)) {
+          const auto id = reader.Varint();
+          const auto offset = (type & quic::kStreamOff) ? reader.Varint() : 0;
+          const auto len = (type & quic::kStreamLen) ? reader.Varint()
+                                                     : reader.Rest().size();
+          const auto data = reader.Bytes(len);
+          if (reader.Ok() &&
+              !OnStream(id, offset, data, type & quic::kStreamFin)) {
+            return false;
+          }
+          break;
+        }
+        CloseWithError(TransportError::kFrameEncoding, "unknown frame");
+        return false;
+    }
+  }
+  if (!reader.Ok()) {
+    CloseWithError(TransportError::kFrameEncoding, "truncated frame");
+    return false;
+  }
+
+  const bool in_order = received_.Empty() || pn == largest_received_ + 1;
+  received_.Add(pn, pn + 1);
+  received_.Trim(kMaxAckRanges * 2);
+  if (pn >= largest_received_) {
+    largest_received_ = pn;
+    largest_received_time_ = now;
+    // the newest packet of a client arrived from elsewhere, the server
+    // checks that the new path is reachable before moving there
+    if (!client_ && from != peer_ && header.type == PacketType::kShort &&
+        probing_ != from) {
+      probing_ = from;
+      challenge_ = Random64();
+      challenge_pending_ = true;
+    }
+  }
+  if (ack_eliciting) {
+    if (ack_eliciting_received_++ == 0) ack_deadline_ = now + kMaxAckDelay;
+    // a gap is reported right away, it speeds up the peer's loss detection
+    if (!in_order) ack_now_ = true;
+  }
+  return true;
+}
+
+bool QuicChannel::OnHello(std::string_view hello) {
+  const auto params = quic::TransportParams::Decode(hello);
+  if (!params) {
+    CloseWithError(TransportError::kTransportParameter, "bad parameters");
+    return false;
+  }
+  if (!client_ && !config_.psk.empty() && !SameKey(params->psk, config_.psk)) {
+    SPDLOG_DEBUG("[quic] refused without key, peer={}:{}",
+                 peer_.address().to_string(), peer_.port());
+    CloseWithError(TransportError::kConnectionRefused, "unauthenticated");
+    return false;
+  }
+  hello_received_ = true;
+  peer_params_ = *params;
+  peer_max_data_ = std::max(peer_max_data_, params->max_data);
+  if (params->max_streams > peer_max_streams_) {
+    peer_max_streams_ = params->max_streams;
+    open_ready_.NotifyAll();
+  }
+  for (auto &[id, stream] : streams_) {
+    if (params->max_stream_data > stream->send_limit_) {
+      stream->send_limit_ = params->max_stream_data;
+      QueueStream(*stream);
+    }
+  }
+
+  if (client_) {
+    early_accepted_ = early_data_ && params->early_data;
+    if (early_data_ && !early_accepted_) {
+      // the server forgot the ticket, 0-RTT data goes again as 1-RTT
+      for (auto &packet : sent_) {
+        if (packet.zero_rtt && !packet.acked && !packet.lost) {
+          OnPacketLost(packet, false, Clock::now());
+        }
+      }
+    }
+  } else {
+    early_accepted_ = !token_.empty() && redeem_ && redeem_(token_);
+    local_params_.early_data = early_accepted_;
+    hello_pending_ = true;
+    if (auto ticket = issue_ ? issue_() : std::string{}; !ticket.empty()) {
+      std::string frame(1 + 8 + ticket.size(), '\0');
+      quic::Writer writer{frame};
+      writer.Varint(Type(FrameType::kNewToken));
+      writer.Varint(ticket.size());
+      writer.Bytes(ticket);
+      frame.resize(writer.Size());
+      QueueControl(std::move(frame));
+    }
+  }
+  state_ = State::kEstablished;
+  established_.NotifyAll();
+  SPDLOG_DEBUG("[quic] established, client={}, peer={}:{}, early_data={}",
+               client_, peer_.address().to_string(), peer_.port(),
+               early_accepted_);
+  return true;
+}
+
+bool QuicChannel::OnAck(quic::Reader &reader, Clock::time_point now) {
+  const auto largest = reader.Varint();
+  const auto delay = reader.Varint();
+  const auto count = reader.Varint();
+  auto low = largest - std::min(largest, reader.Varint());
+  if (!reader.Ok() || largest >= next_pn_) {
+    CloseWithError(TransportError::kProtocolViolation, "bad ack");
+    return false;
+  }
+
+  bool newly_acked{false};
+  bool rtt_sample{false};
+  Clock::time_point largest_sent{};
+  const auto acknowledge = [&](uint64_t first, uint64_t last) {
+    if (sent_.empty()) return;
+    const auto front = sent_.front().pn;
+    for (auto pn = std::max(first, front); pn <= last && pn < next_pn_; ++pn) {
+      auto &packet = sent_[pn - front];
+      if (packet.acked) continue;
+      if (pn == largest) {
+        largest_sent = packet.time;
+        rtt_sample = true;
+      }
+      newly_acked = newly_acked || packet.ack_eliciting;
+      OnPacketAcked(packet, now);
+    }
+  };
+  acknowledge(low, largest);
+  for (uint64_t i = 0; i < count; ++i) {
+    const auto gap = reader.Varint();
+    const auto len = reader.Varint();
+    if (!reader.Ok() || gap + 2 > low || len > low - gap - 2) {
+      CloseWithError(TransportError::kFrameEncoding, "bad ack range");
+      return false;
+    }
+    const auto high = low - gap - 2;
+    low = high - len;
+    acknowledge(low, high);
+  }
+
+  if (!largest_acked_ || largest > *largest_acked_) largest_acked_ = largest;
+  if (rtt_sample && newly_acked) {
+    const auto ack_delay = std::min<Clock::duration>(
+        std::chrono::microseconds{delay << 3}, kMaxAckDelay);
+    rtt_.Update(now - largest_sent, ack_delay);
+  }
+  if (newly_acked) pto_count_ = 0;
+  DetectLost(now);
+  while (!sent_.empty() && (sent_.front().acked || sent_.front().lost)) {
+    sent_.pop_front();
+  }
+  return true;
+}
+
+void QuicChannel::OnPacketAcked(SentPacket &packet, Clock::time_point now) {
+  packet.acked = true;
+  if (!packet.lost && packet.ack_eliciting) {
+    bytes_in_flight_ -= packet.bytes;
+    cc_.OnAck(packet.bytes, packet.time, now, rtt_);
+  }
+  for (const auto &sent : packet.streams) {
+    const auto it = streams_.find(sent.id);
+    if (it == streams_.end()) continue;
+    auto &stream = *it->second;
+    if (stream.reset_sent_) continue;
+    stream.send_acked_.Add(sent.offset, sent.offset + sent.length);
+    stream.send_lost_.Remove(sent.offset, sent.offset + sent.length);
+    if (sent.fin) stream.fin_acked_ = true;
+
+    const auto base = stream.send_acked_.ContiguousEnd(stream.send_base_);
+    if (base > stream.send_base_) {
+      stream.send_head_ += base - stream.send_base_;
+      stream.send_base_ = base;
+      stream.send_acked_.Remove(0, base);
+      if (stream.send_head_ >= stream.send_buf_.size() / 2) {
+        stream.send_buf_.erase(stream.send_buf_.begin(),
+                               stream.send_buf_.begin() + stream.send_head_);
+        stream.send_head_ = 0;
+      }
+      stream.writable_.NotifyAll();
+    }
+    MaybeRetire(stream);
+  }
+}
+
+void QuicChannel::OnPacketLost(SentPacket &packet, bool congestion,
+                               Clock::time_point now) {
+  packet.lost = true;
+  if (packet.ack_eliciting) {
+    ++stats_.packets_lost;
+    bytes_in_flight_ -= packet.bytes;
+    if (congestion) cc_.OnLoss(packet.time, now);
+  }
+  if (packet.hello && (!client_ || state_ == State::kHandshake)) {
+    hello_pending_ = true;
+  }
+  if (!packet.control.empty()) QueueControl(std::move(packet.control));
+  for (const auto &sent : packet.streams) {
+    const auto it = streams_.find(sent.id);
+    if (it == streams_.end()) continue;
+    auto &stream = *it->second;
+    if (stream.reset_sent_) continue;
+    stream.send_lost_.Add(sent.offset, sent.offset + sent.length);
+    if (sent.fin && !stream.fin_acked_) stream.fin_sent_ = false;
+    QueueStream(stream);
+  }
+}
+
+void QuicChannel::DetectLost(Clock::time_point now) {
+  loss_time_ = {};
+  if (!largest_acked_) return;
+  const auto delay = std::max<Clock::duration>(
+      std::max(rtt_.Latest(), rtt_.Smoothed()) * 9 / 8, kGranularity);
+  for (auto &packet : sent_) {
+    if (packet.pn >= *largest_acked_) break;
+    if (packet.acked || packet.lost) continue;
+    if (packet.time + delay <= now ||
+        packet.pn + kPacketThreshold <= *largest_acked_) {
+      OnPacketLost(packet, true, now);
+    } else if (loss_time_ == Clock::time_point{} ||
+               packet.time + delay < loss_time_) {
+      loss_time_ = packet.time + delay;
+    }
+  }
+}
+
+QuicStream *QuicChannel::StreamOf(uint64_t id, TransportError *error) {
+  if (const auto it = streams_.find(id); it != streams_.end()) {
+    return it->second.get();
+  }
+  if (IsLocal(id)) {
+    if (id >= next_local_stream_) *error = TransportError::kStreamState;
+    return nullptr;
+  }
+  if ((id & 2) != 0) {
+    // only bidirectional streams are used
+    *error = TransportError::kStreamState;
+    return nullptr;
+  }
+  if (id < next_peer_stream_) return nullptr;
+  if (id / 4 >= local_max_streams_) {
+    *error = TransportError::kStreamLimit;
+    return nullptr;
+  }
+  // lower streams of the peer open along, RFC 9000 section 3.2
+  std::shared_ptr<QuicStream> stream;
+  while (next_peer_stream_ <= id) {
+    stream = CreateStream(next_peer_stream_);
+    accepted_.push_back(stream);
+    next_peer_stream_ += 4;
+  }
+  accept_ready_.NotifyAll();
+  return stream.get();
+}
+
+bool QuicChannel::OnStream(uint64_t id, uint64_t offset, std::string_view data,
+                           bool fin) {
+  auto error{TransportError::kNoError};
+  auto *stream = StreamOf(id, &error);
+  if (error != TransportError::kNoError) {
+    CloseWithError(error, "stream");
+    return false;
+  }
+  if (stream == nullptr) return true;
+
+  auto &s = *stream;
+  const auto end = offset + data.size();
+  if (end > quic::kMaxVarint || end > s.recv_limit_) {
+    CloseWithError(TransportError::kFlowControl, "stream window");
+    return false;
+  }
+  if ((s.recv_final_ != QuicStream::kUnknown &&
+       (end > s.recv_final_ || (fin && end != s.recv_final_))) ||
+      (fin && end < s.recv_highest_)) {
+    CloseWithError(TransportError::kFinalSize, "final size");
+    return false;
+  }
+  if (fin) s.recv_final_ = end;
+  if (end > s.recv_highest_) {
+    const auto grown = end - s.recv_highest_;
+    s.recv_highest_ = end;
+    conn_received_ += grown;
+    if (conn_received_ > local_max_data_) {
+      CloseWithError(TransportError::kFlowControl, "connection window");
+      return false;
+    }
+    if (s.stop_sent_ || s.reset_received_) OnConnRead(grown);
+  }
+  if (s.stop_sent_ || s.reset_received_) return true;
+
+  if (end > s.recv_contiguous_) {
+    if (offset <= s.recv_contiguous_) {
+      s.recv_buf_.append(data.substr(s.recv_contiguous_ - offset));
+      s.recv_contiguous_ = end;
+      auto &chunks = s.recv_chunks_;
+      for (auto it = chunks.begin();
+           it != chunks.end() && it->first <= s.recv_contiguous_;
+           it = chunks.erase(it)) {
+        const auto chunk_end = it->first + it->second.size();
+        if (chunk_end > s.recv_contiguous_) {
+          s.recv_buf_.append(
+              std::string_view{it->second}.substr(s.recv_contiguous_ -
+                                                  it->first));
+          s.recv_contiguous_ = chunk_end;
+        }
+      }
+    } else {
+      auto &chunk = s.recv_chunks_[offset];
+      if (chunk.size() < data.size()) chunk.assign(data);
+    }
+  }
+  s.readable_.NotifyAll();
+  return true;
+}
+
+bool QuicChannel::OnResetStream(uint64_t id, uint64_t final_size) {
+  auto error{TransportError::kNoError};
+  auto *stream = StreamOf(id, &error);
+  if (error != TransportError::kNoError) {
+    CloseWithError(error, "reset stream");
+    return false;
+  }
+  if (stream == nullptr || stream->reset_received_) return true;
+
+  auto &s = *stream;
+  if ((s.recv_final_ != QuicStream::kUnknown && final_size != s.recv_final_) ||
+      final_size < s.recv_highest_ || final_size > s.recv_limit_) {
+    CloseWithError(TransportError::kFinalSize, "reset final size");
+    return false;
+  }
+  conn_received_ += final_size - s.recv_highest_;
+  if (s.stop_sent_) {
+    OnConnRead(final_size - s.recv_highest_);
+  } else {
+    // bytes never read return to the connection window
+    OnConnRead(final_size - s.recv_read_);
+  }
+  s.recv_highest_ = s.recv_final_ = final_size;
+  s.reset_received_ = true;
+  s.recv_buf_.clear();
+  s.recv_head_ = 0;
+  s.recv_chunks_.clear();
+  s.Wake();
+  MaybeRetire(s);
+  return true;
+}
+
+void QuicChannel::OnStreamRead(QuicStream &stream, size_t len) {
+  OnConnRead(len);
+  if (stream.recv_final_ == QuicStream::kUnknown &&
+      stream.recv_limit_ - stream.recv_read_ < stream.recv_window_ / 2) {
+    stream.recv_limit_ = stream.recv_read_ + stream.recv_window_;
+    window_updates_.push_back(stream.id_);
+    ScheduleFlush();
+  }
+  if (stream.RecvDone()) MaybeRetire(stream);
+}
+
+void QuicChannel::OnConnRead(uint64_t len) {
+  conn_read_ += len;
+  if (local_max_data_ - conn_read_ < config_.conn_window / 2) {
+    local_max_data_ = conn_read_ + config_.conn_window;
+    max_data_pending_ = true;
+    ScheduleFlush();
+  }
+}
+
+void QuicChannel::MaybeRetire(QuicStream &stream) {
+  if (!stream.SendDone() || !stream.RecvDone()) return;
+  const auto it = streams_.find(stream.id_);
+  if (it == streams_.end()) return;
+  if (stream.queued_) {
+    std::erase(send_queue_, &stream);
+    stream.queued_ = false;
+  }
+  if (!IsLocal(stream.id_)) {
+    ++peer_streams_retired_;
+    local_max_streams_ = peer_streams_retired_ + config_.max_streams;
+    max_streams_pending_ = true;
+  }
+  // callers may still be inside the stream, it goes once they are done
+  asio::post(executor_, [stream = std::move(it->second)] {});
+  streams_.erase(it);
+}
+
+void QuicChannel::QueueControl(std::string frame) {
+  control_.emplace_back(std::move(frame));
+  ScheduleFlush();
+}
+
+void QuicChannel::QueueStream(QuicStream &stream) {
+  if (stream.queued_ || !stream.HasSendable()) return;
+  stream.queued_ = true;
+  send_queue_.push_back(&stream);
+}
+
+void QuicChannel::ScheduleFlush() {
+  if (flush_scheduled_ || state_ == State::kClosed) return;
+  flush_scheduled_ = true;
+  asio::post(executor_, [self = shared_from_this()] {
+    self->flush_scheduled_ = false;
+    self->Flush();
+  });
+}
+
+void QuicChannel::Flush() {
+  if (state_ == State::kClosed || !socket_) return;
+  const auto now = Clock::now();
+  if (challenge_pending_) SendChallenge();
+  while (SendPacket(now)) {
+  }
+  socket_->Flush();
+  ArmTimer();
+}
+
+bool QuicChannel::SendPacket(Clock::time_point now) {
+  PacketType type{PacketType::kShort};
+  if (hello_pending_) {
+    type = PacketType::kInitial;
+  } else if (client_ && state_ == State::kHandshake) {
+    if (!early_data_) return false;
+    type = PacketType::kZeroRtt;
+  }
+  const bool ack_owed =
+      ack_now_ || ack_eliciting_received_ >= kAckEvery ||
+      (ack_eliciting_received_ > 0 && now >= ack_deadline_);
+  const auto size = std::min<size_t>(socket_->MaxDatagram(),
+                                     hello_received_
+                                         ? peer_params_.max_datagram
+                                         : quic::kMinInitialSize);
+  const bool cwnd_open =
+      probes_ > 0 || bytes_in_flight_ + size <= cc_.Window();
+
+  quic::Writer writer{socket_->Prepare().first(size)};
+  SentPacket packet{.pn = next_pn_, .time = now};
+  quic::PacketWriter header{writer,     type,
+                            peer_cid_,  local_cid_,
+                            client_ ? std::string_view{token_} : "",
+                            next_pn_};
+
+  // 0-RTT packets can't carry acks, RFC 9000 section 12.4
+  const bool ack = type != PacketType::kZeroRtt &&
+                   ack_eliciting_received_ > 0 && !received_.Empty();
+  if (ack) WriteAck(writer, now);
+  if (type == PacketType::kInitial) {
+    std::string hello(128 + local_params_.psk.size(), '\0');
+    quic::Writer params{hello};
+    local_params_.Encode(params);
+    writer.Varint(Type(FrameType::kCrypto));
+    writer.Varint(0);
+    writer.Varint(params.Size());
+    writer.Bytes({hello.data(), params.Size()});
+    packet.hello = packet.ack_eliciting = true;
+  }
+  if (type != PacketType::kZeroRtt) WriteControl(writer, packet);
+  if (cwnd_open && type != PacketType::kInitial) {
+    for (auto tries = send_queue_.size();
+         tries > 0 && !send_queue_.empty() &&
+         writer.Room() > kStreamOverhead;
+         --tries) {
+      auto *stream = send_queue_.front();
+      send_queue_.pop_front();
+      stream->queued_ = false;
+      WriteStream(writer, *stream, packet);
+      QueueStream(*stream);
+    }
+  }
+  const bool ping = !packet.ack_eliciting && (probes_ > 0 || ping_pending_);
+  if (ping) {
+    writer.Varint(Type(FrameType::kPing));
+    packet.ack_eliciting = true;
+  }
+  if (!packet.ack_eliciting && !(ack && ack_owed)) return false;
+
+  if (type == PacketType::kInitial && client_) {
+    while (writer.Size() < quic::kMinInitialSize) writer.U8(0);
+  }
+  header.Finish();
+  if (!writer.Ok()) {
+    SPDLOG_ERROR("[quic] packet overflow, pn={}", next_pn_);
+    return false;
+  }
+
+  socket_->Commit(peer_, writer.Size());
+  if (type == PacketType::kInitial) hello_pending_ = false;
+  if (ack) {
+    ack_eliciting_received_ = 0;
+    ack_now_ = false;
+  }
+  if (ping) ping_pending_ = false;
+  packet.bytes = writer.Size();
+  packet.zero_rtt = type == PacketType::kZeroRtt;
+  if (packet.ack_eliciting) {
+    bytes_in_flight_ += packet.bytes;
+    last_ack_eliciting_ = now;
+    if (probes_ > 0) --probes_;
+  }
+  ++next_pn_;
+  ++stats_.packets_sent;
+  sent_.emplace_back(std::move(packet));
+  return true;
+}
+
+void QuicChannel::WriteAck(quic::Writer &writer, Clock::time_point now) {
+  const auto &ranges = received_.Get();
+  auto it = ranges.rbegin();
+  const auto largest = it->second - 1;
+  const auto delay = std::chrono::duration_cast<std::chrono::microseconds>(
+                         now - largest_received_time_)
+                         .count() >>
+                     3;
+  const auto count = std::min(ranges.size() - 1, kMaxAckRanges);
+  writer.Varint(Type(FrameType::kAck));
+  writer.Varint(largest);
+  writer.Varint(delay);
+  writer.Varint(count);
+  writer.Varint(largest - it->first);
+  auto low = it->first;
+  for (size_t i = 0; i < count; ++i) {
+    ++it;
+    writer.Varint(low - it->second - 1);
+    writer.Varint(it->second - 1 - it->first);
+    low = it->first;
+  }
+}
+
+void QuicChannel::WriteControl(quic::Writer &writer, SentPacket &packet) {
+  const auto emit = [&writer, &packet](std::string_view frame) {
+    if (writer.Room() < frame.size()) return false;
+    writer.Bytes(frame);
+    packet.control.append(frame);
+    packet.ack_eliciting = true;
+    return true;
+  };
+  if (max_data_pending_ &&
+      emit(VarintFrame({Type(FrameType::kMaxData), local_max_data_}))) {
+    max_data_pending_ = false;
+  }
+  if (max_streams_pending_ &&
+      emit(VarintFrame({Type(FrameType::kMaxStreams), local_max_streams_}))) {
+    max_streams_pending_ = false;
+  }
+  while (!window_updates_.empty()) {
+    const auto it = streams_.find(window_updates_.back());
+    if (it != streams_.end() &&
+        !emit(VarintFrame({Type(FrameType::kMaxStreamData), it->first,
+                           it->second->recv_limit_}))) {
+      break;
+    }
+    window_updates_.pop_back();
+  }
+  while (!control_.empty() && emit(control_.front())) {
+    control_.pop_front();
+  }
+}
+
+bool QuicChannel::WriteStream(quic::Writer &writer, QuicStream &stream,
+                              SentPacket &packet) {
+  const auto room = writer.Room() - kStreamOverhead;
+  uint64_t offset{0}, len{0};
+  bool fin{false}, retransmit{false};
+  // lost data goes first, it was paid for with flow control credit already
+  while (!stream.send_lost_.Empty()) {
+    const auto [begin, end] = *stream.send_lost_.Get().begin();
+    if (end <= stream.send_base_) {
+      stream.send_lost_.Remove(begin, end);
+      continue;
+    }
+    offset = std::max(begin, stream.send_base_);
+    len = std::min<uint64_t>(end - offset, room);
+    stream.send_lost_.Remove(offset, offset + len);
+    fin = stream.fin_ && !stream.fin_acked_ &&
+          offset + len == stream.SendEnd() && offset + len == stream.send_next_;
+    retransmit = true;
+    break;
+  }
+  if (!retransmit) {
+    const auto stream_credit = stream.send_limit_ > stream.send_next_
+                                   ? stream.send_limit_ - stream.send_next_
+                                   : 0;
+    const auto conn_credit =
+        peer_max_data_ > conn_sent_ ? peer_max_data_ - conn_sent_ : 0;
+    offset = stream.send_next_;
+    len = std::min({stream.SendEnd() - offset, stream_credit, conn_credit,
+                    static_cast<uint64_t>(room)});
+    fin = stream.fin_ && !stream.fin_sent_ && offset + len == stream.SendEnd();
+    if (len == 0 && !fin) return false;
+    stream.send_next_ += len;
+    conn_sent_ += len;
+  }
+  if (fin) stream.fin_sent_ = true;
+
+  auto type = Type(FrameType::kStream) | quic::kStreamLen;
+  if (offset > 0) type |= quic::kStreamOff;
+  if (fin) type |= quic::kStreamFin;
+  writer.Varint(type);
+  writer.Varint(stream.id_);
+  if (offset > 0) writer.Varint(offset);
+  writer.Varint(len);
+  writer.Bytes({stream.send_buf_.data() + stream.send_head_ +
+                    (offset - stream.send_base_),
+                len});
+  packet.streams.push_back(SentStream{stream.id_, offset, len, fin});
+  packet.ack_eliciting = true;
+  return true;
+}
+
+void QuicChannel::SendChallenge() {
+  challenge_pending_ = false;
+  if (!probing_) return;
+  // padded, a path has to carry full sized packets, RFC 9000 section 8.2.1
+  quic::Writer writer{socket_->Prepare().first(quic::kMinInitialSize)};
+  quic::PacketWriter header{writer,    PacketType::kShort, peer_cid_,
+                            local_cid_, "",                 next_pn_};
+  writer.Bytes(PathFrame(FrameType::kPathChallenge, challenge_));
+  while (writer.Room() > 0) writer.U8(0);
+  header.Finish();
+  socket_->Commit(*probing_, writer.Size());
+  // in flight, so a lost challenge is sent again on the probe timeout
+  const auto now = Clock::now();
+  sent_.emplace_back(SentPacket{.pn = next_pn_++,
+                                .time = now,
+                                .bytes = writer.Size(),
+                                .ack_eliciting = true});
+  bytes_in_flight_ += writer.Size();
+  last_ack_eliciting_ = now;
+  ++stats_.packets_sent;
+}
+
+Clock::duration QuicChannel::Pto() const {
+  return rtt_.Smoothed() +
+         std::max<Clock::duration>(rtt_.Var() * 4, kGranularity) +
+         kMaxAckDelay;
+}
+
+void QuicChannel::ArmTimer() {
+  if (state_ == State::kClosed) return;
+  auto deadline =
+      last_received_ + std::max<Clock::duration>(config_.idle_timeout,
+                                                 Pto() * 3);
+  if (ack_eliciting_received_ > 0) deadline = std::min(deadline, ack_deadline_);
+  if (loss_time_ != Clock::time_point{}) {
+    deadline = std::min(deadline, loss_time_);
+  } else if (bytes_in_flight_ > 0) {
+    deadline = std::min(deadline, last_ack_eliciting_ +
+                                      Pto() * (1 << std::min<size_t>(
+                                                   pto_count_, 10)));
+  }
+  if (!streams_.empty() && config_.keep_alive.count() > 0) {
+    deadline = std::min(deadline, last_ack_eliciting_ + config_.keep_alive);
+  }
+
+  // an earlier wake up recomputes the deadline anyway
+  if (deadline >= timer_deadline_) return;
+  timer_deadline_ = deadline;
+  timer_.expires_at(deadline);
+  timer_.async_wait([weak = weak_from_this()](const asio::error_code &err) {
+    if (err) return;
+    if (const auto self = weak.lock()) {
+      self->timer_deadline_ = Clock::time_point::max();
+      self->OnTimer(Clock::now());
+    }
+  });
+}
+
+void QuicChannel::OnTimer(Clock::time_point now) {
+  if (state_ == State::kClosed) return;
+  const auto idle =
+      std::max<Clock::duration>(config_.idle_timeout, Pto() * 3);
+  if (now >= last_received_ + idle) {
+    SPDLOG_INFO("[quic] idle timeout, peer={}:{}",
+                peer_.address().to_string(), peer_.port());
+    Terminate(asio::error::timed_out);
+    return;
+  }
+
+  if (loss_time_ != Clock::time_point{} && now >= loss_time_) {
+    DetectLost(now);
+  } else if (bytes_in_flight_ > 0 &&
+             now >= last_ack_eliciting_ +
+                        Pto() * (1 << std::min<size_t>(pto_count_, 10))) {
+    if (++pto_count_ == kPersistentPto) cc_.OnPersistentCongestion();
+    probes_ = 2;
+    // the oldest unacked data is sent again as the probe
+    for (auto &packet : sent_) {
+      if (packet.acked || packet.lost || !packet.ack_eliciting) continue;
+      if (packet.hello && (!client_ || state_ == State::kHandshake)) {
+        hello_pending_ = true;
+      }
+      if (!packet.control.empty()) control_.push_back(packet.control);
+      for (const auto &sent : packet.streams) {
+        const auto it = streams_.find(sent.id);
+        if (it == streams_.end() || it->second->reset_sent_) continue;
+        it->second->send_lost_.Add(sent.offset, sent.offset + sent.length);
+        if (sent.fin && !it->second->fin_acked_) {
+          it->second->fin_sent_ = false;
+        }
+        QueueStream(*it->second);
+      }
+      break;
+    }
+    if (probing_) challenge_pending_ = true;
+  }
+  if (!streams_.empty() && config_.keep_alive.count() > 0 &&
+      now >= last_ack_eliciting_ + config_.keep_alive) {
+    ping_pending_ = true;
+  }
+  Flush();
+}
+
+void QuicChannel::CloseWithError(TransportError error,
+                                 std::string_view reason) {
+  if (state_ == State::kClosed) return;
+  if (error != TransportError::kNoError) {
+    SPDLOG_WARN("[quic] connection error, error={}, reason={}",
+                Type(error), reason);
+  }
+  std::string frame(1 + 8 + 1 + 8 + reason.size(), '\0');
+  quic::Writer writer{frame};
+  writer.Varint(Type(FrameType::kConnectionClose));
+  writer.Varint(Type(error));
+  writer.Varint(0);
+  writer.Varint(reason.size());
+  writer.Bytes(reason);
+  frame.resize(writer.Size());
+  control_.push_front(std::move(frame));
+  // the close goes out ahead of anything else still queued
+  send_queue_.clear();
+  Flush();
+  Terminate(error == TransportError::kNoError
+                ? asio::error::operation_aborted
+                : asio::error::connection_aborted);
+}
+
+void QuicChannel::Terminate(const asio::error_code &error) {
+  if (state_ == State::kClosed) return;
+  const auto self = shared_from_this();
+  state_ = State::kClosed;
+  error_ = error;
+  timer_.cancel();
+  accept_ready_.NotifyAll();
+  open_ready_.NotifyAll();
+  established_.NotifyAll();
+  // streams keep the channel, the cycle ends with their last user
+  const auto streams = std::move(streams_);
+  streams_.clear();
+  for (const auto &[id, stream] : streams) {
+    stream->queued_ = false;
+    stream->Wake();
+  }
+  send_queue_.clear();
+  accepted_.clear();
+  if (client_ && socket_) socket_->Close();
+  if (on_close_) on_close_(this);
+}
+
+QuicListener::QuicListener(asio::io_context &ctx,
+                           const asio::ip::udp::endpoint &endpoint,
+                           const QuicConfig &config)
+    : ctx_{ctx},
+      config_{config},
+      socket_{std::make_shared<UdpBatch>(ctx.get_executor(), endpoint,
+                                         config.max_datagram,
+                                         config.offload)} {
+  co_spawn(ctx_, Receive(), asio::detached);
+}
+
+QuicListener::~QuicListener() { Close(); }
+
+void QuicListener::Close() {
+  if (closed_) return;
+  closed_ = true;
+  socket_->Close();
+  const auto channels = std::move(channels_);
+  channels_.clear();
+  for (const auto &[cid, channel] : channels) {
+    channel->on_close_ = nullptr;
+    channel->Terminate(asio::error::operation_aborted);
+  }
+  accepted_.clear();
+  accept_ready_.NotifyAll();
+}
+
+asio::awaitable<std::shared_ptr<QuicChannel>> QuicListener::AsyncAccept() {
+  while (accepted_.empty()) {
+    if (closed_) throw asio::system_error{asio::error::operation_aborted};
+    co_await accept_ready_.Wait();
+  }
+  auto channel = std::move(accepted_.front());
+  accepted_.pop_front();
+  co_return channel;
+}
+
+asio::awaitable<void> QuicListener::Receive() {
+  // the listener may be gone by the time a closed socket wakes this up
+  const auto socket = socket_;
+  std::vector<std::shared_ptr<QuicChannel>> touched;
+  try {
+    while (true) {
+      const auto datagrams = co_await socket->AsyncReceive();
+      const auto now = Clock::now();
+      // answers to the whole batch leave together
+      socket->Cork();
+      for (const auto &datagram : datagrams) {
+        OnDatagram(datagram, now, touched);
+      }
+      for (const auto &channel : touched) channel->Flush();
+      touched.clear();
+      socket->Uncork();
+    }
+  } catch (const asio::system_error &e) {
+  }
+}
+
+void QuicListener::OnDatagram(
+    const UdpBatch::Datagram &datagram, Clock::time_point now,
+    std::vector<std::shared_ptr<QuicChannel>> &touched) {
+  const auto dcid = quic::PeekDcid(datagram.data);
+  if (!dcid) return;
+
+  std::shared_ptr<QuicChannel> channel;
+  bool created{false};
+  if (const auto it = channels_.find(*dcid); it != channels_.end()) {
+    channel = it->second;
+  } else {
+    // only the padded first flight of a client opens a connection
+    auto data = datagram.data;
+    const auto header = quic::ParsePacket(data);
+    if (!header || header->type != PacketType::kInitial ||
+        datagram.data.size() < quic::kMinInitialSize || closed_) {
+      return;
+    }
+    channel.reset(new QuicChannel(ctx_.get_executor(), config_, false));
+    channel->StartServer(socket_, datagram.peer, *dcid);
+    channel->redeem_ = [this](std::string_view token) {
+      return Redeem(token);
+    };
+    channel->issue_ = [this] { return Issue(); };
+    channel->on_close_ = [this](QuicChannel *closed) {
+      for (const auto cid : {closed->local_cid_, closed->initial_cid_}) {
+        const auto it = channels_.find(cid);
+        if (it != channels_.end() && it->second.get() == closed) {
+          channels_.erase(it);
+        }
+      }
+    };
+    channels_.emplace(channel->local_cid_, channel);
+    channels_.emplace(*dcid, channel);
+    created = true;
+  }
+
+  channel->OnDatagram(datagram.peer, datagram.data, now);
+  if (created && channel->state_ == QuicChannel::State::kEstablished) {
+    accepted_.push_back(channel);
+    accept_ready_.NotifyAll();
+  }
+  if (std::ranges::find(touched, channel) == touched.end()) {
+    touched.push_back(std::move(channel));
+  }
+}
+
+bool QuicListener::Redeem(std::string_view token) {
+  const auto it = tickets_.find(std::string{token});
+  if (it == tickets_.end()) return false;
+  const bool valid = it->second > Clock::now();
+  tickets_.erase(it);
+  return valid;
+}
+
+std::string QuicListener::Issue() {
+  const auto now = Clock::now();
+  if (tickets_.size() >= kMaxTickets) {
+    std::erase_if(tickets_, [now](const auto &ticket) {
+      return ticket.second <= now;
+    });
+    if (tickets_.size() >= kMaxTickets) return {};
+  }
+  std::string token(kTokenSize, '\0');
+  for (size_t i = 0; i < kTokenSize; i += 8) {
+    const auto random = Random64();
+    std::memcpy(token.data() + i, &random, 8);
+  }
+  tickets_.emplace(token, now + kTicketLifetime);
+  return token;
+}
+
+}  // namespace socks
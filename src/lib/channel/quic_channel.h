@@ -1,10 +1,388 @@
 #pragma once
 
+#include <asio/awaitable.hpp>
+#include <asio/ip/udp.hpp>
+#include <asio/steady_timer.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "channel/congestion.h"
+#include "channel/quic_wire.h"
+#include "channel/udp_batch.h"
+#include "coro/waiter_list.h"
+#include "utility/ctor.h"
+#include "utility/small_vector.h"
+
 namespace socks {
 
-class QuicChannel {
+struct QuicConfig {
+  // receive windows, per stream and for the whole connection
+  uint64_t stream_window{1024 * 1024};
+  uint64_t conn_window{16 * 1024 * 1024};
+  // concurrent streams the peer may open
+  uint64_t max_streams{4096};
+  // closes the connection after this long without hearing from the peer
+  std::chrono::milliseconds idle_timeout{30000};
+  // pings a quiet connection so it outlives middlebox udp timeouts
+  std::chrono::milliseconds keep_alive{10000};
+  // udp payload of outgoing packets, 1200 passes about any path
+  size_t max_datagram{1350};
+  // udp segmentation and receive offload where the kernel has them
+  bool offload{true};
+  // Key shared by both ends. A client presents it in its hello, a server
+  // with one turns away clients that don't. Nothing is encrypted: the key
+  // crosses the wire in the clear, so it keeps out other local users of a
+  // loopback relay, never anyone who can see the packets.
+  std::string psk;
+};
+
+// Remembered from a connection to a server, lets the next connection to it
+// send stream data in its first flight (0-RTT). Tickets are single use.
+struct QuicTicket {
+  std::string token;
+  quic::TransportParams params;
+};
+
+struct QuicStats {
+  std::chrono::microseconds rtt;
+  size_t cwnd;
+  size_t bytes_in_flight;
+  uint64_t packets_sent;
+  uint64_t packets_lost;
+  uint64_t packets_received;
+};
+
+class QuicChannel;
+
+// A bidirectional stream of a QuicChannel. Streams of one channel are
+// ordered and flow controlled each on their own, a loss stalls only the
+// streams whose data it carried. Everything runs on the channel's thread.
+class QuicStream : NonCopyable {
  public:
-   
+  QuicStream(std::shared_ptr<QuicChannel> channel, uint64_t id,
+             uint64_t send_limit, uint64_t recv_window);
+
+  [[nodiscard]] uint64_t Id() const { return id_; }
+
+  // Returns 0 once the peer finished the stream. Throws asio::system_error
+  // when the stream was reset or its channel closed.
+  asio::awaitable<size_t> AsyncReadSome(asio::mutable_buffer buf);
+  // Returns once all of `data` is buffered, waits while a window of unacked
+  // data is outstanding.
+  asio::awaitable<void> AsyncWrite(asio::const_buffer data);
+  // Finishes the sending side after the buffered data.
+  void Shutdown();
+  // Abandons both sides, the peer sees connection_reset.
+  void Reset();
+
+ private:
+  friend class QuicChannel;
+
+  // the fin may be acked ahead of data still missing
+  [[nodiscard]] bool SendDone() const {
+    return (fin_acked_ && send_base_ == SendEnd()) || reset_sent_;
+  }
+  [[nodiscard]] bool RecvDone() const {
+    return reset_received_ || stop_sent_ ||
+           (recv_final_ != kUnknown && recv_read_ == recv_final_);
+  }
+  [[nodiscard]] bool HasSendable() const;
+  [[nodiscard]] uint64_t SendEnd() const {
+    return send_base_ + send_buf_.size() - send_head_;
+  }
+  void Wake();
+
+  static constexpr uint64_t kUnknown = UINT64_MAX;
+
+  std::shared_ptr<QuicChannel> channel_;
+  const uint64_t id_;
+  WaiterList readable_;
+  WaiterList writable_;
+  // queued in the channel for sending
+  bool queued_{false};
+
+  // bytes from send_base_ on are unacked, send_next_ is the first never
+  // sent, send_limit_ the peer's flow control limit
+  std::vector<char> send_buf_;
+  size_t send_head_{0};
+  uint64_t send_base_{0};
+  uint64_t send_next_{0};
+  uint64_t send_limit_;
+  quic::RangeSet send_acked_;
+  quic::RangeSet send_lost_;
+  bool fin_{false};
+  bool fin_sent_{false};
+  bool fin_acked_{false};
+  bool reset_sent_{false};
+  bool stop_received_{false};
+
+  // contiguous bytes not read yet, and the ones past a gap
+  std::string recv_buf_;
+  size_t recv_head_{0};
+  std::map<uint64_t, std::string> recv_chunks_;
+  uint64_t recv_read_{0};
+  uint64_t recv_contiguous_{0};
+  uint64_t recv_highest_{0};
+  uint64_t recv_final_{kUnknown};
+  const uint64_t recv_window_;
+  uint64_t recv_limit_;
+  bool reset_received_{false};
+  bool stop_sent_{false};
+};
+
+// A multiplexed tunnel transport over udp, one connection carrying many
+// streams, shaped after quic (RFC 9000 and RFC 9002). Loss recovery is per
+// packet with CUBIC congestion control, a client holding a ticket sends
+// stream data in its first flight, and connections survive a change of the
+// client's address as they are told apart by connection ids.
+//
+// Packets are not protected: no TLS handshake, no header or payload
+// encryption. Run it over a trusted network or inside an encrypted tunnel.
+//
+// A channel and its streams run on the thread of the executor they were
+// created on.
+class QuicChannel : public std::enable_shared_from_this<QuicChannel>,
+                    NonCopyable {
+ public:
+  // Connects to a QuicListener at `server`. With a ticket the channel is
+  // returned right away and streams send 0-RTT, else once the server
+  // answered. Throws asio::system_error timed_out.
+  static asio::awaitable<std::shared_ptr<QuicChannel>> AsyncConnect(
+      const asio::ip::udp::endpoint &server, QuicConfig config,
+      std::optional<QuicTicket> ticket = std::nullopt);
+  // With the default config. Callers inside coroutines use this or pass a
+  // named config, GCC 12 destroys a QuicConfig temporary of a co_await
+  // expression twice.
+  static asio::awaitable<std::shared_ptr<QuicChannel>> AsyncConnect(
+      const asio::ip::udp::endpoint &server) {
+    return AsyncConnect(server, QuicConfig{});
+  }
+
+  ~QuicChannel();
+
+  // Opens a stream, waits while the peer's stream limit is reached.
+  asio::awaitable<std::shared_ptr<QuicStream>> AsyncOpen();
+  // Waits for a stream opened by the peer.
+  asio::awaitable<std::shared_ptr<QuicStream>> AsyncAccept();
+  // Closes the channel and every stream of it.
+  void Close();
+  // Moves a client to a new local port, as after a network change. The
+  // server follows once it validated the new path.
+  void Migrate();
+
+  // A ticket for the next connection, once the server issued one.
+  [[nodiscard]] std::optional<QuicTicket> Ticket() const { return ticket_; }
+  [[nodiscard]] bool Closed() const { return state_ == State::kClosed; }
+  [[nodiscard]] bool EarlyDataAccepted() const { return early_accepted_; }
+  [[nodiscard]] const asio::ip::udp::endpoint &Peer() const { return peer_; }
+  [[nodiscard]] QuicStats Stats() const;
+
+ private:
+  friend class QuicStream;
+  friend class QuicListener;
+
+  enum class State { kHandshake, kEstablished, kClosed };
+
+  struct SentStream {
+    uint64_t id;
+    uint64_t offset;
+    uint64_t length;
+    bool fin;
+  };
+  struct SentPacket {
+    uint64_t pn;
+    quic::Clock::time_point time;
+    size_t bytes;
+    bool ack_eliciting;
+    bool zero_rtt;
+    bool acked;
+    bool lost;
+    // carried our transport parameters
+    bool hello;
+    SmallVector<SentStream, 2> streams;
+    // retransmittable control frames, encoded back to back
+    std::string control;
+  };
+
+  QuicChannel(const asio::any_io_executor &executor, const QuicConfig &config,
+              bool client);
+
+  void StartClient(const asio::ip::udp::endpoint &server,
+                   std::optional<QuicTicket> ticket);
+  void StartServer(std::shared_ptr<UdpBatch> socket,
+                   const asio::ip::udp::endpoint &peer, uint64_t dcid);
+  asio::awaitable<void> Receive(std::shared_ptr<UdpBatch> socket);
+
+  // receiving
+  void OnDatagram(const asio::ip::udp::endpoint &from, std::string_view data,
+                  quic::Clock::time_point now);
+  bool OnPacket(const quic::Header &header, uint64_t pn,
+                const asio::ip::udp::endpoint &from,
+                quic::Clock::time_point now);
+  bool OnAck(quic::Reader &reader, quic::Clock::time_point now);
+  bool OnHello(std::string_view hello);
+  bool OnStream(uint64_t id, uint64_t offset, std::string_view data, bool fin);
+  bool OnResetStream(uint64_t id, uint64_t final_size);
+  // Null for streams retired already, opens the peer's new ones.
+  QuicStream *StreamOf(uint64_t id, quic::TransportError *error);
+  [[nodiscard]] bool IsLocal(uint64_t id) const {
+    return (id & 1) == (client_ ? 0 : 1);
+  }
+  void OnPacketAcked(SentPacket &packet, quic::Clock::time_point now);
+  void OnPacketLost(SentPacket &packet, bool congestion,
+                    quic::Clock::time_point now);
+  void DetectLost(quic::Clock::time_point now);
+
+  // sending
+  void Flush();
+  void ScheduleFlush();
+  bool SendPacket(quic::Clock::time_point now);
+  void WriteAck(quic::Writer &writer, quic::Clock::time_point now);
+  void WriteControl(quic::Writer &writer, SentPacket &packet);
+  bool WriteStream(quic::Writer &writer, QuicStream &stream,
+                   SentPacket &packet);
+  void SendChallenge();
+  void QueueControl(std::string frame);
+  void QueueStream(QuicStream &stream);
+
+  // timers and teardown
+  void ArmTimer();
+  void OnTimer(quic::Clock::time_point now);
+  [[nodiscard]] quic::Clock::duration Pto() const;
+  void CloseWithError(quic::TransportError error, std::string_view reason);
+  void Terminate(const asio::error_code &error);
+  void OnStreamRead(QuicStream &stream, size_t len);
+  void OnConnRead(uint64_t len);
+  void MaybeRetire(QuicStream &stream);
+  std::shared_ptr<QuicStream> CreateStream(uint64_t id);
+
+  asio::any_io_executor executor_;
+  const QuicConfig config_;
+  const bool client_;
+  State state_{State::kHandshake};
+  asio::error_code error_;
+
+  std::shared_ptr<UdpBatch> socket_;
+  asio::ip::udp::endpoint peer_;
+  uint64_t local_cid_;
+  uint64_t peer_cid_;
+  // the server routes the client's first packets by it
+  uint64_t initial_cid_{0};
+  std::function<void(QuicChannel *)> on_close_;
+
+  // path validation of a migrated client, on the server
+  std::optional<asio::ip::udp::endpoint> probing_;
+  uint64_t challenge_{0};
+  bool challenge_pending_{false};
+
+  quic::TransportParams local_params_;
+  quic::TransportParams peer_params_;
+  bool hello_received_{false};
+  bool hello_pending_{false};
+  std::optional<QuicTicket> ticket_;
+  std::string token_;
+  // redeem and issue tickets on the server
+  std::function<bool(std::string_view)> redeem_;
+  std::function<std::string()> issue_;
+  bool early_data_{false};
+  bool early_accepted_{false};
+
+  std::unordered_map<uint64_t, std::shared_ptr<QuicStream>> streams_;
+  uint64_t next_local_stream_;
+  uint64_t next_peer_stream_;
+  // peer initiated streams retired so far, raise the peer's stream limit
+  uint64_t peer_streams_retired_{0};
+  uint64_t local_max_streams_;
+  uint64_t peer_max_streams_{0};
+  std::deque<std::shared_ptr<QuicStream>> accepted_;
+  WaiterList accept_ready_;
+  WaiterList open_ready_;
+  WaiterList established_;
+
+  // connection level flow control, counted over the highest offsets
+  uint64_t conn_sent_{0};
+  uint64_t peer_max_data_{0};
+  uint64_t conn_received_{0};
+  uint64_t conn_read_{0};
+  uint64_t local_max_data_;
+
+  // frames waiting to be sent
+  std::deque<std::string> control_;
+  std::vector<uint64_t> window_updates_;
+  bool max_data_pending_{false};
+  bool max_streams_pending_{false};
+  bool ping_pending_{false};
+  std::deque<QuicStream *> send_queue_;
+  bool flush_scheduled_{false};
+
+  // loss recovery, sent_[i] holds packet number sent_.front().pn + i
+  std::deque<SentPacket> sent_;
+  uint64_t next_pn_{0};
+  std::optional<uint64_t> largest_acked_;
+  size_t bytes_in_flight_{0};
+  quic::Clock::time_point last_ack_eliciting_{};
+  quic::Clock::time_point loss_time_{};
+  size_t pto_count_{0};
+  size_t probes_{0};
+  quic::RttEstimator rtt_;
+  quic::Cubic cc_;
+
+  // packets received, and what is owed to the peer
+  quic::RangeSet received_;
+  uint64_t largest_received_{0};
+  quic::Clock::time_point largest_received_time_{};
+  size_t ack_eliciting_received_{0};
+  bool ack_now_{false};
+  quic::Clock::time_point ack_deadline_{};
+  quic::Clock::time_point last_received_{};
+
+  asio::steady_timer timer_;
+  quic::Clock::time_point timer_deadline_{quic::Clock::time_point::max()};
+
+  QuicStats stats_{};
+};
+
+// Accepts QuicChannels on a udp port, telling connections apart by their
+// connection ids rather than client addresses.
+class QuicListener : NonCopyable {
+ public:
+  QuicListener(asio::io_context &ctx, const asio::ip::udp::endpoint &endpoint,
+               const QuicConfig &config = {});
+  ~QuicListener();
+
+  asio::awaitable<std::shared_ptr<QuicChannel>> AsyncAccept();
+  void Close();
+  [[nodiscard]] asio::ip::udp::endpoint LocalEndpoint() const {
+    return socket_->LocalEndpoint();
+  }
+
+ private:
+  // tickets live this long and are redeemed once
+  static constexpr auto kTicketLifetime = std::chrono::hours{24};
+  static constexpr size_t kMaxTickets = 65536;
+
+  asio::awaitable<void> Receive();
+  void OnDatagram(const UdpBatch::Datagram &datagram,
+                  quic::Clock::time_point now,
+                  std::vector<std::shared_ptr<QuicChannel>> &touched);
+  bool Redeem(std::string_view token);
+  std::string Issue();
+
+  asio::io_context &ctx_;
+  const QuicConfig config_;
+  std::shared_ptr<UdpBatch> socket_;
+  // by every connection id a channel is reached with
+  std::unordered_map<uint64_t, std::shared_ptr<QuicChannel>> channels_;
+  std::deque<std::shared_ptr<QuicChannel>> accepted_;
+  WaiterList accept_ready_;
+  std::unordered_map<std::string, quic::Clock::time_point> tickets_;
+  bool closed_{false};
 };
 
-}  // namespace socks
\ No newline at end of file
+}  // namespace socks
@@ -0,0 +1,363 @@
+#include "channel/quic_wire.h"
+
+#include <cstring>
+#include <iterator>
+
+namespace socks::quic {
+
+namespace {
+
+constexpr uint8_t kLongHeader = 0xc0;
+constexpr uint8_t kShortHeader = 0x40;
+// packet numbers always take four bytes
+constexpr uint8_t kPnLength = 0x03;
+
+enum class ParamId : uint64_t {
+  kIdleTimeout = 0x01,
+  kMaxDatagram = 0x03,
+  kMaxData = 0x04,
+  kMaxStreamData = 0x05,
+  kMaxStreams = 0x08,
+  // private use range, RFC 9000 section 18.1
+  kEarlyData = 0x5153,
+  kPsk = 0x5154,
+};
+
+}  // namespace
+
+size_t VarintSize(uint64_t value) {
+  if (value < (1ull << 6)) return 1;
+  if (value < (1ull << 14)) return 2;
+  if (value < (1ull << 30)) return 4;
+  return 8;
+}
+
+char *Writer::Take(size_t len) {
+  if (!ok_ || Room() < len) {
+    ok_ = false;
+    return nullptr;
+  }
+  auto *p = buf_.data() + size_;
+  size_ += len;
+  return p;
+}
+
+void Writer::U8(uint8_t value) {
+  if (auto *p = Take(1)) *p = static_cast<char>(value);
+}
+
+void Writer::U16(uint16_t value) {
+  if (auto *p = Take(2)) {
+    p[0] = static_cast<char>(value >> 8);
+    p[1] = static_cast<char>(value);
+  }
+}
+
+void Writer::U32(uint32_t value) {
+  if (auto *p = Take(4)) {
+    for (int i = 0; i < 4; ++i) p[i] = static_cast<char>(value >> (24 - i * 8));
+  }
+}
+
+void Writer::U64(uint64_t value) {
+  if (auto *p = Take(8)) {
+    for (int i = 0; i < 8; ++i) p[i] = static_cast<char>(value >> (56 - i * 8));
+  }
+}
+
+void Writer::Varint(uint64_t value) {
+  switch (VarintSize(value)) {
+    case 1:
+      U8(static_cast<uint8_t>(value));
+      break;
+    case 2:
+      U16(static_cast<uint16_t>(value | 0x4000));
+      break;
+    case 4:
+      U32(static_cast<uint32_t>(value | 0x80000000));
+      break;
+    default:
+      U64(value | 0xc000000000000000);
+      break;
+  }
+}
+
+void Writer::Bytes(std::string_view data) {
+  if (auto *p = Take(data.size())) std::memcpy(p, data.data(), data.size());
+}
+
+size_t Writer::Reserve16() {
+  const auto at = size_;
+  U16(0);
+  return at;
+}
+
+void Writer::Patch16(size_t at, uint16_t value) {
+  if (!ok_) return;
+  value |= 0x4000;
+  buf_[at] = static_cast<char>(value >> 8);
+  buf_[at + 1] = static_cast<char>(value);
+}
+
+uint8_t Reader::U8() {
+  if (data_.empty()) {
+    ok_ = false;
+    return 0;
+  }
+  const auto value = static_cast<uint8_t>(data_[0]);
+  data_.remove_prefix(1);
+  return value;
+}
+
+uint16_t Reader::U16() {
+  const uint16_t hi = U8();
+  return static_cast<uint16_t>(hi << 8 | U8());
+}
+
+uint32_t Reader::U32() {
+  const uint32_t hi = U16();
+  return hi << 16 | U16();
+}
+
+uint64_t Reader::U64() {
+  const uint64_t hi = U32();
+  return hi << 32 | U32();
+}
+
+uint64_t Reader::Varint() {
+  if (data_.empty()) {
+    ok_ = false;
+    return 0;
+  }
+  const auto prefix = static_cast<uint8_t>(data_[0]) >> 6;
+  switch (prefix) {
+    case 0:
+      return U8();
+    case 1:
+      return U16() & 0x3fff;
+    case 2:
+      return U32() & 0x3fffffff;
+    default:
+      return U64() & 0x3fffffffffffffff;
+  }
+}
+
+std::string_view Reader::Bytes(size_t len) {
+  if (data_.size() < len) {
+    ok_ = false;
+    data_ = {};
+    return {};
+  }
+  const auto bytes = data_.substr(0, len);
+  data_.remove_prefix(len);
+  return bytes;
+}
+
+std::optional<Header> ParsePacket(std::string_view &datagram) {
+  Reader reader{datagram};
+  Header header{};
+  const auto first = reader.U8();
+  if ((first & kLongHeader) == kLongHeader) {
+    header.type = static_cast<PacketType>((first >> 4) & 0x03);
+    if (header.type != PacketType::kInitial &&
+        header.type != PacketType::kZeroRtt) {
+      return std::nullopt;
+    }
+    if (reader.U32() != kVersion || reader.U8() != kCidSize) {
+      return std::nullopt;
+    }
+    header.dcid = reader.U64();
+    if (reader.U8() != kCidSize) return std::nullopt;
+    header.scid = reader.U64();
+    if (header.type == PacketType::kInitial) {
+      header.token = reader.Bytes(reader.Varint());
+    }
+    const auto length = reader.Varint();
+    if (!reader.Ok() || length < 4 || length > reader.Rest().size()) {
+      return std::nullopt;
+    }
+    header.pn = reader.U32();
+    header.payload = reader.Bytes(length - 4);
+    datagram = reader.Rest();
+    return header;
+  }
+  if ((first & kShortHeader) == 0) return std::nullopt;
+
+  header.type = PacketType::kShort;
+  header.dcid = reader.U64();
+  header.pn = reader.U32();
+  if (!reader.Ok()) return std::nullopt;
+  header.payload = reader.Rest();
+  datagram = {};
+  return header;
+}
+
+std::optional<uint64_t> PeekDcid(std::string_view datagram) {
+  Reader reader{datagram};
+  const auto first = reader.U8();
+  if ((first & kLongHeader) == kLongHeader) {
+    if (reader.U32() != kVersion || reader.U8() != kCidSize) {
+      return std::nullopt;
+    }
+  }
+  const auto dcid = reader.U64();
+  if (!reader.Ok()) return std::nullopt;
+  return dcid;
+}
+
+uint64_t DecodePacketNumber(uint64_t largest, uint32_t truncated) {
+  constexpr uint64_t kWindow = 1ull << 32;
+  constexpr uint64_t kHalf = kWindow / 2;
+  const auto expected = largest + 1;
+  const auto candidate = (expected & ~(kWindow - 1)) | truncated;
+  if (candidate + kHalf <= expected && candidate < (1ull << 62) - kWindow) {
+    return candidate + kWindow;
+  }
+  if (candidate > expected + kHalf && candidate >= kWindow) {
+    return candidate - kWindow;
+  }
+  return candidate;
+}
+
+PacketWriter::PacketWriter(Writer &writer, PacketType type, uint64_t dcid,
+                           uint64_t scid, std::string_view token,
+                           uint64_t pn)
+    : writer{writer}, type{type} {
+  if (type == PacketType::kShort) {
+    writer.U8(kShortHeader | kPnLength);
+    writer.U64(dcid);
+  } else {
+    writer.U8(kLongHeader | static_cast<uint8_t>(type) << 4 | kPnLength);
+    writer.U32(kVersion);
+    writer.U8(kCidSize);
+    writer.U64(dcid);
+    writer.U8(kCidSize);
+    writer.U64(scid);
+    if (type == PacketType::kInitial) {
+      writer.Varint(token.size());
+      writer.Bytes(token);
+    }
+    length_at = writer.Reserve16();
+  }
+  pn_at = writer.Size();
+  writer.U32(static_cast<uint32_t>(pn));
+}
+
+void PacketWriter::Finish() {
+  if (type != PacketType::kShort) {
+    writer.Patch16(length_at, static_cast<uint16_t>(writer.Size() - pn_at));
+  }
+}
+
+void TransportParams::Encode(Writer &writer) const {
+  const auto param = [&writer](ParamId id, uint64_t value) {
+    writer.Varint(static_cast<uint64_t>(id));
+    writer.Varint(VarintSize(value));
+    writer.Varint(value);
+  };
+  param(ParamId::kIdleTimeout, idle_timeout_ms);
+  param(ParamId::kMaxDatagram, max_datagram);
+  param(ParamId::kMaxData, max_data);
+  param(ParamId::kMaxStreamData, max_stream_data);
+  param(ParamId::kMaxStreams, max_streams);
+  if (early_data) param(ParamId::kEarlyData, 1);
+  if (!psk.empty()) {
+    writer.Varint(static_cast<uint64_t>(ParamId::kPsk));
+    writer.Varint(psk.size());
+    writer.Bytes(psk);
+  }
+}
+
+std::optional<TransportParams> TransportParams::Decode(std::string_view data) {
+  TransportParams params;
+  Reader reader{data};
+  while (!reader.Empty()) {
+    const auto id = static_cast<ParamId>(reader.Varint());
+    Reader value{reader.Bytes(reader.Varint())};
+    switch (id) {
+      case ParamId::kIdleTimeout:
+        params.idle_timeout_ms = value.Varint();
+        break;
+      case ParamId::kMaxDatagram:
+        params.max_datagram = value.Varint();
+        break;
+      case ParamId::kMaxData:
+        params.max_data = value.Varint();
+        break;
+      case ParamId::kMaxStreamData:
+        params.max_stream_data = value.Varint();
+        break;
+      case ParamId::kMaxStreams:
+        params.max_streams = value.Varint();
+        break;
+      case ParamId::kEarlyData:
+        params.early_data = value.Varint() != 0;
+        break;
+      case ParamId::kPsk:
+        params.psk = value.Rest();
+        break;
+      default:
+        // unknown parameters are ignored, RFC 9000 section 7.4.2
+        break;
+    }
+    if (!reader.Ok() || !value.Ok()) return std::nullopt;
+  }
+  if (params.max_datagram < kMinInitialSize) return std::nullopt;
+  return params;
+}
+
+void RangeSet::Add(uint64_t begin, uint64_t end) {
+  if (begin >= end) return;
+  auto it = ranges_.upper_bound(begin);
+  if (it != ranges_.begin()) {
+    auto prev = std::prev(it);
+    if (prev->second >= begin) {
+      if (prev->second >= end) return;
+      begin = prev->first;
+      it = prev;
+    }
+  }
+  while (it != ranges_.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    it = ranges_.erase(it);
+  }
+  ranges_.emplace_hint(it, begin, end);
+}
+
+void RangeSet::Remove(uint64_t begin, uint64_t end) {
+  if (begin >= end) return;
+  auto it = ranges_.upper_bound(begin);
+  if (it != ranges_.begin()) --it;
+  while (it != ranges_.end() && it->first < end) {
+    const auto [first, last] = *it;
+    if (last <= begin) {
+      ++it;
+      continue;
+    }
+    it = ranges_.erase(it);
+    if (first < begin) ranges_.emplace(first, begin);
+    if (last > end) {
+      ranges_.emplace(end, last);
+      break;
+    }
+  }
+}
+
+bool RangeSet::Contains(uint64_t value) const {
+  auto it = ranges_.upper_bound(value);
+  if (it == ranges_.begin()) return false;
+  return std::prev(it)->second > value;
+}
+
+uint64_t RangeSet::ContiguousEnd(uint64_t value) const {
+  auto it = ranges_.upper_bound(value);
+  if (it == ranges_.begin()) return value;
+  --it;
+  return it->second > value ? it->second : value;
+}
+
+void RangeSet::Trim(size_t count) {
+  while (ranges_.size() > count) ranges_.erase(ranges_.begin());
+}
+
+}  // namespace socks::quic
@@ -0,0 +1,188 @@
+#ifndef QUIC_SOCKS_CHANNEL_QUIC_WIRE_H_
+#define QUIC_SOCKS_CHANNEL_QUIC_WIRE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+// Packet and frame layout of the quic channel. Frames, varints, transport
+// parameters and the long/short header split follow RFC 9000, packets carry
+// no protection though, see QuicChannel.
+namespace socks::quic {
+
+// not an IETF version, peers speaking real quic drop these packets
+constexpr uint32_t kVersion = 0x51534b01;
+constexpr size_t kCidSize = 8;
+// client initials are padded to it, RFC 9000 section 14.1
+constexpr size_t kMinInitialSize = 1200;
+constexpr size_t kMaxVarint = (1ull << 62) - 1;
+
+enum class FrameType : uint8_t {
+  kPadding = 0x00,
+  kPing = 0x01,
+  kAck = 0x02,
+  kResetStream = 0x04,
+  kStopSending = 0x05,
+  kCrypto = 0x06,
+  kNewToken = 0x07,
+  kStream = 0x08,
+  kMaxData = 0x10,
+  kMaxStreamData = 0x11,
+  kMaxStreams = 0x12,
+  kPathChallenge = 0x1a,
+  kPathResponse = 0x1b,
+  kConnectionClose = 0x1c,
+  kHandshakeDone = 0x1e,
+};
+
+// low bits of a STREAM frame type
+constexpr uint8_t kStreamFin = 0x01;
+constexpr uint8_t kStreamLen = 0x02;
+constexpr uint8_t kStreamOff = 0x04;
+
+// transport error codes, RFC 9000 section 20.1
+enum class TransportError : uint64_t {
+  kNoError = 0x0,
+  kInternal = 0x1,
+  kConnectionRefused = 0x2,
+  kFlowControl = 0x3,
+  kStreamLimit = 0x4,
+  kStreamState = 0x5,
+  kFinalSize = 0x6,
+  kFrameEncoding = 0x7,
+  kTransportParameter = 0x8,
+  kProtocolViolation = 0xa,
+};
+
+enum class PacketType : uint8_t { kInitial, kZeroRtt, kShort };
+
+size_t VarintSize(uint64_t value);
+
+// Appends to a fixed buffer. Writing past its end stops the writer, which
+// is then no longer Ok().
+class Writer {
+ public:
+  explicit Writer(std::span<char> buf) : buf_{buf} {}
+
+  void U8(uint8_t value);
+  void U16(uint16_t value);
+  void U32(uint32_t value);
+  void U64(uint64_t value);
+  void Varint(uint64_t value);
+  void Bytes(std::string_view data);
+  // Leaves room for a two byte varint filled in later by Patch16.
+  size_t Reserve16();
+  void Patch16(size_t at, uint16_t value);
+
+  [[nodiscard]] bool Ok() const { return ok_; }
+  [[nodiscard]] size_t Size() const { return size_; }
+  [[nodiscard]] size_t Room() const { return buf_.size() - size_; }
+  char *Data() { return buf_.data(); }
+
+ private:
+  char *Take(size_t len);
+
+  std::span<char> buf_;
+  size_t size_{0};
+  bool ok_{true};
+};
+
+// Reads from a buffer. Reading past its end yields zeros and the reader is
+// no longer Ok().
+class Reader {
+ public:
+  explicit Reader(std::string_view data) : data_{data} {}
+
+  uint8_t U8();
+  uint16_t U16();
+  uint32_t U32();
+  uint64_t U64();
+  uint64_t Varint();
+  std::string_view Bytes(size_t len);
+
+  [[nodiscard]] bool Ok() const { return ok_; }
+  [[nodiscard]] bool Empty() const { return data_.empty(); }
+  [[nodiscard]] std::string_view Rest() const { return data_; }
+
+ private:
+  std::string_view data_;
+  bool ok_{true};
+};
+
+struct Header {
+  PacketType type;
+  uint64_t dcid;
+  // long headers only
+  uint64_t scid;
+  std::string_view token;
+  // truncated to 32 bits, see DecodePacketNumber
+  uint32_t pn;
+  std::string_view payload;
+};
+
+// Parses the next packet off the front of `datagram`, long header packets
+// may be coalesced with more behind them.
+std::optional<Header> ParsePacket(std::string_view &datagram);
+// Returns the destination connection id without parsing the whole packet.
+std::optional<uint64_t> PeekDcid(std::string_view datagram);
+
+// Recovers the full packet number, RFC 9000 appendix A.3.
+uint64_t DecodePacketNumber(uint64_t largest, uint32_t truncated);
+
+// Starts a packet, the header of a long one is completed by Finish once
+// the payload is written.
+struct PacketWriter {
+  PacketWriter(Writer &writer, PacketType type, uint64_t dcid, uint64_t scid,
+               std::string_view token, uint64_t pn);
+  void Finish();
+
+  Writer &writer;
+  PacketType type;
+  size_t length_at{0};
+  size_t pn_at{0};
+};
+
+struct TransportParams {
+  uint64_t idle_timeout_ms{0};
+  uint64_t max_datagram{65527};
+  uint64_t max_data{0};
+  uint64_t max_stream_data{0};
+  uint64_t max_streams{0};
+  // server only, whether the 0-RTT data of the client was taken
+  bool early_data{false};
+  // client only, see QuicConfig::psk
+  std::string psk;
+
+  void Encode(Writer &writer) const;
+  static std::optional<TransportParams> Decode(std::string_view data);
+};
+
+// Disjoint half open ranges, of stream offsets or packet numbers.
+class RangeSet {
+ public:
+  using Ranges = std::map<uint64_t, uint64_t>;
+
+  void Add(uint64_t begin, uint64_t end);
+  void Remove(uint64_t begin, uint64_t end);
+  [[nodiscard]] bool Contains(uint64_t value) const;
+  // End of the range holding `value`, `value` itself when there is none.
+  [[nodiscard]] uint64_t ContiguousEnd(uint64_t value) const;
+  // Drops the lowest ranges beyond the first `count`, counted from the top.
+  void Trim(size_t count);
+
+  [[nodiscard]] bool Empty() const { return ranges_.empty(); }
+  [[nodiscard]] size_t Size() const { return ranges_.size(); }
+  [[nodiscard]] const Ranges &Get() const { return ranges_; }
+  void Clear() { ranges_.clear(); }
+
+ private:
+  Ranges ranges_;
+};
+
+}  // namespace socks::quic
+
+#endif  // QUIC_SOCKS_CHANNEL_QUIC_WIRE_H_
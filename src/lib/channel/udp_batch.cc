@@ -0,0 +1,259 @@
+#include "channel/udp_batch.h"
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#endif
+
+#include <array>
+#include <asio.hpp>
+#include <cerrno>
+#include <cstring>
+
+#include "utility/log.h"
+
+namespace socks {
+
+namespace {
+
+#ifdef __linux__
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+// the kernel takes at most 64 segments and 64k per gso send
+constexpr size_t kMaxSegments = 64;
+constexpr size_t kMaxSuperDatagram = 65000;
+constexpr size_t kGroSlot = 65535;
+constexpr int kSocketBuffer = 4 * 1024 * 1024;
+
+}  // namespace
+
+UdpBatch::UdpBatch(const asio::any_io_executor &executor,
+                   const asio::ip::udp::endpoint &local, size_t max_datagram,
+                   bool offload)
+    : socket_{executor, local}, max_datagram_{max_datagram} {
+  socket_.non_blocking(true);
+  asio::error_code err;
+  // bursts of a whole congestion window must not overflow the defaults
+  socket_.set_option(asio::socket_base::receive_buffer_size(kSocketBuffer),
+                     err);
+  socket_.set_option(asio::socket_base::send_buffer_size(kSocketBuffer), err);
+#ifdef __linux__
+  if (offload) {
+    const int zero = 0, one = 1;
+    const auto fd = socket_.native_handle();
+    gso_ = ::setsockopt(fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+    gro_ = ::setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+  }
+#endif
+  slot_size_ = gro_ ? kGroSlot : max_datagram_;
+  in_.resize(kBatch * slot_size_);
+  SPDLOG_DEBUG("[quic] udp socket bound, local={}:{}, gso={}, gro={}",
+               LocalEndpoint().address().to_string(), LocalEndpoint().port(),
+               gso_, gro_);
+}
+
+asio::ip::udp::endpoint UdpBatch::LocalEndpoint() const {
+  asio::error_code err;
+  return socket_.local_endpoint(err);
+}
+
+void UdpBatch::Close() {
+  asio::error_code err;
+  socket_.close(err);
+  pending_.clear();
+  used_ = sent_ = 0;
+}
+
+asio::awaitable<std::span<const UdpBatch::Datagram>> UdpBatch::AsyncReceive() {
+  received_.clear();
+  while (true) {
+    if (!socket_.is_open()) {
+      throw asio::system_error{asio::error::bad_descriptor};
+    }
+    ReceiveSome();
+    if (!received_.empty()) break;
+    co_await socket_.async_wait(asio::ip::udp::socket::wait_read,
+                                asio::use_awaitable);
+  }
+  co_return std::span<const Datagram>{received_};
+}
+
+void UdpBatch::ReceiveSome() {
+#ifdef __linux__
+  std::array<mmsghdr, kBatch> msgs{};
+  std::array<iovec, kBatch> iovs{};
+  std::array<sockaddr_storage, kBatch> names{};
+  alignas(cmsghdr) std::array<char, kBatch * CMSG_SPACE(sizeof(int))> control{};
+  for (size_t i = 0; i < kBatch; ++i) {
+    iovs[i] = {in_.data() + i * slot_size_, slot_size_};
+    auto &hdr = msgs[i].msg_hdr;
+    hdr.msg_name = &names[i];
+    hdr.msg_namelen = sizeof(names[i]);
+    hdr.msg_iov = &iovs[i];
+    hdr.msg_iovlen = 1;
+    if (gro_) {
+      hdr.msg_control = control.data() + i * CMSG_SPACE(sizeof(int));
+      hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+    }
+  }
+  const auto n = ::recvmmsg(socket_.native_handle(), msgs.data(), kBatch,
+                            MSG_DONTWAIT, nullptr);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      SPDLOG_DEBUG("[quic] recvmmsg failed, err={}", std::strerror(errno));
+    }
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    const auto &hdr = msgs[i].msg_hdr;
+    asio::ip::udp::endpoint peer;
+    std::memcpy(peer.data(), hdr.msg_name, hdr.msg_namelen);
+    peer.resize(hdr.msg_namelen);
+
+    size_t segment = msgs[i].msg_len;
+    for (auto *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(const_cast<msghdr *>(&hdr), cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int size{0};
+        std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+        if (size > 0) segment = size;
+      }
+    }
+    const std::string_view data{static_cast<char *>(iovs[i].iov_base),
+                                msgs[i].msg_len};
+    for (size_t at = 0; at < data.size(); at += segment) {
+      received_.push_back(Datagram{peer, data.substr(at, segment)});
+    }
+  }
+#else
+  for (size_t i = 0; i < kBatch; ++i) {
+    asio::ip::udp::endpoint peer;
+    asio::error_code err;
+    const auto len = socket_.receive_from(
+        asio::buffer(in_.data() + i * slot_size_, slot_size_), peer, 0, err);
+    if (err) break;
+    received_.push_back(
+        Datagram{peer, {in_.data() + i * slot_size_, len}});
+  }
+#endif
+}
+
+std::span<char> UdpBatch::Prepare() {
+  if (out_.size() < used_ + max_datagram_) {
+    out_.resize(used_ + max_datagram_);
+  }
+  return {out_.data() + used_, max_datagram_};
+}
+
+void UdpBatch::Commit(const asio::ip::udp::endpoint &peer, size_t len) {
+  pending_.push_back(Pending{peer, used_, len});
+  used_ += len;
+}
+
+void UdpBatch::Uncork() {
+  if (corked_ > 0 && --corked_ == 0) Flush();
+}
+
+void UdpBatch::Flush() {
+  if (corked_ > 0 || waiting_write_ || !socket_.is_open()) return;
+  if (SendSome()) {
+    pending_.clear();
+    used_ = sent_ = 0;
+    return;
+  }
+  waiting_write_ = true;
+  socket_.async_wait(asio::ip::udp::socket::wait_write,
+                     [this](const asio::error_code &err) {
+                       // cancelled ones may find the batch gone
+                       if (err) return;
+                       waiting_write_ = false;
+                       Flush();
+                     });
+}
+
+bool UdpBatch::SendSome() {
+#ifdef __linux__
+  while (sent_ < pending_.size()) {
+    std::array<mmsghdr, kBatch> msgs{};
+    std::array<iovec, kBatch> iovs{};
+    std::array<size_t, kBatch> counts{};
+    alignas(cmsghdr) std::array<char, kBatch * CMSG_SPACE(sizeof(uint16_t))>
+        control{};
+    size_t n{0};
+    for (auto idx = sent_; n < kBatch && idx < pending_.size(); ++n) {
+      const auto &first = pending_[idx];
+      size_t count{1};
+      size_t bytes{first.len};
+      // a run of one size to one peer, the last one may be shorter
+      while (gso_ && idx + count < pending_.size() && count < kMaxSegments) {
+        const auto &next = pending_[idx + count];
+        if (next.peer != first.peer || next.len > first.len ||
+            bytes + next.len > kMaxSuperDatagram) {
+          break;
+        }
+        bytes += next.len;
+        ++count;
+        if (next.len < first.len) break;
+      }
+
+      iovs[n] = {out_.data() + first.offset, bytes};
+      auto &hdr = msgs[n].msg_hdr;
+      hdr.msg_name = const_cast<sockaddr *>(first.peer.data());
+      hdr.msg_namelen = first.peer.size();
+      hdr.msg_iov = &iovs[n];
+      hdr.msg_iovlen = 1;
+      if (count > 1) {
+        hdr.msg_control = control.data() + n * CMSG_SPACE(sizeof(uint16_t));
+        hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        auto *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        const auto size = static_cast<uint16_t>(first.len);
+        std::memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+      }
+      counts[n] = count;
+      idx += count;
+    }
+
+    const auto sent = ::sendmmsg(socket_.native_handle(), msgs.data(), n,
+                                 MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        return false;
+      }
+      if (gso_ && counts[0] > 1 && (errno == EIO || errno == EINVAL)) {
+        // the route's device can't segment, e.g. checksum offload is off
+        SPDLOG_WARN("[quic] udp segmentation offload failed, disabled");
+        gso_ = false;
+        continue;
+      }
+      // e.g. an unreachable peer, its datagrams must not hold up the rest
+      SPDLOG_DEBUG("[quic] sendmmsg failed, err={}", std::strerror(errno));
+      sent_ += counts[0];
+      continue;
+    }
+    for (int i = 0; i < sent; ++i) sent_ += counts[i];
+  }
+  return true;
+#else
+  for (; sent_ < pending_.size(); ++sent_) {
+    const auto &datagram = pending_[sent_];
+    asio::error_code err;
+    socket_.send_to(
+        asio::buffer(out_.data() + datagram.offset, datagram.len),
+        datagram.peer, 0, err);
+    if (err == asio::error::would_block) return false;
+  }
+  return true;
+#endif
+}
+
+}  // namespace socks
@@ -0,0 +1,89 @@
+#ifndef QUIC_SOCKS_CHANNEL_UDP_BATCH_H_
+#define QUIC_SOCKS_CHANNEL_UDP_BATCH_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/ip/udp.hpp>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "utility/ctor.h"
+
+namespace socks {
+
+// A non blocking udp socket moving datagrams in batches, with recvmmsg and
+// sendmmsg on linux. Where the kernel has udp segmentation offload, runs of
+// equally sized datagrams to one peer leave as a single UDP_SEGMENT send and
+// arrive coalesced by UDP_GRO, which is split up again here.
+class UdpBatch : NonCopyable {
+ public:
+  struct Datagram {
+    asio::ip::udp::endpoint peer;
+    std::string_view data;
+  };
+
+  // Messages per recvmmsg and per sendmmsg.
+  static constexpr size_t kBatch = 16;
+
+  // `max_datagram` bounds outgoing datagrams, `offload` enables gso and gro
+  // when the kernel supports them.
+  UdpBatch(const asio::any_io_executor &executor,
+           const asio::ip::udp::endpoint &local, size_t max_datagram,
+           bool offload);
+
+  // Waits for the socket to be readable and takes what is queued, up to a
+  // batch. The datagrams stay valid until the next call. Throws
+  // asio::system_error once the socket is closed.
+  asio::awaitable<std::span<const Datagram>> AsyncReceive();
+
+  // Room for the next datagram, sent to `peer` once committed.
+  std::span<char> Prepare();
+  void Commit(const asio::ip::udp::endpoint &peer, size_t len);
+  // Sends the committed datagrams. What the socket can't take now goes out
+  // as soon as it is writable again, nothing is dropped here.
+  void Flush();
+  // Defers flushing until Uncork, so datagrams of several sources leave in
+  // one batch.
+  void Cork() { ++corked_; }
+  void Uncork();
+
+  void Close();
+  [[nodiscard]] bool IsOpen() const { return socket_.is_open(); }
+  [[nodiscard]] asio::ip::udp::endpoint LocalEndpoint() const;
+  [[nodiscard]] size_t MaxDatagram() const { return max_datagram_; }
+  [[nodiscard]] bool Offload() const { return gso_; }
+
+ private:
+  struct Pending {
+    asio::ip::udp::endpoint peer;
+    size_t offset;
+    size_t len;
+  };
+
+  // Returns false when the socket would block.
+  bool SendSome();
+  void ReceiveSome();
+
+  asio::ip::udp::socket socket_;
+  const size_t max_datagram_;
+  bool gso_{false};
+  bool gro_{false};
+  size_t corked_{0};
+  bool waiting_write_{false};
+
+  // committed datagrams back to back in [0, used_), pending_ from sent_ on
+  // are not sent yet
+  std::vector<char> out_;
+  size_t used_{0};
+  std::vector<Pending> pending_;
+  size_t sent_{0};
+
+  // one slot per message of a batch
+  std::vector<char> in_;
+  size_t slot_size_;
+  std::vector<Datagram> received_;
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_CHANNEL_UDP_BATCH_H_
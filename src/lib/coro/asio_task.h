@@ -0,0 +1,253 @@
+#ifndef QUIC_SOCKS_CORO_ASIO_TASK_H_
+#define QUIC_SOCKS_CORO_ASIO_TASK_H_
+
+#include <asio/associated_executor.hpp>
+#include <asio/async_result.hpp>
+#include <asio/dispatch.hpp>
+#include <asio/error_code.hpp>
+#include <asio/post.hpp>
+#include <asio/system_error.hpp>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "coro/task.h"
+
+namespace socks {
+
+// Completion token that makes asio operations awaitable inside a Task,
+// `co_await socket.async_read_some(buffer, use_task)`. An error_code
+// leading the completion is thrown as asio::system_error, an exception_ptr
+// is rethrown, the remaining arguments are returned, as a tuple if there
+// are several. Awaitables run inside a task through
+// `co_await asio::co_spawn(executor, awaitable, use_task)`. The operation
+// keeps its arguments in the awaiting frame, nothing is allocated.
+struct UseTask {};
+inline constexpr UseTask use_task{};
+
+namespace detail {
+
+template <typename... Args>
+struct TaskResult {
+  using type = std::tuple<Args...>;
+  static type From(std::tuple<Args...> &&args) { return std::move(args); }
+};
+
+template <>
+struct TaskResult<> {
+  using type = void;
+  static void From(std::tuple<> &&) {}
+};
+
+template <typename Arg>
+struct TaskResult<Arg> {
+  using type = Arg;
+  static type From(std::tuple<Arg> &&args) {
+    return std::move(std::get<0>(args));
+  }
+};
+
+template <typename... Args>
+struct TaskResult<asio::error_code, Args...> {
+  using type = typename TaskResult<Args...>::type;
+  static type From(std::tuple<asio::error_code, Args...> &&args) {
+    if (const auto &err = std::get<0>(args)) throw asio::system_error{err};
+    return std::apply(
+        [](asio::error_code, Args &&...rest) {
+          return TaskResult<Args...>::From(
+              std::tuple<Args...>{std::move(rest)...});
+        },
+        std::move(args));
+  }
+};
+
+template <>
+struct TaskResult<asio::error_code> {
+  using type = void;
+  static void From(std::tuple<asio::error_code> &&args) {
+    if (const auto &err = std::get<0>(args)) throw asio::system_error{err};
+  }
+};
+
+// what asio::co_spawn completes with
+template <typename... Args>
+struct TaskResult<std::exception_ptr, Args...> {
+  using type = typename TaskResult<Args...>::type;
+  static type From(std::tuple<std::exception_ptr, Args...> &&args) {
+    if (const auto &error = std::get<0>(args)) std::rethrow_exception(error);
+    return std::apply(
+        [](std::exception_ptr, Args &&...rest) {
+          return TaskResult<Args...>::From(
+              std::tuple<Args...>{std::move(rest)...});
+        },
+        std::move(args));
+  }
+};
+
+template <>
+struct TaskResult<std::exception_ptr> {
+  using type = void;
+  static void From(std::tuple<std::exception_ptr> &&args) {
+    if (const auto &error = std::get<0>(args)) std::rethrow_exception(error);
+  }
+};
+
+template <typename Initiation, typename InitArgs, typename... Args>
+class AsioOperation {
+  using Result = TaskResult<std::decay_t<Args>...>;
+  using Values = std::tuple<std::decay_t<Args>...>;
+
+  struct Handler {
+    AsioOperation *op;
+    std::coroutine_handle<> awaiting;
+
+    void operator()(Args... args) {
+      op->values_.emplace(std::forward<Args>(args)...);
+      awaiting.resume();
+    }
+  };
+
+ public:
+  AsioOperation(Initiation initiation, InitArgs args)
+      : initiation_{std::move(initiation)}, args_{std::move(args)} {}
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> awaiting) {
+    std::apply(
+        [this, awaiting](auto &&...args) {
+          std::move(initiation_)(Handler{this, awaiting},
+                                 std::move(args)...);
+        },
+        args_);
+  }
+  typename Result::type await_resume() {
+    return Result::From(std::move(*values_));
+  }
+
+ private:
+  Initiation initiation_;
+  InitArgs args_;
+  std::optional<Values> values_;
+};
+
+// Runs a detached coroutine, its frame frees itself at the end.
+struct Detached {
+  struct promise_type : PooledFrame {
+    Detached get_return_object() noexcept {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+// Resumes a Detached once posted, or destroys it when its executor shuts
+// down before getting to it.
+class Starter {
+ public:
+  explicit Starter(std::coroutine_handle<> handle) : handle_{handle} {}
+  Starter(Starter &&other) noexcept
+      : handle_{std::exchange(other.handle_, nullptr)} {}
+  Starter(const Starter &) = delete;
+  ~Starter() {
+    if (handle_) handle_.destroy();
+  }
+
+  void operator()() { std::exchange(handle_, nullptr).resume(); }
+
+ private:
+  std::coroutine_handle<> handle_;
+};
+
+template <typename T, typename Handler>
+Detached Drive(Task<T> task, Handler handler) {
+  std::exception_ptr error;
+  auto executor = asio::get_associated_executor(handler);
+  if constexpr (std::is_void_v<T>) {
+    try {
+      co_await std::move(task);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    asio::dispatch(executor, [handler = std::move(handler), error]() mutable {
+      std::move(handler)(error);
+    });
+  } else {
+    std::optional<T> value;
+    try {
+      value.emplace(co_await std::move(task));
+    } catch (...) {
+      error = std::current_exception();
+    }
+    asio::dispatch(executor, [handler = std::move(handler), error,
+                              value = std::move(value)]() mutable {
+      std::move(handler)(error, value ? std::move(*value) : T{});
+    });
+  }
+}
+
+template <typename T>
+struct RunSignature {
+  using type = void(std::exception_ptr, T);
+};
+
+template <>
+struct RunSignature<void> {
+  using type = void(std::exception_ptr);
+};
+
+}  // namespace detail
+
+// Runs `task` on `executor` and completes `token` with the exception it
+// threw, if any, and its value, like asio::co_spawn does for awaitables.
+// Awaitable code awaits a task with `asio::use_awaitable`, `asio::detached`
+// runs it on its own.
+template <typename Executor, typename T, typename CompletionToken>
+  requires(!std::is_convertible_v<Executor &, asio::execution_context &>)
+auto AsyncRun(const Executor &executor, Task<T> task,
+              CompletionToken &&token) {
+  return asio::async_initiate<CompletionToken,
+                              typename detail::RunSignature<T>::type>(
+      [executor](auto handler, Task<T> task) {
+        auto driver = detail::Drive(std::move(task), std::move(handler));
+        asio::post(executor, detail::Starter{driver.handle});
+      },
+      token, std::move(task));
+}
+
+template <typename ExecutionContext, typename T, typename CompletionToken>
+  requires std::is_convertible_v<ExecutionContext &, asio::execution_context &>
+auto AsyncRun(ExecutionContext &ctx, Task<T> task, CompletionToken &&token) {
+  return AsyncRun(ctx.get_executor(), std::move(task),
+                  std::forward<CompletionToken>(token));
+}
+
+}  // namespace socks
+
+namespace asio {
+
+template <typename R, typename... Args>
+class async_result<socks::UseTask, R(Args...)> {
+ public:
+  template <typename Initiation, typename... InitArgs>
+  static auto initiate(Initiation &&initiation, socks::UseTask,
+                       InitArgs &&...args) {
+    return socks::detail::AsioOperation<std::decay_t<Initiation>,
+                                        std::tuple<std::decay_t<InitArgs>...>,
+                                        Args...>{
+        std::forward<Initiation>(initiation),
+        std::tuple<std::decay_t<InitArgs>...>{
+            std::forward<InitArgs>(args)...}};
+  }
+};
+
+}  // namespace asio
+
+#endif  // QUIC_SOCKS_CORO_ASIO_TASK_H_
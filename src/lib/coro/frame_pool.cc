@@ -0,0 +1,71 @@
+#include "coro/frame_pool.h"
+
+#include <bit>
+#include <new>
+
+namespace socks {
+
+namespace {
+// cleared once the pool of the thread is destroyed, frames freed during
+// thread exit after that bypass it
+thread_local bool local_alive{false};
+}  // namespace
+
+FramePool::FramePool() { local_alive = true; }
+
+FramePool::~FramePool() {
+  local_alive = false;
+  for (size_t i = 0; i < kClasses; ++i) {
+    while (free_[i] != nullptr) {
+      auto *node = free_[i];
+      free_[i] = node->next;
+      ::operator delete(node, kMinClass << i);
+    }
+  }
+}
+
+FramePool *FramePool::Local() {
+  thread_local FramePool pool;
+  return local_alive ? &pool : nullptr;
+}
+
+size_t FramePool::ClassOf(size_t size) {
+  const auto rounded = std::bit_ceil(size < kMinClass ? kMinClass : size);
+  return std::countr_zero(rounded) - std::countr_zero(kMinClass);
+}
+
+void *FramePool::Allocate(size_t size) {
+  if (size > kMaxClass) return ::operator new(size);
+  const auto cls = ClassOf(size);
+  auto *pool = Local();
+  if (pool != nullptr && pool->free_[cls] != nullptr) {
+    auto *node = pool->free_[cls];
+    pool->free_[cls] = node->next;
+    --pool->count_[cls];
+    return node;
+  }
+  return ::operator new(kMinClass << cls);
+}
+
+void FramePool::Deallocate(void *frame, size_t size) noexcept {
+  if (size > kMaxClass) {
+    ::operator delete(frame, size);
+    return;
+  }
+  const auto cls = ClassOf(size);
+  auto *pool = Local();
+  if (pool == nullptr || pool->count_[cls] >= kMaxFree) {
+    ::operator delete(frame, kMinClass << cls);
+    return;
+  }
+  pool->free_[cls] = new (frame) Node{pool->free_[cls]};
+  ++pool->count_[cls];
+}
+
+size_t FramePool::Cached(size_t size) {
+  auto *pool = Local();
+  if (size > kMaxClass || pool == nullptr) return 0;
+  return pool->count_[ClassOf(size)];
+}
+
+}  // namespace socks
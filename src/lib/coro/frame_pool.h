@@ -0,0 +1,49 @@
+#ifndef QUIC_SOCKS_CORO_FRAME_POOL_H_
+#define QUIC_SOCKS_CORO_FRAME_POOL_H_
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "utility/ctor.h"
+
+namespace socks {
+
+// Free lists of coroutine frames, one per size class and thread. Frames go
+// back to the pool of the thread that frees them, which for sessions is
+// the shard that allocated them, so no list is ever shared.
+class FramePool : NonCopyable {
+ public:
+  static constexpr size_t kMinClass = 64;
+  // larger frames come from operator new directly
+  static constexpr size_t kMaxClass = 4096;
+
+  static void *Allocate(size_t size);
+  // `size` has to be the one passed to Allocate.
+  static void Deallocate(void *frame, size_t size) noexcept;
+
+  // Frames of `size` kept by the calling thread, for tests.
+  static size_t Cached(size_t size);
+
+ private:
+  static constexpr size_t kClasses = 7;
+  static constexpr size_t kMaxFree = 256;
+
+  struct Node {
+    Node *next;
+  };
+
+  FramePool();
+  ~FramePool();
+
+  // null once the pool of the calling thread is gone
+  static FramePool *Local();
+  static size_t ClassOf(size_t size);
+
+  std::array<Node *, kClasses> free_{};
+  std::array<size_t, kClasses> count_{};
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_CORO_FRAME_POOL_H_
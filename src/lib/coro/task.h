@@ -1,14 +1,165 @@
-#pragma once
+//
+// Created by suun on 2022/4/26.
+//
 
+#ifndef QUIC_SOCKS_CORO_TASK_H_
+#define QUIC_SOCKS_CORO_TASK_H_
+
+#include <cassert>
 #include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "coro/frame_pool.h"
 
 namespace socks {
 
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+// Frames of every coroutine type here come from the FramePool.
+struct PooledFrame {
+  static void *operator new(size_t size) { return FramePool::Allocate(size); }
+  static void operator delete(void *frame, size_t size) noexcept {
+    FramePool::Deallocate(frame, size);
+  }
+};
+
+class TaskPromiseBase : public PooledFrame {
+  // Hands control straight to the awaiting coroutine, so chains of tasks
+  // that complete synchronously don't grow the stack.
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> handle) noexcept {
+      return handle.promise().continuation_;
+    }
+    void await_resume() noexcept {}
+  };
+
+ public:
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() noexcept { error_ = std::current_exception(); }
+
+  void SetContinuation(std::coroutine_handle<> continuation) noexcept {
+    continuation_ = continuation;
+  }
+
+ protected:
+  void Rethrow() const {
+    if (error_) std::rethrow_exception(error_);
+  }
+
+ private:
+  std::coroutine_handle<> continuation_{std::noop_coroutine()};
+  std::exception_ptr error_;
+};
+
+template <typename T>
+class TaskPromise final : public TaskPromiseBase {
+ public:
+  Task<T> get_return_object() noexcept;
+
+  template <typename U>
+  void return_value(U &&value) {
+    value_.emplace(std::forward<U>(value));
+  }
+
+  T Result() {
+    Rethrow();
+    return std::move(*value_);
+  }
+
+ private:
+  std::optional<T> value_;
+};
+
+template <>
+class TaskPromise<void> final : public TaskPromiseBase {
+ public:
+  Task<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void Result() { Rethrow(); }
+};
+
+}  // namespace detail
+
+// A lazily started coroutine, it runs once awaited and resumes its awaiter
+// by symmetric transfer when done. Exceptions are rethrown to the awaiter.
+// Tasks don't know about executors, whatever resumes the innermost one
+// runs the whole chain, see coro/asio_task.h for running them on asio.
 template <typename T>
-class Task {
-  bool await_ready() { return false; }
-  void await_suspend(std::coroutine_handle<> handle) { handle.resume(); }
-  T await_resume() { return T{}; }
+class [[nodiscard]] Task {
+ public:
+  using promise_type = detail::TaskPromise<T>;
+  using value_type = T;
+
+  Task() = default;
+  Task(Task &&other) noexcept
+      : handle_{std::exchange(other.handle_, nullptr)} {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (handle_) handle_.destroy();
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() {
+    if (handle_) handle_.destroy();
+  }
+
+  auto operator co_await() &&noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> handle;
+
+      bool await_ready() noexcept {
+        // moved from and default constructed tasks have nothing to await
+        assert(handle);
+        return handle.done();
+      }
+      std::coroutine_handle<> await_suspend(
+          std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().SetContinuation(awaiting);
+        return handle;
+      }
+      T await_resume() { return handle.promise().Result(); }
+    };
+    return Awaiter{handle_};
+  }
+
+  [[nodiscard]] bool Valid() const { return static_cast<bool>(handle_); }
+
+ private:
+  friend class detail::TaskPromise<T>;
+
+  explicit Task(std::coroutine_handle<promise_type> handle) noexcept
+      : handle_{handle} {}
+
+  std::coroutine_handle<promise_type> handle_;
 };
 
-}  // namespace socks
\ No newline at end of file
+namespace detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept {
+  return Task<T>{std::coroutine_handle<TaskPromise>::from_promise(*this)};
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+  return Task<void>{std::coroutine_handle<TaskPromise>::from_promise(*this)};
+}
+
+}  // namespace detail
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_CORO_TASK_H_
@@ -0,0 +1,28 @@
+#include "coro/waiter_list.h"
+
+#include <algorithm>
+#include <asio.hpp>
+#include <utility>
+
+namespace socks {
+
+asio::awaitable<void> WaiterList::Wait() {
+  asio::steady_timer timer{co_await asio::this_coro::executor,
+                           asio::steady_timer::time_point::max()};
+  // the frame goes away with a stopped io_context, NotifyAll must not
+  // touch the timer then
+  struct Unregister {
+    WaiterList *list;
+    asio::steady_timer *timer;
+    ~Unregister() { std::erase(list->timers_, timer); }
+  } unregister{this, &timer};
+  timers_.push_back(&timer);
+  asio::error_code err;
+  co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, err));
+}
+
+void WaiterList::NotifyAll() {
+  for (auto *timer : std::exchange(timers_, {})) timer->cancel();
+}
+
+}  // namespace socks
@@ -0,0 +1,31 @@
+#ifndef QUIC_SOCKS_CORO_WAITER_LIST_H_
+#define QUIC_SOCKS_CORO_WAITER_LIST_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/steady_timer.hpp>
+#include <vector>
+
+#include "utility/ctor.h"
+
+namespace socks {
+
+// Coroutines parked until a condition may have changed, any number of
+// them. Each waits on a timer of its own, so waking or parking one never
+// disturbs another. Used from the thread of its executor only, waiters
+// check their condition again once woken.
+class WaiterList : NonCopyable {
+ public:
+  // Parks the calling coroutine until the next NotifyAll.
+  asio::awaitable<void> Wait();
+  // Wakes every coroutine parked by now.
+  void NotifyAll();
+
+  [[nodiscard]] size_t Size() const { return timers_.size(); }
+
+ private:
+  std::vector<asio::steady_timer *> timers_;
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_CORO_WAITER_LIST_H_
@@ -0,0 +1,112 @@
+#ifndef QUIC_SOCKS_CORO_WHEN_ALL_H_
+#define QUIC_SOCKS_CORO_WHEN_ALL_H_
+
+#include <array>
+#include <concepts>
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include "coro/task.h"
+
+namespace socks {
+
+namespace detail {
+
+// Counts down the tasks of a join, the last to finish resumes the joiner.
+struct JoinCounter {
+  size_t pending{0};
+  std::coroutine_handle<> joiner;
+
+  std::coroutine_handle<> Arrive() noexcept {
+    return --pending == 0 ? joiner : std::noop_coroutine();
+  }
+};
+
+class JoinTask {
+ public:
+  struct promise_type : PooledFrame {
+    JoinCounter *counter{nullptr};
+
+    JoinTask get_return_object() noexcept {
+      return JoinTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept {
+      struct Arrive {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<promise_type> handle) noexcept {
+          return handle.promise().counter->Arrive();
+        }
+        void await_resume() noexcept {}
+      };
+      return Arrive{};
+    }
+    void return_void() noexcept {}
+    // MakeJoin catches everything
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+  JoinTask(JoinTask &&other) noexcept
+      : handle_{std::exchange(other.handle_, nullptr)} {}
+  JoinTask(const JoinTask &) = delete;
+  ~JoinTask() {
+    if (handle_) handle_.destroy();
+  }
+
+  void Start(JoinCounter &counter) {
+    handle_.promise().counter = &counter;
+    handle_.resume();
+  }
+
+ private:
+  explicit JoinTask(std::coroutine_handle<promise_type> handle)
+      : handle_{handle} {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+inline JoinTask MakeJoin(Task<void> task, std::exception_ptr &error) {
+  try {
+    co_await std::move(task);
+  } catch (...) {
+    if (!error) error = std::current_exception();
+  }
+}
+
+template <size_t N>
+struct JoinAwaiter {
+  std::array<JoinTask, N> &joins;
+  JoinCounter counter{};
+
+  bool await_ready() noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> joiner) {
+    // one extra count keeps tasks that finish right away from resuming the
+    // joiner before all of them started
+    counter.pending = N + 1;
+    counter.joiner = joiner;
+    for (auto &join : joins) join.Start(counter);
+    return --counter.pending != 0;
+  }
+  void await_resume() noexcept {}
+};
+
+}  // namespace detail
+
+// Runs `tasks` side by side and returns once every one of them is done.
+// Nothing is cancelled when one fails, ending the others is up to the
+// caller, e.g. by closing what they wait on. The first exception is
+// rethrown at the end. All tasks have to run on one thread.
+template <std::same_as<Task<void>>... Tasks>
+Task<void> WhenAll(Tasks... tasks) {
+  std::exception_ptr error;
+  std::array<detail::JoinTask, sizeof...(Tasks)> joins{
+      detail::MakeJoin(std::move(tasks), error)...};
+  co_await detail::JoinAwaiter<sizeof...(Tasks)>{joins};
+  if (error) std::rethrow_exception(error);
+}
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_CORO_WHEN_ALL_H_
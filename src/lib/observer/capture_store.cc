@@ -0,0 +1,574 @@
+#include "observer/capture_store.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+
+#include "utility/log.h"
+
+namespace socks {
+
+#ifndef _WIN32
+
+namespace {
+
+constexpr std::array<char, 16> kFileMagic{"quic-socks-cap1"};
+constexpr uint32_t kRecordsBegin = kFileMagic.size();
+constexpr uint32_t kIndexStride = 256;
+constexpr uint64_t kNoPrev = ~uint64_t{0};
+constexpr size_t kMinSegmentSize = 1024 * 1024;
+constexpr size_t kEndpointSize = 19;
+
+struct RecordHeader {
+  int64_t time_ns;
+  uint64_t idx;
+  // location of the previous record of the same connection
+  uint64_t prev;
+  uint32_t stored;
+  uint32_t len;
+  uint8_t type;
+  uint8_t outside;
+  uint16_t reserved;
+  uint32_t padding;
+};
+static_assert(sizeof(RecordHeader) == 40);
+
+constexpr uint32_t Align8(size_t n) {
+  return static_cast<uint32_t>((n + 7) & ~size_t{7});
+}
+
+uint64_t Pack(uint64_t seq, uint32_t offset) { return seq << 32 | offset; }
+
+void EncodeEndpoint(char *out, const asio::ip::tcp::endpoint &ep) {
+  std::memset(out, 0, kEndpointSize);
+  const auto address = ep.address();
+  out[0] = address.is_v6() ? 1 : 0;
+  if (address.is_v6()) {
+    const auto bytes = address.to_v6().to_bytes();
+    std::memcpy(out + 1, bytes.data(), bytes.size());
+  } else {
+    const auto bytes = address.to_v4().to_bytes();
+    std::memcpy(out + 1, bytes.data(), bytes.size());
+  }
+  out[17] = static_cast<char>(ep.port() >> 8);
+  out[18] = static_cast<char>(ep.port() & 0xff);
+}
+
+asio::ip::tcp::endpoint DecodeEndpoint(const char *in) {
+  const auto port = static_cast<uint16_t>(
+      static_cast<uint8_t>(in[17]) << 8 | static_cast<uint8_t>(in[18]));
+  if (in[0] != 0) {
+    asio::ip::address_v6::bytes_type bytes;
+    std::memcpy(bytes.data(), in + 1, bytes.size());
+    return {asio::ip::address_v6{bytes}, port};
+  }
+  asio::ip::address_v4::bytes_type bytes;
+  std::memcpy(bytes.data(), in + 1, bytes.size());
+  return {asio::ip::address_v4{bytes}, port};
+}
+
+class PcapngWriter {
+ public:
+  explicit PcapngWriter(const std::string &path)
+      : out_{path, std::ios::binary | std::ios::trunc} {
+    // section header, byte order magic, version 1.0, unknown section length
+    Put<uint32_t>(0x0A0D0D0A);
+    Put<uint32_t>(28);
+    Put<uint32_t>(0x1A2B3C4D);
+    Put<uint16_t>(1);
+    Put<uint16_t>(0);
+    Put<uint64_t>(~uint64_t{0});
+    Put<uint32_t>(28);
+    // interface description, LINKTYPE_RAW carries bare ipv4/ipv6 packets
+    Put<uint32_t>(1);
+    Put<uint32_t>(20);
+    Put<uint16_t>(101);
+    Put<uint16_t>(0);
+    Put<uint32_t>(0);
+    Put<uint32_t>(20);
+  }
+
+  [[nodiscard]] bool Good() const { return out_.good(); }
+
+  void Write(const CaptureRecord &record) {
+    switch (record.type) {
+      case NetworkEvent::Type::kConnect:
+        flows_[record.idx] = Flow{record.src, record.dst};
+        break;
+      case NetworkEvent::Type::kForward:
+        if (!record.data.empty()) WritePacket(record);
+        break;
+      case NetworkEvent::Type::kDisconnect:
+        flows_.erase(record.idx);
+        break;
+    }
+  }
+
+ private:
+  struct Flow {
+    asio::ip::tcp::endpoint client;
+    asio::ip::tcp::endpoint remote;
+    // next sequence number from the client and from the remote side
+    uint32_t client_seq{1};
+    uint32_t remote_seq{1};
+  };
+
+  template <typename T>
+  void Put(T value) {
+    out_.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  static void PutBe16(std::vector<char> &buf, size_t at, uint16_t v) {
+    buf[at] = static_cast<char>(v >> 8);
+    buf[at + 1] = static_cast<char>(v & 0xff);
+  }
+  static void PutBe32(std::vector<char> &buf, size_t at, uint32_t v) {
+    PutBe16(buf, at, static_cast<uint16_t>(v >> 16));
+    PutBe16(buf, at + 2, static_cast<uint16_t>(v & 0xffff));
+  }
+
+  void WritePacket(const CaptureRecord &record) {
+    const auto it = flows_.find(record.idx);
+    if (it == flows_.end()) return;
+    auto &flow = it->second;
+    const auto &src = record.outside ? flow.client : flow.remote;
+    const auto &dst = record.outside ? flow.remote : flow.client;
+    auto &seq = record.outside ? flow.client_seq : flow.remote_seq;
+    const auto ack = record.outside ? flow.remote_seq : flow.client_seq;
+
+    // both ends go as ipv6 once either of them is
+    const bool v6 = src.address().is_v6() || dst.address().is_v6();
+    const size_t ip_len = v6 ? 40 : 20;
+    const size_t tcp_len = 20;
+    const auto payload = record.data.size();
+    packet_.assign(ip_len + tcp_len + payload, 0);
+    if (v6) {
+      const auto as_v6 = [](const asio::ip::address &a) {
+        return a.is_v6() ? a.to_v6()
+                         : asio::ip::make_address_v6(asio::ip::v4_mapped,
+                                                     a.to_v4());
+      };
+      packet_[0] = 0x60;
+      PutBe16(packet_, 4, static_cast<uint16_t>(tcp_len + payload));
+      packet_[6] = 6;
+      packet_[7] = 64;
+      const auto s = as_v6(src.address()).to_bytes();
+      const auto d = as_v6(dst.address()).to_bytes();
+      std::memcpy(packet_.data() + 8, s.data(), s.size());
+      std::memcpy(packet_.data() + 24, d.data(), d.size());
+    } else {
+      packet_[0] = 0x45;
+      PutBe16(packet_, 2, static_cast<uint16_t>(ip_len + tcp_len + payload));
+      PutBe16(packet_, 6, 0x4000);
+      packet_[8] = 64;
+      packet_[9] = 6;
+      const auto s = src.address().to_v4().to_bytes();
+      const auto d = dst.address().to_v4().to_bytes();
+      std::memcpy(packet_.data() + 12, s.data(), s.size());
+      std::memcpy(packet_.data() + 16, d.data(), d.size());
+      uint32_t sum{0};
+      for (size_t i = 0; i < ip_len; i += 2) {
+        sum += static_cast<uint8_t>(packet_[i]) << 8 |
+               static_cast<uint8_t>(packet_[i + 1]);
+      }
+      while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+      PutBe16(packet_, 10, static_cast<uint16_t>(~sum));
+    }
+
+    PutBe16(packet_, ip_len, src.port());
+    PutBe16(packet_, ip_len + 2, dst.port());
+    PutBe32(packet_, ip_len + 4, seq);
+    PutBe32(packet_, ip_len + 8, ack);
+    packet_[ip_len + 12] = 0x50;
+    // psh, ack
+    packet_[ip_len + 13] = 0x18;
+    PutBe16(packet_, ip_len + 14, 0xffff);
+    std::memcpy(packet_.data() + ip_len + tcp_len, record.data.data(),
+                payload);
+    seq += static_cast<uint32_t>(payload);
+
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                            record.time.time_since_epoch())
+                            .count();
+    const auto padded = Align4(packet_.size());
+    Put<uint32_t>(6);
+    Put<uint32_t>(static_cast<uint32_t>(32 + padded));
+    Put<uint32_t>(0);
+    Put<uint32_t>(static_cast<uint32_t>(static_cast<uint64_t>(micros) >> 32));
+    Put<uint32_t>(static_cast<uint32_t>(micros & 0xffffffff));
+    Put<uint32_t>(static_cast<uint32_t>(packet_.size()));
+    Put<uint32_t>(static_cast<uint32_t>(packet_.size()));
+    out_.write(packet_.data(), static_cast<std::streamsize>(packet_.size()));
+    for (auto i = packet_.size(); i < padded; ++i) out_.put(0);
+    Put<uint32_t>(static_cast<uint32_t>(32 + padded));
+  }
+
+  static size_t Align4(size_t n) { return (n + 3) & ~size_t{3}; }
+
+  std::ofstream out_;
+  std::unordered_map<size_t, Flow> flows_;
+  std::vector<char> packet_;
+};
+
+}  // namespace
+
+struct CaptureStore::Segment : NonCopyable {
+  Segment(uint64_t seq, std::string path) : seq{seq}, path{std::move(path)} {}
+  ~Segment() { Unmap(); }
+
+  // sealed segments are mapped read only while being visited
+  const char *Map() {
+    if (base != nullptr) return base;
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    auto *addr = ::mmap(nullptr, used, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+    base = static_cast<char *>(addr);
+    mapped = used;
+    return base;
+  }
+
+  void Unmap() {
+    if (base == nullptr) return;
+    ::munmap(base, mapped);
+    base = nullptr;
+    mapped = 0;
+  }
+
+  uint64_t seq;
+  std::string path;
+  char *base{nullptr};
+  size_t mapped{0};
+  uint32_t used{kRecordsBegin};
+  uint32_t records{0};
+  bool sealed{false};
+  // records of several io threads interleave, their times aren't in order
+  int64_t min_ns{std::numeric_limits<int64_t>::max()};
+  int64_t max_ns{std::numeric_limits<int64_t>::min()};
+  // of every kIndexStride-th record the latest time of the records before
+  // it, which never decreases, and its offset
+  std::vector<std::pair<int64_t, uint32_t>> index;
+};
+
+CaptureStore::CaptureStore(const CaptureConfig &config) : config_{config} {}
+
+std::unique_ptr<CaptureStore> CaptureStore::Create(
+    const CaptureConfig &config) {
+  if (config.dir.empty()) return nullptr;
+
+  std::error_code err;
+  std::filesystem::create_directories(config.dir, err);
+  for (const auto &entry :
+       std::filesystem::directory_iterator{config.dir, err}) {
+    const auto name = entry.path().filename().string();
+    if (name.starts_with("capture-") && name.ends_with(".seg")) {
+      std::filesystem::remove(entry.path(), err);
+    }
+  }
+
+  auto segment_config = config;
+  segment_config.segment_size =
+      std::clamp(config.segment_size, kMinSegmentSize,
+                 size_t{std::numeric_limits<uint32_t>::max()});
+  std::unique_ptr<CaptureStore> store{new CaptureStore{segment_config}};
+  if (!store->Roll()) return nullptr;
+  SPDLOG_INFO("[capture] store opened, dir={}, segment={}, max={}", config.dir,
+              segment_config.segment_size, config.max_bytes);
+  return store;
+}
+
+CaptureStore::~CaptureStore() {
+  for (auto &&segment : segments_) {
+    if (!segment->sealed && segment->base != nullptr) {
+      ::msync(segment->base, segment->used, MS_ASYNC);
+    }
+  }
+}
+
+void CaptureStore::OnEvents(std::span<const NetworkEvent> events) {
+  // events carry steady time, files carry wall time
+  const auto sys_now = std::chrono::system_clock::now();
+  const auto steady_now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (segments_.empty() || segments_.back()->sealed) return;
+  for (const auto &event : events) {
+    const auto time = sys_now - std::chrono::duration_cast<
+                                    std::chrono::system_clock::duration>(
+                                    steady_now - event.time);
+    Append(event, time);
+  }
+  Expire(sys_now);
+}
+
+void CaptureStore::Append(const NetworkEvent &event,
+                          std::chrono::system_clock::time_point time) {
+  size_t stored{0};
+  if (event.type == NetworkEvent::Type::kConnect) {
+    stored = kEndpointSize * 2 + event.host.size();
+  } else if (event.type == NetworkEvent::Type::kForward) {
+    stored = event.data.size();
+  }
+  const auto need = Align8(sizeof(RecordHeader) + stored);
+  if (segments_.back()->used + need > config_.segment_size && !Roll()) {
+    return;
+  }
+
+  auto &segment = *segments_.back();
+  const auto offset = segment.used;
+  const auto time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           time.time_since_epoch())
+                           .count();
+  RecordHeader header{.time_ns = time_ns,
+                      .idx = event.idx,
+                      .prev = kNoPrev,
+                      .stored = static_cast<uint32_t>(stored),
+                      .len = static_cast<uint32_t>(event.len),
+                      .type = static_cast<uint8_t>(event.type),
+                      .outside = static_cast<uint8_t>(event.outside)};
+  auto [it, inserted] = last_.try_emplace(event.idx, Location{});
+  if (!inserted) {
+    header.prev = Pack(it->second.seq, it->second.offset);
+  }
+  it->second = Location{segment.seq, offset};
+
+  auto *out = segment.base + offset;
+  std::memcpy(out, &header, sizeof(header));
+  out += sizeof(header);
+  if (event.type == NetworkEvent::Type::kConnect) {
+    EncodeEndpoint(out, event.src);
+    EncodeEndpoint(out + kEndpointSize, event.dst);
+    std::memcpy(out + kEndpointSize * 2, event.host.data(), event.host.size());
+  } else if (stored > 0) {
+    std::memcpy(out, event.data.data(), stored);
+  }
+
+  if (segment.records++ % kIndexStride == 0) {
+    segment.index.emplace_back(segment.max_ns, offset);
+  }
+  segment.min_ns = std::min(segment.min_ns, time_ns);
+  segment.max_ns = std::max(segment.max_ns, time_ns);
+  segment.used += need;
+  total_bytes_ += need;
+}
+
+bool CaptureStore::Roll() {
+  if (!segments_.empty()) {
+    auto &last = *segments_.back();
+    last.Unmap();
+    if (::truncate(last.path.c_str(), last.used) != 0) {
+      SPDLOG_WARN("[capture] truncate segment failed, path={}", last.path);
+    }
+    last.sealed = true;
+  }
+
+  const auto seq = next_seq_++;
+  auto segment = std::make_unique<Segment>(
+      seq, fmt::format("{}/capture-{:010}.seg", config_.dir, seq));
+  const int fd = ::open(segment->path.c_str(),
+                        O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    SPDLOG_ERROR("[capture] open segment failed, path={}, errno={}",
+                 segment->path, errno);
+    return false;
+  }
+  void *addr = MAP_FAILED;
+  if (::ftruncate(fd, static_cast<off_t>(config_.segment_size)) == 0) {
+    addr = ::mmap(nullptr, config_.segment_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    SPDLOG_ERROR("[capture] map segment failed, path={}, errno={}",
+                 segment->path, errno);
+    ::unlink(segment->path.c_str());
+    return false;
+  }
+
+  segment->base = static_cast<char *>(addr);
+  segment->mapped = config_.segment_size;
+  std::memcpy(segment->base, kFileMagic.data(), kFileMagic.size());
+  total_bytes_ += kRecordsBegin;
+  segments_.emplace_back(std::move(segment));
+  return true;
+}
+
+void CaptureStore::Expire(std::chrono::system_clock::time_point now) {
+  const auto deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            (now - config_.max_age).time_since_epoch())
+                            .count();
+  while (segments_.size() > 1) {
+    auto &oldest = *segments_.front();
+    if (total_bytes_ <= config_.max_bytes && oldest.max_ns >= deadline) {
+      break;
+    }
+    total_bytes_ -= oldest.used;
+    ::unlink(oldest.path.c_str());
+    std::erase_if(last_, [seq = oldest.seq](const auto &entry) {
+      return entry.second.seq == seq;
+    });
+    segments_.pop_front();
+  }
+}
+
+CaptureStore::Segment *CaptureStore::Find(uint64_t seq) {
+  if (segments_.empty() || seq < segments_.front()->seq) return nullptr;
+  const auto pos = seq - segments_.front()->seq;
+  return pos < segments_.size() ? segments_[pos].get() : nullptr;
+}
+
+namespace {
+
+CaptureRecord ToRecord(const RecordHeader &header, const char *payload) {
+  CaptureRecord record{
+      .type = static_cast<NetworkEvent::Type>(header.type),
+      .outside = header.outside != 0,
+      .idx = header.idx,
+      .time = std::chrono::system_clock::time_point{
+          std::chrono::duration_cast<std::chrono::system_clock::duration>(
+              std::chrono::nanoseconds{header.time_ns})},
+      .len = header.len};
+  if (record.type == NetworkEvent::Type::kConnect) {
+    record.src = DecodeEndpoint(payload);
+    record.dst = DecodeEndpoint(payload + kEndpointSize);
+    record.host = {payload + kEndpointSize * 2,
+                   header.stored - kEndpointSize * 2};
+  } else {
+    record.data = {payload, header.stored};
+  }
+  return record;
+}
+
+}  // namespace
+
+void CaptureStore::Visit(size_t idx, const Visitor &visitor) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  const auto it = last_.find(idx);
+  if (it == last_.end()) return;
+
+  // the chain runs backwards, collect it first
+  std::vector<std::pair<Segment *, uint32_t>> chain;
+  auto loc = Pack(it->second.seq, it->second.offset);
+  while (loc != kNoPrev) {
+    auto *segment = Find(loc >> 32);
+    if (segment == nullptr || segment->Map() == nullptr) break;
+    const auto offset = static_cast<uint32_t>(loc & 0xffffffff);
+    chain.emplace_back(segment, offset);
+    RecordHeader header{};
+    std::memcpy(&header, segment->base + offset, sizeof(header));
+    loc = header.prev;
+  }
+
+  for (auto i = chain.rbegin(); i != chain.rend(); ++i) {
+    const auto *at = i->first->base + i->second;
+    RecordHeader header{};
+    std::memcpy(&header, at, sizeof(header));
+    visitor(ToRecord(header, at + sizeof(header)));
+  }
+  for (auto &&segment : segments_) {
+    if (segment->sealed) segment->Unmap();
+  }
+}
+
+void CaptureStore::Visit(std::chrono::system_clock::time_point from,
+                         std::chrono::system_clock::time_point to,
+                         const Visitor &visitor) {
+  const auto ns = [](std::chrono::system_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               t.time_since_epoch())
+        .count();
+  };
+  const auto from_ns = ns(from);
+  const auto to_ns = ns(to);
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  for (auto &&segment : segments_) {
+    if (segment->records == 0 || segment->max_ns < from_ns ||
+        segment->min_ns >= to_ns) {
+      continue;
+    }
+    if (segment->Map() == nullptr) continue;
+
+    // skips the strides all of whose records are older than `from`
+    const auto it = std::ranges::lower_bound(
+        segment->index, from_ns, {},
+        [](const auto &entry) { return entry.first; });
+    const auto offset =
+        it == segment->index.begin() ? kRecordsBegin : std::prev(it)->second;
+    VisitSegment(*segment, offset, from_ns, to_ns, visitor);
+    if (segment->sealed) segment->Unmap();
+  }
+}
+
+void CaptureStore::VisitSegment(Segment &segment, uint32_t offset,
+                                int64_t from_ns, int64_t to_ns,
+                                const Visitor &visitor) {
+  while (offset < segment.used) {
+    const auto *at = segment.base + offset;
+    RecordHeader header{};
+    std::memcpy(&header, at, sizeof(header));
+    offset += Align8(sizeof(header) + header.stored);
+    if (header.time_ns < from_ns || header.time_ns >= to_ns) continue;
+    visitor(ToRecord(header, at + sizeof(header)));
+  }
+}
+
+bool CaptureStore::ExportPcapng(const std::string &path,
+                                std::optional<size_t> idx) {
+  PcapngWriter writer{path};
+  if (!writer.Good()) {
+    SPDLOG_ERROR("[capture] open pcapng failed, path={}", path);
+    return false;
+  }
+
+  const auto write = [&writer](const CaptureRecord &record) {
+    writer.Write(record);
+  };
+  if (idx) {
+    Visit(*idx, write);
+  } else {
+    Visit(std::chrono::system_clock::time_point::min(),
+          std::chrono::system_clock::time_point::max(), write);
+  }
+  return writer.Good();
+}
+
+#else
+
+struct CaptureStore::Segment {};
+
+CaptureStore::CaptureStore(const CaptureConfig &config) : config_{config} {}
+
+std::unique_ptr<CaptureStore> CaptureStore::Create(
+    const CaptureConfig &config) {
+  if (!config.dir.empty()) {
+    SPDLOG_WARN("[capture] not supported on this platform");
+  }
+  return nullptr;
+}
+
+CaptureStore::~CaptureStore() = default;
+void CaptureStore::OnEvents(std::span<const NetworkEvent> events) {}
+void CaptureStore::Visit(size_t idx, const Visitor &visitor) {}
+void CaptureStore::Visit(std::chrono::system_clock::time_point from,
+                         std::chrono::system_clock::time_point to,
+                         const Visitor &visitor) {}
+bool CaptureStore::ExportPcapng(const std::string &path,
+                                std::optional<size_t> idx) {
+  return false;
+}
+
+#endif
+
+}  // namespace socks
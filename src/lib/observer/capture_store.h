@@ -0,0 +1,91 @@
+#ifndef QUIC_SOCKS_OBSERVER_CAPTURE_STORE_H_
+#define QUIC_SOCKS_OBSERVER_CAPTURE_STORE_H_
+
+#include <asio/ip/tcp.hpp>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "observer/network_observer.h"
+#include "utility/ctor.h"
+
+namespace socks {
+
+struct CaptureRecord {
+  NetworkEvent::Type type;
+  bool outside;
+  size_t idx;
+  std::chrono::system_clock::time_point time;
+  // forwarded length, `data` is empty for payload relayed in the kernel
+  size_t len;
+  std::string_view data;
+  // connect only
+  asio::ip::tcp::endpoint src;
+  asio::ip::tcp::endpoint dst;
+  std::string_view host;
+};
+
+// Appends observer events to fixed size memory mapped segment files. Only
+// the segment being written stays mapped, so memory use is independent of
+// the amount captured. Records of one connection are chained backwards
+// inside the files, a sparse time index is kept per segment.
+class CaptureStore : public NetworkObserver, NonCopyable {
+ public:
+  using Visitor = std::function<void(const CaptureRecord &)>;
+
+  static std::unique_ptr<CaptureStore> Create(const CaptureConfig &config);
+  ~CaptureStore() override;
+
+  void OnEvents(std::span<const NetworkEvent> events) override;
+
+  // Visits the retained records of connection `idx` in order.
+  void Visit(size_t idx, const Visitor &visitor);
+  // Visits the retained records within [from, to) in the order they were
+  // stored, which is only roughly the order of their times.
+  void Visit(std::chrono::system_clock::time_point from,
+             std::chrono::system_clock::time_point to, const Visitor &visitor);
+
+  // Writes the retained records, or those of connection `idx`, as pcapng
+  // with synthesized ip/tcp headers.
+  bool ExportPcapng(const std::string &path,
+                    std::optional<size_t> idx = std::nullopt);
+
+ private:
+  struct Segment;
+  struct Location {
+    uint64_t seq;
+    uint32_t offset;
+  };
+
+  explicit CaptureStore(const CaptureConfig &config);
+
+  bool Roll();
+  void Append(const NetworkEvent &event,
+              std::chrono::system_clock::time_point time);
+  void Expire(std::chrono::system_clock::time_point now);
+  Segment *Find(uint64_t seq);
+  // Visits the records from `offset` on whose times are within
+  // [from_ns, to_ns).
+  void VisitSegment(Segment &segment, uint32_t offset, int64_t from_ns,
+                    int64_t to_ns, const Visitor &visitor);
+
+  const CaptureConfig config_;
+  std::mutex mutex_;
+  uint64_t next_seq_{0};
+  size_t total_bytes_{0};
+  std::deque<std::unique_ptr<Segment>> segments_;
+  // last record of every connection still retained
+  std::unordered_map<size_t, Location> last_;
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_OBSERVER_CAPTURE_STORE_H_
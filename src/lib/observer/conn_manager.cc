@@ -0,0 +1,182 @@
+#include "observer/conn_manager.h"
+
+#include <algorithm>
+#include <asio.hpp>
+#include <optional>
+#include <string_view>
+
+namespace socks {
+
+namespace {
+
+double Capacity(double rate) { return std::max(1.0, rate); }
+
+}  // namespace
+
+ConnManager::Clock::duration ConnManager::TokenBucket::Take(
+    double rate, Clock::time_point now) {
+  if (refilled == Clock::time_point{}) {
+    tokens = Capacity(rate);
+  } else {
+    const std::chrono::duration<double> elapsed = now - refilled;
+    tokens = std::min(Capacity(rate), tokens + elapsed.count() * rate);
+  }
+  refilled = now;
+  if (tokens >= 1) {
+    tokens -= 1;
+    return Clock::duration::zero();
+  }
+  return std::max<Clock::duration>(
+      std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>{(1 - tokens) / rate}),
+      Clock::duration{1});
+}
+
+bool ConnManager::TokenBucket::Full(double rate, Clock::time_point now) const {
+  const std::chrono::duration<double> elapsed = now - refilled;
+  return refilled == Clock::time_point{} ||
+         tokens + elapsed.count() * rate >= Capacity(rate);
+}
+
+size_t ConnManager::AddressHash::operator()(
+    const asio::ip::address &address) const {
+  if (address.is_v4()) return std::hash<uint32_t>{}(address.to_v4().to_uint());
+  const auto bytes = address.to_v6().to_bytes();
+  return std::hash<std::string_view>{}(
+      {reinterpret_cast<const char *>(bytes.data()), bytes.size()});
+}
+
+ConnManager::ConnManager(const AdmissionConfig &config)
+    : config_{config},
+      per_client_{config.max_per_client > 0 || config.rate_per_client > 0} {}
+
+asio::awaitable<void> ConnManager::AsyncAcquire(asio::io_context &ctx) {
+  if (config_.max_connections > 0 && Full()) {
+    asio::steady_timer timer{ctx};
+    // the frame goes away with a stopped io_context, Release must not wake
+    // it then
+    struct Unregister {
+      ConnManager *manager;
+      asio::steady_timer *timer;
+      ~Unregister() {
+        std::lock_guard<std::mutex> lock{manager->waiters_mutex_};
+        std::erase_if(manager->waiters_, [this](const Waiter &waiter) {
+          return waiter.timer == timer;
+        });
+      }
+    } unregister{this, &timer};
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock{waiters_mutex_};
+        if (!Full()) break;
+        timer.expires_at(Clock::time_point::max());
+        waiters_.push_back({&ctx, &timer});
+      }
+      asio::error_code err;
+      co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, err));
+    }
+  }
+
+  if (config_.rate > 0) {
+    std::optional<asio::steady_timer> timer;
+    while (true) {
+      Clock::duration wait;
+      {
+        std::lock_guard<std::mutex> lock{rate_mutex_};
+        wait = rate_.Take(config_.rate, Clock::now());
+      }
+      if (wait == Clock::duration::zero()) break;
+      if (!timer) timer.emplace(ctx);
+      timer->expires_after(wait);
+      co_await timer->async_wait(asio::use_awaitable);
+    }
+  }
+}
+
+bool ConnManager::TryAcquire() {
+  if (config_.max_connections > 0 && Full()) return false;
+  if (config_.rate > 0) {
+    std::lock_guard<std::mutex> lock{rate_mutex_};
+    return rate_.Take(config_.rate, Clock::now()) == Clock::duration::zero();
+  }
+  return true;
+}
+
+std::pair<ConnManager::Verdict, ConnManager::Ticket> ConnManager::Admit(
+    const asio::ip::address &client) {
+  if (per_client_) {
+    const auto verdict = AdmitClient(client);
+    if (verdict != Verdict::kAdmitted) return {verdict, Ticket{}};
+  }
+  const auto open = open_.fetch_add(1, std::memory_order_relaxed);
+  if (config_.max_connections > 0 && open >= config_.max_connections) {
+    // back to where it was, still full, nobody to wake
+    open_.fetch_sub(1, std::memory_order_relaxed);
+    if (per_client_) {
+      auto &stripe = StripeOf(client);
+      std::lock_guard<std::mutex> lock{stripe.mutex};
+      --stripe.clients[client].open;
+    }
+    return {Verdict::kFull, Ticket{}};
+  }
+  return {Verdict::kAdmitted, Ticket{this, client}};
+}
+
+ConnManager::Stripe &ConnManager::StripeOf(const asio::ip::address &client) {
+  // std::hash of an ipv4 address is its value, the low bits spread well
+  // enough across stripes
+  return stripes_[AddressHash{}(client) % kStripes];
+}
+
+ConnManager::Verdict ConnManager::AdmitClient(const asio::ip::address &client) {
+  auto &stripe = StripeOf(client);
+  const auto now = Clock::now();
+  std::lock_guard<std::mutex> lock{stripe.mutex};
+  if (++stripe.admits % kSweepInterval == 0) Sweep(stripe, now);
+
+  auto &state = stripe.clients[client];
+  if (config_.max_per_client > 0 && state.open >= config_.max_per_client) {
+    return Verdict::kClientFull;
+  }
+  if (config_.rate_per_client > 0 &&
+      state.bucket.Take(config_.rate_per_client, now) !=
+          Clock::duration::zero()) {
+    return Verdict::kClientRate;
+  }
+  ++state.open;
+  return Verdict::kAdmitted;
+}
+
+void ConnManager::Release(const asio::ip::address &client) {
+  open_.fetch_sub(1, std::memory_order_relaxed);
+  if (per_client_) {
+    auto &stripe = StripeOf(client);
+    std::lock_guard<std::mutex> lock{stripe.mutex};
+    const auto it = stripe.clients.find(client);
+    // a client that comes back has to find its bucket as it left it, the
+    // sweep drops it once it refilled
+    if (it != stripe.clients.end() && --it->second.open == 0 &&
+        config_.rate_per_client == 0) {
+      stripe.clients.erase(it);
+    }
+  }
+  if (config_.max_connections > 0) {
+    std::lock_guard<std::mutex> lock{waiters_mutex_};
+    if (waiters_.empty() || Full()) return;
+    for (const auto &waiter : waiters_) {
+      asio::post(*waiter.ctx, [timer = waiter.timer] { timer->cancel(); });
+    }
+    waiters_.clear();
+  }
+}
+
+void ConnManager::Sweep(Stripe &stripe, Clock::time_point now) const {
+  std::erase_if(stripe.clients, [this, now](const auto &entry) {
+    const auto &state = entry.second;
+    return state.open == 0 &&
+           (config_.rate_per_client == 0 ||
+            state.bucket.Full(config_.rate_per_client, now));
+  });
+}
+
+}  // namespace socks
@@ -1,10 +1,158 @@
-#pragma once
+//
+// Created by suun on 2022/4/30.
+//
+
+#ifndef QUIC_SOCKS_OBSERVER_CONN_MANAGER_H_
+#define QUIC_SOCKS_OBSERVER_CONN_MANAGER_H_
+
+#include <array>
+#include <asio/awaitable.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/address.hpp>
+#include <asio/steady_timer.hpp>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utility/ctor.h"
 
 namespace socks {
 
-class ConnManager {
-public:
-  
+struct AdmissionConfig {
+  // open client connections in total and per client address, 0 is
+  // unlimited
+  size_t max_connections{0};
+  size_t max_per_client{0};
+  // new client connections per second in total and per client address,
+  // bursts of up to a second's worth pass, 0 is unlimited
+  double rate{0};
+  double rate_per_client{0};
 };
 
-}  // namespace socks
\ No newline at end of file
+// Admission control of client connections, shared by all io threads.
+//
+// The global limits hold accepting back: while the proxy is full or ahead
+// of its rate, acceptors wait in AsyncAcquire and new connections queue in
+// the listen backlog, so admitted clients keep their latency. The limits per
+// client address are enforced after accept, by Admit. A rejected connection
+// is answered cheaply and closed before a session or a buffer exists for
+// it.
+class ConnManager : NonCopyable {
+  using Clock = std::chrono::steady_clock;
+
+ public:
+  enum class Verdict : uint8_t { kAdmitted, kFull, kClientFull, kClientRate };
+
+  // The slot of an admitted connection, returned when destroyed. Tickets
+  // may be destroyed on any thread.
+  class Ticket {
+   public:
+    Ticket() = default;
+    Ticket(Ticket &&other) noexcept
+        : manager_{std::exchange(other.manager_, nullptr)},
+          client_{other.client_} {}
+    Ticket &operator=(Ticket &&other) noexcept {
+      if (this != &other) {
+        Release();
+        manager_ = std::exchange(other.manager_, nullptr);
+        client_ = other.client_;
+      }
+      return *this;
+    }
+    ~Ticket() { Release(); }
+
+    explicit operator bool() const { return manager_ != nullptr; }
+
+   private:
+    friend class ConnManager;
+    Ticket(ConnManager *manager, const asio::ip::address &client)
+        : manager_{manager}, client_{client} {}
+    void Release() {
+      if (manager_ != nullptr) {
+        std::exchange(manager_, nullptr)->Release(client_);
+      }
+    }
+
+    ConnManager *manager_{nullptr};
+    asio::ip::address client_;
+  };
+
+  explicit ConnManager(const AdmissionConfig &config);
+
+  // Returns once there's room for another connection, pausing the acceptor
+  // on `ctx` meanwhile. Acceptors of several threads may overshoot by a
+  // connection each, Admit turns those away.
+  asio::awaitable<void> AsyncAcquire(asio::io_context &ctx);
+  // Whether there's room right away, as AsyncAcquire would find it without
+  // pausing. Takes the token of the rate limit when there is.
+  bool TryAcquire();
+  // Takes a slot for a connection from `client`, the ticket is empty unless
+  // the verdict is kAdmitted.
+  std::pair<Verdict, Ticket> Admit(const asio::ip::address &client);
+
+  [[nodiscard]] size_t Size() const {
+    return open_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr size_t kStripes = 64;
+  // clients of a stripe are swept for stale entries every so many admits
+  static constexpr size_t kSweepInterval = 1024;
+
+  // Refills by `rate` per second up to a second's worth, at least one.
+  struct TokenBucket {
+    double tokens{0};
+    Clock::time_point refilled{};
+
+    // Returns how long until a token is available, zero if one was taken.
+    Clock::duration Take(double rate, Clock::time_point now);
+    [[nodiscard]] bool Full(double rate, Clock::time_point now) const;
+  };
+
+  struct Client {
+    size_t open{0};
+    TokenBucket bucket;
+  };
+
+  struct AddressHash {
+    size_t operator()(const asio::ip::address &address) const;
+  };
+
+  // The clients whose addresses hash to it, each behind its own lock.
+  struct alignas(64) Stripe {
+    std::mutex mutex;
+    std::unordered_map<asio::ip::address, Client, AddressHash> clients;
+    size_t admits{0};
+  };
+
+  // An acceptor paused until a connection is closed.
+  struct Waiter {
+    asio::io_context *ctx;
+    asio::steady_timer *timer;
+  };
+
+  [[nodiscard]] bool Full() const {
+    return config_.max_connections > 0 &&
+           open_.load(std::memory_order_relaxed) >= config_.max_connections;
+  }
+  Stripe &StripeOf(const asio::ip::address &client);
+  Verdict AdmitClient(const asio::ip::address &client);
+  void Release(const asio::ip::address &client);
+  void Sweep(Stripe &stripe, Clock::time_point now) const;
+
+  const AdmissionConfig config_;
+  const bool per_client_;
+  std::atomic_size_t open_{0};
+  std::mutex rate_mutex_;
+  TokenBucket rate_;
+  std::mutex waiters_mutex_;
+  std::vector<Waiter> waiters_;
+  std::array<Stripe, kStripes> stripes_;
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_OBSERVER_CONN_MANAGER_H_
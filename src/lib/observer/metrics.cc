@@ -0,0 +1,198 @@
+#include "observer/metrics.h"
+
+#include <fmt/format.h>
+
+#include <asio.hpp>
+#include <cmath>
+
+#include "utility/log.h"
+
+namespace socks {
+
+namespace {
+
+constexpr std::array<std::string_view, kStages> kStageNames{
+    "head", "resolve", "connect", "first_byte"};
+constexpr std::array<std::string_view, kCacheVerdicts> kCacheVerdictNames{
+    "hit", "revalidate", "miss", "pass"};
+// in us, a bucket counts toward the first bound that covers all of it
+constexpr std::array<uint64_t, 17> kBounds{
+    100,     250,     500,     1000,    2500,     5000,
+    10000,   25000,   50000,   100000,  250000,   500000,
+    1000000, 2500000, 5000000, 10000000, 30000000};
+constexpr size_t kMaxRequest = 8192;
+
+void AppendCounter(std::string &out, std::string_view name,
+                   std::string_view help, std::string_view type,
+                   uint64_t value) {
+  fmt::format_to(std::back_inserter(out), "# HELP {0} {1}\n# TYPE {0} {2}\n",
+                 name, help, type);
+  fmt::format_to(std::back_inserter(out), "{} {}\n", name, value);
+}
+
+}  // namespace
+
+uint64_t HistogramSnapshot::Quantile(double q) const {
+  if (count == 0) return 0;
+  const auto rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(count))));
+  uint64_t seen{0};
+  for (size_t i = 0; i < counts.size(); ++i) {
+    seen += counts[i];
+    if (seen >= rank) return HistogramBuckets::Lower(i + 1) - 1;
+  }
+  return HistogramBuckets::kMaxValue;
+}
+
+void Histogram::AddTo(HistogramSnapshot &snapshot) const {
+  // the count is summed up here instead of kept, so that it always agrees
+  // with the buckets
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    const auto n = counts_[i].load(std::memory_order_relaxed);
+    snapshot.counts[i] += n;
+    snapshot.count += n;
+  }
+  snapshot.sum += sum_.load(std::memory_order_relaxed);
+}
+
+void MetricsSnapshot::Add(const ThreadMetrics &metrics) {
+  opened += metrics.opened.Load();
+  closed += metrics.closed.Load();
+  rejected += metrics.rejected.Load();
+  outbound_bytes += metrics.outbound_bytes.Load();
+  inbound_bytes += metrics.inbound_bytes.Load();
+  for (size_t i = 0; i < kCacheVerdicts; ++i) {
+    cache_lookups[i] += metrics.cache_lookups[i].Load();
+  }
+  for (size_t i = 0; i < kStages; ++i) metrics.stages[i].AddTo(stages[i]);
+}
+
+std::string MetricsSnapshot::Render() const {
+  std::string out;
+  AppendCounter(out, "quic_socks_sessions_opened_total",
+                "Client connections accepted.", "counter", opened);
+  // threads are read one after the other, a session may show up as closed
+  // but not yet opened
+  AppendCounter(out, "quic_socks_sessions_active",
+                "Client connections open.", "gauge",
+                opened > closed ? opened - closed : 0);
+  AppendCounter(out, "quic_socks_sessions_rejected_total",
+                "Client connections turned away by admission control.",
+                "counter", rejected);
+
+  out += "# HELP quic_socks_relayed_bytes_total Payload relayed.\n"
+         "# TYPE quic_socks_relayed_bytes_total counter\n";
+  fmt::format_to(std::back_inserter(out),
+                 "quic_socks_relayed_bytes_total{{direction=\"outbound\"}} "
+                 "{}\nquic_socks_relayed_bytes_total{{direction=\"inbound\"}} "
+                 "{}\n",
+                 outbound_bytes, inbound_bytes);
+
+  out += "# HELP quic_socks_cache_lookups_total Http cache lookups by "
+         "outcome.\n"
+         "# TYPE quic_socks_cache_lookups_total counter\n";
+  for (size_t i = 0; i < kCacheVerdicts; ++i) {
+    fmt::format_to(std::back_inserter(out),
+                   "quic_socks_cache_lookups_total{{result=\"{}\"}} {}\n",
+                   kCacheVerdictNames[i], cache_lookups[i]);
+  }
+
+  out += "# HELP quic_socks_stage_seconds Connection setup by stage.\n"
+         "# TYPE quic_socks_stage_seconds histogram\n";
+  for (size_t i = 0; i < kStages; ++i) {
+    const auto &histogram = stages[i];
+    const auto stage = kStageNames[i];
+    size_t bucket{0};
+    uint64_t cumulative{0};
+    for (const auto bound : kBounds) {
+      while (bucket < HistogramBuckets::kSize &&
+             HistogramBuckets::Lower(bucket + 1) <= bound + 1) {
+        cumulative += histogram.counts[bucket++];
+      }
+      fmt::format_to(std::back_inserter(out),
+                     "quic_socks_stage_seconds_bucket{{stage=\"{}\",le=\"{}\"}}"
+                     " {}\n",
+                     stage, static_cast<double>(bound) / 1e6, cumulative);
+    }
+    fmt::format_to(
+        std::back_inserter(out),
+        "quic_socks_stage_seconds_bucket{{stage=\"{0}\",le=\"+Inf\"}} {1}\n"
+        "quic_socks_stage_seconds_sum{{stage=\"{0}\"}} {2}\n"
+        "quic_socks_stage_seconds_count{{stage=\"{0}\"}} {1}\n",
+        stage, histogram.count, static_cast<double>(histogram.sum) / 1e6);
+  }
+  return out;
+}
+
+MetricsServer::MetricsServer(uint16_t port,
+                             std::function<MetricsSnapshot()> collect)
+    : collect_{std::move(collect)}, acceptor_{ctx_} {
+  const asio::ip::tcp::endpoint endpoint{asio::ip::tcp::v4(), port};
+  acceptor_.open(endpoint.protocol());
+  acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#if defined(__linux__) && defined(SO_REUSEPORT)
+  // an instance taking over by upgrade serves the port while the one it
+  // replaces drains
+  using ReusePort =
+      asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+  acceptor_.set_option(ReusePort(true));
+#endif
+  acceptor_.bind(endpoint);
+  acceptor_.listen();
+}
+
+MetricsServer::~MetricsServer() {
+  ctx_.stop();
+  if (thread_.joinable()) thread_.join();
+}
+
+void MetricsServer::Start() {
+  co_spawn(
+      ctx_, [this] { return Accept(); }, asio::detached);
+  thread_ = std::jthread{[this] { ctx_.run(); }};
+  SPDLOG_INFO("[metrics] serving, port={}", Port());
+}
+
+asio::awaitable<void> MetricsServer::Accept() {
+  while (true) {
+    try {
+      auto socket = co_await acceptor_.async_accept(asio::use_awaitable);
+      co_spawn(ctx_, Serve(std::move(socket)), asio::detached);
+    } catch (const asio::system_error &e) {
+      SPDLOG_ERROR("[metrics] accept exception, e={}", e.what());
+      break;
+    }
+  }
+}
+
+// Answers a single request per connection, the head is all that's read.
+asio::awaitable<void> MetricsServer::Serve(asio::ip::tcp::socket socket) {
+  try {
+    std::string request;
+    co_await asio::async_read_until(
+        socket, asio::dynamic_buffer(request, kMaxRequest), "\r\n\r\n",
+        asio::use_awaitable);
+    std::string response;
+    if (request.starts_with("GET /metrics ") ||
+        request.starts_with("GET /metrics?")) {
+      const auto body = collect_().Render();
+      response = fmt::format(
+          "HTTP/1.1 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n"
+          "Content-Length: {}\r\nConnection: close\r\n\r\n{}",
+          body.size(), body);
+    } else {
+      response =
+          "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+          "Connection: close\r\n\r\n";
+    }
+    co_await asio::async_write(socket, asio::buffer(response),
+                               asio::use_awaitable);
+  } catch (const asio::system_error &e) {
+    SPDLOG_DEBUG("[metrics] scrape failed, e={}", e.what());
+  }
+  asio::error_code err;
+  socket.shutdown(asio::socket_base::shutdown_both, err);
+}
+
+}  // namespace socks
@@ -0,0 +1,196 @@
+#ifndef QUIC_SOCKS_OBSERVER_METRICS_H_
+#define QUIC_SOCKS_OBSERVER_METRICS_H_
+
+#include <algorithm>
+#include <array>
+#include <asio/awaitable.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "utility/ctor.h"
+
+namespace socks {
+
+// A counter with a single writer. Adding is a plain load and store, no
+// locked instruction, while readers on other threads still see a value
+// that was current at some point.
+class Counter {
+ public:
+  void Add(uint64_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+  [[nodiscard]] uint64_t Load() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic_uint64_t value_{0};
+};
+
+// Log linear buckets as in HdrHistogram: values below 8 have a bucket of
+// their own, every power of two above is split into 8 buckets. A recorded
+// value is thus off by less than 12.5%, up to about 19 hours in us.
+struct HistogramBuckets {
+  static constexpr size_t kSubBits = 3;
+  static constexpr uint64_t kSub = uint64_t{1} << kSubBits;
+  static constexpr uint64_t kMaxValue = (uint64_t{1} << 36) - 1;
+  static constexpr size_t kSize = (36 - kSubBits + 1) * kSub;
+
+  static constexpr size_t Index(uint64_t value) {
+    value = std::min(value, kMaxValue);
+    if (value < kSub) return value;
+    const auto shift = std::bit_width(value) - 1 - kSubBits;
+    return (shift + 1) * kSub + (value >> shift) - kSub;
+  }
+  // smallest value of bucket `idx`
+  static constexpr uint64_t Lower(size_t idx) {
+    if (idx < kSub) return idx;
+    const auto shift = idx / kSub - 1;
+    return (kSub + idx % kSub) << shift;
+  }
+};
+
+struct HistogramSnapshot {
+  std::array<uint64_t, HistogramBuckets::kSize> counts{};
+  uint64_t count{0};
+  uint64_t sum{0};
+
+  // Upper bound of the bucket holding quantile `q` of the values, 0 while
+  // empty.
+  [[nodiscard]] uint64_t Quantile(double q) const;
+};
+
+// Written by a single thread like Counter, merged into a snapshot on read.
+class Histogram : NonCopyable {
+ public:
+  void Record(uint64_t value) {
+    Bump(counts_[HistogramBuckets::Index(value)], 1);
+    Bump(sum_, value);
+  }
+  void AddTo(HistogramSnapshot &snapshot) const;
+
+ private:
+  static void Bump(std::atomic_uint64_t &value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+
+  std::array<std::atomic_uint64_t, HistogramBuckets::kSize> counts_{};
+  std::atomic_uint64_t sum_{0};
+};
+
+// Stages of setting up a connection, each timed from the end of the one
+// before. kFirstByte is how long the origin takes to answer the first
+// bytes sent to it.
+enum class Stage : uint8_t { kHead, kResolve, kConnect, kFirstByte };
+inline constexpr size_t kStages = 4;
+// Outcomes of http cache lookups, in the order of HttpCache::Verdict: hit,
+// revalidate, miss and pass.
+inline constexpr size_t kCacheVerdicts = 4;
+
+// The metrics of one io thread, only that thread writes them. Keeping them
+// apart spares the hot path any shared cache line, readers merge the
+// threads into a MetricsSnapshot.
+struct alignas(64) ThreadMetrics : NonCopyable {
+  using Clock = std::chrono::steady_clock;
+
+  Counter opened;
+  Counter closed;
+  // turned away by admission control, written by the thread that accepted
+  // them, which is this one unless shard 0 accepts for all
+  Counter rejected;
+  // relayed payload, from clients and from origins
+  Counter outbound_bytes;
+  Counter inbound_bytes;
+  std::array<Counter, kCacheVerdicts> cache_lookups;
+  // in us
+  std::array<Histogram, kStages> stages;
+
+  void Forwarded(bool outside, size_t len) {
+    (outside ? outbound_bytes : inbound_bytes).Add(len);
+  }
+  void Record(Stage stage, Clock::duration elapsed) {
+    stages[static_cast<size_t>(stage)].Record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+            .count()));
+  }
+  // Records the time since `since` and moves it to now.
+  void Lap(Stage stage, Clock::time_point &since) {
+    const auto now = Clock::now();
+    Record(stage, now - since);
+    since = now;
+  }
+};
+
+// Times Stage::kFirstByte of a session, from the first bytes it sends to an
+// origin to the first ones it receives.
+class FirstByteTimer {
+ public:
+  void Sent() {
+    if (!sent_) sent_ = ThreadMetrics::Clock::now();
+  }
+  void Received(ThreadMetrics &metrics) {
+    if (!sent_ || done_) return;
+    done_ = true;
+    metrics.Record(Stage::kFirstByte, ThreadMetrics::Clock::now() - *sent_);
+  }
+
+ private:
+  std::optional<ThreadMetrics::Clock::time_point> sent_;
+  bool done_{false};
+};
+
+struct MetricsSnapshot {
+  uint64_t opened{0};
+  uint64_t closed{0};
+  uint64_t rejected{0};
+  uint64_t outbound_bytes{0};
+  uint64_t inbound_bytes{0};
+  std::array<uint64_t, kCacheVerdicts> cache_lookups{};
+  std::array<HistogramSnapshot, kStages> stages{};
+
+  void Add(const ThreadMetrics &metrics);
+  // In the Prometheus text exposition format.
+  [[nodiscard]] std::string Render() const;
+};
+
+struct MetricsConfig {
+  // serves GET /metrics on this port, 0 disables it
+  uint16_t port{0};
+};
+
+// A minimal http endpoint for Prometheus to scrape, on a thread of its own
+// so that a scrape never stalls an io thread. `collect` runs on that thread.
+class MetricsServer : NonCopyable {
+ public:
+  // A `port` of 0 binds any free one.
+  MetricsServer(uint16_t port, std::function<MetricsSnapshot()> collect);
+  ~MetricsServer();
+
+  void Start();
+  [[nodiscard]] uint16_t Port() const {
+    return acceptor_.local_endpoint().port();
+  }
+
+ private:
+  asio::awaitable<void> Accept();
+  asio::awaitable<void> Serve(asio::ip::tcp::socket socket);
+
+  std::function<MetricsSnapshot()> collect_;
+  asio::io_context ctx_;
+  asio::ip::tcp::acceptor acceptor_;
+  std::jthread thread_;
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_OBSERVER_METRICS_H_
@@ -2,63 +2,274 @@
 
 #include <fmt/ostream.h>
 
+#include <algorithm>
+#include <cstring>
+
+#include "observer/capture_store.h"
 #include "utility/log.h"
 
 namespace socks {
 
-NetworkRelay::NetworkRelay() : pool_{1} {}
+namespace {
+
+constexpr size_t kBatchSize = 256;
+constexpr auto kDropReportInterval = std::chrono::seconds{1};
+
+std::atomic_uint64_t relay_ids{0};
 
-NetworkRelay::~NetworkRelay() {}
+}  // namespace
 
-void NetworkRelay::Start() {}
+void NetworkObserver::OnEvents(std::span<const NetworkEvent> events) {
+  for (const auto &event : events) {
+    switch (event.type) {
+      case NetworkEvent::Type::kConnect:
+        Connect(event.idx, event.src, event.dst, event.host);
+        break;
+      case NetworkEvent::Type::kForward:
+        if (event.data.empty()) {
+          ForwardBytes(event.idx, event.outside, event.len);
+        } else {
+          Forward(event.idx, event.outside, event.data.View());
+        }
+        break;
+      case NetworkEvent::Type::kDisconnect:
+        Disconnect(event.idx);
+        break;
+    }
+  }
+}
+
+NetworkRelay::NetworkRelay(const RelayConfig &config)
+    : config_{config},
+      id_{++relay_ids},
+      capture_{CaptureStore::Create(config.capture)} {}
+
+NetworkRelay::~NetworkRelay() = default;
+
+void NetworkRelay::Start() {
+  refreshed_ = std::chrono::steady_clock::now();
+  thread_ = std::jthread{[this](std::stop_token stop) { Run(stop); }};
+}
 
 void NetworkRelay::Connect(size_t idx, asio::ip::tcp::endpoint src,
-                           asio::ip::tcp::endpoint dst, std::string host) {
-  asio::post(pool_, [this, idx, src, dst, host = std::move(host)]() mutable {
-    AsyncConnect(idx, src, dst, std::move(host));
-  });
+                           asio::ip::tcp::endpoint dst, std::string_view host) {
+  NetworkEvent event{.type = NetworkEvent::Type::kConnect,
+                     .idx = idx,
+                     .time = std::chrono::steady_clock::now(),
+                     .src = src,
+                     .dst = dst,
+                     .host = std::string{host}};
+  Publish(event);
 }
 
-void NetworkRelay::Forward(size_t idx, bool outside, std::string s) {
-  asio::post(pool_, [this, idx, outside, s = std::move(s)]() mutable {
-    AsyncForward(idx, outside, std::move(s));
-  });
+void NetworkRelay::Forward(size_t idx, bool outside, std::string_view s) {
+  while (!s.empty()) {
+    auto buf = BufferSlice::Acquire();
+    const auto len = std::min(s.size(), buf.size());
+    std::memcpy(buf.data(), s.data(), len);
+    Forward(idx, outside, buf.Slice(0, len));
+    s.remove_prefix(len);
+  }
+}
+
+void NetworkRelay::Forward(size_t idx, bool outside, BufferSlice data) {
+  NetworkEvent event{.type = NetworkEvent::Type::kForward,
+                     .outside = outside,
+                     .idx = idx,
+                     .time = std::chrono::steady_clock::now(),
+                     .len = data.size(),
+                     .data = std::move(data)};
+  Publish(event);
+}
+
+void NetworkRelay::ForwardBytes(size_t idx, bool outside, size_t len) {
+  NetworkEvent event{.type = NetworkEvent::Type::kForward,
+                     .outside = outside,
+                     .idx = idx,
+                     .time = std::chrono::steady_clock::now(),
+                     .len = len};
+  Publish(event);
 }
 
 void NetworkRelay::Disconnect(size_t idx) {
-  asio::post(pool_, [this, idx] { AsyncDisconnect(idx); });
+  NetworkEvent event{.type = NetworkEvent::Type::kDisconnect,
+                     .idx = idx,
+                     .time = std::chrono::steady_clock::now()};
+  Publish(event);
 }
 
-void socks::NetworkRelay::AsyncConnect(size_t idx, asio::ip::tcp::endpoint src,
-                                       asio::ip::tcp::endpoint dst,
-                                       std::string host) {
-  SPDLOG_INFO("[net] remote connected, src={}, dst={}, host={}, idx={}", src,
-              dst, host, idx);
-  conns_.insert({idx, ConnModel{src, dst, host}});
-  for (const auto &observer : observers_) {
-    observer->Connect(idx, src, dst, host);
+NetworkRelay::Queue &NetworkRelay::LocalQueue() {
+  // a thread mostly publishes to a single relay, the map is only consulted
+  // when it switches between relays
+  thread_local uint64_t cached_id{0};
+  thread_local Queue *cached{nullptr};
+  if (cached_id == id_) {
+    return *cached;
+  }
+
+  std::lock_guard<std::mutex> lock{queues_mutex_};
+  auto &queue = queues_[std::this_thread::get_id()];
+  if (!queue) {
+    queue = std::make_unique<Queue>(config_.queue_size);
+    queue_count_.store(queues_.size(), std::memory_order_release);
+  }
+  cached_id = id_;
+  cached = queue.get();
+  return *cached;
+}
+
+void NetworkRelay::Publish(NetworkEvent &event) {
+  auto &queue = LocalQueue();
+  if (!queue.TryPush(event)) {
+    if (config_.overflow == OverflowPolicy::kDrop) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    do {
+      std::this_thread::yield();
+    } while (!queue.TryPush(event));
+  }
+  Wake();
+}
+
+void NetworkRelay::Wake() {
+  // orders the push before reading idle_, pairs with the fence in Idle:
+  // either the relay thread sees the event or this sees it idle
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!idle_.load(std::memory_order_relaxed)) return;
+  // the relay thread is either before its check or waiting once this locks
+  { std::lock_guard<std::mutex> lock{idle_mutex_}; }
+  idle_cv_.notify_one();
+}
+
+void NetworkRelay::Idle(const std::vector<Queue *> &queues,
+                        std::stop_token stop,
+                        std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock{idle_mutex_};
+  idle_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const auto pending = [](const Queue *queue) { return !queue->Empty(); };
+  idle_cv_.wait_until(lock, stop, deadline, [&] {
+    return queues.size() != queue_count_.load(std::memory_order_acquire) ||
+           std::ranges::any_of(queues, pending);
+  });
+  idle_.store(false, std::memory_order_relaxed);
+}
+
+void NetworkRelay::Run(std::stop_token stop) {
+  std::vector<NetworkEvent> batch;
+  batch.reserve(kBatchSize);
+  std::vector<Queue *> queues;
+  auto last_report = std::chrono::steady_clock::now();
+  while (true) {
+    if (queues.size() != queue_count_.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock{queues_mutex_};
+      queues.clear();
+      for (const auto &[_, queue] : queues_) {
+        queues.emplace_back(queue.get());
+      }
+    }
+
+    // one batch per queue and round, a busy thread can't starve the others
+    size_t drained{0};
+    for (auto *queue : queues) {
+      drained += queue->PopBatch(batch, kBatchSize);
+      if (!batch.empty()) {
+        Dispatch(batch);
+        batch.clear();
+      }
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now - last_report >= kDropReportInterval) {
+      last_report = now;
+      if (const auto dropped = dropped_.exchange(0); dropped > 0) {
+        SPDLOG_WARN("[net] relay queue full, dropped={}", dropped);
+      }
+    }
+    if (now - refreshed_ >= config_.refresh) Refresh(now);
+    if (drained == 0) {
+      if (stop.stop_requested()) break;
+      Idle(queues, stop, refreshed_ + config_.refresh);
+    }
   }
 }
 
-void socks::NetworkRelay::AsyncForward(size_t idx, bool outside,
-                                       std::string s) {
-  SPDLOG_DEBUG("[net] forward packet, outside={}, size={}, idx={}", outside,
-               s.size(), idx);
-  packets_.emplace_back(idx, outside, s);
+void NetworkRelay::Dispatch(std::span<NetworkEvent> events) {
+  for (const auto &event : events) {
+    switch (event.type) {
+      case NetworkEvent::Type::kConnect: {
+        SPDLOG_INFO("[net] remote connected, src={}, dst={}, host={}, idx={}",
+                    event.src, event.dst, event.host, event.idx);
+        // a keep-alive client may move on to another origin, its totals
+        // carry on
+        auto &conn = conns_[event.idx];
+        conn.summary.idx = event.idx;
+        conn.summary.src = event.src;
+        conn.summary.dst = event.dst;
+        conn.summary.host = event.host;
+        conn.dirty = true;
+        break;
+      }
+      case NetworkEvent::Type::kForward: {
+        // requests over pooled origin connections come without a connect
+        auto &conn = conns_[event.idx];
+        conn.summary.idx = event.idx;
+        (event.outside ? conn.summary.outbound_bytes
+                       : conn.summary.inbound_bytes) += event.len;
+        conn.dirty = true;
+        break;
+      }
+      case NetworkEvent::Type::kDisconnect:
+        SPDLOG_INFO("[net] remote disconnected, idx={}", event.idx);
+        if (auto it = conns_.find(event.idx); it != conns_.end()) {
+          it->second.summary.online = false;
+          it->second.offline_since = event.time;
+          it->second.dirty = true;
+        }
+        break;
+    }
+  }
+
+  if (capture_) capture_->OnEvents(events);
   for (const auto &observer : observers_) {
-    observer->Forward(idx, outside, s);
+    observer->OnEvents(events);
   }
 }
 
-void socks::NetworkRelay::AsyncDisconnect(size_t idx) {
-  SPDLOG_INFO("[net] remote disconnected, idx={}", idx);
-  auto it = conns_.find(idx);
-  if (it == conns_.end()) {
-    return;
+void NetworkRelay::Refresh(std::chrono::steady_clock::time_point now) {
+  const auto elapsed = std::chrono::duration<double>(now - refreshed_).count();
+  refreshed_ = now;
+  const auto rate = [elapsed](uint64_t bytes) {
+    return static_cast<uint64_t>(static_cast<double>(bytes) / elapsed);
+  };
+
+  ConnDelta delta;
+  for (auto it = conns_.begin(); it != conns_.end();) {
+    auto &conn = it->second;
+    auto &summary = conn.summary;
+    if (!summary.online && now - conn.offline_since >= config_.linger) {
+      delta.removed.emplace_back(it->first);
+      it = conns_.erase(it);
+      continue;
+    }
+    // a connection that went quiet is listed once more with its rates at 0
+    if (conn.dirty || summary.outbound_rate > 0 || summary.inbound_rate > 0) {
+      summary.outbound_rate =
+          rate(summary.outbound_bytes - conn.outbound_refreshed);
+      summary.inbound_rate =
+          rate(summary.inbound_bytes - conn.inbound_refreshed);
+      conn.outbound_refreshed = summary.outbound_bytes;
+      conn.inbound_refreshed = summary.inbound_bytes;
+      conn.dirty = false;
+      delta.updated.emplace_back(summary);
+    }
+    ++it;
   }
-  it->second.online = false;
+
+  if (delta.updated.empty() && delta.removed.empty()) return;
   for (const auto &observer : observers_) {
-    observer->Disconnect(idx);
+    observer->OnRefresh(delta);
   }
 }
 
@@ -1,68 +1,178 @@
 #pragma once
 
 #include <asio/ip/tcp.hpp>
-#include <asio/thread_pool.hpp>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "utility/buffer.h"
+#include "utility/spsc_ring.h"
+
 namespace socks {
 
+struct NetworkEvent {
+  enum class Type : uint8_t { kConnect, kForward, kDisconnect };
+
+  Type type{Type::kForward};
+  bool outside{false};
+  size_t idx{0};
+  std::chrono::steady_clock::time_point time;
+  // forwarded length, `data` stays empty for payload relayed in the kernel
+  size_t len{0};
+  BufferSlice data;
+  // connect only
+  asio::ip::tcp::endpoint src;
+  asio::ip::tcp::endpoint dst;
+  std::string host;
+};
+
+// The totals of a connection as of a refresh of the relay.
+struct ConnSummary {
+  size_t idx{0};
+  asio::ip::tcp::endpoint src;
+  asio::ip::tcp::endpoint dst;
+  std::string host;
+  bool online{true};
+  // from the client and from the origin
+  uint64_t outbound_bytes{0};
+  uint64_t inbound_bytes{0};
+  // bytes per second since the previous refresh
+  uint64_t outbound_rate{0};
+  uint64_t inbound_rate{0};
+};
+
+// How the connections changed since the previous refresh.
+struct ConnDelta {
+  // connections that are new, moved payload, slowed down or went offline
+  std::vector<ConnSummary> updated;
+  // connections offline for longer than RelayConfig::linger, gone from
+  // later deltas
+  std::vector<size_t> removed;
+};
+
 class NetworkObserver {
  public:
+  virtual ~NetworkObserver() = default;
+
+  // Receives events in batches on the relay thread, the slices in `events`
+  // are only valid during the call. Dispatches to the callbacks below by
+  // default.
+  virtual void OnEvents(std::span<const NetworkEvent> events);
+
   virtual void Connect(size_t idx, asio::ip::tcp::endpoint src,
-                       asio::ip::tcp::endpoint dst, std::string_view host) = 0;
-  virtual void Forward(size_t idx, bool outside, std::string_view data) = 0;
-  virtual void Disconnect(size_t idx) = 0;
+                       asio::ip::tcp::endpoint dst, std::string_view host) {}
+  virtual void Forward(size_t idx, bool outside, std::string_view data) {}
+  // payload relayed inside the kernel, only its length is known
+  virtual void ForwardBytes(size_t idx, bool outside, size_t len) {}
+  virtual void Disconnect(size_t idx) {}
+  // Receives the changes of every refresh on the relay thread. Summing the
+  // deltas up is cheaper than following the events for a viewer, and its
+  // cost doesn't grow with the traffic.
+  virtual void OnRefresh(const ConnDelta &delta) {}
+};
+
+enum class OverflowPolicy {
+  // the io thread waits for the relay, observers never miss an event
+  kBlock,
+  // events are dropped while the queue of the io thread is full
+  kDrop,
+};
+
+struct CaptureConfig {
+  // capture is disabled while empty
+  std::string dir;
+  size_t segment_size{64 * 1024 * 1024};
+  // oldest segments are removed beyond either limit
+  size_t max_bytes{1024 * 1024 * 1024};
+  std::chrono::seconds max_age{std::chrono::hours{24}};
 };
 
+struct RelayConfig {
+  // events buffered per io thread
+  size_t queue_size{4096};
+  OverflowPolicy overflow{OverflowPolicy::kBlock};
+  CaptureConfig capture;
+  // how often observers receive a ConnDelta
+  std::chrono::milliseconds refresh{500};
+  // offline connections are kept in the summaries this long
+  std::chrono::seconds linger{10};
+};
+
+class CaptureStore;
+
+// Collects events from the io threads through one single producer queue per
+// thread and hands them to the observers in batches on its own thread.
 class NetworkRelay : public NetworkObserver {
  public:
-  NetworkRelay();
-  ~NetworkRelay();
+  explicit NetworkRelay(const RelayConfig &config = {});
+  ~NetworkRelay() override;
 
   void Start();
+  // observers have to be registered before Start
   void Register(NetworkObserver *observer) {
     observers_.emplace_back(std::move(observer));
   }
   void Connect(size_t idx, asio::ip::tcp::endpoint src,
                asio::ip::tcp::endpoint dst, std::string_view host) override;
+  // copies `s` into pooled buffers
   void Forward(size_t idx, bool outside, std::string_view s) override;
+  // shares `data` with the observers without copying
+  void Forward(size_t idx, bool outside, BufferSlice data);
+  void ForwardBytes(size_t idx, bool outside, size_t len) override;
   void Disconnect(size_t idx) override;
 
+  // null while capture is disabled
+  [[nodiscard]] CaptureStore *Capture() const { return capture_.get(); }
+
  private:
+  using Queue = SpscRing<NetworkEvent>;
+
   struct ConnModel {
-    bool online{true};
-    asio::ip::tcp::endpoint src;
-    asio::ip::tcp::endpoint dst;
-    std::string host;
-
-    ConnModel(asio::ip::tcp::endpoint src, asio::ip::tcp::endpoint dst,
-              std::string host)
-        : src{src}, dst{dst}, host{std::move(host)} {}
-  };
-  struct PacketModel {
-    size_t idx;
-    bool outside;
-    std::chrono::time_point<std::chrono::steady_clock> time;
-    std::string data;
-
-    PacketModel(size_t idx, bool outside, std::string data)
-        : idx{idx},
-          outside{outside},
-          time{std::chrono::steady_clock::now()},
-          data{std::move(data)} {}
+    ConnSummary summary;
+    // totals as of the previous refresh
+    uint64_t outbound_refreshed{0};
+    uint64_t inbound_refreshed{0};
+    // changed since the previous refresh
+    bool dirty{true};
+    std::chrono::steady_clock::time_point offline_since;
   };
 
-  void AsyncConnect(size_t idx, asio::ip::tcp::endpoint src,
-                    asio::ip::tcp::endpoint dst, std::string host);
-  void AsyncForward(size_t idx, bool outside, std::string s);
-  void AsyncDisconnect(size_t idx);
+  Queue &LocalQueue();
+  void Publish(NetworkEvent &event);
+  // Wakes the relay thread if it waits for events.
+  void Wake();
+  void Run(std::stop_token stop);
+  // Waits until `queues` hold events, a queue was added, `deadline` passed
+  // or a stop was requested.
+  void Idle(const std::vector<Queue *> &queues, std::stop_token stop,
+            std::chrono::steady_clock::time_point deadline);
+  void Dispatch(std::span<NetworkEvent> events);
+  void Refresh(std::chrono::steady_clock::time_point now);
 
-  asio::thread_pool pool_;
+  const RelayConfig config_;
+  const uint64_t id_;
+  std::mutex queues_mutex_;
+  std::unordered_map<std::thread::id, std::unique_ptr<Queue>> queues_;
+  std::atomic_size_t queue_count_{0};
+  std::atomic_size_t dropped_{0};
+  // set while the relay thread waits, publishers only notify then
+  std::atomic_bool idle_{false};
+  std::mutex idle_mutex_;
+  std::condition_variable_any idle_cv_;
+
+  // relay thread only
   std::unordered_map<size_t, ConnModel> conns_;
-  std::vector<PacketModel> packets_;
+  std::chrono::steady_clock::time_point refreshed_;
+  // retains the forwarded payload, null while capture is disabled
+  std::unique_ptr<CaptureStore> capture_;
   std::vector<NetworkObserver *> observers_;
+
+  std::jthread thread_;
 };
 
 }  // namespace socks
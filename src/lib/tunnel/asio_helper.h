@@ -9,6 +9,9 @@
 #include <asio.hpp>
 #include <type_traits>
 
+#include "coro/asio_task.h"
+#include "coro/when_all.h"
+
 namespace socks::tunnel {
 
 namespace detail {
@@ -20,63 +23,26 @@ struct IsSpec<Ref<Args...>, Ref> : std::true_type {};
 
 template <typename Arg, typename... Args>
 concept AwaitAbles = IsSpec<Arg, asio::awaitable>::value &&
+    std::is_same_v<typename Arg::value_type, void> &&
     std::conjunction_v<std::is_same<Arg, Args>...>;
 
 template <typename Ctx>
 concept IsAsioContext = std::is_convertible_v<Ctx &, asio::execution_context &>;
 
-template <size_t N, typename... Args>
-using ArgIdx = std::tuple_element_t<N, std::tuple<Args...>>;
-
-template <AwaitAbles... Args>
-using AwaitAblesValueType = typename ArgIdx<0, Args...>::value_type;
-
-template <typename T>
-struct VectorCompVoid {
-  using type = std::vector<T>;
-};
-
-template <>
-struct VectorCompVoid<void> {
-  using type = std::vector<int>;
-};
+template <typename Ctx>
+Task<void> Spawned(Ctx &ctx, asio::awaitable<void> awaitable) {
+  co_await asio::co_spawn(ctx, std::move(awaitable), use_task);
+}
 
 }  // namespace detail
 
+// Runs `args` side by side on `ctx` and returns once all of them are done,
+// without a timer or detached coroutines to leave behind. Nothing is
+// cancelled when one fails, the first exception is rethrown at the end.
 template <detail::IsAsioContext Ctx, detail::AwaitAbles... Args>
-asio::awaitable<std::conditional_t<
-    std::is_same_v<void, detail::AwaitAblesValueType<Args...>>, void,
-    std::vector<detail::AwaitAblesValueType<Args...>>>>
-WaitAll(Ctx &ctx, std::chrono::seconds timeout, Args &&...args) {
-  asio::steady_timer barrier{ctx, timeout};
-  std::atomic_size_t count{0};
-  size_t idx{0};
-
-  // return values only used when value type not void
-  using ValueType = detail::AwaitAblesValueType<Args...>;
-  constexpr bool ret_void = std::is_same_v<void, ValueType>;
-  std::vector<std::conditional_t<ret_void, int, ValueType>> ret;
-  std::mutex mutex;
-
-  (asio::co_spawn(
-       ctx,
-       [c = std::move(args), &barrier, &count, cur = idx++, &mutex,
-        &ret]() mutable -> asio::awaitable<void> {
-         if constexpr (ret_void) {
-           co_await std::move(c);
-         } else {
-           auto &&val = co_await std::move(c);
-           std::lock_guard<std::mutex> lock{mutex};
-           ret.emplace_back(std::forward<ValueType>(val));
-         }
-         if (++count == sizeof...(Args)) barrier.cancel();
-       },
-       asio::detached),
-   ...);
-  co_await barrier.async_wait(asio::use_awaitable);
-  if constexpr (!ret_void) {
-    co_return ret;
-  }
+asio::awaitable<void> WaitAll(Ctx &ctx, Args &&...args) {
+  co_await AsyncRun(ctx, WhenAll(detail::Spawned(ctx, std::move(args))...),
+                    asio::use_awaitable);
 }
 
 }  // namespace socks::tunnel
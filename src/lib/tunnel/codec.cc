@@ -1 +1,146 @@
 #include "tunnel/codec.h"
+
+#include <algorithm>
+
+#include "channel/quic_wire.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+// Appends `value` as a varint to `out`.
+void PutVarint(std::string &out, uint64_t value) {
+  const auto at = out.size();
+  out.resize(at + quic::VarintSize(value));
+  quic::Writer writer{std::span<char>{out}.subspan(at)};
+  writer.Varint(value);
+}
+
+}  // namespace
+
+void FrameEncoder::Header(FrameKind kind, uint64_t stream, uint64_t len) {
+  headers_.push_back(static_cast<char>(kind));
+  PutVarint(headers_, stream);
+  PutVarint(headers_, len);
+}
+
+// Extends the previous piece when it is a header range too, so a run of
+// control frames takes a single buffer.
+void FrameEncoder::Own(size_t offset) {
+  const auto len = headers_.size() - offset;
+  size_ += len;
+  if (!pieces_.empty() && pieces_.back().data == nullptr) {
+    pieces_.back().len += len;
+    return;
+  }
+  pieces_.push_back(Piece{nullptr, offset, len});
+}
+
+void FrameEncoder::Open(uint64_t stream, std::string_view target) {
+  const auto at = headers_.size();
+  Header(FrameKind::kOpen, stream, target.size());
+  headers_.append(target);
+  Own(at);
+}
+
+void FrameEncoder::Data(uint64_t stream, asio::const_buffer payload) {
+  const auto *p = static_cast<const char *>(payload.data());
+  auto left = payload.size();
+  do {
+    const auto len = std::min(left, kMaxFramePayload);
+    const auto at = headers_.size();
+    Header(FrameKind::kData, stream, len);
+    Own(at);
+    if (len > 0) {
+      pieces_.push_back(Piece{p, 0, len});
+      size_ += len;
+    }
+    p += len;
+    left -= len;
+  } while (left > 0);
+}
+
+void FrameEncoder::Fin(uint64_t stream) {
+  const auto at = headers_.size();
+  Header(FrameKind::kFin, stream, 0);
+  Own(at);
+}
+
+void FrameEncoder::Reset(uint64_t stream, uint64_t error) {
+  const auto at = headers_.size();
+  Header(FrameKind::kReset, stream, quic::VarintSize(error));
+  PutVarint(headers_, error);
+  Own(at);
+}
+
+void FrameEncoder::Window(uint64_t stream, uint64_t increment) {
+  const auto at = headers_.size();
+  Header(FrameKind::kWindow, stream, quic::VarintSize(increment));
+  PutVarint(headers_, increment);
+  Own(at);
+}
+
+// Built only now, appending to `headers_` may have moved it.
+std::span<const asio::const_buffer> FrameEncoder::Buffers() {
+  buffers_.clear();
+  buffers_.reserve(pieces_.size());
+  for (const auto &piece : pieces_) {
+    buffers_.emplace_back(
+        piece.data != nullptr ? piece.data : headers_.data() + piece.offset,
+        piece.len);
+  }
+  return buffers_;
+}
+
+void FrameEncoder::Clear() {
+  headers_.clear();
+  pieces_.clear();
+  buffers_.clear();
+  size_ = 0;
+}
+
+FrameDecoder::Status FrameDecoder::Decode(std::string_view &data,
+                                          Frame &frame) {
+  quic::Reader reader{data};
+  const auto kind = reader.U8();
+  const auto stream = reader.Varint();
+  const auto len = reader.Varint();
+  if (!reader.Ok()) return Status::kPartial;
+  if (kind < static_cast<uint8_t>(FrameKind::kOpen) ||
+      kind > static_cast<uint8_t>(FrameKind::kWindow) ||
+      len > kMaxFramePayload) {
+    return Status::kInvalid;
+  }
+  if (reader.Rest().size() < len) return Status::kPartial;
+
+  frame = Frame{.kind = static_cast<FrameKind>(kind),
+                .stream = stream,
+                .payload = reader.Bytes(len)};
+  switch (frame.kind) {
+    case FrameKind::kFin:
+      if (len != 0) return Status::kInvalid;
+      break;
+    case FrameKind::kReset:
+    case FrameKind::kWindow: {
+      quic::Reader value{frame.payload};
+      frame.value = value.Varint();
+      if (!value.Ok() || !value.Empty()) return Status::kInvalid;
+      frame.payload = {};
+      break;
+    }
+    default:
+      break;
+  }
+  data = reader.Rest();
+  return Status::kDone;
+}
+
+uint64_t RecvCredit::OnConsumed(uint64_t len) {
+  consumed_ += len;
+  if (limit_ - consumed_ >= window_ / 2) return 0;
+  const auto increment = consumed_ + window_ - limit_;
+  limit_ += increment;
+  return increment;
+}
+
+}  // namespace socks::tunnel
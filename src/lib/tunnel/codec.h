@@ -1,8 +1,125 @@
 #ifndef QUIC_SOCKS_TUNNEL_CODEC_H_
 #define QUIC_SOCKS_TUNNEL_CODEC_H_
 
+#include <asio/buffer.hpp>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Framing of a link carrying many tunnels over one tcp connection, for
+// paths where udp is blocked. A frame is [kind][stream][length][payload],
+// the three numbers quic varints, RFC 9000 section 16.
 namespace socks::tunnel {
 
-}
+enum class FrameKind : uint8_t {
+  // opens the stream, the payload names the target as host:port
+  kOpen = 0x01,
+  kData = 0x02,
+  // the sender finished its side of the stream
+  kFin = 0x03,
+  // abandons both sides, the payload is an error code
+  kReset = 0x04,
+  // grants the peer more credit on the stream, the payload is the increment
+  kWindow = 0x05,
+};
+
+struct Frame {
+  FrameKind kind;
+  uint64_t stream;
+  // a view into the decoded bytes, for kOpen and kData
+  std::string_view payload;
+  // the error code of kReset, the increment of kWindow
+  uint64_t value{0};
+};
+
+// Largest header of a frame, kind, stream id and length.
+constexpr size_t kMaxFrameHeader = 1 + 8 + 8;
+// Data frames larger than this are split by the encoder and refused by the
+// decoder.
+constexpr size_t kMaxFramePayload = 64 * 1024;
+
+// Collects frames for one gather write. Headers are encoded into a buffer
+// of the encoder, data payloads are referenced where they are and have to
+// stay valid until the write completed.
+class FrameEncoder {
+ public:
+  void Open(uint64_t stream, std::string_view target);
+  void Data(uint64_t stream, asio::const_buffer payload);
+  void Fin(uint64_t stream);
+  void Reset(uint64_t stream, uint64_t error);
+  void Window(uint64_t stream, uint64_t increment);
+
+  // The frames so far, valid until the next frame is added.
+  std::span<const asio::const_buffer> Buffers();
+  [[nodiscard]] size_t Size() const { return size_; }
+  [[nodiscard]] bool Empty() const { return pieces_.empty(); }
+  void Clear();
+
+ private:
+  // a range of `headers_`, or a payload when `data` is set
+  struct Piece {
+    const void *data;
+    size_t offset;
+    size_t len;
+  };
+
+  void Header(FrameKind kind, uint64_t stream, uint64_t len);
+  void Own(size_t offset);
+
+  std::string headers_;
+  std::vector<Piece> pieces_;
+  std::vector<asio::const_buffer> buffers_;
+  size_t size_{0};
+};
+
+// Decodes the frame at the front of `data` and consumes it. kPartial leaves
+// `data` as it was, more bytes are needed.
+class FrameDecoder {
+ public:
+  enum class Status { kPartial, kDone, kInvalid };
+
+  static Status Decode(std::string_view &data, Frame &frame);
+};
+
+// Credit of a sending side. It may have at most the credit the peer granted
+// in flight beyond what the peer consumed.
+class SendCredit {
+ public:
+  explicit SendCredit(uint64_t window) : limit_{window} {}
+
+  [[nodiscard]] uint64_t Available() const { return limit_ - sent_; }
+  void Consume(uint64_t len) { sent_ += len; }
+  void Grant(uint64_t increment) { limit_ += increment; }
+
+ private:
+  uint64_t sent_{0};
+  uint64_t limit_;
+};
+
+// Credit of a receiving side. Consumed bytes are granted back in batches of
+// at least half the window, so window frames stay rare.
+class RecvCredit {
+ public:
+  explicit RecvCredit(uint64_t window) : window_{window}, limit_{window} {}
+
+  // Returns false when the peer sent past its credit.
+  [[nodiscard]] bool OnData(uint64_t len) {
+    received_ += len;
+    return received_ <= limit_;
+  }
+  // Returns the increment to grant the peer, 0 while it is not worth a
+  // frame yet.
+  uint64_t OnConsumed(uint64_t len);
+
+ private:
+  const uint64_t window_;
+  uint64_t received_{0};
+  uint64_t consumed_{0};
+  uint64_t limit_;
+};
+
+}  // namespace socks::tunnel
 
-#endif
\ No newline at end of file
+#endif  // QUIC_SOCKS_TUNNEL_CODEC_H_
@@ -0,0 +1,566 @@
+#include "tunnel/dns_resolver.h"
+
+#include <fmt/ostream.h>
+
+#include <algorithm>
+#include <asio.hpp>
+#include <charconv>
+#include <fstream>
+#include <optional>
+#include <random>
+#include <span>
+#include <sstream>
+
+#include "utility/log.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+constexpr uint16_t kTypeA = 1;
+constexpr uint16_t kTypeAaaa = 28;
+constexpr uint16_t kTypeOpt = 41;
+constexpr uint16_t kClassIn = 1;
+// edns payload size that avoids ip fragmentation on common paths
+constexpr uint16_t kUdpPayload = 1232;
+constexpr uint16_t kFlagResponse = 0x8000;
+constexpr uint16_t kFlagTruncated = 0x0200;
+constexpr uint16_t kFlagRecursion = 0x0100;
+constexpr uint8_t kRcodeNoError = 0;
+constexpr uint8_t kRcodeNxDomain = 3;
+constexpr uint16_t kDnsPort = 53;
+
+struct Reply {
+  uint8_t rcode{kRcodeNoError};
+  bool truncated{false};
+  uint32_t ttl{std::numeric_limits<uint32_t>::max()};
+  DnsResolver::Addresses addresses;
+};
+
+struct Query {
+  uint16_t id;
+  uint16_t type;
+  std::vector<uint8_t> message;
+  std::optional<Reply> reply;
+};
+
+class Reader {
+ public:
+  explicit Reader(std::span<const uint8_t> data) : data_{data} {}
+
+  bool U8(uint8_t &v) {
+    if (pos_ + 1 > data_.size()) return false;
+    v = data_[pos_++];
+    return true;
+  }
+  bool U16(uint16_t &v) {
+    if (pos_ + 2 > data_.size()) return false;
+    v = static_cast<uint16_t>(data_[pos_] << 8 | data_[pos_ + 1]);
+    pos_ += 2;
+    return true;
+  }
+  bool U32(uint32_t &v) {
+    uint16_t high{0}, low{0};
+    if (!U16(high) || !U16(low)) return false;
+    v = uint32_t{high} << 16 | low;
+    return true;
+  }
+  bool Skip(size_t n) {
+    if (pos_ + n > data_.size()) return false;
+    pos_ += n;
+    return true;
+  }
+  std::span<const uint8_t> Bytes(size_t n) {
+    if (!Skip(n)) return {};
+    return data_.subspan(pos_ - n, n);
+  }
+
+  // uncompressed name, as found in the question section
+  bool Name(std::string &out) {
+    out.clear();
+    uint8_t len{0};
+    while (U8(len) && len != 0) {
+      if (len > 63 || pos_ + len > data_.size()) return false;
+      if (!out.empty()) out.push_back('.');
+      for (size_t i = 0; i < len; ++i) {
+        const auto c = static_cast<char>(data_[pos_ + i]);
+        out.push_back(static_cast<char>(std::tolower(c)));
+      }
+      pos_ += len;
+    }
+    return len == 0 && pos_ <= data_.size();
+  }
+  bool SkipName() {
+    uint8_t len{0};
+    while (U8(len)) {
+      if (len == 0) return true;
+      // compression pointer ends the name
+      if ((len & 0xc0) == 0xc0) return Skip(1);
+      if (!Skip(len)) return false;
+    }
+    return false;
+  }
+
+ private:
+  std::span<const uint8_t> data_;
+  size_t pos_{0};
+};
+
+void Put16(std::vector<uint8_t> &out, uint16_t v) {
+  out.push_back(static_cast<uint8_t>(v >> 8));
+  out.push_back(static_cast<uint8_t>(v & 0xff));
+}
+
+bool EncodeQuery(std::vector<uint8_t> &out, uint16_t id, std::string_view name,
+                 uint16_t type) {
+  if (name.empty() || name.size() > 253) return false;
+  out.clear();
+  Put16(out, id);
+  Put16(out, kFlagRecursion);
+  // one question, one additional record for edns
+  for (uint16_t count : {1, 0, 0, 1}) Put16(out, count);
+  while (!name.empty()) {
+    const auto dot = std::min(name.find('.'), name.size());
+    if (dot == 0 || dot > 63) return false;
+    out.push_back(static_cast<uint8_t>(dot));
+    out.insert(out.end(), name.begin(), name.begin() + dot);
+    name.remove_prefix(std::min(dot + 1, name.size()));
+  }
+  out.push_back(0);
+  Put16(out, type);
+  Put16(out, kClassIn);
+  // opt record, root name, udp payload size as class, no options
+  out.push_back(0);
+  Put16(out, kTypeOpt);
+  Put16(out, kUdpPayload);
+  for (uint16_t v : {0, 0, 0}) Put16(out, v);
+  return true;
+}
+
+// Returns nothing for messages not answering `query`.
+std::optional<Reply> ParseReply(std::span<const uint8_t> msg,
+                                std::string_view name, const Query &query) {
+  Reader reader{msg};
+  uint16_t id{0}, flags{0}, qd{0}, an{0}, ns{0}, ar{0};
+  if (!reader.U16(id) || !reader.U16(flags) || !reader.U16(qd) ||
+      !reader.U16(an) || !reader.U16(ns) || !reader.U16(ar)) {
+    return std::nullopt;
+  }
+  if (id != query.id || (flags & kFlagResponse) == 0 || qd != 1) {
+    return std::nullopt;
+  }
+  std::string qname;
+  uint16_t qtype{0}, qclass{0};
+  if (!reader.Name(qname) || !reader.U16(qtype) || !reader.U16(qclass) ||
+      qname != name || qtype != query.type || qclass != kClassIn) {
+    return std::nullopt;
+  }
+
+  Reply reply{.rcode = static_cast<uint8_t>(flags & 0x0f),
+              .truncated = (flags & kFlagTruncated) != 0};
+  if (reply.truncated) return reply;
+  for (uint16_t i = 0; i < an; ++i) {
+    uint16_t type{0}, cls{0}, len{0};
+    uint32_t ttl{0};
+    if (!reader.SkipName() || !reader.U16(type) || !reader.U16(cls) ||
+        !reader.U32(ttl) || !reader.U16(len)) {
+      return std::nullopt;
+    }
+    const auto rdata = reader.Bytes(len);
+    if (rdata.size() != len) return std::nullopt;
+    // cname records of the chain are skipped, the addresses follow them
+    if (cls != kClassIn || type != query.type) continue;
+    if (type == kTypeA && len == 4) {
+      asio::ip::address_v4::bytes_type bytes;
+      std::copy(rdata.begin(), rdata.end(), bytes.begin());
+      reply.addresses.emplace_back(asio::ip::address_v4{bytes});
+    } else if (type == kTypeAaaa && len == 16) {
+      asio::ip::address_v6::bytes_type bytes;
+      std::copy(rdata.begin(), rdata.end(), bytes.begin());
+      reply.addresses.emplace_back(asio::ip::address_v6{bytes});
+    } else {
+      continue;
+    }
+    reply.ttl = std::min(reply.ttl, ttl);
+  }
+  return reply;
+}
+
+uint16_t NextId() {
+  thread_local std::mt19937 engine{std::random_device{}()};
+  return static_cast<uint16_t>(engine());
+}
+
+std::string Normalize(std::string_view host) {
+  if (host.ends_with('.')) host.remove_suffix(1);
+  std::string name{host};
+  std::ranges::transform(name, name.begin(), [](char c) {
+    return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  });
+  return name;
+}
+
+struct ResolvConf {
+  std::vector<asio::ip::udp::endpoint> servers;
+  std::vector<std::string> search;
+  size_t ndots{1};
+};
+
+// The keys of resolv.conf(5) a stub resolver needs, the last search or
+// domain line wins.
+ResolvConf ReadResolvConf() {
+  ResolvConf conf;
+  std::ifstream in{"/etc/resolv.conf"};
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields{line};
+    std::string key, value;
+    if (!(fields >> key >> value)) continue;
+    if (key == "nameserver") {
+      asio::error_code err;
+      const auto address = asio::ip::make_address(value, err);
+      if (!err) conf.servers.emplace_back(address, kDnsPort);
+    } else if (key == "search" || key == "domain") {
+      conf.search.clear();
+      do {
+        conf.search.push_back(Normalize(value));
+      } while (key == "search" && fields >> value);
+    } else if (key == "options") {
+      do {
+        size_t ndots{0};
+        const auto *end = value.data() + value.size();
+        if (value.starts_with("ndots:") &&
+            std::from_chars(value.data() + 6, end, ndots).ec == std::errc{}) {
+          // capped like the libc resolver does
+          conf.ndots = std::min<size_t>(ndots, 15);
+        }
+      } while (fields >> value);
+    }
+  }
+  return conf;
+}
+
+// Names of the hosts file by the addresses listed for them, in the order of
+// the file.
+std::unordered_map<std::string, DnsResolver::Addresses> ReadHosts(
+    const std::string &path) {
+  std::unordered_map<std::string, DnsResolver::Addresses> hosts;
+  if (path.empty()) return hosts;
+  std::ifstream in{path};
+  std::string line;
+  while (std::getline(in, line)) {
+    line.erase(std::min(line.find('#'), line.size()));
+    std::istringstream fields{line};
+    std::string value;
+    if (!(fields >> value)) continue;
+    asio::error_code err;
+    const auto address = asio::ip::make_address(value, err);
+    if (err) continue;
+    while (fields >> value) {
+      auto &addresses = hosts[Normalize(value)];
+      if (std::ranges::find(addresses, address) == addresses.end()) {
+        addresses.push_back(address);
+      }
+    }
+  }
+  return hosts;
+}
+
+// Closes `socket` once `timer` expires, the pending operations then fail
+// with operation_aborted.
+template <typename Socket>
+void CloseAfter(asio::steady_timer &timer, std::shared_ptr<Socket> socket) {
+  timer.async_wait([socket](const asio::error_code &err) {
+    if (!err) socket->close();
+  });
+}
+
+asio::awaitable<void> AsyncQueryUdp(const asio::ip::udp::endpoint &server,
+                                    const std::string &name,
+                                    std::span<Query> queries,
+                                    std::chrono::milliseconds timeout) {
+  const auto executor = co_await asio::this_coro::executor;
+  auto socket =
+      std::make_shared<asio::ip::udp::socket>(executor, server.protocol());
+  socket->connect(server);
+  asio::steady_timer timer{executor, timeout};
+  CloseAfter(timer, socket);
+
+  for (auto &query : queries) {
+    co_await socket->async_send(asio::buffer(query.message),
+                                asio::use_awaitable);
+  }
+  std::array<uint8_t, kUdpPayload> buf{};
+  size_t answered{0};
+  while (answered < queries.size()) {
+    const auto len = co_await socket->async_receive(asio::buffer(buf),
+                                                    asio::use_awaitable);
+    for (auto &query : queries) {
+      if (query.reply) continue;
+      query.reply = ParseReply({buf.data(), len}, name, query);
+      if (query.reply) {
+        ++answered;
+        break;
+      }
+    }
+  }
+}
+
+asio::awaitable<void> AsyncQueryTcp(const asio::ip::tcp::endpoint &server,
+                                    const std::string &name,
+                                    std::span<Query> queries,
+                                    std::chrono::milliseconds timeout) {
+  const auto executor = co_await asio::this_coro::executor;
+  auto socket = std::make_shared<asio::ip::tcp::socket>(executor);
+  asio::steady_timer timer{executor, timeout};
+  CloseAfter(timer, socket);
+
+  co_await socket->async_connect(server, asio::use_awaitable);
+  std::vector<uint8_t> out;
+  for (const auto &query : queries) {
+    Put16(out, static_cast<uint16_t>(query.message.size()));
+    out.insert(out.end(), query.message.begin(), query.message.end());
+  }
+  co_await asio::async_write(*socket, asio::buffer(out), asio::use_awaitable);
+
+  std::vector<uint8_t> msg;
+  size_t answered{0};
+  while (answered < queries.size()) {
+    std::array<uint8_t, 2> prefix{};
+    co_await asio::async_read(*socket, asio::buffer(prefix),
+                              asio::use_awaitable);
+    msg.resize(prefix[0] << 8 | prefix[1]);
+    co_await asio::async_read(*socket, asio::buffer(msg), asio::use_awaitable);
+    for (auto &query : queries) {
+      if (query.reply) continue;
+      query.reply = ParseReply(msg, name, query);
+      if (query.reply) {
+        ++answered;
+        break;
+      }
+    }
+  }
+}
+
+}  // namespace
+
+DnsResolver::DnsResolver(const ResolverConfig &config)
+    : config_{config},
+      servers_{config.servers},
+      search_{config.search},
+      ndots_{config.ndots},
+      hosts_{ReadHosts(config.hosts_file)} {
+  if (servers_.empty()) {
+    auto conf = ReadResolvConf();
+    servers_ = std::move(conf.servers);
+    search_ = std::move(conf.search);
+    ndots_ = conf.ndots;
+  }
+  if (servers_.empty()) {
+    SPDLOG_WARN("[dns] no nameserver configured, fallback to localhost");
+    servers_.emplace_back(asio::ip::address_v4::loopback(), kDnsPort);
+  }
+}
+
+DnsResolver::Shard &DnsResolver::ShardOf(const std::string &name) {
+  return shards_[std::hash<std::string>{}(name) % kShards];
+}
+
+std::vector<std::string> DnsResolver::Candidates(std::string_view host) const {
+  const auto name = Normalize(host);
+  // a trailing dot marks the name as absolute
+  if (host.ends_with('.') || search_.empty()) return {name};
+  std::vector<std::string> names;
+  const auto dots = static_cast<size_t>(std::ranges::count(name, '.'));
+  if (dots >= ndots_) names.push_back(name);
+  for (const auto &domain : search_) names.push_back(name + '.' + domain);
+  if (dots < ndots_) names.push_back(name);
+  return names;
+}
+
+asio::awaitable<DnsResolver::Addresses> DnsResolver::AsyncResolve(
+    std::string_view host) {
+  asio::error_code err;
+  const auto literal = asio::ip::make_address(std::string{host}, err);
+  if (!err) {
+    co_return Addresses{literal};
+  }
+
+  asio::error_code failed;
+  for (const auto &name : Candidates(host)) {
+    try {
+      co_return co_await AsyncResolveName(name);
+    } catch (const asio::system_error &e) {
+      // a name that doesn't exist moves on to the next, not getting an
+      // answer is what's reported if none resolves
+      if (!failed || e.code() == asio::error::host_not_found_try_again) {
+        failed = e.code();
+      }
+    }
+  }
+  throw asio::system_error{failed, std::string{host}};
+}
+
+asio::awaitable<DnsResolver::Addresses> DnsResolver::AsyncResolveName(
+    const std::string &name) {
+  if (auto it = hosts_.find(name); it != hosts_.end()) {
+    co_return it->second;
+  }
+
+  auto &shard = ShardOf(name);
+  const auto executor = co_await asio::this_coro::executor;
+  const auto spawn = [this, &executor, &name] {
+    asio::co_spawn(executor, AsyncComplete(name), asio::detached);
+  };
+
+  std::optional<Entry> hit;
+  bool refresh{false};
+  {
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    const auto now = std::chrono::steady_clock::now();
+    if (auto it = shard.cache.find(name);
+        it != shard.cache.end() && it->second.expires > now) {
+      hit = it->second;
+      refresh = now >= it->second.refresh &&
+                shard.pending.try_emplace(name).second;
+    }
+  }
+  if (hit) {
+    if (refresh) spawn();
+    if (hit->error) throw asio::system_error{hit->error, name};
+    co_return std::move(hit->addresses);
+  }
+
+  // joins the lookup in flight, or starts one
+  co_return co_await asio::async_initiate<decltype(asio::use_awaitable),
+                                          void(asio::error_code, Addresses)>(
+      [this, &shard, &name, &spawn](auto handler) {
+        using Handler = decltype(handler);
+        auto shared = std::make_shared<Handler>(std::move(handler));
+        Waiter waiter = [shared](asio::error_code err, Addresses addresses) {
+          const auto ex = asio::get_associated_executor(*shared);
+          asio::post(ex, [shared, err, addresses = std::move(addresses)]() {
+            (*shared)(err, addresses);
+          });
+        };
+
+        bool leader{false};
+        {
+          std::lock_guard<std::mutex> lock{shard.mutex};
+          const auto it = shard.cache.find(name);
+          if (it != shard.cache.end() &&
+              it->second.expires > std::chrono::steady_clock::now()) {
+            waiter(it->second.error, it->second.addresses);
+            return;
+          }
+          auto [pending, inserted] = shard.pending.try_emplace(name);
+          pending->second.emplace_back(std::move(waiter));
+          leader = inserted;
+        }
+        if (leader) spawn();
+      },
+      asio::use_awaitable);
+}
+
+asio::awaitable<void> DnsResolver::AsyncComplete(std::string name) {
+  auto entry = co_await AsyncLookup(name);
+
+  auto &shard = ShardOf(name);
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    // transient failures are not cached, neither do they replace an answer
+    // still being served
+    if (entry.expires > std::chrono::steady_clock::now()) {
+      Store(shard, name, entry);
+    }
+    if (auto it = shard.pending.find(name); it != shard.pending.end()) {
+      waiters = std::move(it->second);
+      shard.pending.erase(it);
+    }
+  }
+  for (auto &waiter : waiters) {
+    waiter(entry.error, entry.addresses);
+  }
+}
+
+asio::awaitable<DnsResolver::Entry> DnsResolver::AsyncLookup(
+    const std::string &name) {
+  std::array<Query, 2> queries{Query{.id = NextId(), .type = kTypeA},
+                               Query{.id = NextId(), .type = kTypeAaaa}};
+  for (auto &query : queries) {
+    if (!EncodeQuery(query.message, query.id, name, query.type)) {
+      SPDLOG_DEBUG("[dns] invalid host, host={}", name);
+      co_return Entry{.error = asio::error::host_not_found};
+    }
+  }
+
+  const auto first = next_server_.fetch_add(1, std::memory_order_relaxed);
+  const auto rounds = std::max<size_t>(config_.attempts, 1) * servers_.size();
+  for (size_t i = 0; i < rounds; ++i) {
+    const auto &server = servers_[(first + i) % servers_.size()];
+    try {
+      for (auto &query : queries) query.reply.reset();
+      co_await AsyncQueryUdp(server, name, queries, config_.timeout);
+      if (std::ranges::any_of(queries,
+                              [](auto &q) { return q.reply->truncated; })) {
+        for (auto &query : queries) query.reply.reset();
+        co_await AsyncQueryTcp({server.address(), server.port()}, name,
+                               queries, config_.timeout);
+      }
+    } catch (const asio::system_error &e) {
+      SPDLOG_DEBUG("[dns] query failed, server={}, host={}, err={}", server,
+                   name, e.what());
+      continue;
+    }
+
+    Entry entry;
+    uint32_t ttl{std::numeric_limits<uint32_t>::max()};
+    bool nxdomain{false}, failed{false};
+    for (auto &query : queries) {
+      auto &reply = *query.reply;
+      if (reply.rcode == kRcodeNxDomain) {
+        nxdomain = true;
+      } else if (reply.rcode != kRcodeNoError) {
+        failed = true;
+      } else if (!reply.addresses.empty()) {
+        ttl = std::min(ttl, reply.ttl);
+        std::ranges::move(reply.addresses,
+                          std::back_inserter(entry.addresses));
+      }
+    }
+    // servfail and refused are worth asking the next server
+    if (entry.addresses.empty() && failed && !nxdomain) continue;
+
+    const auto now = std::chrono::steady_clock::now();
+    if (entry.addresses.empty()) {
+      entry.error = asio::error::host_not_found;
+      entry.expires = entry.refresh = now + config_.negative_ttl;
+    } else {
+      const auto lifetime = std::clamp(std::chrono::seconds{ttl},
+                                       config_.min_ttl, config_.max_ttl);
+      entry.expires = now + lifetime;
+      entry.refresh = now + lifetime * 7 / 8;
+    }
+    co_return entry;
+  }
+
+  SPDLOG_WARN("[dns] resolve failed, host={}", name);
+  co_return Entry{.error = asio::error::host_not_found_try_again};
+}
+
+void DnsResolver::Store(Shard &shard, const std::string &name,
+                        const Entry &entry) {
+  const auto capacity = std::max<size_t>(config_.cache_size / kShards, 1);
+  if (shard.cache.size() >= capacity && !shard.cache.contains(name)) {
+    const auto now = std::chrono::steady_clock::now();
+    std::erase_if(shard.cache,
+                  [now](const auto &it) { return it.second.expires <= now; });
+    if (shard.cache.size() >= capacity) {
+      shard.cache.erase(shard.cache.begin());
+    }
+  }
+  shard.cache.insert_or_assign(name, entry);
+}
+
+}  // namespace socks::tunnel
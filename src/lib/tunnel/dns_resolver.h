@@ -0,0 +1,101 @@
+#ifndef QUIC_SOCKS_TUNNEL_DNS_RESOLVER_H_
+#define QUIC_SOCKS_TUNNEL_DNS_RESOLVER_H_
+
+#include <array>
+#include <asio/awaitable.hpp>
+#include <asio/ip/address.hpp>
+#include <asio/ip/udp.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+struct ResolverConfig {
+  // empty reads the nameservers, the search domains and ndots from
+  // /etc/resolv.conf
+  std::vector<asio::ip::udp::endpoint> servers;
+  // domains appended to relative names, those with fewer dots than `ndots`
+  // are looked up with them first, the others as they are first
+  std::vector<std::string> search;
+  size_t ndots{1};
+  // names answered before any query, empty for none
+  std::string hosts_file{"/etc/hosts"};
+  // per query and server
+  std::chrono::milliseconds timeout{2000};
+  // rounds over all servers
+  size_t attempts{2};
+  // bounds applied to the ttl of the answers
+  std::chrono::seconds min_ttl{1};
+  std::chrono::seconds max_ttl{std::chrono::hours{1}};
+  // lifetime of NXDOMAIN and empty answers
+  std::chrono::seconds negative_ttl{30};
+  // names cached across all shards
+  size_t cache_size{16384};
+};
+
+// Stub resolver speaking DNS over udp, and tcp for truncated answers. Answers
+// are cached per name, split over shards each with its own lock. Concurrent
+// lookups of one name wait for a single query, and hot entries are refreshed
+// in the background shortly before they expire.
+class DnsResolver : NonCopyable {
+ public:
+  using Addresses = std::vector<asio::ip::address>;
+
+  explicit DnsResolver(const ResolverConfig &config = {});
+
+  // Resolves the A and AAAA records of `host` on the executor of the calling
+  // coroutine, ip literals are returned as is. Names in the hosts file are
+  // answered from it, relative ones are tried with the search domains.
+  // Throws asio::system_error with host_not_found or
+  // host_not_found_try_again.
+  asio::awaitable<Addresses> AsyncResolve(std::string_view host);
+
+ private:
+  static constexpr size_t kShards = 16;
+
+  struct Entry {
+    Addresses addresses;
+    asio::error_code error;
+    std::chrono::steady_clock::time_point expires;
+    std::chrono::steady_clock::time_point refresh;
+  };
+  using Waiter = std::function<void(asio::error_code, Addresses)>;
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> cache;
+    // names being looked up and the callers waiting for them
+    std::unordered_map<std::string, std::vector<Waiter>> pending;
+  };
+
+  Shard &ShardOf(const std::string &name);
+  // The names to try for `host` in turn, with the search domains.
+  [[nodiscard]] std::vector<std::string> Candidates(
+      std::string_view host) const;
+  // Resolves a single fully qualified name, from the cache if it can.
+  asio::awaitable<Addresses> AsyncResolveName(const std::string &name);
+  // Looks `name` up, caches the answer and completes the waiters.
+  asio::awaitable<void> AsyncComplete(std::string name);
+  asio::awaitable<Entry> AsyncLookup(const std::string &name);
+  void Store(Shard &shard, const std::string &name, const Entry &entry);
+
+  const ResolverConfig config_;
+  std::vector<asio::ip::udp::endpoint> servers_;
+  std::vector<std::string> search_;
+  size_t ndots_;
+  // the hosts file, read once
+  std::unordered_map<std::string, Addresses> hosts_;
+  std::atomic_size_t next_server_{0};
+  std::array<Shard, kShards> shards_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_DNS_RESOLVER_H_
@@ -6,35 +6,160 @@
 
 #include <fmt/format.h>
 
-#include <regex>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <optional>
 
 #include "utility/result.h"
+#include "utility/simd.h"
 
 namespace socks::tunnel {
 
+namespace {
+
+constexpr auto npos = std::string_view::npos;
+
+size_t Find(std::string_view s, char c, size_t pos = 0) {
+  if (pos >= s.size()) return npos;
+  const auto end = s.data() + s.size();
+  const auto it = simd::FindByte(s.data() + pos, end, c);
+  return it == end ? npos : static_cast<size_t>(it - s.data());
+}
+
+std::string_view TrimSpace(std::string_view s) {
+  const auto space = [](char c) { return c == ' ' || c == '\t'; };
+  while (!s.empty() && space(s.front())) s.remove_prefix(1);
+  while (!s.empty() && space(s.back())) s.remove_suffix(1);
+  return s;
+}
+
+bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+int HexValue(char c) {
+  if (IsDigit(c)) return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool IsVersion(std::string_view ver) {
+  return ver.size() == 8 && ver.starts_with("HTTP/") && IsDigit(ver[5]) &&
+         ver[6] == '.' && IsDigit(ver[7]);
+}
+
+std::string_view FindHeader(const HeaderTable &headers, std::string_view name) {
+  for (const auto &header : headers) {
+    if (EqualsIgnoreCase(header.name, name)) return header.value;
+  }
+  return {};
+}
+
+bool KeepAlive(std::string_view ver, std::string_view connection) {
+  if (HasToken(connection, "close")) return false;
+  return ver == "HTTP/1.1" || HasToken(connection, "keep-alive");
+}
+
+// Content-Length may repeat as long as the values agree.
+std::optional<uint64_t> ContentLength(const HeaderTable &headers) {
+  std::optional<uint64_t> length;
+  for (const auto &header : headers) {
+    if (!EqualsIgnoreCase(header.name, "Content-Length")) continue;
+    uint64_t value{0};
+    const auto &v = header.value;
+    const auto end = v.data() + v.size();
+    const auto [ptr, ec] = std::from_chars(v.data(), end, value);
+    if (v.empty() || ec != std::errc{} || ptr != end ||
+        (length && *length != value)) {
+      throw SocksException(
+          fmt::format("[tunnel] invalid content length, value={}", v));
+    }
+    length = value;
+  }
+  return length;
+}
+
+// The body is chunked when chunked is the final transfer coding.
+bool Chunked(std::string_view encoding) {
+  encoding = TrimSpace(encoding);
+  const auto comma = encoding.rfind(',');
+  const auto last =
+      comma == npos ? encoding : TrimSpace(encoding.substr(comma + 1));
+  return EqualsIgnoreCase(last, "chunked");
+}
+
+}  // namespace
+
+bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  const auto lower = [](char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  };
+  return std::ranges::equal(a, b, [&lower](char x, char y) {
+    return lower(x) == lower(y);
+  });
+}
+
+bool HasToken(std::string_view list, std::string_view token) {
+  while (!list.empty()) {
+    const auto comma = std::min(Find(list, ','), list.size());
+    if (EqualsIgnoreCase(TrimSpace(list.substr(0, comma)), token)) {
+      return true;
+    }
+    list.remove_prefix(std::min(comma + 1, list.size()));
+  }
+  return false;
+}
+
 Uri Uri::Parse(std::string_view s) {
-  const std::regex pattern{"^((\\w+)://)?([^/:]+)(:(\\d+))?(.*)?$"};
-  std::match_results<std::string_view::const_iterator> match;
-  if (!std::regex_match(s.begin(), s.end(), match, pattern)) {
-    throw SocksException(
+  const auto fail = [s] {
+    return SocksException(
         fmt::format("[tunnel] parse resource failed, s={}", s));
-  }
+  };
 
   Uri uri;
-  uri.scheme = match.str(2);
-  uri.host = match.str(3);
-  const auto port_str = match.str(5);
-  if (port_str.empty()) {
+  auto rest = s;
+  if (const auto pos = rest.find("://"); pos != npos) {
+    uri.scheme = rest.substr(0, pos);
+    rest.remove_prefix(pos + 3);
+  }
+
+  const auto path_pos = Find(rest, '/');
+  const auto authority = rest.substr(0, path_pos);
+  if (path_pos != npos) {
+    uri.path = rest.substr(path_pos);
+  }
+
+  std::string_view port;
+  if (authority.starts_with('[')) {
+    // ipv6 literal, [::1]:443
+    const auto end = Find(authority, ']');
+    if (end == npos) throw fail();
+    uri.host = authority.substr(1, end - 1);
+    const auto tail = authority.substr(end + 1);
+    if (!tail.empty()) {
+      if (tail.front() != ':') throw fail();
+      port = tail.substr(1);
+    }
+  } else if (const auto colon = Find(authority, ':'); colon != npos) {
+    uri.host = authority.substr(0, colon);
+    port = authority.substr(colon + 1);
+  } else {
+    uri.host = authority;
+  }
+  if (uri.host.empty()) throw fail();
+
+  if (port.empty()) {
     if (uri.scheme == "http") {
       uri.port = 80;
     } else if (uri.scheme == "https") {
       uri.port = 443;
     }
   } else {
-    uri.port =
-        static_cast<uint16_t>(std::strtol(port_str.c_str(), nullptr, 10));
+    const auto end = port.data() + port.size();
+    const auto [ptr, ec] = std::from_chars(port.data(), end, uri.port);
+    if (ec != std::errc{} || ptr != end) throw fail();
   }
-  uri.path = match.str(6);
   return uri;
 }
 std::ostream &operator<<(std::ostream &os, const Uri &uri) {
@@ -44,63 +169,387 @@ std::ostream &operator<<(std::ostream &os, const Uri &uri) {
 std::ostream &operator<<(std::ostream &os, const RequestEntity &req) {
   return os << fmt::format("{} {} {}", req.method, req.uri, req.ver);
 }
-std::string RequestEntity::Dump() const {
-  fmt::memory_buffer buf;
-  const auto uri_obj = Uri::Parse(uri);
-  fmt::format_to(std::back_inserter(buf), "{} {} {}\r\n", method, uri_obj.path,
-                 ver);
-  for (const auto &[k, v] : headers) {
-    fmt::format_to(std::back_inserter(buf), "{}: {}\r\n", k, v);
+std::string_view RequestEntity::FindHeader(std::string_view name) const {
+  return tunnel::FindHeader(headers, name);
+}
+std::string_view RequestEntity::ToOriginForm(std::span<char> head) {
+  if (method == "CONNECT" || uri.starts_with('/') || uri == "*") {
+    return {head.data(), raw.size()};
   }
-  fmt::format_to(std::back_inserter(buf), "\r\n");
-  return fmt::to_string(buf);
+
+  // start line is "method SP target SP version", the method is moved right
+  // in front of the path and the head starts from there
+  const auto target = Uri::Parse(uri);
+  const auto offset = [this](std::string_view v) {
+    return static_cast<size_t>(v.data() - raw.data());
+  };
+  auto *base = head.data();
+  const auto target_end = offset(uri) + uri.size();
+  size_t path_begin{0};
+  if (target.path.empty()) {
+    path_begin = target_end - 1;
+    base[path_begin] = '/';
+  } else {
+    path_begin = offset(target.path);
+  }
+  const auto start = path_begin - method.size() - 1;
+  std::memmove(base + start, base, method.size());
+  base[path_begin - 1] = ' ';
+
+  method = {base + start, method.size()};
+  uri = {base + path_begin, target_end - path_begin};
+  raw = {base + start, raw.size() - start};
+  return raw;
 }
-Result<RequestEntity, SocksException> RequestEntity::Parse(std::string_view s) {
-  RequestEntity entity;
 
-  // start line
-  {
-    const auto line_end = s.find("\r\n");
-    if (line_end == std::string_view::npos) {
-      return SocksException(
-          fmt::format("[tunnel] parse request failed, no start line, s={}", s));
+std::ostream &operator<<(std::ostream &os, const ResponseEntity &res) {
+  return os << fmt::format("{} {} {}", res.ver, res.status, res.reason);
+}
+std::string_view ResponseEntity::FindHeader(std::string_view name) const {
+  return tunnel::FindHeader(headers, name);
+}
+
+bool KeepAlive(const RequestEntity &req) {
+  // clients written against http/1.0 proxies still send Proxy-Connection
+  auto connection = req.FindHeader("Connection");
+  if (connection.empty()) connection = req.FindHeader("Proxy-Connection");
+  return KeepAlive(req.ver, connection);
+}
+bool KeepAlive(const ResponseEntity &res) {
+  return KeepAlive(res.ver, res.FindHeader("Connection"));
+}
+bool ExpectsContinue(const RequestEntity &req) {
+  return EqualsIgnoreCase(req.FindHeader("Expect"), "100-continue");
+}
+
+BodyFraming BodyFraming::Of(const RequestEntity &req) {
+  const auto encoding = req.FindHeader("Transfer-Encoding");
+  const auto length = ContentLength(req.headers);
+  if (!encoding.empty()) {
+    // both at once is how requests get smuggled, RFC 9112 section 6.3
+    if (!Chunked(encoding) || length) {
+      throw SocksException(fmt::format(
+          "[tunnel] invalid request framing, encoding={}", encoding));
     }
+    return {.kind = Kind::kChunked};
+  }
+  if (length && *length > 0) return {.kind = Kind::kLength, .length = *length};
+  return {};
+}
 
-    const std::regex re{R"(^([A-Z]+) ([^ ]+) (HTTP/\d\.\d)$)"};
-    std::match_results<std::string_view::const_iterator> match;
-    if (!std::regex_match(s.begin(), s.begin() + line_end, match, re)) {
-      return SocksException(
-          fmt::format("[tunnel] parse request failed, no start line, s={}", s));
+BodyFraming BodyFraming::Of(const ResponseEntity &res,
+                            std::string_view method) {
+  if (method == "HEAD" || res.status / 100 == 1 || res.status == 204 ||
+      res.status == 304) {
+    return {};
+  }
+  const auto encoding = res.FindHeader("Transfer-Encoding");
+  if (!encoding.empty()) {
+    return {.kind = Chunked(encoding) ? Kind::kChunked : Kind::kClose};
+  }
+  if (const auto length = ContentLength(res.headers)) {
+    if (*length == 0) return {};
+    return {.kind = Kind::kLength, .length = *length};
+  }
+  return {.kind = Kind::kClose};
+}
+
+CacheControl CacheControl::Of(const HeaderTable &headers) {
+  // delta-seconds, anything unparsable counts as 0 and thus as stale
+  const auto seconds = [](std::string_view v) {
+    if (v.size() >= 2 && v.front() == '"' && v.back() == '"') {
+      v = v.substr(1, v.size() - 2);
+    }
+    uint64_t value{0};
+    const auto end = v.data() + v.size();
+    const auto [ptr, ec] = std::from_chars(v.data(), end, value);
+    if (ec == std::errc::result_out_of_range) {
+      value = std::numeric_limits<uint32_t>::max();
+    } else if (v.empty() || ec != std::errc{} || ptr != end) {
+      value = 0;
     }
+    return std::chrono::seconds{
+        std::min<uint64_t>(value, std::numeric_limits<uint32_t>::max())};
+  };
 
-    entity.method = match.str(1);
-    entity.uri = match.str(2);
-    entity.ver = match.str(3);
+  CacheControl cc;
+  for (const auto &header : headers) {
+    if (!EqualsIgnoreCase(header.name, "Cache-Control")) continue;
+    auto list = header.value;
+    while (!list.empty()) {
+      // commas may appear inside quoted values, no-cache="a, b"
+      size_t end{0};
+      bool quoted{false};
+      for (; end < list.size() && (quoted || list[end] != ','); ++end) {
+        if (list[end] == '"') quoted = !quoted;
+      }
+      const auto directive = TrimSpace(list.substr(0, end));
+      list.remove_prefix(std::min(end + 1, list.size()));
 
-    s = s.substr(line_end + 2);
+      const auto eq = Find(directive, '=');
+      const auto name = TrimSpace(directive.substr(0, eq));
+      const auto value =
+          eq == npos ? std::string_view{} : TrimSpace(directive.substr(eq + 1));
+      if (EqualsIgnoreCase(name, "no-store")) {
+        cc.no_store = true;
+      } else if (EqualsIgnoreCase(name, "no-cache")) {
+        cc.no_cache = true;
+      } else if (EqualsIgnoreCase(name, "private")) {
+        cc.is_private = true;
+      } else if (EqualsIgnoreCase(name, "must-revalidate") ||
+                 EqualsIgnoreCase(name, "proxy-revalidate")) {
+        cc.must_revalidate = true;
+      } else if (EqualsIgnoreCase(name, "max-age")) {
+        cc.max_age = seconds(value);
+      } else if (EqualsIgnoreCase(name, "s-maxage")) {
+        cc.s_maxage = seconds(value);
+      }
+    }
   }
-  // headers
-  while (true) {
-    const auto line_end = s.find("\r\n");
-    if (line_end == std::string_view::npos) {
+  return cc;
+}
+
+std::optional<std::chrono::system_clock::time_point> ParseHttpDate(
+    std::string_view s) {
+  static constexpr std::string_view kMonths[] = {
+      "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  s = TrimSpace(s);
+  // Sun, 06 Nov 1994 08:49:37 GMT
+  if (s.size() != 29 || s[3] != ',' || s[4] != ' ' || s[7] != ' ' ||
+      s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':' ||
+      s.substr(25) != " GMT") {
+    return std::nullopt;
+  }
+  const auto number = [s](size_t pos, size_t len) -> std::optional<int> {
+    int value{0};
+    const auto begin = s.data() + pos;
+    const auto [ptr, ec] = std::from_chars(begin, begin + len, value);
+    if (ec != std::errc{} || ptr != begin + len) return std::nullopt;
+    return value;
+  };
+  const auto month = std::ranges::find(kMonths, s.substr(8, 3));
+  const auto day = number(5, 2);
+  const auto year = number(12, 4);
+  const auto hour = number(17, 2);
+  const auto minute = number(20, 2);
+  const auto second = number(23, 2);
+  if (month == std::end(kMonths) || !day || !year || !hour || !minute ||
+      !second || *hour > 23 || *minute > 59 || *second > 60) {
+    return std::nullopt;
+  }
+  const std::chrono::year_month_day date{
+      std::chrono::year{*year},
+      std::chrono::month{
+          static_cast<unsigned>(month - std::begin(kMonths) + 1)},
+      std::chrono::day{static_cast<unsigned>(*day)}};
+  if (!date.ok()) return std::nullopt;
+  return std::chrono::sys_days{date} + std::chrono::hours{*hour} +
+         std::chrono::minutes{*minute} + std::chrono::seconds{*second};
+}
+
+size_t ChunkedScanner::Feed(std::string_view data) {
+  size_t i{0};
+  const auto expect = [this](char c, char want, State next) {
+    state_ = c == want ? next : State::kInvalid;
+  };
+  while (i < data.size() && state_ != State::kDone &&
+         state_ != State::kInvalid) {
+    if (state_ == State::kData) {
+      const auto n = std::min<uint64_t>(remaining_, data.size() - i);
+      i += n;
+      remaining_ -= n;
+      if (remaining_ == 0) state_ = State::kDataCr;
+      continue;
+    }
+
+    const auto c = data[i++];
+    switch (state_) {
+      case State::kSize:
+        if (const auto v = HexValue(c); v >= 0 && digits_ < 16) {
+          remaining_ = remaining_ << 4 | static_cast<uint64_t>(v);
+          ++digits_;
+        } else if (digits_ == 0) {
+          state_ = State::kInvalid;
+        } else if (c == '\r') {
+          state_ = State::kSizeLf;
+        } else if (c == ';' || c == ' ' || c == '\t') {
+          state_ = State::kExtension;
+        } else {
+          state_ = State::kInvalid;
+        }
+        break;
+      case State::kExtension:
+        if (c == '\r') state_ = State::kSizeLf;
+        break;
+      case State::kSizeLf:
+        expect(c, '\n', remaining_ == 0 ? State::kTrailerStart : State::kData);
+        break;
+      case State::kDataCr:
+        expect(c, '\r', State::kDataLf);
+        break;
+      case State::kDataLf:
+        expect(c, '\n', State::kSize);
+        digits_ = 0;
+        break;
+      case State::kTrailerStart:
+        state_ = c == '\r' ? State::kLastLf : State::kTrailer;
+        break;
+      case State::kTrailer:
+        if (c == '\r') state_ = State::kTrailerLf;
+        break;
+      case State::kTrailerLf:
+        expect(c, '\n', State::kTrailerStart);
+        break;
+      case State::kLastLf:
+        expect(c, '\n', State::kDone);
+        break;
+      default:
+        break;
+    }
+  }
+  return i;
+}
+
+Result<RequestEntity, SocksException> RequestEntity::Parse(std::string_view s) {
+  RequestParser parser;
+  switch (parser.Feed(s)) {
+    case RequestParser::Status::kDone:
+      return std::move(parser.Entity());
+    case RequestParser::Status::kPartial:
       return SocksException(
           fmt::format("[tunnel] parse request failed, no header, s={}", s));
-    }
+    case RequestParser::Status::kInvalid:
+      break;
+  }
+  return SocksException(fmt::format("[tunnel] parse request failed, {}, s={}",
+                                    parser.Error(), s));
+}
+
+namespace {
 
-    const auto line = s.substr(0, line_end);
-    if (line.empty()) break;
+bool ParseStartLine(std::string_view line, RequestEntity &entity) {
+  const auto method_end = Find(line, ' ');
+  const auto uri_end = Find(line, ' ', method_end + 1);
+  if (method_end == npos || uri_end == npos) return false;
 
-    const std::regex re{"^([^:]+): (.*)$"};
-    std::match_results<std::string_view::const_iterator> match;
-    if (!std::regex_match(line.begin(), line.end(), match, re)) {
-      return SocksException(fmt::format(
-          "[tunnel] parse request failed, invalid header, s={}", s));
+  entity.method = line.substr(0, method_end);
+  entity.uri = line.substr(method_end + 1, uri_end - method_end - 1);
+  entity.ver = line.substr(uri_end + 1);
+  return !entity.method.empty() && !entity.uri.empty() &&
+         std::ranges::all_of(entity.method,
+                             [](char c) { return c >= 'A' && c <= 'Z'; }) &&
+         IsVersion(entity.ver);
+}
+
+// "HTTP/1.1 200 OK", the reason phrase may be empty
+bool ParseStartLine(std::string_view line, ResponseEntity &entity) {
+  if (line.size() < 12 || line[8] != ' ' ||
+      (line.size() > 12 && line[12] != ' ')) {
+    return false;
+  }
+  entity.ver = line.substr(0, 8);
+  const auto status = line.substr(9, 3);
+  if (!IsVersion(entity.ver) || !std::ranges::all_of(status, IsDigit)) {
+    return false;
+  }
+  std::from_chars(status.data(), status.data() + 3, entity.status);
+  entity.reason = line.size() > 13 ? line.substr(13) : std::string_view{};
+  return true;
+}
+
+void Clear(RequestEntity &entity) {
+  entity.method = {};
+  entity.uri = {};
+  entity.ver = {};
+  entity.headers.clear();
+  entity.raw = {};
+}
+
+void Clear(ResponseEntity &entity) {
+  entity.ver = {};
+  entity.status = 0;
+  entity.reason = {};
+  entity.headers.clear();
+  entity.raw = {};
+}
+
+}  // namespace
+
+template <typename T>
+typename HeadParser<T>::Status HeadParser<T>::Feed(std::string_view data) {
+  if (data.data() != base_) {
+    Reset();
+    base_ = data.data();
+  }
+  while (true) {
+    const auto nl = Find(data, '\n', scanned_);
+    if (nl == npos) {
+      scanned_ = data.size();
+      if (scanned_ >= kMaxHeadSize) return Fail("head too large");
+      return Status::kPartial;
+    }
+    scanned_ = nl + 1;
+    if (scanned_ > kMaxHeadSize) return Fail("head too large");
+    if (nl == line_start_ || data[nl - 1] != '\r') {
+      return Fail("bare line feed");
     }
 
-    entity.headers.emplace(match.str(1), match.str(2));
-    s = s.substr(line_end + 2);
+    const auto line = data.substr(line_start_, nl - 1 - line_start_);
+    line_start_ = scanned_;
+    if (start_line_) {
+      start_line_ = false;
+      if (!ParseStartLine(line, entity_)) return Fail("no start line");
+      continue;
+    }
+    if (line.empty()) {
+      entity_.raw = data.substr(0, scanned_);
+      return Status::kDone;
+    }
+    if (!ParseHeader(line)) return Status::kInvalid;
   }
+}
 
-  return entity;
+template <typename T>
+void HeadParser<T>::Reset() {
+  Clear(entity_);
+  base_ = nullptr;
+  line_start_ = 0;
+  scanned_ = 0;
+  start_line_ = true;
+  error_ = {};
 }
+
+template <typename T>
+typename HeadParser<T>::Status HeadParser<T>::Fail(std::string_view error) {
+  error_ = error;
+  return Status::kInvalid;
+}
+
+template <typename T>
+bool HeadParser<T>::ParseHeader(std::string_view line) {
+  const auto colon = Find(line, ':');
+  if (colon == npos || colon == 0) {
+    error_ = "invalid header";
+    return false;
+  }
+  if (entity_.headers.size() == kMaxHeaders) {
+    error_ = "too many headers";
+    return false;
+  }
+
+  // no whitespace is allowed between field name and colon, which also
+  // rejects obsolete line folding
+  const auto name = line.substr(0, colon);
+  if (Find(name, ' ') != npos || Find(name, '\t') != npos) {
+    error_ = "invalid header";
+    return false;
+  }
+  entity_.headers.push_back({name, TrimSpace(line.substr(colon + 1))});
+  return true;
+}
+
+template class HeadParser<RequestEntity>;
+template class HeadParser<ResponseEntity>;
+
 }  // namespace socks::tunnel
@@ -3,37 +3,194 @@
 // Created by suun 2022/4/6.
 //
 
-#include <map>
+#include <chrono>
+#include <cstdint>
+#include <optional>
 #include <ostream>
+#include <span>
 #include <string>
 #include <string_view>
 
 #include "utility/result.h"
+#include "utility/small_vector.h"
 
 namespace socks::tunnel {
 
+// All views point into the string the uri was parsed from.
 struct Uri {
   uint16_t port{};
-  std::string scheme;
-  std::string host;
-  std::string path;
+  std::string_view scheme;
+  std::string_view host;
+  std::string_view path;
 
   static Uri Parse(std::string_view s);
 
   friend std::ostream &operator<<(std::ostream &os, const Uri &uri);
 };
 
+struct Header {
+  std::string_view name;
+  std::string_view value;
+};
+
+using HeaderTable = SmallVector<Header, 24>;
+
+// All views point into the buffer the request head was parsed from.
 struct RequestEntity {
-  std::string method;
-  std::string uri;
-  std::string ver;
-  std::multimap<std::string, std::string> headers;
+  std::string_view method;
+  std::string_view uri;
+  std::string_view ver;
+  HeaderTable headers;
+  // the whole head, terminated by the empty line
+  std::string_view raw;
 
   static Result<RequestEntity, SocksException> Parse(std::string_view s);
 
   friend std::ostream &operator<<(std::ostream &os, const RequestEntity &req);
   RequestEntity() = default;
 
-  [[nodiscard]] std::string Dump() const;
+  // Case-insensitive lookup of the first header called `name`, empty when
+  // absent.
+  [[nodiscard]] std::string_view FindHeader(std::string_view name) const;
+
+  // Rewrites an absolute-form start line into origin-form inside `head`,
+  // the buffer `raw` was parsed from, and returns the rewritten head. The
+  // views into the request target are invalidated.
+  std::string_view ToOriginForm(std::span<char> head);
+};
+
+// All views point into the buffer the response head was parsed from.
+struct ResponseEntity {
+  std::string_view ver;
+  uint16_t status{0};
+  std::string_view reason;
+  HeaderTable headers;
+  // the whole head, terminated by the empty line
+  std::string_view raw;
+
+  friend std::ostream &operator<<(std::ostream &os, const ResponseEntity &res);
+
+  // Case-insensitive lookup of the first header called `name`, empty when
+  // absent.
+  [[nodiscard]] std::string_view FindHeader(std::string_view name) const;
+};
+
+bool EqualsIgnoreCase(std::string_view a, std::string_view b);
+// Whether the comma separated `list` holds `token`, ignoring case, as in
+// Connection: close.
+bool HasToken(std::string_view list, std::string_view token);
+
+// Whether the sender of a head keeps the connection open after the message,
+// from its version and Connection header.
+bool KeepAlive(const RequestEntity &req);
+bool KeepAlive(const ResponseEntity &res);
+// Whether the client waits for 100 Continue before sending the body.
+bool ExpectsContinue(const RequestEntity &req);
+
+// How the end of the body following a head is found, RFC 9112 section 6.
+struct BodyFraming {
+  enum class Kind : uint8_t {
+    kNone,
+    kLength,
+    kChunked,
+    // delimited by the sender closing the connection
+    kClose,
+  };
+
+  Kind kind{Kind::kNone};
+  uint64_t length{0};
+
+  // Throw SocksException on conflicting or malformed length headers.
+  static BodyFraming Of(const RequestEntity &req);
+  // `method` is the one of the request being answered.
+  static BodyFraming Of(const ResponseEntity &res, std::string_view method);
+};
+
+// The Cache-Control directives of a message, RFC 9111 section 5.2. Every
+// Cache-Control header counts, unknown directives are ignored.
+struct CacheControl {
+  bool no_store{false};
+  bool no_cache{false};
+  bool is_private{false};
+  bool must_revalidate{false};
+  std::optional<std::chrono::seconds> max_age;
+  std::optional<std::chrono::seconds> s_maxage;
+
+  static CacheControl Of(const HeaderTable &headers);
+};
+
+// Parses an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT". The obsolete
+// formats are not understood, a cache takes them for a date in the past.
+std::optional<std::chrono::system_clock::time_point> ParseHttpDate(
+    std::string_view s);
+
+// Finds the end of a chunked body without decoding it, the bytes are
+// relayed as they are.
+class ChunkedScanner {
+ public:
+  // Scans the next bytes of the body and returns how many of them belong to
+  // it, less than `data.size()` only once the body ended or turned invalid.
+  size_t Feed(std::string_view data);
+
+  [[nodiscard]] bool Done() const { return state_ == State::kDone; }
+  [[nodiscard]] bool Invalid() const { return state_ == State::kInvalid; }
+
+ private:
+  enum class State : uint8_t {
+    kSize,
+    kExtension,
+    kSizeLf,
+    kData,
+    kDataCr,
+    kDataLf,
+    kTrailerStart,
+    kTrailer,
+    kTrailerLf,
+    kLastLf,
+    kDone,
+    kInvalid,
+  };
+
+  State state_{State::kSize};
+  uint64_t remaining_{0};
+  size_t digits_{0};
+};
+
+// Resumable message head parser, each call continues scanning where the
+// previous one stopped.
+template <typename T>
+class HeadParser {
+ public:
+  enum class Status { kPartial, kDone, kInvalid };
+
+  // heads past either limit are invalid, RFC 9112 leaves the limits to the
+  // recipient
+  static constexpr size_t kMaxHeadSize = 64 * 1024;
+  static constexpr size_t kMaxHeaders = 128;
+
+  // `data` holds every byte received so far, scanning starts over when it
+  // moved to another address since the previous call.
+  Status Feed(std::string_view data);
+  void Reset();
+
+  [[nodiscard]] T &Entity() { return entity_; }
+  [[nodiscard]] std::string_view Error() const { return error_; }
+
+ private:
+  Status Fail(std::string_view error);
+  bool ParseHeader(std::string_view line);
+
+  T entity_;
+  const char *base_{nullptr};
+  size_t line_start_{0};
+  size_t scanned_{0};
+  bool start_line_{true};
+  std::string_view error_;
 };
+
+using RequestParser = HeadParser<RequestEntity>;
+using ResponseParser = HeadParser<ResponseEntity>;
+extern template class HeadParser<RequestEntity>;
+extern template class HeadParser<ResponseEntity>;
+
 }  // namespace socks::tunnel
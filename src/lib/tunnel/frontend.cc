@@ -0,0 +1,86 @@
+#include "tunnel/frontend.h"
+
+#include <asio.hpp>
+
+#include "utility/log.h"
+#include "utility/trace.h"
+
+namespace socks::tunnel {
+
+Frontend::Frontend(uint16_t port, const FrontendConfig &config)
+    : frontend_{config},
+      relay_{config.relay},
+      resolver_{config.resolver},
+      conns_{config.admission},
+      reactor_{config.threads, config.pin_threads, config.io_backend},
+      upgrade_{config.upgrade} {
+  if (!ZeroCopySupported(frontend_.zero_copy)) {
+    SPDLOG_WARN("[tunnel] zero copy not supported, fallback to copy");
+    frontend_.zero_copy = ZeroCopyMode::kNone;
+  }
+  if (frontend_.zero_copy == ZeroCopyMode::kSockMap) {
+    sockmap_ = SockMap::Create();
+    if (!sockmap_) frontend_.zero_copy = ZeroCopyMode::kSplice;
+  }
+
+  // nothing is accepted before Start, the derived class is complete then
+  reactor_.Listen(
+      asio::ip::tcp::endpoint{asio::ip::tcp::v4(), port},
+      [this](Reactor::Shard &shard, size_t idx, asio::ip::tcp::socket socket) {
+        Accept(shard, idx, std::move(socket));
+      },
+      &conns_, upgrade_.Inherited());
+  if (frontend_.metrics.port != 0) {
+    metrics_ = std::make_unique<MetricsServer>(
+        frontend_.metrics.port, [this] { return reactor_.Metrics(); });
+  }
+}
+
+Frontend::~Frontend() { Stop(); }
+
+void Frontend::Start() {
+  relay_.Start();
+  reactor_.Start();
+  if (metrics_) metrics_->Start();
+  upgrade_.Start([this] { return reactor_.ListeningHandles(); },
+                 [this] { reactor_.StopAccepting(); },
+                 [this] { return conns_.Size(); });
+}
+
+void Frontend::Stop() {
+  // it reads the shards
+  metrics_.reset();
+  reactor_.Stop();
+}
+
+void Frontend::Reject(asio::ip::tcp::socket &socket) {
+  asio::error_code err;
+  socket.close(err);
+}
+
+void Frontend::Accept(Reactor::Shard &shard, size_t idx,
+                      asio::ip::tcp::socket socket) {
+  asio::error_code err;
+  const auto client = socket.remote_endpoint(err);
+  if (err) return;
+  auto [verdict, ticket] = conns_.Admit(client.address());
+  if (!ticket) {
+    SPDLOG_DEBUG("[tunnel] connection rejected, client={}, verdict={}",
+                 client.address().to_string(), static_cast<int>(verdict));
+    Trace(TraceEvent::kReject, idx, static_cast<uint64_t>(verdict));
+    shard.metrics.rejected.Add();
+    Reject(socket);
+    return;
+  }
+  Trace(TraceEvent::kAccept, idx, client.port());
+
+  co_spawn(
+      shard.ctx,
+      [this, &shard, idx, socket = std::move(socket),
+       ticket = std::move(ticket)]() mutable -> asio::awaitable<void> {
+        co_await Serve(shard, idx, std::move(socket));
+      },
+      asio::detached);
+}
+
+}  // namespace socks::tunnel
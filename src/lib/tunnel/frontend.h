@@ -0,0 +1,103 @@
+#ifndef QUIC_SOCKS_TUNNEL_FRONTEND_H_
+#define QUIC_SOCKS_TUNNEL_FRONTEND_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/ip/tcp.hpp>
+#include <memory>
+
+#include "observer/conn_manager.h"
+#include "observer/metrics.h"
+#include "observer/network_observer.h"
+#include "tunnel/dns_resolver.h"
+#include "tunnel/handoff.h"
+#include "tunnel/happy_eyeballs.h"
+#include "tunnel/reactor.h"
+#include "tunnel/relay.h"
+#include "tunnel/uring.h"
+#include "tunnel/zero_copy.h"
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+// How a proxy frontend runs, accepts its clients and reaches remotes, the
+// same for every protocol it speaks.
+struct FrontendConfig {
+  // io threads, each runs its own reactor shard, 0 uses one per core
+  size_t threads{0};
+  // pin every io thread to its own cpu
+  bool pin_threads{false};
+  // how client connections are accepted
+  IoBackend io_backend{IoBackend::kEpoll};
+  // relay established tunnels inside the kernel, observers only receive
+  // byte counts for such tunnels
+  ZeroCopyMode zero_copy{ZeroCopyMode::kNone};
+  // queueing of observer events between io threads and the relay thread,
+  // and the traffic capture kept by the relay
+  RelayConfig relay;
+  // nameservers and caching of remote host lookups
+  ResolverConfig resolver;
+  // racing of connects to remotes with several addresses
+  ConnectConfig connect;
+  // `header` bounds what a client sends ahead of its request, `idle`
+  // tunnels
+  TimeoutConfig timeouts;
+  // per shard counters and setup latencies, scraped over http
+  MetricsConfig metrics;
+  // limits on client connections
+  AdmissionConfig admission;
+  // takeover of the listening sockets from a running instance and by the
+  // next one
+  UpgradeConfig upgrade;
+};
+
+// Listens on a port across the shards of a reactor, admits the client
+// connections accepted and serves each on the thread of its shard. The
+// proxies derive from it and implement Serve.
+class Frontend : NonCopyable {
+ public:
+  void Start();
+  // observers have to be registered before Start
+  void Register(NetworkObserver *observer) { relay_.Register(observer); }
+  // retained traffic, null unless `relay.capture.dir` is set
+  [[nodiscard]] CaptureStore *Capture() const { return relay_.Capture(); }
+  // Blocks until another instance took over by `upgrade.path` and the
+  // sessions left drained, forever without upgrades.
+  void Wait() { upgrade_.Wait(); }
+
+ protected:
+  Frontend(uint16_t port, const FrontendConfig &config);
+  virtual ~Frontend();
+
+  // Stops the shards. Derived classes call it first thing when destroyed,
+  // their sessions refer to their members.
+  void Stop();
+  // Serves a connection admitted on `shard`, `idx` is unique across the
+  // shards.
+  virtual asio::awaitable<void> Serve(Reactor::Shard &shard, size_t idx,
+                                      asio::ip::tcp::socket socket) = 0;
+  // Turns away a connection admission refused, by closing it unless a
+  // protocol can say why.
+  virtual void Reject(asio::ip::tcp::socket &socket);
+
+  // `zero_copy` is lowered to what the platform supports
+  FrontendConfig frontend_;
+  NetworkRelay relay_;
+  DnsResolver resolver_;
+  // outlives the reactor, sessions hold tickets
+  ConnManager conns_;
+  // null unless `zero_copy` is kSockMap
+  std::unique_ptr<SockMap> sockmap_;
+  // null unless `metrics.port` is set
+  std::unique_ptr<MetricsServer> metrics_;
+  // stopped first, sessions refer to the members above
+  Reactor reactor_;
+  // calls into the reactor and the connections from its own thread
+  Upgrade upgrade_;
+
+ private:
+  void Accept(Reactor::Shard &shard, size_t idx, asio::ip::tcp::socket socket);
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_FRONTEND_H_
@@ -0,0 +1,281 @@
+#include "tunnel/handoff.h"
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+
+#include "utility/log.h"
+
+namespace socks::tunnel {
+
+#ifdef __linux__
+
+namespace {
+
+// sent ahead of the listening sockets, the count follows
+constexpr std::array<char, 4> kMagic{'Q', 'S', 'U', '1'};
+constexpr char kCommit = 'c';
+constexpr size_t kMaxListeners = 256;
+// handing the sockets over takes well below this
+constexpr auto kHandoffTimeout = std::chrono::seconds{10};
+constexpr auto kDrainPoll = std::chrono::milliseconds{100};
+
+struct Header {
+  std::array<char, 4> magic;
+  uint32_t count;
+};
+
+void SetTimeout(int fd, std::chrono::seconds timeout) {
+  timeval tv{.tv_sec = static_cast<time_t>(timeout.count()), .tv_usec = 0};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Whether `fd` is a listening TCP socket, anything else handed over means
+// the peer is not a compatible instance.
+bool IsListener(int fd) {
+  int type{0}, protocol{0}, listening{0};
+  socklen_t len = sizeof(int);
+  if (::getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0 ||
+      type != SOCK_STREAM) {
+    return false;
+  }
+  len = sizeof(int);
+  if (::getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) != 0 ||
+      protocol != IPPROTO_TCP) {
+    return false;
+  }
+  len = sizeof(int);
+  if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 ||
+      listening == 0) {
+    return false;
+  }
+  sockaddr_storage addr{};
+  len = sizeof(addr);
+  return ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) == 0 &&
+         (addr.ss_family == AF_INET || addr.ss_family == AF_INET6);
+}
+
+// Returns false if `path` does not fit a unix socket address.
+bool Address(const std::string &path, sockaddr_un &addr) {
+  addr = sockaddr_un{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) return false;
+  std::memcpy(addr.sun_path, path.data(), path.size());
+  return true;
+}
+
+}  // namespace
+
+Upgrade::Upgrade(UpgradeConfig config) : config_{std::move(config)} {
+  if (config_.path.empty()) return;
+  sockaddr_un addr{};
+  if (!Address(config_.path, addr)) {
+    SPDLOG_WARN("[upgrade] path too long, path={}", config_.path);
+    config_.path.clear();
+    return;
+  }
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return;
+  if (::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) !=
+      0) {
+    // nobody serves the path, or a crashed instance left it behind
+    SPDLOG_INFO("[upgrade] no running instance, path={}", config_.path);
+    ::close(fd);
+    return;
+  }
+  predecessor_ = fd;
+  SetTimeout(predecessor_, kHandoffTimeout);
+  Receive();
+}
+
+Upgrade::~Upgrade() {
+  thread_.request_stop();
+  // wakes the thread blocked in accept
+  if (listen_fd_ >= 0) ::shutdown(listen_fd_, SHUT_RDWR);
+  if (thread_.joinable()) thread_.join();
+  if (listen_fd_ >= 0) {
+    ::close(listen_fd_);
+    // after retiring the path belongs to the new instance
+    if (!retired_) ::unlink(config_.path.c_str());
+  }
+  if (predecessor_ >= 0) ::close(predecessor_);
+}
+
+void Upgrade::Receive() {
+  Header header{};
+  iovec iov{.iov_base = &header, .iov_len = sizeof(header)};
+  alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int) * kMaxListeners)>
+      control{};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  const auto n = ::recvmsg(predecessor_, &msg, MSG_CMSG_CLOEXEC);
+  for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    const auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const auto *data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+    inherited_.insert(inherited_.end(), data, data + count);
+  }
+  if (n == static_cast<ssize_t>(sizeof(header)) && header.magic == kMagic &&
+      header.count == inherited_.size() && (msg.msg_flags & MSG_CTRUNC) == 0 &&
+      std::ranges::all_of(inherited_, IsListener)) {
+    SPDLOG_INFO("[upgrade] took over listening sockets, count={}",
+                inherited_.size());
+    return;
+  }
+
+  SPDLOG_WARN("[upgrade] bad handoff, starting fresh, path={}", config_.path);
+  for (const int fd : inherited_) ::close(fd);
+  inherited_.clear();
+  ::close(std::exchange(predecessor_, -1));
+}
+
+void Upgrade::Start(Listeners listeners, StopAccepting stop_accepting,
+                    Sessions sessions) {
+  listeners_ = std::move(listeners);
+  stop_accepting_ = std::move(stop_accepting);
+  sessions_ = std::move(sessions);
+  if (predecessor_ >= 0) {
+    // the old instance stops accepting on this, a send failing means it is
+    // gone already
+    ::send(predecessor_, &kCommit, 1, MSG_NOSIGNAL);
+    ::close(std::exchange(predecessor_, -1));
+  }
+  if (config_.path.empty()) return;
+
+  sockaddr_un addr{};
+  Address(config_.path, addr);
+  listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  ::unlink(config_.path.c_str());
+  if (listen_fd_ < 0 ||
+      ::bind(listen_fd_, reinterpret_cast<const sockaddr *>(&addr),
+             sizeof(addr)) != 0 ||
+      ::listen(listen_fd_, 1) != 0) {
+    SPDLOG_WARN("[upgrade] listen failed, path={}, errno={}", config_.path,
+                errno);
+    if (listen_fd_ >= 0) ::close(std::exchange(listen_fd_, -1));
+    return;
+  }
+  thread_ = std::jthread([this](const std::stop_token &token) { Serve(token); });
+}
+
+void Upgrade::Serve(const std::stop_token &token) {
+  // the listening socket, then the instances handed the sockets that have
+  // neither committed nor given up yet. Any of them may commit, however
+  // long it takes, and the first commit retires this instance.
+  std::vector<pollfd> fds{{.fd = listen_fd_, .events = POLLIN}};
+  while (!token.stop_requested()) {
+    if (::poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (size_t i = fds.size() - 1; i > 0; --i) {
+      if (fds[i].revents == 0) continue;
+      char reply{0};
+      const bool committed =
+          ::recv(fds[i].fd, &reply, 1, MSG_DONTWAIT) == 1 && reply == kCommit;
+      ::close(fds[i].fd);
+      fds.erase(fds.begin() + static_cast<ptrdiff_t>(i));
+      if (committed) {
+        for (size_t j = 1; j < fds.size(); ++j) ::close(fds[j].fd);
+        Retire();
+        return;
+      }
+      SPDLOG_WARN("[upgrade] new instance gave up, serving on");
+    }
+    if ((fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) break;
+    if ((fds[0].revents & POLLIN) == 0) continue;
+    const int conn = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+      break;
+    }
+    if (Handoff(conn)) {
+      fds.push_back({.fd = conn, .events = POLLIN});
+    } else {
+      ::close(conn);
+    }
+  }
+  for (size_t i = 1; i < fds.size(); ++i) ::close(fds[i].fd);
+}
+
+bool Upgrade::Handoff(int conn) {
+  SetTimeout(conn, kHandoffTimeout);
+  const auto fds = listeners_();
+  if (fds.empty() || fds.size() > kMaxListeners) return false;
+
+  Header header{.magic = kMagic, .count = static_cast<uint32_t>(fds.size())};
+  iovec iov{.iov_base = &header, .iov_len = sizeof(header)};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  auto *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  if (::sendmsg(conn, &msg, MSG_NOSIGNAL) !=
+      static_cast<ssize_t>(sizeof(header))) {
+    return false;
+  }
+  // both instances accept until the new one commits
+  SPDLOG_INFO("[upgrade] handed over listening sockets, count={}", fds.size());
+  return true;
+}
+
+void Upgrade::Retire() {
+  stop_accepting_();
+  const auto deadline = std::chrono::steady_clock::now() + config_.drain;
+  size_t left = sessions_();
+  SPDLOG_INFO("[upgrade] replaced, draining, sessions={}", left);
+  while (left > 0 && std::chrono::steady_clock::now() < deadline &&
+         !thread_.get_stop_token().stop_requested()) {
+    std::this_thread::sleep_for(kDrainPoll);
+    left = sessions_();
+  }
+  SPDLOG_INFO("[upgrade] retired, sessions left={}", left);
+  std::lock_guard lock{mutex_};
+  retired_ = true;
+  retired_cv_.notify_all();
+}
+
+#else
+
+Upgrade::Upgrade(UpgradeConfig config) : config_{std::move(config)} {
+  if (!config_.path.empty()) {
+    SPDLOG_WARN("[upgrade] not supported on this platform");
+  }
+}
+
+Upgrade::~Upgrade() = default;
+
+void Upgrade::Start(Listeners listeners, StopAccepting stop_accepting,
+                    Sessions sessions) {}
+
+#endif
+
+void Upgrade::Wait() {
+  std::unique_lock lock{mutex_};
+  retired_cv_.wait(lock, [this] { return retired_; });
+}
+
+}  // namespace socks::tunnel
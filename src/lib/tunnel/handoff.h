@@ -0,0 +1,83 @@
+#ifndef QUIC_SOCKS_TUNNEL_HANDOFF_H_
+#define QUIC_SOCKS_TUNNEL_HANDOFF_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+struct UpgradeConfig {
+  // unix socket a running instance hands its listening sockets over on,
+  // empty disables upgrades
+  std::string path;
+  // how long a replaced instance lets its sessions finish before it retires
+  std::chrono::seconds drain{30};
+};
+
+// Replaces a running instance without closing its port. The new process
+// connects to `path` and receives the listening sockets of the old one with
+// SCM_RIGHTS, both accept from the same sockets until the new one commits.
+// The old one then stops accepting and drains its sessions, connections
+// waiting in the backlog are accepted by the new one. The old one retires
+// on the first commit it sees, however late, and a new process that dies
+// before committing leaves it serving as before. Sockets received are only
+// taken over if each is a listening TCP socket.
+//
+// Established sessions are not handed over: they keep their buffers and
+// parser state in the old process until they close or the drain expires.
+class Upgrade : NonCopyable {
+ public:
+  using Listeners = std::function<std::vector<int>()>;
+  using StopAccepting = std::function<void()>;
+  using Sessions = std::function<size_t()>;
+
+  // Takes the listening sockets over from the instance serving on `path`,
+  // if there's one.
+  explicit Upgrade(UpgradeConfig config);
+  ~Upgrade();
+
+  // Listening sockets received from the old instance, empty for a fresh
+  // start. They belong to whoever listens on them from then on.
+  [[nodiscard]] std::span<const int> Inherited() const { return inherited_; }
+
+  // Commits the takeover, if any, and serves the next instance on `path`.
+  // `listeners` are handed to it, then `stop_accepting` is called and the
+  // instance waits for `sessions` to reach 0. The callbacks run on a thread
+  // of the upgrade.
+  void Start(Listeners listeners, StopAccepting stop_accepting,
+             Sessions sessions);
+  // Blocks until a new instance took over and the sessions drained.
+  void Wait();
+
+ private:
+  void Receive();
+  void Serve(const std::stop_token &token);
+  // Sends the listening sockets over `conn`, returns whether they went out.
+  bool Handoff(int conn);
+  void Retire();
+
+  UpgradeConfig config_;
+  // connection to the old instance until committed, -1 otherwise
+  int predecessor_{-1};
+  std::vector<int> inherited_;
+  int listen_fd_{-1};
+  Listeners listeners_;
+  StopAccepting stop_accepting_;
+  Sessions sessions_;
+  std::mutex mutex_;
+  std::condition_variable retired_cv_;
+  bool retired_{false};
+  std::jthread thread_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_HANDOFF_H_
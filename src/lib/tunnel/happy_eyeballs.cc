@@ -0,0 +1,134 @@
+#include "tunnel/happy_eyeballs.h"
+
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
+
+#include <asio.hpp>
+#include <memory>
+#include <optional>
+
+#include "utility/log.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+using FastOpenConnect =
+    asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>;
+#endif
+
+// State shared by the attempts of one race and the coroutine running it.
+struct Race {
+  explicit Race(const asio::any_io_executor &executor) : wake{executor} {}
+
+  std::vector<std::shared_ptr<asio::ip::tcp::socket>> attempts;
+  std::optional<asio::ip::tcp::socket> winner;
+  size_t failed{0};
+  asio::error_code error{asio::error::host_not_found};
+  // cancelled whenever an attempt completes
+  asio::steady_timer wake;
+
+  [[nodiscard]] bool Settled() const {
+    return winner || failed == attempts.size();
+  }
+};
+
+void StartAttempt(const std::shared_ptr<Race> &race,
+                  const asio::ip::tcp::endpoint &endpoint,
+                  [[maybe_unused]] const ConnectConfig &config) {
+  auto socket =
+      std::make_shared<asio::ip::tcp::socket>(race->wake.get_executor());
+  race->attempts.emplace_back(socket);
+
+  asio::error_code err;
+  socket->open(endpoint.protocol(), err);
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+  if (!err && config.fast_open) {
+    // best effort, a plain handshake follows when refused
+    asio::error_code ignored;
+    socket->set_option(FastOpenConnect(true), ignored);
+  }
+#endif
+  if (err) {
+    ++race->failed;
+    race->error = err;
+    return;
+  }
+  // requests leave in whole pieces, see Reactor::Accept
+  asio::error_code ignored;
+  socket->set_option(asio::ip::tcp::no_delay(true), ignored);
+
+  socket->async_connect(endpoint, [race, socket, endpoint](
+                                      const asio::error_code &err) {
+    if (race->winner) return;
+    if (err) {
+      SPDLOG_DEBUG("[tunnel] connect attempt failed, endpoint={}:{}, err={}",
+                   endpoint.address().to_string(), endpoint.port(),
+                   err.message());
+      ++race->failed;
+      race->error = err;
+    } else {
+      race->winner.emplace(std::move(*socket));
+    }
+    race->wake.cancel();
+  });
+}
+
+}  // namespace
+
+std::vector<asio::ip::tcp::endpoint> InterleaveFamilies(
+    std::vector<asio::ip::tcp::endpoint> endpoints, bool prefer_ipv6) {
+  std::vector<asio::ip::tcp::endpoint> preferred, others;
+  for (auto &&endpoint : endpoints) {
+    (endpoint.address().is_v6() == prefer_ipv6 ? preferred : others)
+        .emplace_back(endpoint);
+  }
+  if (preferred.empty()) return others;
+
+  endpoints.clear();
+  for (size_t i = 0; i < std::max(preferred.size(), others.size()); ++i) {
+    if (i < preferred.size()) endpoints.emplace_back(preferred[i]);
+    if (i < others.size()) endpoints.emplace_back(others[i]);
+  }
+  return endpoints;
+}
+
+asio::awaitable<asio::ip::tcp::socket> AsyncConnect(
+    std::span<const asio::ip::tcp::endpoint> endpoints,
+    const ConnectConfig &config) {
+  const auto executor = co_await asio::this_coro::executor;
+  auto race = std::make_shared<Race>(executor);
+  const auto deadline = std::chrono::steady_clock::now() + config.timeout;
+
+  asio::error_code err;
+  for (const auto &endpoint : endpoints) {
+    StartAttempt(race, endpoint, config);
+    if (race->winner) break;
+    if (race->Settled()) continue;
+    // a failing attempt wakes the race early, the next starts right away
+    race->wake.expires_at(std::min(
+        std::chrono::steady_clock::now() + config.attempt_delay, deadline));
+    co_await race->wake.async_wait(
+        asio::redirect_error(asio::use_awaitable, err));
+    if (race->winner || std::chrono::steady_clock::now() >= deadline) break;
+  }
+  while (!race->Settled() && std::chrono::steady_clock::now() < deadline) {
+    race->wake.expires_at(deadline);
+    co_await race->wake.async_wait(
+        asio::redirect_error(asio::use_awaitable, err));
+  }
+
+  // closing cancels the pending attempts, their handlers see the winner
+  for (auto &attempt : race->attempts) {
+    attempt->close(err);
+  }
+  if (race->winner) {
+    co_return std::move(*race->winner);
+  }
+  if (!race->Settled()) race->error = asio::error::timed_out;
+  throw asio::system_error{race->error};
+}
+
+}  // namespace socks::tunnel
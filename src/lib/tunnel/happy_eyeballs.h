@@ -0,0 +1,40 @@
+#ifndef QUIC_SOCKS_TUNNEL_HAPPY_EYEBALLS_H_
+#define QUIC_SOCKS_TUNNEL_HAPPY_EYEBALLS_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/ip/tcp.hpp>
+#include <chrono>
+#include <span>
+#include <vector>
+
+namespace socks::tunnel {
+
+struct ConnectConfig {
+  // head start of an attempt before the next address is tried, RFC 8305
+  // section 5 recommends 250ms
+  std::chrono::milliseconds attempt_delay{250};
+  // for the whole race, the kernel gives up on a single syn much later
+  std::chrono::seconds timeout{10};
+  bool prefer_ipv6{true};
+  // Sends the first write in the syn to origins that handed out a cookie
+  // before, needs net.ipv4.tcp_fastopen to allow client use. Connects then
+  // complete at once and failures surface on that first write instead.
+  bool fast_open{false};
+};
+
+// Orders `endpoints` alternating between address families, the preferred
+// family first, RFC 8305 section 4.
+std::vector<asio::ip::tcp::endpoint> InterleaveFamilies(
+    std::vector<asio::ip::tcp::endpoint> endpoints, bool prefer_ipv6);
+
+// Connects to the first of `endpoints` to answer. Attempts start
+// `attempt_delay` apart, or right away once the previous one failed, and the
+// losers are cancelled. Throws asio::system_error with the last error when
+// every attempt failed or timed out.
+asio::awaitable<asio::ip::tcp::socket> AsyncConnect(
+    std::span<const asio::ip::tcp::endpoint> endpoints,
+    const ConnectConfig &config);
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_HAPPY_EYEBALLS_H_
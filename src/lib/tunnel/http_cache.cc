@@ -0,0 +1,416 @@
+#include "tunnel/http_cache.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <asio/associated_executor.hpp>
+#include <asio/async_result.hpp>
+#include <asio/post.hpp>
+#include <asio/use_awaitable.hpp>
+#include <charconv>
+
+namespace socks::tunnel {
+
+namespace {
+
+// how long lookups of a key answered with something not to be stored go
+// straight to the origin
+constexpr auto kPassTtl = std::chrono::seconds{10};
+constexpr size_t kMaxPasses = 4096;
+// share of a shard the protected segment may take
+constexpr size_t kProtectPercent = 80;
+// cap of the lifetime guessed from Last-Modified, RFC 9111 section 4.2.2
+constexpr auto kMaxHeuristic = std::chrono::hours{24};
+
+// Statuses stored without explicit freshness, RFC 9110 section 15.1. Partial
+// content is left out, ranges aren't combined.
+bool HeuristicallyCacheable(uint16_t status) {
+  switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Hop-by-hop headers, those `res` names in Connection among them, and Age
+// which is worked out anew for every hit.
+bool Stored(const ResponseEntity &res, std::string_view name) {
+  static constexpr std::string_view kDropped[] = {
+      "Connection",          "Keep-Alive", "Proxy-Connection",
+      "Proxy-Authenticate",  "TE",         "Upgrade",
+      "Proxy-Authorization", "Age"};
+  const auto dropped = [name](std::string_view hop) {
+    return EqualsIgnoreCase(name, hop);
+  };
+  const auto nominated = [name](const Header &header) {
+    return EqualsIgnoreCase(header.name, "Connection") &&
+           HasToken(header.value, name);
+  };
+  return std::ranges::none_of(kDropped, dropped) &&
+         std::ranges::none_of(res.headers, nominated);
+}
+
+// A 304 can't change how the stored body is framed.
+bool Framing(std::string_view name) {
+  return EqualsIgnoreCase(name, "Content-Length") ||
+         EqualsIgnoreCase(name, "Transfer-Encoding");
+}
+
+// The head of `res` as stored, with the headers of `update` replacing
+// those of the same name.
+std::string StoredHead(const ResponseEntity &res,
+                       const ResponseEntity *update) {
+  auto head = fmt::format("{} {} {}\r\n", res.ver, res.status, res.reason);
+  const auto append = [&head](const Header &header) {
+    head.append(header.name).append(": ").append(header.value).append("\r\n");
+  };
+  const auto updated = [update](const Header &header) {
+    return update != nullptr && !Framing(header.name) &&
+           std::ranges::any_of(update->headers, [&header](const Header &h) {
+             return EqualsIgnoreCase(h.name, header.name);
+           });
+  };
+  for (const auto &header : res.headers) {
+    if (Stored(res, header.name) && !updated(header)) append(header);
+  }
+  if (update != nullptr) {
+    for (const auto &header : update->headers) {
+      if (Stored(*update, header.name) && !Framing(header.name)) append(header);
+    }
+  }
+  head.append("\r\n");
+  return head;
+}
+
+std::chrono::seconds DeltaSeconds(std::string_view s) {
+  uint32_t value{0};
+  const auto end = s.data() + s.size();
+  const auto [ptr, ec] = std::from_chars(s.data(), end, value);
+  return std::chrono::seconds{ec == std::errc{} && ptr == end ? value : 0};
+}
+
+// Works out the freshness of `res`, received just now, RFC 9111 section
+// 4.2. Returns false when there's nothing to gain from storing it.
+bool Describe(const ResponseEntity &res, CachedResponse &response) {
+  using std::chrono::duration_cast;
+  using std::chrono::seconds;
+  const auto cc = CacheControl::Of(res.headers);
+  const auto now = std::chrono::system_clock::now();
+  const auto zero = std::chrono::system_clock::duration::zero();
+  const auto date = ParseHttpDate(res.FindHeader("Date")).value_or(now);
+
+  response.status = res.status;
+  response.etag = res.FindHeader("ETag");
+  response.last_modified = res.FindHeader("Last-Modified");
+  response.stored = CachedResponse::Clock::now();
+  response.initial_age =
+      std::max(DeltaSeconds(res.FindHeader("Age")),
+               duration_cast<seconds>(std::max(now - date, zero)));
+  if (cc.no_cache) {
+    response.lifetime = seconds{0};
+  } else if (cc.s_maxage || cc.max_age) {
+    response.lifetime = cc.s_maxage ? *cc.s_maxage : *cc.max_age;
+  } else if (const auto expires = res.FindHeader("Expires");
+             !expires.empty()) {
+    // invalid dates are in the past
+    const auto at = ParseHttpDate(expires).value_or(date);
+    response.lifetime = duration_cast<seconds>(std::max(at - date, zero));
+  } else if (const auto modified = ParseHttpDate(response.last_modified);
+             modified && *modified < date) {
+    response.lifetime = std::min<seconds>(
+        duration_cast<seconds>((date - *modified) / 10), kMaxHeuristic);
+  }
+  return response.lifetime > response.initial_age ||
+         response.Revalidatable();
+}
+
+}  // namespace
+
+HttpCache::Fill::Fill(HttpCache *cache, std::string key,
+                      std::shared_ptr<const CachedResponse> stale)
+    : cache_{cache}, key_{std::move(key)}, stale_{std::move(stale)} {}
+
+HttpCache::Fill::~Fill() {
+  if (!done_) Finish(nullptr, false);
+}
+
+bool HttpCache::Fill::Begin(const ResponseEntity &res) {
+  const auto cc = CacheControl::Of(res.headers);
+  const auto framing = BodyFraming::Of(res, "GET");
+  response_ = std::make_shared<CachedResponse>();
+  // a shared cache stores neither private answers nor ones varying by
+  // request headers it doesn't key on
+  if (!HeuristicallyCacheable(res.status) || cc.no_store || cc.is_private ||
+      !res.FindHeader("Vary").empty() ||
+      !res.FindHeader("Set-Cookie").empty() ||
+      framing.kind == BodyFraming::Kind::kClose ||
+      framing.length > cache_->config_.max_object ||
+      !Describe(res, *response_)) {
+    response_.reset();
+    Finish(nullptr, true);
+    return false;
+  }
+  response_->head = StoredHead(res, nullptr);
+  return true;
+}
+
+void HttpCache::Fill::Append(std::string_view data) {
+  if (!response_ || done_) return;
+  if (body_.size() + data.size() > cache_->config_.max_object) {
+    response_.reset();
+    Finish(nullptr, true);
+    return;
+  }
+  body_.append(data);
+}
+
+void HttpCache::Fill::Commit() {
+  if (!response_ || done_) return;
+  response_->body = std::make_shared<const std::string>(std::move(body_));
+  Finish(std::move(response_), false);
+}
+
+std::shared_ptr<const CachedResponse> HttpCache::Fill::Refresh(
+    const ResponseEntity &not_modified) {
+  if (!stale_ || done_) return nullptr;
+  ResponseParser parser;
+  if (parser.Feed(stale_->head) != ResponseParser::Status::kDone) {
+    Finish(nullptr, false);
+    return stale_;
+  }
+  auto response = std::make_shared<CachedResponse>();
+  response->head = StoredHead(parser.Entity(), &not_modified);
+  ResponseParser merged;
+  merged.Feed(response->head);
+  Describe(merged.Entity(), *response);
+  response->body = stale_->body;
+  Finish(response, false);
+  return response;
+}
+
+void HttpCache::Fill::Finish(std::shared_ptr<const CachedResponse> response,
+                             bool pass) {
+  done_ = true;
+  cache_->Complete(key_, std::move(response), pass);
+}
+
+HttpCache::HttpCache(const HttpCacheConfig &config)
+    : config_{config}, shard_capacity_{config.capacity / kShards} {}
+
+std::string HttpCache::Key(const Uri &uri) {
+  auto key = fmt::format("{}:{}{}", uri.host, uri.port,
+                         uri.path.empty() ? "/" : uri.path);
+  // hosts are case-insensitive, paths are not
+  std::transform(key.begin(), key.begin() + uri.host.size(), key.begin(),
+                 [](char c) {
+                   return c >= 'A' && c <= 'Z' ? static_cast<char>(c + 32)
+                                               : c;
+                 });
+  return key;
+}
+
+bool HttpCache::Admits(const RequestEntity &req, const BodyFraming &framing) {
+  static constexpr std::string_view kPassed[] = {
+      "Authorization",   "Range",         "If-Match",
+      "If-None-Match",   "If-Modified-Since", "If-Unmodified-Since",
+      "If-Range"};
+  // conditional and range requests are the client's business with the
+  // origin
+  return req.method == "GET" && framing.kind == BodyFraming::Kind::kNone &&
+         std::ranges::none_of(req.headers, [](const Header &header) {
+           return std::ranges::any_of(kPassed, [&header](auto name) {
+             return EqualsIgnoreCase(header.name, name);
+           });
+         });
+}
+
+bool HttpCache::Safe(std::string_view method) {
+  return method == "GET" || method == "HEAD" || method == "OPTIONS" ||
+         method == "TRACE";
+}
+
+HttpCache::Shard &HttpCache::ShardOf(const std::string &key) {
+  return shards_[std::hash<std::string>{}(key) % kShards];
+}
+
+asio::awaitable<HttpCache::Lookup> HttpCache::AsyncLookup(
+    const std::string &key, const RequestEntity &req) {
+  const auto cc = CacheControl::Of(req.headers);
+  if (cc.no_store) co_return Lookup{.verdict = Verdict::kPass};
+  // the client wants the origin to confirm what's stored
+  const bool reload =
+      cc.no_cache || (cc.max_age && cc.max_age->count() == 0) ||
+      (req.FindHeader("Cache-Control").empty() &&
+       EqualsIgnoreCase(req.FindHeader("Pragma"), "no-cache"));
+
+  auto &shard = ShardOf(key);
+  {
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    if (auto lookup = Find(shard, key, reload, true)) {
+      co_return std::move(*lookup);
+    }
+  }
+
+  // waits for the fetch in flight
+  co_await asio::async_initiate<decltype(asio::use_awaitable), void()>(
+      [&shard, &key](auto handler) {
+        using Handler = decltype(handler);
+        auto shared = std::make_shared<Handler>(std::move(handler));
+        Waiter waiter = [shared] {
+          const auto ex = asio::get_associated_executor(*shared);
+          asio::post(ex, [shared] { (*shared)(); });
+        };
+        {
+          std::lock_guard<std::mutex> lock{shard.mutex};
+          if (auto it = shard.pending.find(key); it != shard.pending.end()) {
+            it->second.emplace_back(std::move(waiter));
+            return;
+          }
+        }
+        waiter();
+      },
+      asio::use_awaitable);
+
+  // what the fetch stored, a failed one isn't waited for again
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  co_return std::move(*Find(shard, key, reload, false));
+}
+
+std::optional<HttpCache::Lookup> HttpCache::Find(Shard &shard,
+                                                 const std::string &key,
+                                                 bool reload, bool may_wait) {
+  const auto now = CachedResponse::Clock::now();
+  std::shared_ptr<const CachedResponse> stale;
+  if (auto it = shard.index.find(key); it != shard.index.end()) {
+    const auto &response = it->second->response;
+    if (!reload && response->Fresh(now)) {
+      auto hit = response;
+      Touch(shard, it->second);
+      return Lookup{.verdict = Verdict::kHit, .response = std::move(hit)};
+    }
+    if (response->Revalidatable()) stale = response;
+  } else if (auto pass = shard.passes.find(key); pass != shard.passes.end()) {
+    if (pass->second > now) return Lookup{.verdict = Verdict::kPass};
+    shard.passes.erase(pass);
+  }
+
+  if (shard.pending.contains(key)) {
+    if (may_wait) return std::nullopt;
+    return Lookup{.verdict = Verdict::kPass};
+  }
+  if (!may_wait) return Lookup{.verdict = Verdict::kPass};
+  shard.pending.try_emplace(key);
+  const auto verdict = stale ? Verdict::kRevalidate : Verdict::kMiss;
+  return Lookup{.verdict = verdict,
+                .response = stale,
+                .fill = std::unique_ptr<Fill>{new Fill{this, key, stale}}};
+}
+
+void HttpCache::Touch(Shard &shard, std::list<Node>::iterator it) {
+  if (it->hot) {
+    shard.protect.splice(shard.protect.begin(), shard.protect, it);
+    return;
+  }
+  // promoted on its second hit, the coldest of the protected ones go back
+  // on probation
+  it->hot = true;
+  shard.probation_size -= it->size;
+  shard.protect_size += it->size;
+  shard.protect.splice(shard.protect.begin(), shard.probation, it);
+  const auto limit = shard_capacity_ * kProtectPercent / 100;
+  while (shard.protect_size > limit && shard.protect.size() > 1) {
+    const auto last = std::prev(shard.protect.end());
+    last->hot = false;
+    shard.protect_size -= last->size;
+    shard.probation_size += last->size;
+    shard.probation.splice(shard.probation.begin(), shard.protect, last);
+  }
+}
+
+void HttpCache::Store(Shard &shard, const std::string &key,
+                      std::shared_ptr<const CachedResponse> response) {
+  if (auto it = shard.index.find(key); it != shard.index.end()) {
+    Erase(shard, it->second);
+  }
+  const auto size = sizeof(Node) + key.size() + response->head.size() +
+                    response->body->size();
+  if (size > shard_capacity_) return;
+
+  shard.probation.push_front(Node{.key = key,
+                                  .response = std::move(response),
+                                  .size = size,
+                                  .hot = false});
+  shard.probation_size += size;
+  shard.index.insert_or_assign(key, shard.probation.begin());
+  while (shard.probation_size + shard.protect_size > shard_capacity_) {
+    auto &victims = shard.probation.empty() ? shard.protect : shard.probation;
+    Erase(shard, std::prev(victims.end()));
+  }
+}
+
+void HttpCache::Erase(Shard &shard, std::list<Node>::iterator it) {
+  (it->hot ? shard.protect_size : shard.probation_size) -= it->size;
+  shard.index.erase(it->key);
+  (it->hot ? shard.protect : shard.probation).erase(it);
+}
+
+void HttpCache::Complete(const std::string &key,
+                         std::shared_ptr<const CachedResponse> response,
+                         bool pass) {
+  auto &shard = ShardOf(key);
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    if (response) {
+      Store(shard, key, std::move(response));
+    } else if (pass) {
+      // the origin's answer supersedes what was stored
+      if (auto it = shard.index.find(key); it != shard.index.end()) {
+        Erase(shard, it->second);
+      }
+      if (shard.passes.size() >= kMaxPasses) {
+        const auto now = CachedResponse::Clock::now();
+        std::erase_if(shard.passes,
+                      [now](const auto &it) { return it.second <= now; });
+        if (shard.passes.size() >= kMaxPasses) shard.passes.clear();
+      }
+      shard.passes.insert_or_assign(key,
+                                    CachedResponse::Clock::now() + kPassTtl);
+    }
+    if (auto it = shard.pending.find(key); it != shard.pending.end()) {
+      waiters = std::move(it->second);
+      shard.pending.erase(it);
+    }
+  }
+  for (auto &waiter : waiters) waiter();
+}
+
+void HttpCache::Invalidate(const std::string &key) {
+  auto &shard = ShardOf(key);
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  if (auto it = shard.index.find(key); it != shard.index.end()) {
+    Erase(shard, it->second);
+  }
+}
+
+size_t HttpCache::Size() const {
+  size_t size{0};
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    size += shard.index.size();
+  }
+  return size;
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,176 @@
+#ifndef QUIC_SOCKS_TUNNEL_HTTP_CACHE_H_
+#define QUIC_SOCKS_TUNNEL_HTTP_CACHE_H_
+
+#include <array>
+#include <asio/awaitable.hpp>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "tunnel/entities.h"
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+struct HttpCacheConfig {
+  // bytes of responses kept across all shards, 0 disables caching
+  size_t capacity{0};
+  // larger responses are relayed without being kept
+  size_t max_object{8 * 1024 * 1024};
+};
+
+// A stored response. Hits write straight from it, so it's never modified,
+// a revalidation stores a new one sharing the body.
+struct CachedResponse {
+  using Clock = std::chrono::steady_clock;
+
+  uint16_t status{0};
+  // status line and end to end headers, ending in the empty line
+  std::string head;
+  // as framed by the origin, chunked or not
+  std::shared_ptr<const std::string> body;
+  // validators sent along when revalidating, empty if absent
+  std::string etag;
+  std::string last_modified;
+  // when the response was received, and its age by then
+  Clock::time_point stored;
+  std::chrono::seconds initial_age{0};
+  std::chrono::seconds lifetime{0};
+
+  [[nodiscard]] std::chrono::seconds Age(Clock::time_point now) const {
+    return initial_age +
+           std::chrono::duration_cast<std::chrono::seconds>(now - stored);
+  }
+  [[nodiscard]] bool Fresh(Clock::time_point now) const {
+    return Age(now) < lifetime;
+  }
+  [[nodiscard]] bool Revalidatable() const {
+    return !etag.empty() || !last_modified.empty();
+  }
+};
+
+// Shared cache of GET responses, RFC 9111, for all io threads of a proxy.
+// Keys are split over shards each with its own lock and segmented LRU: a
+// response is let in on probation and promoted to the protected segment
+// on its second hit, one-off downloads then can't push the popular ones
+// out. Concurrent misses of a key wait for a single origin fetch.
+class HttpCache : NonCopyable {
+ public:
+  // Stores the response to a miss or a revalidation. Dropping it unfilled
+  // wakes the waiters, which then go to the origin themselves.
+  class Fill : NonCopyable {
+   public:
+    ~Fill();
+
+    // Takes the head of the response, returns false when it's not to be
+    // stored. Runs into the body only then.
+    bool Begin(const ResponseEntity &res);
+    // Body bytes as framed by the origin.
+    void Append(std::string_view data);
+    void Commit();
+    // Renews the revalidated response with the headers of the 304 and
+    // returns it.
+    std::shared_ptr<const CachedResponse> Refresh(
+        const ResponseEntity &not_modified);
+
+   private:
+    friend class HttpCache;
+    Fill(HttpCache *cache, std::string key,
+         std::shared_ptr<const CachedResponse> stale);
+
+    // Hands the outcome to the cache, null stores nothing and `pass` marks
+    // the key as not worth waiting for.
+    void Finish(std::shared_ptr<const CachedResponse> response, bool pass);
+
+    HttpCache *cache_;
+    std::string key_;
+    std::shared_ptr<const CachedResponse> stale_;
+    std::shared_ptr<CachedResponse> response_;
+    std::string body_;
+    bool done_{false};
+  };
+
+  enum class Verdict {
+    // `response` is fresh
+    kHit,
+    // `response` is stale, `fill` revalidates it with the origin
+    kRevalidate,
+    // `fill` stores the response of the origin
+    kMiss,
+    // neither served nor stored
+    kPass,
+  };
+  struct Lookup {
+    Verdict verdict;
+    std::shared_ptr<const CachedResponse> response;
+    std::unique_ptr<Fill> fill;
+  };
+
+  explicit HttpCache(const HttpCacheConfig &config);
+
+  static std::string Key(const Uri &uri);
+  // Whether a cache may answer `req` at all, its body framing included.
+  static bool Admits(const RequestEntity &req, const BodyFraming &framing);
+  // Whether `method` leaves the resource alone, others invalidate it.
+  static bool Safe(std::string_view method);
+
+  // Looks `key` up for the request `req`, waiting on the executor of the
+  // calling coroutine for a fetch of it in flight.
+  asio::awaitable<Lookup> AsyncLookup(const std::string &key,
+                                      const RequestEntity &req);
+  void Invalidate(const std::string &key);
+
+  [[nodiscard]] size_t Size() const;
+
+ private:
+  static constexpr size_t kShards = 16;
+
+  using Waiter = std::function<void()>;
+  struct Node {
+    std::string key;
+    std::shared_ptr<const CachedResponse> response;
+    size_t size;
+    bool hot;
+  };
+  struct Shard {
+    mutable std::mutex mutex;
+    std::list<Node> probation;
+    std::list<Node> protect;
+    size_t probation_size{0};
+    size_t protect_size{0};
+    std::unordered_map<std::string, std::list<Node>::iterator> index;
+    // keys being fetched and the lookups waiting for them
+    std::unordered_map<std::string, std::vector<Waiter>> pending;
+    // keys recently answered with something not to be stored, lookups of
+    // them aren't held up
+    std::unordered_map<std::string, CachedResponse::Clock::time_point> passes;
+  };
+
+  Shard &ShardOf(const std::string &key);
+  // Evaluates what's stored for `key` under the lock of `shard`, null when
+  // a fetch of it is in flight and `may_wait` is set. Only lookups that
+  // may wait start a fetch.
+  std::optional<Lookup> Find(Shard &shard, const std::string &key,
+                             bool reload, bool may_wait);
+  void Touch(Shard &shard, std::list<Node>::iterator it);
+  void Store(Shard &shard, const std::string &key,
+             std::shared_ptr<const CachedResponse> response);
+  void Erase(Shard &shard, std::list<Node>::iterator it);
+  void Complete(const std::string &key,
+                std::shared_ptr<const CachedResponse> response, bool pass);
+
+  const HttpCacheConfig config_;
+  const size_t shard_capacity_;
+  std::array<Shard, kShards> shards_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_HTTP_CACHE_H_
@@ -9,227 +9,999 @@
 #include <asio.hpp>
 #include <asio/awaitable.hpp>
 #include <asio/buffer.hpp>
+#include <deque>
 #include <memory>
-#include <regex>
 #include <variant>
 
-#include "channel/quic_channel.h"
+#include "coro/asio_task.h"
 #include "entities.h"
+#include "observer/metrics.h"
 #include "observer/network_observer.h"
 #include "tunnel/asio_helper.h"
+#include "tunnel/dns_resolver.h"
+#include "tunnel/happy_eyeballs.h"
+#include "tunnel/http_cache.h"
+#include "tunnel/parent_proxy.h"
+#include "tunnel/quic_exit.h"
+#include "tunnel/reactor.h"
+#include "tunnel/relay.h"
+#include "tunnel/upstream_pool.h"
+#include "tunnel/zero_copy.h"
+#include "utility/buffer.h"
 #include "utility/log.h"
 #include "utility/result.h"
+#include "utility/trace.h"
 
 namespace socks::tunnel {
 
 class Session {
+  static constexpr size_t kHeadChunk = 4096;
+  static constexpr size_t kMaxHeadSize = RequestParser::kMaxHeadSize;
+  // requests forwarded ahead of the response being relayed
+  static constexpr size_t kMaxPipeline = 16;
+
+  // what becomes of the origin connection after an exchange
+  enum class Outcome { kReuse, kClose, kUpgrade };
+
+  // A request forwarded to its origin, waiting for its response to be
+  // relayed. Responses go back to the client in request order.
+  struct InFlight {
+    asio::ip::tcp::socket remote;
+    std::string host;
+    uint16_t port;
+    std::string method;
+    bool client_alive;
+    // when the request head went out
+    ThreadMetrics::Clock::time_point sent;
+    // answered by `cached` without asking the origin
+    bool hit{false};
+    // a fresh response, or the stale one revalidated by `fill`
+    std::shared_ptr<const CachedResponse> cached;
+    // stores what the origin answers, null when it's not to be cached
+    std::unique_ptr<HttpCache::Fill> fill;
+    // response bytes read while the request body was held back
+    std::string early;
+    // the origin answered before the body was sent, which it then wasn't
+    bool withheld{false};
+  };
+
  public:
-  Session(size_t idx, asio::io_context &ctx, NetworkObserver *observer,
-          asio::ip::tcp::socket socket)
+  Session(size_t idx, asio::io_context &ctx, NetworkRelay *observer,
+          DnsResolver *resolver, UpstreamPool *pool, HttpCache *cache,
+          ParentSelector *parents, const ConnectConfig &connect,
+          ExitClient *exit,
+          asio::ip::tcp::socket socket, ZeroCopyMode zero_copy,
+          SockMap *sockmap, TimerWheel &wheel, const TimeoutConfig &timeouts,
+          ThreadMetrics &metrics)
       : idx_{idx},
         ctx_{ctx},
         observer_{observer},
+        resolver_{resolver},
+        pool_{pool},
+        cache_{cache},
+        parents_{parents},
+        connect_{connect},
+        exit_{exit},
         socket_{std::move(socket)},
-        remote_{ctx} {}
+        remote_{ctx},
+        request_ready_{ctx},
+        response_done_{ctx},
+        zero_copy_{zero_copy},
+        sockmap_{sockmap},
+        wheel_{wheel},
+        timeouts_{timeouts},
+        header_timer_{[this] { OnHeaderTimeout(); }},
+        continue_timer_{[this] { OnContinueTimeout(); }},
+        response_timer_{[this] { OnResponseIdle(); }},
+        metrics_{metrics},
+        meter_{idx, observer, metrics},
+        stage_start_{ThreadMetrics::Clock::now()} {}
 
   void Start() noexcept {
     co_spawn(
         ctx_, [this] { return this->AsyncStart(); }, asio::detached);
   }
 
+  // Requests are read and forwarded while earlier responses are still
+  // being relayed, each over its own origin connection.
   asio::awaitable<void> AsyncStart() {
-    RequestEntity entity;
+    metrics_.opened.Add();
+    co_await WaitAll(ctx_, ReadRequests(), WriteResponses());
+    in_flight_.clear();
+    CloseSocket();
+    metrics_.closed.Add();
+  }
+
+  asio::awaitable<void> ReadRequests() {
     try {
-      auto &&[entity, remain] = co_await ParseRequest();
-      const auto uri = Uri::Parse(entity.uri);
-      co_await ConnectRemote(uri);
-
-      if (entity.method == "CONNECT") {
-        const std::string response = {
-            "HTTP/1.1 200 Connection Established\r\n\r\n"};
-        co_await socket_.async_write_some(asio::buffer(response),
-                                          asio::use_awaitable);
-      } else {
-        const std::string request = entity.Dump();
-        SPDLOG_DEBUG("[tunnel] request remote, data={}, idx={}", request, idx_);
-        co_await remote_.async_write_some(asio::buffer(request),
-                                          asio::use_awaitable);
-      }
-
-      co_await WaitAll(
-          ctx_, std::chrono::hours{24},
-          [this, &remain]() -> asio::awaitable<void> {
-            auto remain_size = remain.size();
-            if (remain_size > 0) {
-              co_await remote_.async_write_some(asio::buffer(remain),
-                                                asio::use_awaitable);
-              observer_->Forward(idx_, true, remain);
-            }
-
-            co_await ForwardTo(true);
-          }(),
-          ForwardTo(false));
+      while (!stopped_) {
+        auto &&[entity, remain] = co_await ParseRequest();
+        if (entity.method == "CONNECT") {
+          co_await Drain();
+          if (!stopped_) co_await Tunnel(entity, remain);
+          break;
+        }
+
+        const bool upgrade = !entity.FindHeader("Upgrade").empty();
+        // a 100 Continue must not cut into a response being relayed
+        if (upgrade || ExpectsContinue(entity)) co_await Drain();
+        while (in_flight_.size() >= kMaxPipeline && !stopped_) {
+          co_await Wait(response_done_);
+        }
+        if (stopped_ || !co_await ForwardRequest(entity)) break;
+        if (upgrade) {
+          co_await Drain();
+          if (upgraded_) break;
+        }
+      }
     } catch (std::runtime_error &e) {
-      CloseSocket();
+      SPDLOG_DEBUG("[tunnel] stop reading requests, e={}, idx={}", e.what(),
+                   idx_);
     }
+    reading_done_ = true;
+    request_ready_.cancel();
   }
 
-  asio::awaitable<void> ForwardTo(bool outside) {
-    std::array<char, 8196> buf{};
-    size_t len{0};
-    auto &from = outside ? socket_ : remote_;
-    auto &to = outside ? remote_ : socket_;
-    while (true) {
-      try {
-        len = co_await from.async_read_some(asio::buffer(buf),
-                                            asio::use_awaitable);
-      } catch (asio::system_error &e) {
-        CloseSocket(&from);
-        co_return;
+  asio::awaitable<void> WriteResponses() {
+    try {
+      while (true) {
+        while (in_flight_.empty() && !reading_done_) {
+          co_await Wait(request_ready_);
+        }
+        if (in_flight_.empty()) break;
+
+        // stays queued while relayed, the reader counts it as in flight
+        auto &exchange = in_flight_.front();
+        bool response_alive{false};
+        WatchResponse(exchange.remote);
+        const auto outcome = co_await RelayResponse(exchange, &response_alive);
+        response_timer_.Cancel();
+        relaying_ = nullptr;
+        if (outcome == Outcome::kUpgrade) {
+          remote_ = std::move(exchange.remote);
+          upgraded_ = true;
+          Duplex duplex{socket_, remote_, wheel_, timeouts_.idle};
+          co_await AsyncRun(ctx_,
+                            duplex.Relay(meter_, ZeroCopyMode::kNone),
+                            asio::use_awaitable);
+          break;
+        }
+        if (outcome == Outcome::kReuse && exchange.client_alive) {
+          pool_->Checkin(exchange.host, exchange.port,
+                         std::move(exchange.remote));
+        }
+        // a close-delimited response leaves `response_alive` false, the
+        // responses queued behind it would read as the rest of its body
+        const bool keep = exchange.client_alive && response_alive;
+        in_flight_.pop_front();
+        response_done_.cancel();
+        if (!keep) break;
       }
+    } catch (std::runtime_error &e) {
+      SPDLOG_DEBUG("[tunnel] stop writing responses, e={}, idx={}", e.what(),
+                   idx_);
+    }
+    response_timer_.Cancel();
+    relaying_ = nullptr;
+    // the reader may be parked on the client, closing wakes it
+    stopped_ = true;
+    if (!upgraded_) {
+      asio::error_code err;
+      socket_.close(err);
+    }
+    response_done_.cancel();
+  }
 
-      observer_->Forward(idx_, outside,
-                         std::string{buf.begin(), buf.begin() + len});
+  // Times out the response about to be relayed from `remote` once neither
+  // the origin nor the client moved it along for the idle timeout.
+  void WatchResponse(asio::ip::tcp::socket &remote) {
+    relaying_ = &remote;
+    response_active_ = wheel_.Now();
+    if (timeouts_.idle.count() > 0) {
+      wheel_.Arm(response_timer_, timeouts_.idle);
+    }
+  }
 
-      try {
-        len = co_await to.async_write_some(asio::buffer(buf, len),
-                                           asio::use_awaitable);
-      } catch (asio::system_error &e) {
-        CloseSocket(&to);
-        co_return;
+  void OnResponseIdle() {
+    // progress only records when it happened, the timer catches up here
+    const auto quiet = wheel_.Tick() * (wheel_.Now() - response_active_);
+    const std::chrono::milliseconds idle{timeouts_.idle};
+    if (quiet < idle) {
+      wheel_.Arm(response_timer_, idle - quiet);
+      return;
+    }
+    SPDLOG_DEBUG("[tunnel] response stalled, closing, idx={}", idx_);
+    asio::error_code err;
+    relaying_->close(err);
+    socket_.close(err);
+  }
+
+  // Waits until every forwarded request has been answered.
+  asio::awaitable<void> Drain() {
+    while (!in_flight_.empty() && !stopped_) {
+      co_await Wait(response_done_);
+    }
+  }
+
+  // Parks the calling coroutine until `timer` is cancelled. Both sides run
+  // on the session's thread, so a wake up can't slip in between checking
+  // a condition and waiting for it.
+  static asio::awaitable<void> Wait(asio::steady_timer &timer) {
+    timer.expires_at(asio::steady_timer::time_point::max());
+    asio::error_code err;
+    co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, err));
+  }
+
+  asio::awaitable<void> Tunnel(RequestEntity &entity, std::string_view remain) {
+    const auto uri = Uri::Parse(entity.uri);
+    if (exit_ != nullptr) {
+      co_await TunnelExit(uri, remain);
+      co_return;
+    }
+    co_await ConnectRemote(uri, remote_);
+
+    // the redirection has to be in place before the client learns about
+    // the tunnel, see SockMap::Insert
+    const bool redirected = zero_copy_ == ZeroCopyMode::kSockMap &&
+                            sockmap_ != nullptr &&
+                            sockmap_->Insert(socket_, remote_);
+    co_await asio::async_write(socket_, asio::buffer(kEstablished),
+                               asio::use_awaitable);
+    if (!remain.empty()) {
+      co_await asio::async_write(remote_, asio::buffer(remain),
+                                 asio::use_awaitable);
+      meter_.Forward(true, remain);
+      meter_.Sent();
+    }
+    ReleaseHead();
+
+    // redirected payload bypasses the session, it can't tell idle tunnels
+    // from busy ones
+    Duplex duplex{socket_, remote_, wheel_,
+                  redirected ? std::chrono::seconds{0} : timeouts_.idle};
+    co_await AsyncRun(ctx_,
+                      duplex.Relay(meter_, zero_copy_,
+                                   redirected ? sockmap_ : nullptr),
+                      asio::use_awaitable);
+  }
+
+  // Carries the tunnel in a stream to the exit relay, which connects to the
+  // origin. Payload is copied, zero copy has no say here.
+  asio::awaitable<void> TunnelExit(const Uri &uri, std::string_view remain) {
+    stream_ = co_await exit_->AsyncOpen(uri.host, uri.port);
+    const auto &relay = exit_->Relay();
+    Trace(TraceEvent::kConnect, idx_, uri.port, 0);
+    observer_->Connect(idx_, socket_.remote_endpoint(),
+                       {relay.address(), relay.port()}, uri.host);
+    co_await asio::async_write(socket_, asio::buffer(kEstablished),
+                               asio::use_awaitable);
+
+    co_await WaitAll(
+        ctx_,
+        [this, &remain]() -> asio::awaitable<void> {
+          if (!remain.empty()) {
+            co_await stream_->AsyncWrite(asio::buffer(remain));
+            meter_.Forward(true, remain);
+            meter_.Sent();
+          }
+          ReleaseHead();
+          co_await ForwardStream(true);
+        }(),
+        ForwardStream(false));
+  }
+
+  // Forwards a plain http request over a pooled origin connection and
+  // queues it for its response, returns whether the client keeps the
+  // connection open.
+  asio::awaitable<bool> ForwardRequest(RequestEntity &entity) {
+    const auto uri = Uri::Parse(entity.uri);
+    InFlight exchange{.remote = asio::ip::tcp::socket{ctx_},
+                      .host = std::string{uri.host},
+                      .port = uri.port,
+                      .method = std::string{entity.method},
+                      .client_alive = KeepAlive(entity)};
+    const auto framing = BodyFraming::Of(entity);
+    const bool expect = ExpectsContinue(entity);
+    if (cache_ != nullptr) {
+      co_await LookupCache(exchange, entity, uri, framing);
+      if (exchange.hit) co_return Queue(std::move(exchange));
+    }
+    exchange.remote = co_await CheckoutRemote(exchange.host, exchange.port);
+
+    auto &remote = exchange.remote;
+    auto request = entity.ToOriginForm(head_);
+    std::string conditional;
+    if (exchange.fill && exchange.cached) {
+      conditional = Conditional(request, *exchange.cached);
+      request = conditional;
+    }
+    // the head leaves in one segment with the body bytes at hand
+    BodyCursor cursor{framing};
+    const auto body = TakeBody(cursor);
+    co_await asio::async_write(
+        remote, std::array{asio::buffer(request), asio::buffer(body)},
+        asio::use_awaitable);
+    Trace(TraceEvent::kRequest, idx_, request.size(), body.size());
+    meter_.Forward(true, request);
+    if (!body.empty()) meter_.Forward(true, body);
+    exchange.sent = ThreadMetrics::Clock::now();
+    if (expect && !cursor.Done() && !co_await AwaitContinue(exchange)) {
+      // the client may send the body regardless, it couldn't be told from
+      // the next request
+      exchange.withheld = true;
+      exchange.client_alive = false;
+      co_return Queue(std::move(exchange));
+    }
+    co_await RelayRequestBody(cursor, remote);
+    co_return Queue(std::move(exchange));
+  }
+
+  // Gives the origin the chance to turn down a request announcing its body
+  // with Expect: 100-continue, interim responses it sends are relayed. An
+  // origin quiet for `kContinueWait` is taken to expect the body, the
+  // client is then told to go on by the proxy. Returns false when the
+  // origin answered with a final response, which is left in `early`.
+  asio::awaitable<bool> AwaitContinue(InFlight &exchange) {
+    auto &remote = exchange.remote;
+    auto &early = exchange.early;
+    continue_remote_ = &remote;
+    continue_expired_ = false;
+    wheel_.Arm(continue_timer_, kContinueWait);
+    ResponseParser parser;
+    try {
+      while (true) {
+        const auto status = parser.Feed(early);
+        if (status == ResponseParser::Status::kInvalid) {
+          throw SocksException(
+              fmt::format("[tunnel] parse response failed, {}, idx={}",
+                          parser.Error(), idx_));
+        }
+        if (status == ResponseParser::Status::kPartial) {
+          if (early.size() >= kMaxHeadSize) {
+            throw SocksException(fmt::format(
+                "[tunnel] response head too large, idx={}", idx_));
+          }
+          if (continue_expired_) break;
+          const auto size = early.size();
+          early.resize(size + kHeadChunk);
+          asio::error_code err;
+          const auto len = co_await remote.async_read_some(
+              asio::buffer(early.data() + size, kHeadChunk),
+              asio::redirect_error(asio::use_awaitable, err));
+          early.resize(size + len);
+          if (continue_expired_ && err == asio::error::operation_aborted) {
+            break;
+          }
+          if (err) throw asio::system_error{err};
+          if (size == 0) {
+            metrics_.Record(Stage::kFirstByte,
+                            ThreadMetrics::Clock::now() - exchange.sent);
+          }
+          continue;
+        }
+
+        const auto &entity = parser.Entity();
+        if (entity.status / 100 != 1 || entity.status == 101) {
+          continue_timer_.Cancel();
+          co_return false;
+        }
+        const auto raw = entity.raw;
+        const bool proceed = entity.status == 100;
+        Trace(TraceEvent::kResponse, idx_, entity.status, raw.size());
+        co_await asio::async_write(socket_, asio::buffer(raw),
+                                   asio::use_awaitable);
+        meter_.Forward(false, raw);
+        early.erase(0, raw.size());
+        parser.Reset();
+        if (proceed) {
+          continue_timer_.Cancel();
+          co_return true;
+        }
       }
+    } catch (...) {
+      continue_timer_.Cancel();
+      throw;
     }
+    co_await asio::async_write(socket_, asio::buffer(kContinue),
+                               asio::use_awaitable);
+    co_return true;
   }
 
-  asio::awaitable<void> ConnectRemote(const Uri &uri) {
+  void OnContinueTimeout() {
+    continue_expired_ = true;
     asio::error_code err;
-    auto address = asio::ip::make_address(uri.host, err);
-    if (err) {
-      asio::ip::tcp::resolver resolver{ctx_};
-      auto &&resolve_res = co_await resolver.async_resolve(
-          uri.host, std::to_string(uri.port), asio::use_awaitable);
-      if (resolve_res.empty()) {
+    continue_remote_->cancel(err);
+  }
+
+  // Hands `exchange` to the response writer, returns whether the client
+  // keeps the connection open.
+  bool Queue(InFlight exchange) {
+    const bool client_alive = exchange.client_alive;
+    in_flight_.emplace_back(std::move(exchange));
+    request_ready_.cancel();
+    return client_alive;
+  }
+
+  // Answers the request from the cache when it may, otherwise sets the
+  // exchange up to store or revalidate the response. Requests that change
+  // the resource drop what's stored of it.
+  asio::awaitable<void> LookupCache(InFlight &exchange,
+                                    const RequestEntity &entity,
+                                    const Uri &uri,
+                                    const BodyFraming &framing) {
+    const auto key = HttpCache::Key(uri);
+    if (!HttpCache::Safe(entity.method)) {
+      cache_->Invalidate(key);
+      co_return;
+    }
+    if (!HttpCache::Admits(entity, framing)) co_return;
+    auto lookup = co_await cache_->AsyncLookup(key, entity);
+    metrics_.cache_lookups[static_cast<size_t>(lookup.verdict)].Add();
+    exchange.hit = lookup.verdict == HttpCache::Verdict::kHit;
+    exchange.cached = std::move(lookup.response);
+    exchange.fill = std::move(lookup.fill);
+  }
+
+  // The origin-form `request` asking the origin whether `cached` is still
+  // good, by the validators it came with.
+  static std::string Conditional(std::string_view request,
+                                 const CachedResponse &cached) {
+    // ahead of the empty line ending the head
+    std::string head{request.substr(0, request.size() - 2)};
+    if (!cached.etag.empty()) {
+      head.append("If-None-Match: ").append(cached.etag).append("\r\n");
+    }
+    if (!cached.last_modified.empty()) {
+      head.append("If-Modified-Since: ")
+          .append(cached.last_modified)
+          .append("\r\n");
+    }
+    head.append("\r\n");
+    return head;
+  }
+
+  // Writes a stored response straight from the cache, with its current
+  // age. The body is shared with every other hit, observers only learn its
+  // size.
+  asio::awaitable<void> WriteCached(const CachedResponse &cached) {
+    const auto head =
+        std::string_view{cached.head}.substr(0, cached.head.size() - 2);
+    const auto age = fmt::format(
+        "Age: {}\r\n\r\n", cached.Age(CachedResponse::Clock::now()).count());
+    Trace(TraceEvent::kResponse, idx_, cached.status, head.size() + age.size());
+    co_await asio::async_write(socket_,
+                               std::array{asio::buffer(head), asio::buffer(age),
+                                          asio::buffer(*cached.body)},
+                               asio::use_awaitable);
+    meter_.Forward(false, head);
+    meter_.Forward(false, age);
+    if (!cached.body->empty()) {
+      meter_.ForwardBytes(false, cached.body->size());
+    }
+  }
+
+  // Like Duplex::Relay, between the client and the exit relay's stream. An end
+  // of either side is passed on as a half close.
+  asio::awaitable<void> ForwardStream(bool outside) {
+    auto buf = BufferSlice::Acquire();
+    size_t len{0};
+    try {
+      while (true) {
+        if (!buf.Unique()) buf = BufferSlice::Acquire();
+        if (outside) {
+          asio::error_code err;
+          len = co_await socket_.async_read_some(
+              asio::buffer(buf.data(), buf.size()),
+              asio::redirect_error(asio::use_awaitable, err));
+          if (err == asio::error::eof) {
+            stream_->Shutdown();
+            co_return;
+          }
+          if (err) throw asio::system_error{err};
+        } else {
+          len = co_await stream_->AsyncReadSome(
+              asio::buffer(buf.data(), buf.size()));
+          if (len == 0) {
+            asio::error_code err;
+            socket_.shutdown(asio::socket_base::shutdown_send, err);
+            co_return;
+          }
+        }
+
+        if (!outside) meter_.Received();
+        meter_.Forward(outside, buf.Slice(0, len));
+
+        if (outside) {
+          co_await stream_->AsyncWrite(asio::buffer(buf.data(), len));
+          meter_.Sent();
+        } else {
+          co_await asio::async_write(socket_, asio::buffer(buf.data(), len),
+                                     asio::use_awaitable);
+        }
+      }
+    } catch (asio::system_error &e) {
+      stream_->Reset();
+      CloseSocket(&socket_);
+    }
+  }
+
+  // Relays the response to the request just sent, interim 1xx responses
+  // included. `alive` tells whether the client may keep its connection,
+  // which the origin has to allow and the response has to be delimited
+  // for.
+  asio::awaitable<Outcome> RelayResponse(InFlight &exchange, bool *alive) {
+    if (exchange.hit) {
+      co_await WriteCached(*exchange.cached);
+      *alive = true;
+      co_return Outcome::kClose;
+    }
+    auto &remote = exchange.remote;
+    ResponseParser parser;
+    std::vector<char> head(std::max(kHeadChunk, exchange.early.size()));
+    std::ranges::copy(exchange.early, head.begin());
+    size_t size{exchange.early.size()};
+    // past an interim response, the origin has answered already
+    bool interim{false};
+    while (true) {
+      const auto status = parser.Feed({head.data(), size});
+      if (status == ResponseParser::Status::kInvalid) {
         throw SocksException(
-            fmt::format("[tunnel] resolve dns failed, host={}", uri.host));
+            fmt::format("[tunnel] parse response failed, {}, idx={}",
+                        parser.Error(), idx_));
+      }
+      if (status == ResponseParser::Status::kPartial) {
+        if (size == head.size()) {
+          if (size >= kMaxHeadSize) {
+            throw SocksException(
+                fmt::format("[tunnel] response head too large, idx={}", idx_));
+          }
+          head.resize(std::min(size * 2, kMaxHeadSize));
+        }
+        const bool first = size == 0 && !interim;
+        size += co_await remote.async_read_some(
+            asio::buffer(head.data() + size, head.size() - size),
+            asio::use_awaitable);
+        response_active_ = wheel_.Now();
+        if (first) {
+          metrics_.Record(Stage::kFirstByte,
+                          ThreadMetrics::Clock::now() - exchange.sent);
+        }
+        continue;
       }
 
-      address = resolve_res->endpoint().address();
+      auto &entity = parser.Entity();
+      const auto raw = entity.raw;
+      const auto rest = std::string_view{head.data(), size}.substr(raw.size());
+      Trace(TraceEvent::kResponse, idx_, entity.status, raw.size());
+      if (entity.status == 101) {
+        // the protocol switched, whatever follows is relayed blindly
+        co_await asio::async_write(
+            socket_, std::array{asio::buffer(raw), asio::buffer(rest)},
+            asio::use_awaitable);
+        meter_.Forward(false, raw);
+        if (!rest.empty()) meter_.Forward(false, rest);
+        co_return Outcome::kUpgrade;
+      }
+      if (entity.status / 100 == 1) {
+        co_await asio::async_write(socket_, asio::buffer(raw),
+                                   asio::use_awaitable);
+        meter_.Forward(false, raw);
+        std::memmove(head.data(), rest.data(), rest.size());
+        size = rest.size();
+        interim = true;
+        parser.Reset();
+        continue;
+      }
+
+      *alive = KeepAlive(entity);
+      if (exchange.fill && exchange.cached && entity.status == 304) {
+        // the stored response is still good, it answers the client
+        const auto refreshed = exchange.fill->Refresh(entity);
+        co_await WriteCached(*refreshed);
+        co_return *alive && rest.empty() && !exchange.withheld
+            ? Outcome::kReuse
+            : Outcome::kClose;
+      }
+      if (exchange.fill && !exchange.fill->Begin(entity)) exchange.fill.reset();
+      const auto framing = BodyFraming::Of(entity, exchange.method);
+      // the body ends where the origin closes, the client can only tell
+      // that end by its own connection closing too
+      if (framing.kind == BodyFraming::Kind::kClose) *alive = false;
+      const bool clean = co_await RelayResponseBody(framing, raw, rest, remote,
+                                                    exchange.fill.get());
+      co_return clean && *alive && !exchange.withheld ? Outcome::kReuse
+                                                      : Outcome::kClose;
+    }
+  }
+
+  // Relays the response head along with the body, of which `rest` came
+  // with the head, and stores the body by `fill` unless null. Returns false
+  // when the origin sent more than the body, its connection can't be reused
+  // then.
+  asio::awaitable<bool> RelayResponseBody(const BodyFraming &framing,
+                                          std::string_view raw,
+                                          std::string_view rest,
+                                          asio::ip::tcp::socket &remote,
+                                          HttpCache::Fill *fill) {
+    BodyCursor cursor{framing};
+    const auto body = rest.substr(0, cursor.Feed(rest));
+    // head and the body at hand leave in one segment
+    co_await asio::async_write(
+        socket_, std::array{asio::buffer(raw), asio::buffer(body)},
+        asio::use_awaitable);
+    meter_.Forward(false, raw);
+    if (!body.empty()) meter_.Forward(false, body);
+    if (fill != nullptr) fill->Append(body);
+    bool clean = body.size() == rest.size();
+
+    auto buf = BufferSlice::Acquire();
+    while (!cursor.Done()) {
+      if (!buf.Unique()) buf = BufferSlice::Acquire();
+      size_t read{0};
+      try {
+        read = co_await remote.async_read_some(
+            asio::buffer(buf.data(), buf.size()), asio::use_awaitable);
+      } catch (asio::system_error &e) {
+        if (framing.kind == BodyFraming::Kind::kClose &&
+            e.code() == asio::error::eof) {
+          co_return false;
+        }
+        throw;
+      }
+      response_active_ = wheel_.Now();
+      const auto len = cursor.Feed({buf.data(), read});
+      clean = clean && len == read;
+      if (fill != nullptr) fill->Append({buf.data(), len});
+      meter_.Forward(false, buf.Slice(0, len));
+      co_await asio::async_write(socket_, asio::buffer(buf.data(), len),
+                                 asio::use_awaitable);
+      response_active_ = wheel_.Now();
     }
+    if (fill != nullptr) fill->Commit();
+    co_return clean;
+  }
 
-    const auto ep = asio::ip::tcp::endpoint{address, uri.port};
-    co_await remote_.async_connect(ep, asio::use_awaitable);
+  asio::awaitable<void> ConnectRemote(const Uri &uri,
+                                      asio::ip::tcp::socket &remote) {
+    // later requests of a connection only time the stages of their own
+    if (!first_request_) stage_start_ = ThreadMetrics::Clock::now();
+    if (parents_ != nullptr) {
+      // the parent resolves the origin, resolving the parent is part of
+      // connecting to it
+      remote = co_await AsyncConnectThrough(*parents_, *resolver_, uri.host,
+                                            uri.port, connect_);
+    } else {
+      const auto addresses = co_await resolver_->AsyncResolve(uri.host);
+      metrics_.Lap(Stage::kResolve, stage_start_);
+      std::vector<asio::ip::tcp::endpoint> endpoints;
+      endpoints.reserve(addresses.size());
+      for (const auto &address : addresses) {
+        endpoints.emplace_back(address, uri.port);
+      }
+      endpoints =
+          InterleaveFamilies(std::move(endpoints), connect_.prefer_ipv6);
+      remote = co_await AsyncConnect(endpoints, connect_);
+    }
+    metrics_.Lap(Stage::kConnect, stage_start_);
+    Trace(TraceEvent::kConnect, idx_, uri.port, 0);
     observer_->Connect(idx_, socket_.remote_endpoint(),
-                       remote_.remote_endpoint(), uri.host);
+                       remote.remote_endpoint(), uri.host);
   }
 
-  asio::awaitable<std::pair<RequestEntity, std::string>> ParseRequest() {
-    asio::streambuf buf;
+  // Takes a warm connection to the origin from the pool, or opens one.
+  asio::awaitable<asio::ip::tcp::socket> CheckoutRemote(
+      const std::string &host, uint16_t port) {
+    if (auto pooled = pool_->Checkout(host, port)) {
+      Trace(TraceEvent::kConnect, idx_, port, 1);
+      observer_->Connect(idx_, socket_.remote_endpoint(),
+                         pooled->remote_endpoint(), host);
+      co_return std::move(*pooled);
+    }
+    asio::ip::tcp::socket remote{ctx_};
+    co_await ConnectRemote(Uri{.port = port, .host = host}, remote);
+    co_return remote;
+  }
+
+  // The returned entity and the bytes received past its head are views into
+  // `head_`. Bytes left pending by the previous request are parsed first.
+  asio::awaitable<std::pair<RequestEntity, std::string_view>> ParseRequest() {
+    if (pending_ > 0) {
+      std::memmove(head_.data(), head_.data() + pending_,
+                   received_ - pending_);
+      received_ -= pending_;
+      pending_ = 0;
+    }
+
+    if (timeouts_.header.count() > 0) {
+      wheel_.Arm(header_timer_, timeouts_.header);
+    }
+    RequestParser parser;
     while (true) {
-      auto len = co_await socket_.async_read_some(buf.prepare(1024),
-                                                  asio::use_awaitable);
-      buf.commit(len);
-      if (len == 0) continue;
+      const auto status = parser.Feed({head_.data(), received_});
+      if (status == RequestParser::Status::kInvalid) {
+        throw SocksException(
+            fmt::format("[tunnel] parse request failed, {}, idx={}",
+                        parser.Error(), idx_));
+      }
+      if (status == RequestParser::Status::kDone) break;
 
-      const std::string kRequestEnd = "\r\n\r\n";
-      const auto const_buf = buf.data();
-      const auto buf_begin = static_cast<const char *>(const_buf.data());
-      const auto buf_end =
-          static_cast<const char *>(const_buf.data()) + const_buf.size();
-      if (const auto pos =
-              std::search(buf_begin, buf_end, std::begin(kRequestEnd),
-                          std::end(kRequestEnd));
-          pos != buf_end) {
-        const auto raw_len =
-            static_cast<size_t>(pos - buf_begin) + kRequestEnd.size();
-        buf.consume(raw_len);
-        auto res = RequestEntity::Parse(std::string_view{buf_begin, raw_len});
-        if (!res) {
-          throw std::move(res.Error());
+      if (received_ == head_.size()) {
+        if (received_ >= kMaxHeadSize) {
+          throw SocksException(
+              fmt::format("[tunnel] request head too large, idx={}", idx_));
         }
-
-        co_return std::make_pair(res.Value(),
-                                 std::string{buf_begin + raw_len, buf_end});
+        head_.resize(std::clamp(received_ * 2, kHeadChunk, kMaxHeadSize));
       }
+      received_ += co_await socket_.async_read_some(
+          asio::buffer(head_.data() + received_, head_.size() - received_),
+          asio::use_awaitable);
     }
+
+    header_timer_.Cancel();
+    if (std::exchange(first_request_, false)) {
+      metrics_.Lap(Stage::kHead, stage_start_);
+    }
+    auto &entity = parser.Entity();
+    pending_ = entity.raw.size();
+    co_return std::make_pair(
+        std::move(entity),
+        std::string_view{head_.data() + pending_, received_ - pending_});
+  }
+
+  // The client took too long for a request head. Responses still being
+  // relayed keep the connection while they make progress, a pipelining
+  // client waits for them.
+  void OnHeaderTimeout() {
+    const auto quiet = wheel_.Tick() * (wheel_.Now() - response_active_);
+    if (!in_flight_.empty() && quiet < timeouts_.header) {
+      wheel_.Arm(header_timer_, timeouts_.header - quiet);
+      return;
+    }
+    SPDLOG_DEBUG("[tunnel] request head timed out, idx={}", idx_);
+    asio::error_code err;
+    socket_.close(err);
+    // the origin of a stalled response may hold up the writer
+    if (relaying_ != nullptr) relaying_->close(err);
+  }
+
+  // No request follows a tunnel, its head buffer would only sit idle for
+  // the lifetime of the session. Views into it are gone by now.
+  void ReleaseHead() {
+    head_.clear();
+    head_.shrink_to_fit();
+    pending_ = 0;
+    received_ = 0;
   }
 
   void CloseSocket(asio::ip::tcp::socket *socket = nullptr) {
+    asio::error_code err;
     if (socket == nullptr) {
-      socket_.close();
-      remote_.close();
+      socket_.close(err);
+      remote_.close(err);
     } else {
-      socket->close();
+      socket->close(err);
     }
 
-    if (socket_.is_open() || remote_.is_open()) {
+    if (socket_.is_open() || remote_.is_open() || disconnected_) {
       return;
     }
+    disconnected_ = true;
+    Trace(TraceEvent::kClose, idx_);
     observer_->Disconnect(idx_);
   }
 
  private:
+  static constexpr std::string_view kContinue = "HTTP/1.1 100 Continue\r\n\r\n";
+  // for an origin to answer Expect: 100-continue before the body goes on
+  static constexpr std::chrono::milliseconds kContinueWait{1000};
+  static constexpr std::string_view kEstablished =
+      "HTTP/1.1 200 Connection Established\r\n\r\n";
+
+  // Tells where a body framed by `BodyFraming` ends in the bytes that
+  // follow its head.
+  class BodyCursor {
+   public:
+    explicit BodyCursor(const BodyFraming &framing)
+        : kind_{framing.kind}, remaining_{framing.length} {}
+
+    // Returns how many bytes of `data` belong to the body.
+    size_t Feed(std::string_view data) {
+      switch (kind_) {
+        case BodyFraming::Kind::kNone:
+          return 0;
+        case BodyFraming::Kind::kLength: {
+          const auto len = std::min<uint64_t>(remaining_, data.size());
+          remaining_ -= len;
+          return len;
+        }
+        case BodyFraming::Kind::kChunked: {
+          const auto len = chunked_.Feed(data);
+          if (chunked_.Invalid()) {
+            throw SocksException("[tunnel] invalid chunked body");
+          }
+          return len;
+        }
+        case BodyFraming::Kind::kClose:
+          return data.size();
+      }
+      return 0;
+    }
+
+    [[nodiscard]] bool Done() const {
+      switch (kind_) {
+        case BodyFraming::Kind::kNone:
+          return true;
+        case BodyFraming::Kind::kLength:
+          return remaining_ == 0;
+        case BodyFraming::Kind::kChunked:
+          return chunked_.Done();
+        case BodyFraming::Kind::kClose:
+          return false;
+      }
+      return true;
+    }
+
+   private:
+    BodyFraming::Kind kind_;
+    uint64_t remaining_;
+    ChunkedScanner chunked_;
+  };
+
+  // Consumes the pending client bytes that belong to the body.
+  std::string_view TakeBody(BodyCursor &cursor) {
+    const auto data =
+        std::string_view{head_.data(), received_}.substr(pending_);
+    const auto len = cursor.Feed(data);
+    pending_ += len;
+    return data.substr(0, len);
+  }
+
+  // Relays the rest of the request body as it arrives.
+  asio::awaitable<void> RelayRequestBody(BodyCursor &cursor,
+                                         asio::ip::tcp::socket &remote) {
+    while (!cursor.Done()) {
+      if (pending_ == received_) {
+        pending_ = 0;
+        received_ = co_await socket_.async_read_some(asio::buffer(head_),
+                                                     asio::use_awaitable);
+      }
+      const auto body = TakeBody(cursor);
+      co_await asio::async_write(remote, asio::buffer(body),
+                                 asio::use_awaitable);
+      meter_.Forward(true, body);
+    }
+  }
+
   size_t idx_;
   asio::io_context &ctx_;
-  NetworkObserver *observer_;
+  NetworkRelay *observer_;
+  DnsResolver *resolver_;
+  UpstreamPool *pool_;
+  // null while caching is disabled
+  HttpCache *cache_;
+  // null when origins are connected to directly
+  ParentSelector *parents_;
+  const ConnectConfig &connect_;
+  // null when tunnels connect to their origins directly
+  ExitClient *exit_;
   asio::ip::tcp::socket socket_;
+  // origin of a tunnel or an upgraded connection
   asio::ip::tcp::socket remote_;
+  // a tunnel through the exit relay
+  std::shared_ptr<QuicStream> stream_;
+  std::deque<InFlight> in_flight_;
+  // wake the response writer and the request reader respectively
+  asio::steady_timer request_ready_;
+  asio::steady_timer response_done_;
+  bool reading_done_{false};
+  bool stopped_{false};
+  bool upgraded_{false};
+  // client bytes, [0, pending_) is handled, [pending_, received_) is not
+  std::vector<char> head_;
+  size_t pending_{0};
+  size_t received_{0};
+  ZeroCopyMode zero_copy_;
+  SockMap *sockmap_;
+  bool disconnected_{false};
+  TimerWheel &wheel_;
+  const TimeoutConfig &timeouts_;
+  // armed while a request head is awaited
+  TimerWheel::Timer header_timer_;
+  // armed while the origin may still answer Expect: 100-continue, the wait
+  // for it on `continue_remote_` is cancelled when it fires
+  TimerWheel::Timer continue_timer_;
+  asio::ip::tcp::socket *continue_remote_{nullptr};
+  bool continue_expired_{false};
+  // armed while a response is relayed from the origin `relaying_`, which is
+  // null in between, `response_active_` is the tick it last progressed
+  TimerWheel::Timer response_timer_;
+  asio::ip::tcp::socket *relaying_{nullptr};
+  uint64_t response_active_{0};
+  ThreadMetrics &metrics_;
+  RelayMeter meter_;
+  // end of the last stage timed, the accept to begin with
+  ThreadMetrics::Clock::time_point stage_start_;
+  bool first_request_{true};
 };
 
-class HttpProxyImpl final : public HttpProxy {
+class HttpProxyImpl final : public HttpProxy, Frontend {
  public:
-  explicit HttpProxyImpl(const uint16_t port)
-      : ctx_{ASIO_CONCURRENCY_HINT_UNSAFE_IO},
-        acceptor_{ctx_, asio::ip::tcp::endpoint{asio::ip::tcp::v4(), port}} {}
-  ~HttpProxyImpl() override {
-    ctx_.stop();
-    for (auto &&t : threads_) {
-      t.join();
+  explicit HttpProxyImpl(const HttpProxyConfig &config)
+      : Frontend{config.port, config.frontend}, config_{config} {
+    if (config_.cache.capacity > 0) {
+      cache_ = std::make_unique<HttpCache>(config_.cache);
     }
-  }
-  void Start() override {
-    co_spawn(
-        ctx_, [this] { return this->Accept(); }, asio::detached);
-    for (int i = 0; i < 8; ++i) {
-      threads_.emplace_back([this] { ctx_.run(); });
+    if (!config_.parent.parents.empty()) {
+      parents_ = std::make_unique<ParentSelector>(config_.parent);
+    }
+    for (size_t i = 0; i < reactor_.Size(); ++i) {
+      pools_.emplace_back(
+          std::make_unique<UpstreamPool>(reactor_.At(i).ctx, config_.pool));
+      if (config_.exit_relay) {
+        exits_.emplace_back(std::make_unique<ExitClient>(
+            reactor_.At(i).ctx, *config_.exit_relay, config_.quic));
+      }
     }
-    relay_.Start();
   }
+  ~HttpProxyImpl() override {
+    // pooled sockets have to go before the io_contexts they belong to
+    Stop();
+    pools_.clear();
+    exits_.clear();
+  }
+
+  void Start() override { Frontend::Start(); }
   void Register(NetworkObserver *observer) override {
-    relay_.Register(std::move(observer));
+    Frontend::Register(observer);
   }
+  CaptureStore *Capture() override { return Frontend::Capture(); }
+  void Wait() override { Frontend::Wait(); }
 
  private:
-  asio::awaitable<void> Accept() {
-    size_t idx{0};
-    std::atomic_size_t cnt{0};
-    while (true) {
-      try {
-        auto &&socket = co_await acceptor_.async_accept(asio::use_awaitable);
-        auto session =
-            std::make_shared<Session>(idx++, ctx_, &relay_, std::move(socket));
-        co_spawn(
-            ctx_,
-            [session, &cnt]() -> asio::awaitable<void> {
-              ++cnt;
-              co_await session->AsyncStart();
-              --cnt;
-            },
-            asio::detached);
-      } catch (const asio::system_error &e) {
-        SPDLOG_ERROR("accept exception, e={}", e.what());
-        break;
-      }
-    }
-  }
-
-  asio::io_context ctx_;
-  asio::ip::tcp::acceptor acceptor_;
-  std::vector<std::thread> threads_;
-  NetworkRelay relay_;
+  asio::awaitable<void> Serve(Reactor::Shard &shard, size_t idx,
+                              asio::ip::tcp::socket socket) override {
+    auto session = std::make_shared<Session>(
+        idx, shard.ctx, &relay_, &resolver_, pools_[shard.id].get(),
+        cache_.get(), parents_.get(), frontend_.connect,
+        exits_.empty() ? nullptr : exits_[shard.id].get(), std::move(socket),
+        frontend_.zero_copy, sockmap_.get(), shard.wheel, frontend_.timeouts,
+        shard.metrics);
+    co_await session->AsyncStart();
+  }
+
+  // Answers from the send buffer of the fresh socket without waiting on the
+  // client. What the client sent already is read first, closing a socket
+  // with unread data resets the connection and could discard the answer.
+  void Reject(asio::ip::tcp::socket &socket) override {
+    static constexpr std::string_view kUnavailable =
+        "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    asio::error_code err;
+    socket.non_blocking(true, err);
+    std::array<char, 1024> discard{};
+    while (!err) socket.read_some(asio::buffer(discard), err);
+    socket.write_some(asio::buffer(kUnavailable), err);
+    socket.shutdown(asio::socket_base::shutdown_send, err);
+    socket.close(err);
+  }
+
+  const HttpProxyConfig config_;
+  // one per shard, indexed by shard id
+  std::vector<std::unique_ptr<UpstreamPool>> pools_;
+  // shared by the shards, null unless `cache.capacity` is set
+  std::unique_ptr<HttpCache> cache_;
+  // shared by the shards, null unless `parent.parents` is set
+  std::unique_ptr<ParentSelector> parents_;
+  // one per shard when tunnels go through an exit relay
+  std::vector<std::unique_ptr<ExitClient>> exits_;
 };
 
 std::shared_ptr<HttpProxy> HttpProxy::Create(uint16_t port) {
-  return std::make_shared<HttpProxyImpl>(port);
+  return Create(HttpProxyConfig{.port = port});
+}
+
+std::shared_ptr<HttpProxy> HttpProxy::Create(const HttpProxyConfig &config) {
+  return std::make_shared<HttpProxyImpl>(config);
 }
 
 }  // namespace socks::tunnel
@@ -1,19 +1,49 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 
 #include "observer/network_observer.h"
+#include "tunnel/frontend.h"
+#include "tunnel/http_cache.h"
+#include "tunnel/parent_proxy.h"
+#include "tunnel/quic_exit.h"
+#include "tunnel/upstream_pool.h"
 #include "utility/ctor.h"
 
 namespace socks::tunnel {
 
+struct HttpProxyConfig {
+  uint16_t port{8999};
+  // zero copy applies to CONNECT tunnels, `timeouts.header` bounds request
+  // heads and admission turns clients away with a 503
+  FrontendConfig frontend;
+  // idle keep-alive connections to origins of plain http requests
+  UpstreamPoolConfig pool;
+  // GET responses kept in memory and served to every client, off by default
+  HttpCacheConfig cache;
+  // parent proxies connections to origins go through, balanced by their
+  // latency, none connects to origins directly
+  ParentConfig parent;
+  // hands CONNECT tunnels to this exit relay, one quic channel per io
+  // thread, instead of connecting to origins directly
+  std::optional<asio::ip::udp::endpoint> exit_relay;
+  QuicConfig quic;
+};
+
 class HttpProxy : Movable, NonCopyable {
  public:
   static std::shared_ptr<HttpProxy> Create(uint16_t port);
+  static std::shared_ptr<HttpProxy> Create(const HttpProxyConfig &config);
 
   virtual ~HttpProxy() = default;
   virtual void Start() = 0;
   virtual void Register(NetworkObserver *observer) = 0;
+  // retained traffic, null unless `relay.capture.dir` is set
+  virtual CaptureStore *Capture() = 0;
+  // Blocks until another instance took over by `upgrade.path` and the
+  // sessions left drained, forever without upgrades.
+  virtual void Wait() = 0;
 };
 
 }  // namespace socks::tunnel
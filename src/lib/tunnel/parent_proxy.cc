@@ -0,0 +1,345 @@
+#include "tunnel/parent_proxy.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <asio.hpp>
+#include <cstring>
+#include <memory>
+#include <random>
+
+#include "tunnel/entities.h"
+#include "utility/log.h"
+#include "utility/result.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+constexpr uint8_t kSocksVersion = 0x05;
+constexpr uint8_t kNoAuth = 0x00;
+constexpr uint8_t kConnect = 0x01;
+enum AddressType : uint8_t { kIpv4 = 0x01, kDomain = 0x03, kIpv6 = 0x04 };
+
+// greeting and request, the request with a domain of 255 bytes at the most
+constexpr size_t kMaxSocksRequest = 3 + 4 + 1 + 255 + 2;
+// a parent answering CONNECT with more than this is not one
+constexpr size_t kMaxResponseHead = 16 * 1024;
+constexpr size_t kPeekSize = 1024;
+
+int64_t Nanoseconds(ParentSelector::Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+std::string Authority(std::string_view host, uint16_t port) {
+  // ipv6 literals go in brackets
+  return host.find(':') == std::string_view::npos
+             ? fmt::format("{}:{}", host, port)
+             : fmt::format("[{}]:{}", host, port);
+}
+
+// The origin may speak first and the parent relays it right after its
+// answer, those bytes have to stay in the socket. The answer is peeked at
+// and only what belongs to it is read. An answer that isn't http fails
+// like a parent hanging up, a refusal throws SocksException.
+asio::awaitable<void> HttpHandshake(asio::ip::tcp::socket &socket,
+                                    std::string_view host, uint16_t port) {
+  const auto authority = Authority(host, port);
+  const auto request =
+      fmt::format("CONNECT {0} HTTP/1.1\r\nHost: {0}\r\n\r\n", authority);
+  co_await asio::async_write(socket, asio::buffer(request),
+                             asio::use_awaitable);
+
+  std::string head;
+  std::array<char, kPeekSize> peek{};
+  ResponseParser parser;
+  while (true) {
+    co_await socket.async_wait(asio::ip::tcp::socket::wait_read,
+                               asio::use_awaitable);
+    asio::error_code err;
+    const auto n = socket.receive(asio::buffer(peek),
+                                  asio::socket_base::message_peek, err);
+    if (err == asio::error::would_block) continue;
+    if (err) throw asio::system_error{err};
+
+    const auto seen = head.size();
+    head.append(peek.data(), n);
+    const auto status = parser.Feed(head);
+    if (status == ResponseParser::Status::kInvalid) {
+      throw asio::system_error{
+          asio::error::connection_aborted,
+          fmt::format("[tunnel] parse parent response failed, {}",
+                      parser.Error())};
+    }
+    const auto take = status == ResponseParser::Status::kDone
+                          ? parser.Entity().raw.size() - seen
+                          : n;
+    co_await asio::async_read(socket, asio::buffer(peek.data(), take),
+                              asio::use_awaitable);
+    if (status == ResponseParser::Status::kDone) break;
+    if (head.size() >= kMaxResponseHead) {
+      throw asio::system_error{asio::error::connection_aborted,
+                               "[tunnel] parent response head too large"};
+    }
+  }
+  const auto code = parser.Entity().status;
+  if (code < 200 || code >= 300) {
+    throw SocksException(fmt::format(
+        "[tunnel] parent refused tunnel, target={}, status={}", authority,
+        code));
+  }
+}
+
+// Sends the greeting and the request at once, RFC 1928 leaves a server
+// that offered no authentication nothing to wait for. Failures are thrown
+// as in HttpHandshake.
+asio::awaitable<void> Socks5Handshake(asio::ip::tcp::socket &socket,
+                                      std::string_view host, uint16_t port) {
+  std::array<uint8_t, kMaxSocksRequest> request{
+      kSocksVersion, 1, kNoAuth, kSocksVersion, kConnect, 0};
+  size_t len{6};
+  asio::error_code err;
+  const auto address = asio::ip::make_address(host, err);
+  if (!err && address.is_v4()) {
+    request[len++] = kIpv4;
+    const auto bytes = address.to_v4().to_bytes();
+    std::memcpy(request.data() + len, bytes.data(), bytes.size());
+    len += bytes.size();
+  } else if (!err) {
+    request[len++] = kIpv6;
+    const auto bytes = address.to_v6().to_bytes();
+    std::memcpy(request.data() + len, bytes.data(), bytes.size());
+    len += bytes.size();
+  } else {
+    if (host.empty() || host.size() > 255) {
+      throw SocksException(
+          fmt::format("[tunnel] host not addressable, host={}", host));
+    }
+    request[len++] = kDomain;
+    request[len++] = static_cast<uint8_t>(host.size());
+    std::memcpy(request.data() + len, host.data(), host.size());
+    len += host.size();
+  }
+  request[len++] = static_cast<uint8_t>(port >> 8);
+  request[len++] = static_cast<uint8_t>(port & 0xff);
+  co_await asio::async_write(socket, asio::buffer(request.data(), len),
+                             asio::use_awaitable);
+
+  // method selection, then the reply up to the type of its bound address
+  std::array<uint8_t, 2 + 4 + 256 + 2> reply{};
+  co_await asio::async_read(socket, asio::buffer(reply.data(), 6),
+                            asio::use_awaitable);
+  if (reply[0] != kSocksVersion || reply[1] != kNoAuth ||
+      reply[2] != kSocksVersion) {
+    throw asio::system_error{asio::error::connection_aborted,
+                             "[tunnel] parent wants authentication or is no "
+                             "socks5 server"};
+  }
+  if (reply[3] != 0) {
+    throw SocksException(fmt::format(
+        "[tunnel] parent refused tunnel, target={}, reply={}",
+        Authority(host, port), reply[3]));
+  }
+  size_t rest{0};
+  switch (reply[5]) {
+    case kIpv4:
+      rest = 4 + 2;
+      break;
+    case kIpv6:
+      rest = 16 + 2;
+      break;
+    case kDomain:
+      co_await asio::async_read(socket, asio::buffer(reply.data() + 6, 1),
+                                asio::use_awaitable);
+      rest = reply[6] + 2;
+      break;
+    default:
+      throw asio::system_error{asio::error::connection_aborted,
+                               "[tunnel] parent reply invalid"};
+  }
+  co_await asio::async_read(socket, asio::buffer(reply.data() + 7, rest),
+                            asio::use_awaitable);
+}
+
+// Connects to `parent` and has it open a tunnel to `host`:`port`. The
+// handshake gets the connect timeout on its own, past it the socket is
+// closed under it.
+asio::awaitable<asio::ip::tcp::socket> ConnectParent(
+    const ParentProxy &parent, DnsResolver &resolver, std::string_view host,
+    uint16_t port, const ConnectConfig &config) {
+  const auto addresses = co_await resolver.AsyncResolve(parent.host);
+  std::vector<asio::ip::tcp::endpoint> endpoints;
+  endpoints.reserve(addresses.size());
+  for (const auto &address : addresses) {
+    endpoints.emplace_back(address, parent.port);
+  }
+  endpoints = InterleaveFamilies(std::move(endpoints), config.prefer_ipv6);
+  // the timer may fire after the socket left, it then closes an empty one
+  auto socket = std::make_shared<asio::ip::tcp::socket>(
+      co_await AsyncConnect(endpoints, config));
+  auto expired = std::make_shared<bool>(false);
+  asio::steady_timer deadline{co_await asio::this_coro::executor,
+                              config.timeout};
+  deadline.async_wait([socket, expired](const asio::error_code &err) {
+    if (err) return;
+    *expired = true;
+    asio::error_code ignored;
+    socket->close(ignored);
+  });
+  try {
+    if (parent.protocol == ParentProxy::Protocol::kSocks5) {
+      co_await Socks5Handshake(*socket, host, port);
+    } else {
+      co_await HttpHandshake(*socket, host, port);
+    }
+  } catch (const asio::system_error &) {
+    if (*expired) throw asio::system_error{asio::error::timed_out};
+    throw;
+  }
+  deadline.cancel();
+  co_return std::move(*socket);
+}
+
+}  // namespace
+
+ParentSelector::ParentSelector(const ParentConfig &config)
+    : config_{config}, states_(config.parents.size()) {}
+
+std::optional<size_t> ParentSelector::Pick(std::span<const size_t> tried) {
+  thread_local std::minstd_rand random{std::random_device{}()};
+  const auto now = Nanoseconds(Clock::now().time_since_epoch());
+  std::vector<size_t> healthy, untried;
+  for (size_t i = 0; i < states_.size(); ++i) {
+    if (std::ranges::find(tried, i) != tried.end()) continue;
+    untried.push_back(i);
+    if (states_[i].down_until.load(std::memory_order_relaxed) <= now) {
+      healthy.push_back(i);
+    }
+  }
+  if (untried.empty()) return std::nullopt;
+
+  size_t pick{0};
+  if (healthy.empty()) {
+    // with every parent down the one failing least recently may be back
+    pick = *std::ranges::min_element(untried, {}, [this](size_t i) {
+      return states_[i].down_until.load(std::memory_order_relaxed);
+    });
+  } else if (healthy.size() == 1) {
+    pick = healthy.front();
+  } else {
+    std::uniform_int_distribution<size_t> first{0, healthy.size() - 1};
+    std::uniform_int_distribution<size_t> second{0, healthy.size() - 2};
+    const auto a = first(random);
+    auto b = second(random);
+    if (b >= a) ++b;
+    const auto seed = UnmeasuredLatency();
+    pick = Score(healthy[b], seed) < Score(healthy[a], seed) ? healthy[b]
+                                                             : healthy[a];
+  }
+  states_[pick].in_flight.fetch_add(1, std::memory_order_relaxed);
+  return pick;
+}
+
+void ParentSelector::Succeeded(size_t parent, Clock::duration latency) {
+  auto &state = states_[parent];
+  state.in_flight.fetch_sub(1, std::memory_order_relaxed);
+  state.down_until.store(0, std::memory_order_relaxed);
+  // 0 marks a parent never measured
+  const auto sample = std::max<int64_t>(Nanoseconds(latency), 1);
+  auto old = state.latency.load(std::memory_order_relaxed);
+  int64_t next{0};
+  do {
+    next = old == 0 ? sample
+                    : old + static_cast<int64_t>(
+                                config_.decay *
+                                static_cast<double>(sample - old));
+    next = std::max<int64_t>(next, 1);
+  } while (!state.latency.compare_exchange_weak(old, next,
+                                                std::memory_order_relaxed));
+}
+
+void ParentSelector::Failed(size_t parent) {
+  auto &state = states_[parent];
+  state.in_flight.fetch_sub(1, std::memory_order_relaxed);
+  const auto now = Nanoseconds(Clock::now().time_since_epoch());
+  const auto until = now + Nanoseconds(config_.cooldown);
+  if (state.down_until.exchange(until, std::memory_order_relaxed) <= now) {
+    const auto &proxy = config_.parents[parent];
+    SPDLOG_WARN("[tunnel] parent down, parent={}, cooldown={}s",
+                Authority(proxy.host, proxy.port), config_.cooldown.count());
+  }
+}
+
+void ParentSelector::Refused(size_t parent) {
+  states_[parent].in_flight.fetch_sub(1, std::memory_order_relaxed);
+}
+
+ParentSelector::Clock::duration ParentSelector::Latency(size_t parent) const {
+  return std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds{
+      states_[parent].latency.load(std::memory_order_relaxed)});
+}
+
+size_t ParentSelector::InFlight(size_t parent) const {
+  return states_[parent].in_flight.load(std::memory_order_relaxed);
+}
+
+int64_t ParentSelector::UnmeasuredLatency() const {
+  int64_t sum{0};
+  int64_t measured{0};
+  for (const auto &state : states_) {
+    const auto latency = state.latency.load(std::memory_order_relaxed);
+    if (latency == 0) continue;
+    sum += latency;
+    ++measured;
+  }
+  return measured == 0 ? 1 : sum / measured;
+}
+
+double ParentSelector::Score(size_t parent, int64_t unmeasured) const {
+  const auto &state = states_[parent];
+  auto latency = state.latency.load(std::memory_order_relaxed);
+  if (latency == 0) latency = unmeasured;
+  return static_cast<double>(latency) *
+         (state.in_flight.load(std::memory_order_relaxed) + 1);
+}
+
+asio::awaitable<asio::ip::tcp::socket> AsyncConnectThrough(
+    ParentSelector &selector, DnsResolver &resolver, std::string_view host,
+    uint16_t port, const ConnectConfig &config) {
+  std::vector<size_t> tried;
+  asio::error_code error{asio::error::host_unreachable};
+  while (tried.size() < std::max<size_t>(selector.MaxAttempts(), 1)) {
+    const auto parent = selector.Pick(tried);
+    if (!parent) break;
+    tried.push_back(*parent);
+    const auto &proxy = selector.Parent(*parent);
+    const auto start = ParentSelector::Clock::now();
+    std::optional<asio::ip::tcp::socket> socket;
+    try {
+      socket.emplace(co_await ConnectParent(proxy, resolver, host, port,
+                                            config));
+    } catch (const SocksException &) {
+      // any other parent would refuse the target as well
+      selector.Refused(*parent);
+      throw;
+    } catch (const asio::system_error &e) {
+      SPDLOG_DEBUG("[tunnel] parent connect failed, parent={}, e={}",
+                   Authority(proxy.host, proxy.port), e.what());
+      selector.Failed(*parent);
+      error = e.code();
+      continue;
+    } catch (const std::exception &e) {
+      SPDLOG_DEBUG("[tunnel] parent handshake failed, parent={}, e={}",
+                   Authority(proxy.host, proxy.port), e.what());
+      selector.Failed(*parent);
+      error = asio::error::connection_aborted;
+      continue;
+    }
+    selector.Succeeded(*parent, ParentSelector::Clock::now() - start);
+    co_return std::move(*socket);
+  }
+  throw asio::system_error{error};
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,108 @@
+#ifndef QUIC_SOCKS_TUNNEL_PARENT_PROXY_H_
+#define QUIC_SOCKS_TUNNEL_PARENT_PROXY_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/ip/tcp.hpp>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tunnel/dns_resolver.h"
+#include "tunnel/happy_eyeballs.h"
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+struct ParentProxy {
+  enum class Protocol { kHttp, kSocks5 };
+
+  // HTTP CONNECT, or a SOCKS5 CONNECT without authentication
+  Protocol protocol{Protocol::kHttp};
+  std::string host;
+  uint16_t port{0};
+};
+
+struct ParentConfig {
+  // connections to origins go through one of these, none connects to
+  // origins directly
+  std::vector<ParentProxy> parents;
+  // weight of the latest handshake in the moving average of a parent
+  double decay{0.3};
+  // a parent that could not be reached is left out for as long, unless
+  // every parent is
+  std::chrono::seconds cooldown{10};
+  // parents tried for one connection before giving up
+  size_t max_attempts{3};
+};
+
+// Picks the parent for each connection, shared by all io threads. Two
+// parents are drawn at random and the one with the lower moving average of
+// handshake latency, scaled by its handshakes in flight, wins. A slow
+// parent thus gets fewer connections without being starved of the ones
+// that would show it recovered. Parents not measured yet count with the
+// mean latency of those that are.
+//
+// Load means handshakes only. Connections leave the selector once set up,
+// pooled or tunnelled for however long, a parent busy with them shows in
+// the latency of its next handshakes instead.
+class ParentSelector : NonCopyable {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit ParentSelector(const ParentConfig &config);
+
+  [[nodiscard]] size_t Size() const { return config_.parents.size(); }
+  [[nodiscard]] const ParentProxy &Parent(size_t i) const {
+    return config_.parents[i];
+  }
+  [[nodiscard]] size_t MaxAttempts() const { return config_.max_attempts; }
+
+  // Picks a parent for an attempt other than those in `tried`, null when
+  // none is left. The attempt then counts as in flight until reported.
+  std::optional<size_t> Pick(std::span<const size_t> tried);
+  // The parent set up the tunnel after `latency`.
+  void Succeeded(size_t parent, Clock::duration latency);
+  // The parent could not be reached, hung up or answered garbage, it sits
+  // out the cooldown.
+  void Failed(size_t parent);
+  // The parent answered but refused the tunnel, the origin is to blame.
+  void Refused(size_t parent);
+
+  // 0 before the first handshake
+  [[nodiscard]] Clock::duration Latency(size_t parent) const;
+  // handshakes picked and not reported yet
+  [[nodiscard]] size_t InFlight(size_t parent) const;
+
+ private:
+  struct State {
+    std::atomic<int64_t> latency{0};
+    std::atomic<uint32_t> in_flight{0};
+    std::atomic<int64_t> down_until{0};
+  };
+
+  // in nanoseconds, taken for parents without a handshake yet, so that the
+  // connections of a burst before the first one completed spread out too
+  [[nodiscard]] int64_t UnmeasuredLatency() const;
+  [[nodiscard]] double Score(size_t parent, int64_t unmeasured) const;
+
+  const ParentConfig config_;
+  std::vector<State> states_;
+};
+
+// Connects to `host`:`port` through the parents of `selector`, failing
+// over to another parent when one can't be reached, hangs up or answers
+// garbage during the handshake. `config` applies to the connects to parents, its timeout to
+// each handshake too. Throws asio::system_error with the last error when
+// no parent could be reached, and SocksException when a parent refused
+// the tunnel.
+asio::awaitable<asio::ip::tcp::socket> AsyncConnectThrough(
+    ParentSelector &selector, DnsResolver &resolver, std::string_view host,
+    uint16_t port, const ConnectConfig &config);
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_PARENT_PROXY_H_
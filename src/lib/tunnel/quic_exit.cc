@@ -0,0 +1,280 @@
+#include "tunnel/quic_exit.h"
+
+#include <fmt/format.h>
+
+#include <asio.hpp>
+#include <vector>
+
+#include "tunnel/asio_helper.h"
+#include "utility/log.h"
+#include "utility/result.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+constexpr size_t kChunk = 16 * 1024;
+
+// the relay's answer to a target
+enum Status : uint8_t {
+  kOk = 0,
+  kHostNotFound = 1,
+  kUnreachable = 2,
+  kForbidden = 3,
+};
+
+// Addresses of the network the relay sits in rather than of the internet:
+// unspecified, loopback, private, shared (RFC 6598), link local and
+// multicast ones.
+bool Internal(const asio::ip::address &address) {
+  if (address.is_v6()) {
+    const auto v6 = address.to_v6();
+    if (v6.is_v4_mapped()) {
+      return Internal(asio::ip::make_address_v4(asio::ip::v4_mapped, v6));
+    }
+    // fc00::/7, unique local
+    const bool unique_local = (v6.to_bytes()[0] & 0xfe) == 0xfc;
+    return v6.is_unspecified() || v6.is_loopback() || v6.is_link_local() ||
+           v6.is_site_local() || v6.is_multicast() || unique_local;
+  }
+  const auto v4 = address.to_v4().to_uint();
+  const auto in = [v4](uint32_t net, int bits) {
+    return v4 >> (32 - bits) == net >> (32 - bits);
+  };
+  return in(0x00000000, 8) || in(0x0a000000, 8) || in(0x64400000, 10) ||
+         in(0x7f000000, 8) || in(0xa9fe0000, 16) || in(0xac100000, 12) ||
+         in(0xc0a80000, 16) || in(0xe0000000, 3);
+}
+
+// [host length][host][port], the port big endian
+std::string EncodeTarget(std::string_view host, uint16_t port) {
+  std::string target;
+  target.reserve(host.size() + 3);
+  target.push_back(static_cast<char>(host.size()));
+  target.append(host);
+  target.push_back(static_cast<char>(port >> 8));
+  target.push_back(static_cast<char>(port & 0xff));
+  return target;
+}
+
+// Reads the target off the front of `stream`, leaves what followed it in
+// `rest`. Returns false when the stream ended before.
+asio::awaitable<bool> ReadTarget(QuicStream &stream, std::string &host,
+                                 uint16_t &port, std::string &rest) {
+  std::string head;
+  std::array<char, 512> buf{};
+  while (head.empty() ||
+         head.size() < static_cast<uint8_t>(head[0]) + size_t{3}) {
+    const auto len = co_await stream.AsyncReadSome(asio::buffer(buf));
+    if (len == 0) co_return false;
+    head.append(buf.data(), len);
+  }
+  const size_t host_len = static_cast<uint8_t>(head[0]);
+  host = head.substr(1, host_len);
+  port = static_cast<uint8_t>(head[host_len + 1]) << 8 |
+         static_cast<uint8_t>(head[host_len + 2]);
+  rest = head.substr(host_len + 3);
+  co_return true;
+}
+
+// Copies the stream to the target until the proxy finished its side.
+asio::awaitable<void> Upload(QuicStream &stream,
+                             asio::ip::tcp::socket &remote) {
+  std::vector<char> buf(kChunk);
+  asio::error_code err;
+  try {
+    while (true) {
+      const auto len = co_await stream.AsyncReadSome(asio::buffer(buf));
+      if (len == 0) break;
+      co_await asio::async_write(remote, asio::buffer(buf.data(), len),
+                                 asio::use_awaitable);
+    }
+    remote.shutdown(asio::socket_base::shutdown_send, err);
+  } catch (asio::system_error &e) {
+    stream.Reset();
+    remote.close(err);
+  }
+}
+
+// Copies the target to the stream until the target finished its side.
+asio::awaitable<void> Download(QuicStream &stream,
+                               asio::ip::tcp::socket &remote) {
+  std::vector<char> buf(kChunk);
+  asio::error_code err;
+  try {
+    while (true) {
+      const auto len = co_await remote.async_read_some(asio::buffer(buf),
+                                                       asio::use_awaitable);
+      co_await stream.AsyncWrite(asio::buffer(buf.data(), len));
+    }
+  } catch (asio::system_error &e) {
+    if (e.code() == asio::error::eof) {
+      stream.Shutdown();
+    } else {
+      stream.Reset();
+      remote.close(err);
+    }
+  }
+}
+
+// Throws before anything is bound when other hosts could reach the relay.
+// The channel is not encrypted: on the path its key is there for the
+// taking, and with it the relay.
+const ExitRelayConfig &Checked(const ExitRelayConfig &config) {
+  if (!config.endpoint.address().is_loopback()) {
+    throw SocksException(fmt::format(
+        "[exit] the channel is not encrypted, bind loopback only, address={}",
+        config.endpoint.address().to_string()));
+  }
+  return config;
+}
+
+}  // namespace
+
+ExitRelay::ExitRelay(asio::io_context &ctx, const ExitRelayConfig &config)
+    : ctx_{ctx},
+      config_{Checked(config)},
+      resolver_{config.resolver},
+      listener_{ctx, config.endpoint, config.quic} {
+  SPDLOG_INFO("[exit] listening, port={}", listener_.LocalEndpoint().port());
+  co_spawn(ctx_, AcceptChannels(), asio::detached);
+}
+
+ExitRelay::~ExitRelay() { Close(); }
+
+void ExitRelay::Close() { listener_.Close(); }
+
+asio::awaitable<void> ExitRelay::AcceptChannels() {
+  try {
+    while (true) {
+      auto channel = co_await listener_.AsyncAccept();
+      SPDLOG_DEBUG("[exit] accept channel, peer={}:{}",
+                   channel->Peer().address().to_string(),
+                   channel->Peer().port());
+      co_spawn(ctx_, AcceptStreams(std::move(channel)), asio::detached);
+    }
+  } catch (asio::system_error &e) {
+  }
+}
+
+asio::awaitable<void> ExitRelay::AcceptStreams(
+    std::shared_ptr<QuicChannel> channel) {
+  try {
+    while (true) {
+      co_spawn(ctx_, Serve(co_await channel->AsyncAccept()), asio::detached);
+    }
+  } catch (asio::system_error &e) {
+    SPDLOG_DEBUG("[exit] channel closed, e={}", e.what());
+  }
+}
+
+asio::awaitable<void> ExitRelay::Serve(std::shared_ptr<QuicStream> stream) {
+  std::string host, rest;
+  uint16_t port{0};
+  asio::ip::tcp::socket remote{ctx_};
+  try {
+    if (!co_await ReadTarget(*stream, host, port, rest)) {
+      stream->Reset();
+      co_return;
+    }
+    Status status{kOk};
+    try {
+      const auto addresses = co_await resolver_.AsyncResolve(host);
+      std::vector<asio::ip::tcp::endpoint> endpoints;
+      for (const auto &address : addresses) {
+        if (!config_.allow_internal && Internal(address)) continue;
+        endpoints.emplace_back(address, port);
+      }
+      if (endpoints.empty()) {
+        throw asio::system_error{asio::error::access_denied};
+      }
+      endpoints = InterleaveFamilies(std::move(endpoints),
+                                     config_.connect.prefer_ipv6);
+      remote = co_await AsyncConnect(endpoints, config_.connect);
+    } catch (asio::system_error &e) {
+      SPDLOG_DEBUG("[exit] connect failed, host={}, port={}, e={}", host,
+                   port, e.what());
+      if (e.code() == asio::error::host_not_found ||
+          e.code() == asio::error::host_not_found_try_again) {
+        status = kHostNotFound;
+      } else if (e.code() == asio::error::access_denied) {
+        status = kForbidden;
+      } else {
+        status = kUnreachable;
+      }
+    }
+    co_await stream->AsyncWrite(asio::buffer(&status, 1));
+    if (status != kOk) {
+      stream->Shutdown();
+      co_return;
+    }
+    if (!rest.empty()) {
+      co_await asio::async_write(remote, asio::buffer(rest),
+                                 asio::use_awaitable);
+    }
+  } catch (asio::system_error &e) {
+    stream->Reset();
+    co_return;
+  }
+
+  co_await WaitAll(ctx_, Upload(*stream, remote), Download(*stream, remote));
+}
+
+ExitClient::ExitClient(asio::io_context &ctx,
+                       const asio::ip::udp::endpoint &relay,
+                       const QuicConfig &config)
+    : ctx_{ctx}, relay_{relay}, config_{config} {}
+
+ExitClient::~ExitClient() {
+  if (channel_) channel_->Close();
+}
+
+asio::awaitable<std::shared_ptr<QuicChannel>> ExitClient::AsyncChannel() {
+  while (connecting_) co_await connected_.Wait();
+  if (channel_ && !channel_->Closed()) co_return channel_;
+
+  // a ticket is redeemed once, the one of the closed channel is unused
+  if (channel_) ticket_ = channel_->Ticket();
+  connecting_ = true;
+  try {
+    channel_ = co_await QuicChannel::AsyncConnect(relay_, config_,
+                                                  std::exchange(ticket_, {}));
+  } catch (asio::system_error &e) {
+    SPDLOG_WARN("[exit] connect relay failed, relay={}:{}, e={}",
+                relay_.address().to_string(), relay_.port(), e.what());
+    channel_.reset();
+    connecting_ = false;
+    connected_.NotifyAll();
+    throw;
+  }
+  connecting_ = false;
+  connected_.NotifyAll();
+  co_return channel_;
+}
+
+asio::awaitable<std::shared_ptr<QuicStream>> ExitClient::AsyncOpen(
+    std::string_view host, uint16_t port) {
+  if (host.size() > UINT8_MAX) {
+    throw asio::system_error{asio::error::host_not_found};
+  }
+  const auto target = EncodeTarget(host, port);
+  const auto channel = co_await AsyncChannel();
+  auto stream = co_await channel->AsyncOpen();
+  co_await stream->AsyncWrite(asio::buffer(target));
+
+  uint8_t status{kUnreachable};
+  const auto len = co_await stream->AsyncReadSome(asio::buffer(&status, 1));
+  if (len == 0 || status != kOk) {
+    stream->Reset();
+    if (status == kHostNotFound) {
+      throw asio::system_error{asio::error::host_not_found};
+    }
+    if (status == kForbidden) {
+      throw asio::system_error{asio::error::access_denied};
+    }
+    throw asio::system_error{asio::error::connection_refused};
+  }
+  co_return stream;
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,93 @@
+#ifndef QUIC_SOCKS_TUNNEL_QUIC_EXIT_H_
+#define QUIC_SOCKS_TUNNEL_QUIC_EXIT_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/udp.hpp>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+#include "channel/quic_channel.h"
+#include "coro/waiter_list.h"
+#include "tunnel/dns_resolver.h"
+#include "tunnel/happy_eyeballs.h"
+#include "utility/ctor.h"
+
+// A local proxy hands its tunnels to an exit relay, each tunnel a stream of
+// a QuicChannel. A stream starts with the target, the relay answers with a
+// status byte once it connected, then both directions carry the payload
+// until each side finished. The channel is not encrypted, so the relay only
+// binds loopback: other hosts reach it through a tunnel that is, such as
+// WireGuard or ssh.
+namespace socks::tunnel {
+
+struct ExitRelayConfig {
+  // loopback only, the channel carries the key and the payload in the clear
+  asio::ip::udp::endpoint endpoint{asio::ip::address_v4::loopback(), 8998};
+  // the key proxies present is `quic.psk`
+  QuicConfig quic;
+  // connect to targets on loopback, private, link local and the like, the
+  // relay's own network is off limits to proxies otherwise
+  bool allow_internal{false};
+  // lookups and connects to the targets
+  ResolverConfig resolver;
+  ConnectConfig connect;
+};
+
+// Serves tunnels of local proxies, connecting to their targets.
+class ExitRelay : NonCopyable {
+ public:
+  // Throws SocksException when `config` binds anything but loopback.
+  ExitRelay(asio::io_context &ctx, const ExitRelayConfig &config);
+  ~ExitRelay();
+
+  void Close();
+  [[nodiscard]] asio::ip::udp::endpoint LocalEndpoint() const {
+    return listener_.LocalEndpoint();
+  }
+
+ private:
+  asio::awaitable<void> AcceptChannels();
+  asio::awaitable<void> AcceptStreams(std::shared_ptr<QuicChannel> channel);
+  asio::awaitable<void> Serve(std::shared_ptr<QuicStream> stream);
+
+  asio::io_context &ctx_;
+  const ExitRelayConfig config_;
+  DnsResolver resolver_;
+  QuicListener listener_;
+};
+
+// Opens tunnels through an exit relay, all over one channel that is
+// reconnected when it closed. The ticket of the last channel lets the next
+// one send its first tunnels without waiting for the handshake. Like the
+// sockets of a reactor shard, a client is used from its shard's thread only.
+class ExitClient : NonCopyable {
+ public:
+  ExitClient(asio::io_context &ctx, const asio::ip::udp::endpoint &relay,
+             const QuicConfig &config);
+  ~ExitClient();
+
+  // Returns the stream once the relay connected to `host`:`port`. Throws
+  // asio::system_error, host_not_found or connection_refused when the relay
+  // failed, access_denied when it may not connect there.
+  asio::awaitable<std::shared_ptr<QuicStream>> AsyncOpen(std::string_view host,
+                                                         uint16_t port);
+  [[nodiscard]] const asio::ip::udp::endpoint &Relay() const { return relay_; }
+
+ private:
+  asio::awaitable<std::shared_ptr<QuicChannel>> AsyncChannel();
+
+  asio::io_context &ctx_;
+  const asio::ip::udp::endpoint relay_;
+  const QuicConfig config_;
+  std::shared_ptr<QuicChannel> channel_;
+  std::optional<QuicTicket> ticket_;
+  // concurrent opens wait for a single connect
+  bool connecting_{false};
+  WaiterList connected_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_QUIC_EXIT_H_
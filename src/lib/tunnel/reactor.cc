@@ -0,0 +1,298 @@
+#include "tunnel/reactor.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <asio.hpp>
+#include <cerrno>
+#include <optional>
+
+#include "utility/log.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+// how long io_uring accepts rest after running out of descriptors
+constexpr auto kAcceptBackoff = std::chrono::milliseconds{100};
+
+#if defined(__linux__) && defined(SO_REUSEPORT)
+constexpr bool kReusePort = true;
+using ReusePort =
+    asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#else
+constexpr bool kReusePort = false;
+#endif
+
+// Whether a listening socket is part of a SO_REUSEPORT group, more sockets
+// may join it then.
+bool HasReusePort(int fd) {
+#if defined(__linux__) && defined(SO_REUSEPORT)
+  int value{0};
+  socklen_t len = sizeof(value);
+  return ::getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &value, &len) == 0 &&
+         value != 0;
+#else
+  return false;
+#endif
+}
+
+// Whether an inherited `fd` is a TCP socket listening on `endpoint`, where a
+// port of 0 matches any. A socket bound elsewhere is left over from an older
+// configuration.
+bool ListensOn(int fd, const asio::ip::tcp::endpoint &endpoint) {
+#ifdef __linux__
+  int type{0}, listening{0};
+  socklen_t len = sizeof(int);
+  if (::getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0 ||
+      type != SOCK_STREAM) {
+    return false;
+  }
+  len = sizeof(int);
+  if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 ||
+      listening == 0) {
+    return false;
+  }
+  asio::ip::tcp::endpoint local;
+  auto size = static_cast<socklen_t>(local.capacity());
+  if (::getsockname(fd, local.data(), &size) != 0 || size > local.capacity()) {
+    return false;
+  }
+  local.resize(size);
+  return local.protocol() == endpoint.protocol() &&
+         local.address() == endpoint.address() &&
+         (endpoint.port() == 0 || local.port() == endpoint.port());
+#else
+  return false;
+#endif
+}
+
+// Errors io_uring accepts end with where the kernel lacks multishot accept
+// or doesn't let the process use io_uring at all.
+bool UringUnsupported(const asio::error_code &err) {
+  if (err.category() != asio::error::get_system_category()) return false;
+  switch (err.value()) {
+    case EINVAL:
+    case ENOSYS:
+    case EPERM:
+    case EOPNOTSUPP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Errors of accepts that would fail again right away, out of descriptors or
+// memory.
+bool OutOfResources(const asio::error_code &err) {
+  return err == asio::error::no_descriptors || err == asio::error::no_memory ||
+         err == asio::error::no_buffer_space ||
+         (err.category() == asio::error::get_system_category() &&
+          err.value() == ENFILE);
+}
+
+void PinCurrentThread(size_t id) {
+#ifdef __linux__
+  const auto cpus = std::max(1u, std::thread::hardware_concurrency());
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(id % cpus, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    SPDLOG_WARN("[reactor] pin thread failed, shard={}", id);
+  }
+#endif
+}
+
+}  // namespace
+
+Reactor::Reactor(size_t threads, bool pin, IoBackend backend)
+    : pin_{pin}, backend_{backend} {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  shards_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    shards_.emplace_back(std::make_unique<Shard>(i));
+  }
+}
+
+Reactor::~Reactor() { Stop(); }
+
+void Reactor::Stop() {
+  for (auto &&shard : shards_) {
+    shard->work.reset();
+    shard->ctx.stop();
+  }
+  for (auto &&shard : shards_) {
+    if (shard->thread.joinable()) shard->thread.join();
+  }
+}
+
+MetricsSnapshot Reactor::Metrics() const {
+  MetricsSnapshot snapshot;
+  for (const auto &shard : shards_) snapshot.Add(shard->metrics);
+  return snapshot;
+}
+
+void Reactor::Listen(const asio::ip::tcp::endpoint &endpoint,
+                     AcceptHandler handler, ConnManager *conns,
+                     std::span<const int> inherited) {
+  handler_ = std::move(handler);
+  conns_ = conns;
+  std::vector<int> adopted;
+  for (const int fd : inherited) {
+    if (ListensOn(fd, endpoint)) {
+      adopted.push_back(fd);
+      continue;
+    }
+    SPDLOG_WARN("[reactor] inherited socket not listening on endpoint, fd={}",
+                fd);
+#ifdef __linux__
+    ::close(fd);
+#endif
+  }
+  reuse_port_ = kReusePort && shards_.size() > 1 &&
+                (adopted.empty() || HasReusePort(adopted.front()));
+  for (size_t i = 0; i < adopted.size(); ++i) {
+    auto &shard = reuse_port_ ? *shards_[i % shards_.size()] : *shards_[0];
+    shard.acceptors.emplace_back(shard.ctx, endpoint.protocol(), adopted[i]);
+  }
+  for (auto &&shard : shards_) {
+    if (!shard->acceptors.empty()) continue;
+    if (!reuse_port_ && !adopted.empty()) break;
+    auto &acceptor = shard->acceptors.emplace_back(shard->ctx);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    if (reuse_port_) acceptor.set_option(ReusePort(true));
+#endif
+    acceptor.bind(endpoint);
+    acceptor.listen();
+    if (!reuse_port_) break;
+  }
+  size_t urings{0};
+  for (auto &&shard : shards_) {
+    for (auto &acceptor : shard->acceptors) {
+      auto &uring = shard->urings.emplace_back();
+      if (backend_ == IoBackend::kIoUring) {
+        uring = UringAcceptor::Create(shard->ctx, acceptor);
+        if (uring) ++urings;
+      }
+    }
+  }
+  if (backend_ == IoBackend::kIoUring && urings == 0) {
+    SPDLOG_WARN("[reactor] io_uring not supported, fallback to epoll");
+  }
+  SPDLOG_INFO(
+      "[reactor] listening, endpoint={}:{}, shards={}, reuse_port={}, "
+      "inherited={}",
+      endpoint.address().to_string(), endpoint.port(), shards_.size(),
+      reuse_port_, adopted.size());
+}
+
+std::vector<int> Reactor::ListeningHandles() {
+  std::vector<int> handles;
+  for (auto &&shard : shards_) {
+    for (auto &acceptor : shard->acceptors) {
+      handles.emplace_back(acceptor.native_handle());
+    }
+  }
+  return handles;
+}
+
+void Reactor::StopAccepting() {
+  for (auto &&shard : shards_) {
+    asio::post(shard->ctx, [&s = *shard] {
+      asio::error_code err;
+      for (auto &uring : s.urings) {
+        if (uring) uring->Close();
+      }
+      for (auto &acceptor : s.acceptors) acceptor.close(err);
+    });
+  }
+}
+
+void Reactor::Start() {
+  for (auto &&shard : shards_) {
+    for (size_t i = 0; i < shard->acceptors.size(); ++i) {
+      co_spawn(
+          shard->ctx,
+          [this, &s = *shard, i] {
+            return this->Accept(s, s.acceptors[i], s.urings[i].get());
+          },
+          asio::detached);
+    }
+    shard->thread = std::thread([this, &s = *shard] {
+      if (pin_) PinCurrentThread(s.id);
+      s.ctx.run();
+    });
+  }
+}
+
+asio::awaitable<void> Reactor::Accept(Shard &shard,
+                                      asio::ip::tcp::acceptor &acceptor,
+                                      UringAcceptor *uring) {
+  // io_uring accepts that failed for want of resources are retried later
+  std::optional<asio::steady_timer> backoff;
+  while (true) {
+    asio::error_code failed;
+    try {
+      if (conns_ != nullptr && !conns_->TryAcquire()) {
+        // connections past the limits are left to the listen backlog, a
+        // multishot accept would take them in meanwhile
+        if (uring != nullptr) uring->Pause();
+        co_await conns_->AsyncAcquire(shard.ctx);
+      }
+      auto &target =
+          reuse_port_ ? shard : *shards_[next_shard_++ % shards_.size()];
+      asio::ip::tcp::socket socket{target.ctx};
+      if (uring != nullptr) {
+        socket = co_await uring->AsyncAccept(target.ctx);
+      } else {
+        socket =
+            co_await acceptor.async_accept(target.ctx, asio::use_awaitable);
+      }
+      // sessions write whole messages, Nagle would only hold back the tail
+      // of a response until the client's delayed ack
+      asio::error_code ignored;
+      socket.set_option(asio::ip::tcp::no_delay(true), ignored);
+      const auto idx = shard.accepted++ * shards_.size() + shard.id;
+      handler_(target, idx, std::move(socket));
+    } catch (const asio::system_error &e) {
+      if (uring == nullptr || e.code() == asio::error::operation_aborted) {
+        if (e.code() == asio::error::operation_aborted) {
+          SPDLOG_INFO("[reactor] stopped accepting, shard={}", shard.id);
+        } else {
+          SPDLOG_ERROR("accept exception, e={}", e.what());
+        }
+        break;
+      }
+      failed = e.code();
+    }
+    if (UringUnsupported(failed)) {
+      // e.g. a kernel with io_uring but without multishot accept
+      SPDLOG_WARN("[reactor] io_uring accept failed, fallback to epoll, "
+                  "shard={}, e={}",
+                  shard.id, failed.message());
+      uring = nullptr;
+    } else if (failed) {
+      // the next accept arms the ring again
+      SPDLOG_WARN("[reactor] io_uring accept failed, shard={}, e={}",
+                  shard.id, failed.message());
+      if (OutOfResources(failed)) {
+        if (!backoff) backoff.emplace(shard.ctx);
+        backoff->expires_after(kAcceptBackoff);
+        asio::error_code err;
+        co_await backoff->async_wait(
+            asio::redirect_error(asio::use_awaitable, err));
+      }
+    }
+  }
+}
+
+}  // namespace socks::tunnel
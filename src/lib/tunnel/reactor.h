@@ -0,0 +1,97 @@
+#ifndef QUIC_SOCKS_TUNNEL_REACTOR_H_
+#define QUIC_SOCKS_TUNNEL_REACTOR_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <functional>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "observer/conn_manager.h"
+#include "observer/metrics.h"
+#include "tunnel/timer_wheel.h"
+#include "tunnel/uring.h"
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+// A set of single threaded io_contexts, one per core. Every connection is
+// accepted by and stays on one shard, so session state never needs locks.
+class Reactor : NonCopyable {
+ public:
+  struct Shard : NonCopyable {
+    explicit Shard(size_t id)
+        : id{id}, ctx{1}, work{ctx.get_executor()}, wheel{ctx} {}
+
+    size_t id;
+    asio::io_context ctx;
+    asio::executor_work_guard<asio::io_context::executor_type> work;
+    // timeouts of the sessions on this shard
+    TimerWheel wheel;
+    // of the sessions on this shard, only written on its thread
+    ThreadMetrics metrics;
+    // one per shard with SO_REUSEPORT, several if more were inherited
+    std::vector<asio::ip::tcp::acceptor> acceptors;
+    // accepting for acceptors[i] with IoBackend::kIoUring, null where the
+    // acceptor accepts on its own
+    std::vector<std::unique_ptr<UringAcceptor>> urings;
+    // connections accepted by this shard, only touched on its thread
+    size_t accepted{0};
+    std::thread thread;
+  };
+
+  // `idx` is unique across all shards of the reactor.
+  using AcceptHandler =
+      std::function<void(Shard &shard, size_t idx, asio::ip::tcp::socket)>;
+
+  // `threads` of 0 means one shard per hardware thread, `pin` binds shard i
+  // to cpu i. Pinned shards also keep their session memory on the local
+  // numa node, as pages are placed on first touch. `backend` only decides
+  // how connections are accepted, sessions always run on asio sockets.
+  Reactor(size_t threads, bool pin, IoBackend backend = IoBackend::kEpoll);
+  ~Reactor();
+
+  // Binds one SO_REUSEPORT acceptor per shard and lets the kernel balance
+  // connections across them. Without SO_REUSEPORT shard 0 accepts alone and
+  // hands connections to the shards round robin. Acceptors pause while
+  // `conns` holds them back, if given. Listening sockets `inherited` from
+  // another process are taken over instead of binding anew, the shards left
+  // without one bind their own if SO_REUSEPORT allows. Inherited sockets not
+  // listening on `endpoint` are closed.
+  void Listen(const asio::ip::tcp::endpoint &endpoint, AcceptHandler handler,
+              ConnManager *conns = nullptr, std::span<const int> inherited = {});
+  void Start();
+  // Native handles of the listening sockets, to hand them to another
+  // process. Safe from any thread once listening.
+  [[nodiscard]] std::vector<int> ListeningHandles();
+  // Closes the listening sockets of this process, their connections carry
+  // on. Sockets handed to another process stay open there.
+  void StopAccepting();
+  // Stops every shard and joins its thread, the io_contexts stay alive until
+  // destruction.
+  void Stop();
+
+  [[nodiscard]] size_t Size() const { return shards_.size(); }
+  Shard &At(size_t i) { return *shards_[i]; }
+  // Merges the metrics of all shards, from any thread.
+  [[nodiscard]] MetricsSnapshot Metrics() const;
+
+ private:
+  asio::awaitable<void> Accept(Shard &shard, asio::ip::tcp::acceptor &acceptor,
+                               UringAcceptor *uring);
+
+  bool pin_;
+  IoBackend backend_;
+  bool reuse_port_{false};
+  size_t next_shard_{0};
+  AcceptHandler handler_;
+  ConnManager *conns_{nullptr};
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_REACTOR_H_
@@ -0,0 +1,143 @@
+#include "tunnel/relay.h"
+
+#include <asio.hpp>
+
+#include "coro/asio_task.h"
+#include "coro/when_all.h"
+#include "utility/buffer.h"
+#include "utility/log.h"
+
+namespace socks::tunnel {
+
+Duplex::Duplex(asio::ip::tcp::socket &client, asio::ip::tcp::socket &remote,
+               TimerWheel &wheel, std::chrono::milliseconds idle)
+    : client_{client},
+      remote_{remote},
+      wheel_{wheel},
+      idle_{idle},
+      last_active_{wheel.Now()},
+      idle_timer_{[this] { OnIdle(); }} {}
+
+Task<void> Duplex::Run(Task<void> outside, Task<void> inside) {
+  if (idle_.count() > 0) wheel_.Arm(idle_timer_, idle_);
+  co_await WhenAll(std::move(outside), std::move(inside));
+  idle_timer_.Cancel();
+}
+
+Task<void> Duplex::Relay(RelayMeter &meter, ZeroCopyMode mode,
+                         SockMap *sockmap) {
+  co_await Run(Pump(true, meter, mode, sockmap),
+               Pump(false, meter, mode, sockmap));
+}
+
+// The end of the source is passed on as a half close, failures abort both
+// directions.
+Task<void> Duplex::Pump(bool outside, RelayMeter &meter, ZeroCopyMode mode,
+                        SockMap *sockmap) {
+  if (mode == ZeroCopyMode::kNone) {
+    co_await Copy(outside, meter);
+    co_return;
+  }
+
+  auto &from = outside ? client_ : remote_;
+  auto &to = outside ? remote_ : client_;
+  const ByteCounter on_bytes = [this, outside, &meter](size_t len) {
+    Touch();
+    if (outside) {
+      meter.Sent();
+    } else {
+      meter.Received();
+    }
+    meter.ForwardBytes(outside, len);
+  };
+  try {
+    if (sockmap != nullptr) {
+      co_await asio::co_spawn(from.get_executor(),
+                              sockmap->AsyncDrain(from, to, on_bytes),
+                              use_task);
+    } else {
+      co_await asio::co_spawn(from.get_executor(),
+                              AsyncSplice(from, to, on_bytes), use_task);
+    }
+  } catch (asio::system_error &e) {
+    if (e.code() == asio::error::eof) {
+      Finish(outside);
+    } else {
+      Abort();
+    }
+  }
+}
+
+// Runs as a Task, the per chunk operations of a relay then suspend and
+// resume without allocating. An idle direction holds no buffer, it waits
+// for the socket to become readable and takes one of the size the flow has
+// been using only then.
+Task<void> Duplex::Copy(bool outside, RelayMeter &meter) {
+  BufferSlice buf;
+  ReadSizer sizer;
+  size_t len{0};
+  auto &from = outside ? client_ : remote_;
+  auto &to = outside ? remote_ : client_;
+  while (true) {
+    try {
+      if (buf.empty()) {
+        co_await from.async_wait(asio::socket_base::wait_read, use_task);
+      }
+      // observers may still hold the previous chunk
+      if (!buf.Unique() || buf.size() != sizer.Next()) {
+        buf = BufferSlice::Acquire(sizer.Next());
+      }
+      len = co_await from.async_read_some(
+          asio::buffer(buf.data(), buf.size()), use_task);
+    } catch (asio::system_error &e) {
+      if (e.code() == asio::error::eof) {
+        Finish(outside);
+      } else {
+        Abort();
+      }
+      co_return;
+    }
+
+    Touch();
+    if (!outside) meter.Received();
+    meter.Forward(outside, buf.Slice(0, len));
+    // a buffer that wasn't filled drained the socket, the next chunk may be
+    // long in coming
+    const bool drained = len < buf.size();
+    sizer.Record(len, buf.size());
+
+    try {
+      co_await asio::async_write(to, asio::buffer(buf.data(), len), use_task);
+    } catch (asio::system_error &e) {
+      Abort();
+      co_return;
+    }
+    if (outside) meter.Sent();
+    if (drained) buf = {};
+  }
+}
+
+void Duplex::Finish(bool outside) {
+  auto &to = outside ? remote_ : client_;
+  asio::error_code err;
+  to.shutdown(asio::socket_base::shutdown_send, err);
+}
+
+void Duplex::Abort() {
+  asio::error_code err;
+  client_.close(err);
+  remote_.close(err);
+}
+
+void Duplex::OnIdle() {
+  // traffic only records when it happened, the timer catches up here
+  const auto quiet = wheel_.Tick() * (wheel_.Now() - last_active_);
+  if (quiet < idle_) {
+    wheel_.Arm(idle_timer_, idle_ - quiet);
+    return;
+  }
+  SPDLOG_DEBUG("[tunnel] relay idle, closing, idle={}ms", idle_.count());
+  Abort();
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,102 @@
+#ifndef QUIC_SOCKS_TUNNEL_RELAY_H_
+#define QUIC_SOCKS_TUNNEL_RELAY_H_
+
+#include <asio/ip/tcp.hpp>
+#include <chrono>
+#include <utility>
+
+#include "coro/task.h"
+#include "observer/metrics.h"
+#include "observer/network_observer.h"
+#include "tunnel/timer_wheel.h"
+#include "tunnel/zero_copy.h"
+#include "utility/ctor.h"
+#include "utility/trace.h"
+
+namespace socks::tunnel {
+
+struct TimeoutConfig {
+  // for a client to send a request head, this also bounds how long an idle
+  // keep-alive connection waits for its next request, 0 disables it
+  std::chrono::seconds header{30};
+  // of a tunnel without payload in either direction, 0 disables it
+  std::chrono::seconds idle{300};
+};
+
+// Accounts for the payload a session relays: traces it, counts it in the
+// metrics of its shard, hands it to the observers and times the first byte
+// of the remote's answer. `outside` is from the client to the remote.
+class RelayMeter : NonCopyable {
+ public:
+  RelayMeter(size_t idx, NetworkRelay *observer, ThreadMetrics &metrics)
+      : idx_{idx}, observer_{observer}, metrics_{metrics} {}
+
+  // `data` is a string_view, copied for the observers, or a BufferSlice
+  // they share.
+  template <typename Data>
+  void Forward(bool outside, Data &&data) {
+    Trace(TraceEvent::kForward, idx_, outside, data.size());
+    metrics_.Forwarded(outside, data.size());
+    observer_->Forward(idx_, outside, std::forward<Data>(data));
+  }
+  // Payload the session never saw, relayed inside the kernel.
+  void ForwardBytes(bool outside, size_t len) {
+    Trace(TraceEvent::kForward, idx_, outside, len);
+    metrics_.Forwarded(outside, len);
+    observer_->ForwardBytes(idx_, outside, len);
+  }
+  // Payload went out to the remote, or came back from it.
+  void Sent() { first_byte_.Sent(); }
+  void Received() { first_byte_.Received(metrics_); }
+
+ private:
+  size_t idx_;
+  NetworkRelay *observer_;
+  ThreadMetrics &metrics_;
+  FirstByteTimer first_byte_;
+};
+
+// The two directions of a relayed pair of sockets. A direction whose source
+// ends passes that on as a half close and is done while the other goes on.
+// An error or the idle timeout aborts both by closing the sockets, which
+// cancels whatever either direction waits for, so Run returns promptly.
+class Duplex : NonCopyable {
+ public:
+  // An `idle` of 0 never times out.
+  Duplex(asio::ip::tcp::socket &client, asio::ip::tcp::socket &remote,
+         TimerWheel &wheel, std::chrono::milliseconds idle);
+
+  // Returns once both directions are done, `outside` relays from the
+  // client to the remote.
+  Task<void> Run(Task<void> outside, Task<void> inside);
+  // Runs both directions of the pair, accounted for by `meter`. Unless
+  // `mode` is kNone the payload moves inside the kernel, redirected by
+  // `sockmap` if given, spliced otherwise.
+  Task<void> Relay(RelayMeter &meter, ZeroCopyMode mode,
+                   SockMap *sockmap = nullptr);
+
+  // Traffic keeps the pair from idling out, this costs a store only.
+  void Touch() { last_active_ = wheel_.Now(); }
+  // The source of the direction ended, its sink is shut down for sending.
+  void Finish(bool outside);
+  // Closes both sockets.
+  void Abort();
+
+ private:
+  void OnIdle();
+  Task<void> Pump(bool outside, RelayMeter &meter, ZeroCopyMode mode,
+                  SockMap *sockmap);
+  // Relays through user space, holding no buffer while the flow is idle.
+  Task<void> Copy(bool outside, RelayMeter &meter);
+
+  asio::ip::tcp::socket &client_;
+  asio::ip::tcp::socket &remote_;
+  TimerWheel &wheel_;
+  const std::chrono::milliseconds idle_;
+  uint64_t last_active_;
+  TimerWheel::Timer idle_timer_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_RELAY_H_
@@ -0,0 +1,510 @@
+#include "tunnel/socks5_proxy.h"
+
+#include <algorithm>
+#include <array>
+#include <asio.hpp>
+#include <cstring>
+#include <span>
+
+#include "channel/udp_batch.h"
+#include "coro/asio_task.h"
+#include "tunnel/asio_helper.h"
+#include "tunnel/reactor.h"
+#include "tunnel/relay.h"
+#include "utility/log.h"
+#include "utility/result.h"
+#include "utility/trace.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+constexpr uint8_t kVersion = 0x05;
+constexpr uint8_t kNoAuth = 0x00;
+constexpr uint8_t kNoAcceptableMethod = 0xff;
+
+enum Command : uint8_t { kConnect = 0x01, kBind = 0x02, kUdpAssociate = 0x03 };
+enum AddressType : uint8_t { kIpv4 = 0x01, kDomain = 0x03, kIpv6 = 0x04 };
+enum Reply : uint8_t {
+  kSucceeded = 0x00,
+  kGeneralFailure = 0x01,
+  kNetworkUnreachable = 0x03,
+  kHostUnreachable = 0x04,
+  kConnectionRefused = 0x05,
+  kCommandNotSupported = 0x07,
+  kAddressNotSupported = 0x08,
+};
+
+// version, reply, reserved, and an ipv6 address with port at the most
+constexpr size_t kMaxReply = 4 + 16 + 2;
+// a udp request header with a domain of 255 bytes at the most
+constexpr size_t kMaxUdpHeader = 4 + 1 + 255 + 2;
+
+enum class Status { kPartial, kDone, kInvalid };
+
+// An address of a request or a udp header, `host` views the parsed bytes.
+struct Address {
+  uint8_t type;
+  asio::ip::address ip;
+  std::string_view host;
+  uint16_t port;
+};
+
+// Parses [atyp][address][port] at `at`, advancing it past the address.
+Status ParseAddress(std::span<const uint8_t> data, size_t &at,
+                    Address &address) {
+  if (data.size() < at + 1) return Status::kPartial;
+  address.type = data[at];
+  size_t len{0};
+  switch (address.type) {
+    case kIpv4:
+      len = 4;
+      break;
+    case kIpv6:
+      len = 16;
+      break;
+    case kDomain:
+      if (data.size() < at + 2) return Status::kPartial;
+      len = 1 + data[at + 1];
+      break;
+    default:
+      return Status::kInvalid;
+  }
+  if (data.size() < at + 1 + len + 2) return Status::kPartial;
+  const auto *p = data.data() + at + 1;
+  if (address.type == kIpv4) {
+    asio::ip::address_v4::bytes_type bytes;
+    std::memcpy(bytes.data(), p, 4);
+    address.ip = asio::ip::address_v4{bytes};
+  } else if (address.type == kIpv6) {
+    asio::ip::address_v6::bytes_type bytes;
+    std::memcpy(bytes.data(), p, 16);
+    address.ip = asio::ip::address_v6{bytes};
+  } else {
+    address.host = {reinterpret_cast<const char *>(p + 1), len - 1};
+    if (address.host.empty()) return Status::kInvalid;
+  }
+  address.port = static_cast<uint16_t>(p[len] << 8 | p[len + 1]);
+  at += 1 + len + 2;
+  return Status::kDone;
+}
+
+// Writes [atyp][address][port] of `endpoint` to `out`, returns its length.
+template <typename Endpoint>
+size_t PutAddress(uint8_t *out, const Endpoint &endpoint) {
+  auto address = endpoint.address();
+  if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+    address = asio::ip::make_address_v4(asio::ip::v4_mapped,
+                                        address.to_v6());
+  }
+  size_t len{0};
+  if (address.is_v4()) {
+    out[0] = kIpv4;
+    const auto bytes = address.to_v4().to_bytes();
+    std::memcpy(out + 1, bytes.data(), bytes.size());
+    len = 1 + bytes.size();
+  } else {
+    out[0] = kIpv6;
+    const auto bytes = address.to_v6().to_bytes();
+    std::memcpy(out + 1, bytes.data(), bytes.size());
+    len = 1 + bytes.size();
+  }
+  out[len] = static_cast<uint8_t>(endpoint.port() >> 8);
+  out[len + 1] = static_cast<uint8_t>(endpoint.port() & 0xff);
+  return len + 2;
+}
+
+Reply ReplyOf(const asio::error_code &error) {
+  if (error == asio::error::host_not_found ||
+      error == asio::error::host_not_found_try_again ||
+      error == asio::error::host_unreachable ||
+      error == asio::error::timed_out) {
+    return kHostUnreachable;
+  }
+  if (error == asio::error::network_unreachable) return kNetworkUnreachable;
+  if (error == asio::error::connection_refused) return kConnectionRefused;
+  return kGeneralFailure;
+}
+
+}  // namespace
+
+// The handshake is parsed in place from a buffer of the session, clients
+// may send the greeting, the request and payload without waiting for the
+// answers in between.
+class Socks5Session {
+  static constexpr size_t kHandshakeSize = 1024;
+
+ public:
+  Socks5Session(size_t idx, asio::io_context &ctx, NetworkRelay *observer,
+                DnsResolver *resolver, const FrontendConfig &frontend,
+                const Socks5ProxyConfig &config, asio::ip::tcp::socket socket,
+                SockMap *sockmap, TimerWheel &wheel, ThreadMetrics &metrics)
+      : idx_{idx},
+        ctx_{ctx},
+        observer_{observer},
+        resolver_{resolver},
+        frontend_{frontend},
+        config_{config},
+        socket_{std::move(socket)},
+        remote_{ctx},
+        sockmap_{sockmap},
+        wheel_{wheel},
+        handshake_timer_{[this] {
+          asio::error_code err;
+          socket_.close(err);
+        }},
+        metrics_{metrics},
+        meter_{idx, observer, metrics},
+        stage_start_{ThreadMetrics::Clock::now()} {}
+
+  asio::awaitable<void> AsyncStart() {
+    metrics_.opened.Add();
+    try {
+      if (frontend_.timeouts.header.count() > 0) {
+        wheel_.Arm(handshake_timer_, frontend_.timeouts.header);
+      }
+      co_await Handshake();
+    } catch (std::runtime_error &e) {
+      SPDLOG_DEBUG("[socks5] session stopped, e={}, idx={}", e.what(), idx_);
+    }
+    CloseSocket();
+    metrics_.closed.Add();
+  }
+
+ private:
+  // Reads until `parse` is done with the bytes from `pending_` on, and
+  // moves `pending_` past what it consumed.
+  template <typename Parse>
+  asio::awaitable<void> ReadUntil(Parse &&parse) {
+    while (true) {
+      size_t at = pending_;
+      const auto status =
+          parse(std::span<const uint8_t>{buf_.data(), received_}, at);
+      if (status == Status::kInvalid) {
+        throw SocksException(
+            fmt::format("[socks5] invalid handshake, idx={}", idx_));
+      }
+      if (status == Status::kDone) {
+        pending_ = at;
+        co_return;
+      }
+      if (received_ == buf_.size()) {
+        throw SocksException(
+            fmt::format("[socks5] handshake too large, idx={}", idx_));
+      }
+      received_ += co_await socket_.async_read_some(
+          asio::buffer(buf_.data() + received_, buf_.size() - received_),
+          asio::use_awaitable);
+    }
+  }
+
+  asio::awaitable<void> Handshake() {
+    bool no_auth{false};
+    co_await ReadUntil([&no_auth](std::span<const uint8_t> data, size_t &at) {
+      if (data.size() < 2) return Status::kPartial;
+      if (data[0] != kVersion) return Status::kInvalid;
+      const size_t methods = data[1];
+      if (data.size() < 2 + methods) return Status::kPartial;
+      no_auth = std::find(data.begin() + 2, data.begin() + 2 + methods,
+                          kNoAuth) != data.begin() + 2 + methods;
+      at = 2 + methods;
+      return Status::kDone;
+    });
+    const std::array<uint8_t, 2> selected{
+        kVersion, no_auth ? kNoAuth : kNoAcceptableMethod};
+    co_await asio::async_write(socket_, asio::buffer(selected),
+                               asio::use_awaitable);
+    if (!no_auth) {
+      throw SocksException(
+          fmt::format("[socks5] no acceptable method, idx={}", idx_));
+    }
+
+    uint8_t command{0};
+    Address address{};
+    co_await ReadUntil(
+        [&command, &address](std::span<const uint8_t> data, size_t &at) {
+          if (data.size() < at + 4) return Status::kPartial;
+          if (data[at] != kVersion) return Status::kInvalid;
+          command = data[at + 1];
+          at += 3;
+          const auto type = data[at];
+          if (type != kIpv4 && type != kDomain && type != kIpv6) {
+            // the length of the address is unknown, answered and closed
+            address.type = type;
+            return Status::kDone;
+          }
+          return ParseAddress(data, at, address);
+        });
+    handshake_timer_.Cancel();
+    metrics_.Lap(Stage::kHead, stage_start_);
+
+    if (address.type != kIpv4 && address.type != kDomain &&
+        address.type != kIpv6) {
+      co_await WriteReply(kAddressNotSupported, asio::ip::tcp::endpoint{});
+      co_return;
+    }
+    switch (command) {
+      case kConnect:
+        co_await Connect(address);
+        break;
+      case kUdpAssociate:
+        co_await Associate(address);
+        break;
+      default:
+        co_await WriteReply(kCommandNotSupported, asio::ip::tcp::endpoint{});
+        break;
+    }
+  }
+
+  template <typename Endpoint>
+  asio::awaitable<void> WriteReply(Reply reply, const Endpoint &bound) {
+    std::array<uint8_t, kMaxReply> out{kVersion, reply, 0};
+    const auto len = 3 + PutAddress(out.data() + 3, bound);
+    co_await asio::async_write(socket_, asio::buffer(out.data(), len),
+                               asio::use_awaitable);
+  }
+
+  asio::awaitable<std::vector<asio::ip::address>> Resolve(
+      const Address &address) {
+    if (address.type != kDomain) co_return std::vector{address.ip};
+    co_return co_await resolver_->AsyncResolve(address.host);
+  }
+
+  asio::awaitable<void> Connect(const Address &address) {
+    asio::error_code error;
+    try {
+      const auto addresses = co_await Resolve(address);
+      if (address.type == kDomain) metrics_.Lap(Stage::kResolve, stage_start_);
+      std::vector<asio::ip::tcp::endpoint> endpoints;
+      endpoints.reserve(addresses.size());
+      for (const auto &ip : addresses) {
+        endpoints.emplace_back(ip, address.port);
+      }
+      endpoints = InterleaveFamilies(std::move(endpoints),
+                                     frontend_.connect.prefer_ipv6);
+      remote_ = co_await AsyncConnect(endpoints, frontend_.connect);
+      metrics_.Lap(Stage::kConnect, stage_start_);
+    } catch (asio::system_error &e) {
+      error = e.code();
+    }
+    if (error) {
+      co_await WriteReply(ReplyOf(error), asio::ip::tcp::endpoint{});
+      throw asio::system_error{error};
+    }
+    const auto host = address.type == kDomain
+                          ? address.host
+                          : std::string_view{};
+    Trace(TraceEvent::kConnect, idx_, address.port, 0);
+    observer_->Connect(idx_, socket_.remote_endpoint(),
+                       remote_.remote_endpoint(), host);
+
+    // payload the client sent right behind its request
+    const std::string_view early{
+        reinterpret_cast<const char *>(buf_.data()) + pending_,
+        received_ - pending_};
+    if (!early.empty()) {
+      co_await asio::async_write(remote_, asio::buffer(early),
+                                 asio::use_awaitable);
+      meter_.Forward(true, early);
+      meter_.Sent();
+    }
+
+    // the redirection has to be in place before the client learns about
+    // the tunnel, see SockMap::Insert
+    const bool redirected = frontend_.zero_copy == ZeroCopyMode::kSockMap &&
+                            sockmap_ != nullptr &&
+                            sockmap_->Insert(socket_, remote_);
+    co_await WriteReply(kSucceeded, remote_.local_endpoint());
+    // redirected payload bypasses the session, it can't tell idle tunnels
+    // from busy ones
+    Duplex duplex{
+        socket_, remote_, wheel_,
+        redirected ? std::chrono::seconds{0} : frontend_.timeouts.idle};
+    co_await AsyncRun(ctx_,
+                      duplex.Relay(meter_, frontend_.zero_copy,
+                                   redirected ? sockmap_ : nullptr),
+                      asio::use_awaitable);
+  }
+
+  // The association lives as long as the control connection. Datagrams of
+  // the client carry their target in a header, RFC 1928 section 7, answers
+  // go back to it with the header of their source.
+  asio::awaitable<void> Associate(const Address &address) {
+    const auto local = socket_.local_endpoint();
+    UdpBatch batch{ctx_.get_executor(),
+                   asio::ip::udp::endpoint{local.address(), 0},
+                   config_.max_datagram + kMaxUdpHeader, config_.udp_offload};
+    const auto bound = batch.LocalEndpoint();
+    // the client may name the address it sends from, zeros if it can't
+    client_udp_ = asio::ip::udp::endpoint{socket_.remote_endpoint().address(),
+                                          address.port};
+    Trace(TraceEvent::kConnect, idx_, address.port, 0);
+    observer_->Connect(idx_, socket_.remote_endpoint(),
+                       asio::ip::tcp::endpoint{bound.address(), bound.port()},
+                       "udp");
+    co_await WriteReply(kSucceeded, bound);
+
+    co_await WaitAll(
+        ctx_, RelayDatagrams(batch),
+        [this, &batch]() -> asio::awaitable<void> {
+          // nothing more is expected on the control connection
+          std::array<char, 64> discard{};
+          asio::error_code err;
+          while (!err) {
+            co_await socket_.async_read_some(
+                asio::buffer(discard),
+                asio::redirect_error(asio::use_awaitable, err));
+          }
+          batch.Close();
+        }());
+  }
+
+  asio::awaitable<void> RelayDatagrams(UdpBatch &batch) {
+    try {
+      while (true) {
+        for (const auto &datagram : co_await batch.AsyncReceive()) {
+          if (FromClient(datagram.peer)) {
+            co_await ToRemote(batch, datagram);
+          } else if (client_udp_.port() != 0) {
+            ToClient(batch, datagram);
+          }
+        }
+        batch.Flush();
+      }
+    } catch (asio::system_error &e) {
+      SPDLOG_DEBUG("[socks5] association closed, idx={}", idx_);
+    }
+    asio::error_code err;
+    socket_.close(err);
+  }
+
+  // The first datagram of the client's address fixes its port when the
+  // request left it open.
+  bool FromClient(const asio::ip::udp::endpoint &peer) {
+    if (peer.address() != client_udp_.address()) return false;
+    if (client_udp_.port() == 0) client_udp_.port(peer.port());
+    return peer.port() == client_udp_.port();
+  }
+
+  asio::awaitable<void> ToRemote(UdpBatch &batch,
+                                 const UdpBatch::Datagram &datagram) {
+    const std::span<const uint8_t> data{
+        reinterpret_cast<const uint8_t *>(datagram.data.data()),
+        datagram.data.size()};
+    Address address{};
+    size_t at = 3;
+    // fragments are not supported, they are dropped as RFC 1928 allows
+    if (data.size() < at || data[0] != 0 || data[1] != 0 || data[2] != 0 ||
+        ParseAddress(data, at, address) != Status::kDone) {
+      co_return;
+    }
+    const auto payload = datagram.data.substr(at);
+    if (payload.size() > config_.max_datagram) co_return;
+
+    asio::ip::udp::endpoint target;
+    if (address.type == kDomain) {
+      try {
+        const auto addresses = co_await resolver_->AsyncResolve(address.host);
+        // the batch speaks the family of the control connection only
+        const auto it = std::ranges::find_if(
+            addresses, [&batch](const asio::ip::address &ip) {
+              return ip.is_v4() == batch.LocalEndpoint().address().is_v4();
+            });
+        if (it == addresses.end()) co_return;
+        target = {*it, address.port};
+      } catch (asio::system_error &e) {
+        co_return;
+      }
+    } else {
+      target = {address.ip, address.port};
+    }
+    auto out = batch.Prepare();
+    std::memcpy(out.data(), payload.data(), payload.size());
+    batch.Commit(target, payload.size());
+    meter_.ForwardBytes(true, payload.size());
+  }
+
+  void ToClient(UdpBatch &batch, const UdpBatch::Datagram &datagram) {
+    auto out = batch.Prepare();
+    auto *p = reinterpret_cast<uint8_t *>(out.data());
+    p[0] = p[1] = p[2] = 0;
+    const auto header = 3 + PutAddress(p + 3, datagram.peer);
+    if (header + datagram.data.size() > out.size()) return;
+    std::memcpy(p + header, datagram.data.data(), datagram.data.size());
+    batch.Commit(client_udp_, header + datagram.data.size());
+    meter_.ForwardBytes(false, datagram.data.size());
+  }
+
+  void CloseSocket(asio::ip::tcp::socket *socket = nullptr) {
+    asio::error_code err;
+    if (socket == nullptr) {
+      socket_.close(err);
+      remote_.close(err);
+    } else {
+      socket->close(err);
+    }
+
+    if (socket_.is_open() || remote_.is_open() || disconnected_) {
+      return;
+    }
+    disconnected_ = true;
+    Trace(TraceEvent::kClose, idx_);
+    observer_->Disconnect(idx_);
+  }
+
+  size_t idx_;
+  asio::io_context &ctx_;
+  NetworkRelay *observer_;
+  DnsResolver *resolver_;
+  const FrontendConfig &frontend_;
+  const Socks5ProxyConfig &config_;
+  asio::ip::tcp::socket socket_;
+  asio::ip::tcp::socket remote_;
+  SockMap *sockmap_;
+  bool disconnected_{false};
+  TimerWheel &wheel_;
+  // closes the connection unless the handshake is done in time
+  TimerWheel::Timer handshake_timer_;
+  ThreadMetrics &metrics_;
+  RelayMeter meter_;
+  // end of the last stage timed, the accept to begin with
+  ThreadMetrics::Clock::time_point stage_start_;
+  // handshake bytes, [0, pending_) is parsed, [pending_, received_) is not
+  std::array<uint8_t, kHandshakeSize> buf_;
+  size_t pending_{0};
+  size_t received_{0};
+  // where the client sends its datagrams from
+  asio::ip::udp::endpoint client_udp_;
+};
+
+class Socks5ProxyImpl final : public Socks5Proxy, Frontend {
+ public:
+  explicit Socks5ProxyImpl(const Socks5ProxyConfig &config)
+      : Frontend{config.port, config.frontend}, config_{config} {}
+  ~Socks5ProxyImpl() override { Stop(); }
+
+  void Start() override { Frontend::Start(); }
+  void Register(NetworkObserver *observer) override {
+    Frontend::Register(observer);
+  }
+  CaptureStore *Capture() override { return Frontend::Capture(); }
+  void Wait() override { Frontend::Wait(); }
+
+ private:
+  asio::awaitable<void> Serve(Reactor::Shard &shard, size_t idx,
+                              asio::ip::tcp::socket socket) override {
+    auto session = std::make_shared<Socks5Session>(
+        idx, shard.ctx, &relay_, &resolver_, frontend_, config_,
+        std::move(socket), sockmap_.get(), shard.wheel, shard.metrics);
+    co_await session->AsyncStart();
+  }
+
+  const Socks5ProxyConfig config_;
+};
+
+std::shared_ptr<Socks5Proxy> Socks5Proxy::Create(
+    const Socks5ProxyConfig &config) {
+  return std::make_shared<Socks5ProxyImpl>(config);
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,42 @@
+#ifndef QUIC_SOCKS_TUNNEL_SOCKS5_PROXY_H_
+#define QUIC_SOCKS_TUNNEL_SOCKS5_PROXY_H_
+
+#include <memory>
+
+#include "observer/network_observer.h"
+#include "tunnel/frontend.h"
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+struct Socks5ProxyConfig {
+  uint16_t port{1080};
+  // zero copy applies to CONNECT tunnels, `timeouts.header` bounds the
+  // handshake and admission turns clients away by closing the connection
+  FrontendConfig frontend;
+  // payload of relayed udp datagrams, larger ones are cut off on receipt
+  size_t max_datagram{8192};
+  // udp segmentation and receive offload for UDP ASSOCIATE
+  bool udp_offload{true};
+};
+
+// A SOCKS5 proxy (RFC 1928) without authentication. CONNECT requests are
+// tunnelled like those of HttpProxy, UDP ASSOCIATE relays datagrams in
+// batches for as long as the client keeps its control connection.
+class Socks5Proxy : Movable, NonCopyable {
+ public:
+  static std::shared_ptr<Socks5Proxy> Create(const Socks5ProxyConfig &config);
+
+  virtual ~Socks5Proxy() = default;
+  virtual void Start() = 0;
+  virtual void Register(NetworkObserver *observer) = 0;
+  // retained traffic, null unless `relay.capture.dir` is set
+  virtual CaptureStore *Capture() = 0;
+  // Blocks until another instance took over by `upgrade.path` and the
+  // sessions left drained, forever without upgrades.
+  virtual void Wait() = 0;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_SOCKS5_PROXY_H_
@@ -0,0 +1,116 @@
+#include "tunnel/timer_wheel.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace socks::tunnel {
+
+void TimerWheel::Timer::Cancel() noexcept {
+  if (wheel_ != nullptr) wheel_->Unlink(*this);
+}
+
+TimerWheel::TimerWheel(asio::io_context &ctx, std::chrono::milliseconds tick)
+    : driver_{ctx}, tick_{tick}, start_{Clock::now()} {}
+
+TimerWheel::~TimerWheel() {
+  for (auto &level : slots_) {
+    for (auto *&head : level) {
+      while (head != nullptr) {
+        auto *timer = std::exchange(head, head->next_);
+        timer->wheel_ = nullptr;
+        timer->slot_ = nullptr;
+        timer->prev_ = timer->next_ = nullptr;
+      }
+    }
+  }
+}
+
+void TimerWheel::Arm(Timer &timer, std::chrono::milliseconds after) {
+  timer.Cancel();
+  // an empty wheel isn't driven, it catches up with the clock here
+  if (size_ == 0) now_ = Elapsed();
+  const auto rounded = (after.count() + tick_.count() - 1) / tick_.count();
+  const auto ticks = static_cast<uint64_t>(std::max<int64_t>(1, rounded));
+  timer.expiry_ = now_ + std::min(ticks, kMaxTicks);
+  Link(timer);
+  ++size_;
+  Schedule();
+}
+
+uint64_t TimerWheel::Elapsed() const {
+  return static_cast<uint64_t>((Clock::now() - start_) / tick_);
+}
+
+void TimerWheel::Link(Timer &timer) {
+  const auto delta = timer.expiry_ > now_ ? timer.expiry_ - now_ : 0;
+  size_t level{0};
+  while (level + 1 < kLevels &&
+         delta >= (uint64_t{1} << ((level + 1) * kSlotBits))) {
+    ++level;
+  }
+  auto &head =
+      slots_[level][(timer.expiry_ >> (level * kSlotBits)) & (kSlots - 1)];
+  timer.wheel_ = this;
+  timer.slot_ = &head;
+  timer.prev_ = nullptr;
+  timer.next_ = head;
+  if (head != nullptr) head->prev_ = &timer;
+  head = &timer;
+}
+
+void TimerWheel::Unlink(Timer &timer) noexcept {
+  if (timer.prev_ != nullptr) {
+    timer.prev_->next_ = timer.next_;
+  } else {
+    *timer.slot_ = timer.next_;
+  }
+  if (timer.next_ != nullptr) timer.next_->prev_ = timer.prev_;
+  timer.wheel_ = nullptr;
+  timer.slot_ = nullptr;
+  timer.prev_ = timer.next_ = nullptr;
+  --size_;
+}
+
+void TimerWheel::Step() {
+  ++now_;
+  // a level wrapped, the slot of the level above is due to move down
+  for (size_t level = 1; level < kLevels; ++level) {
+    if ((now_ & ((uint64_t{1} << (level * kSlotBits)) - 1)) != 0) break;
+    auto &head = slots_[level][(now_ >> (level * kSlotBits)) & (kSlots - 1)];
+    auto *timer = std::exchange(head, nullptr);
+    while (timer != nullptr) {
+      auto *next = timer->next_;
+      Link(*timer);
+      timer = next;
+    }
+  }
+
+  auto &head = slots_[0][now_ & (kSlots - 1)];
+  // fired one by one, a callback may cancel others of the same slot
+  while (head != nullptr) {
+    auto *timer = head;
+    Unlink(*timer);
+    timer->fire_();
+  }
+}
+
+void TimerWheel::Advance() {
+  const auto target = Elapsed();
+  while (now_ < target && size_ > 0) Step();
+  if (size_ == 0) now_ = std::max(now_, target);
+}
+
+void TimerWheel::Schedule() {
+  if (scheduled_ || size_ == 0) return;
+  scheduled_ = true;
+  driver_.expires_at(start_ + tick_ * (now_ + 1));
+  driver_.async_wait([this](const asio::error_code &err) {
+    // aborted when the wheel is destroyed
+    if (err) return;
+    scheduled_ = false;
+    Advance();
+    Schedule();
+  });
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,86 @@
+#ifndef QUIC_SOCKS_TUNNEL_TIMER_WHEEL_H_
+#define QUIC_SOCKS_TUNNEL_TIMER_WHEEL_H_
+
+#include <array>
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+// Coarse timeouts of one io thread, in a hierarchical timing wheel of four
+// levels with 64 slots each. Arming and cancelling unlink and link an
+// intrusive node, a tick fires one slot and now and then cascades a slot
+// of the level above. One steady_timer drives the wheel while any timer is
+// armed. Timers fire on the thread of the io_context, at most a tick late.
+class TimerWheel : NonCopyable {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  class Timer : NonCopyable {
+   public:
+    explicit Timer(std::function<void()> fire) : fire_{std::move(fire)} {}
+    ~Timer() { Cancel(); }
+
+    void Cancel() noexcept;
+    [[nodiscard]] bool Armed() const { return wheel_ != nullptr; }
+
+   private:
+    friend class TimerWheel;
+
+    std::function<void()> fire_;
+    TimerWheel *wheel_{nullptr};
+    // head of the slot the timer is linked into
+    Timer **slot_{nullptr};
+    Timer *prev_{nullptr};
+    Timer *next_{nullptr};
+    // in ticks of the wheel
+    uint64_t expiry_{0};
+  };
+
+  explicit TimerWheel(
+      asio::io_context &ctx,
+      std::chrono::milliseconds tick = std::chrono::milliseconds{100});
+  // Armed timers stay put but won't fire anymore.
+  ~TimerWheel();
+
+  // (Re)arms `timer` to fire once `after` has passed, rounded up to a tick.
+  void Arm(Timer &timer, std::chrono::milliseconds after);
+
+  // Ticks since the wheel was created, current as of the last tick unless
+  // no timer is armed.
+  [[nodiscard]] uint64_t Now() const { return now_; }
+  [[nodiscard]] std::chrono::milliseconds Tick() const { return tick_; }
+  [[nodiscard]] size_t Size() const { return size_; }
+
+ private:
+  static constexpr size_t kLevels = 4;
+  static constexpr size_t kSlotBits = 6;
+  static constexpr size_t kSlots = size_t{1} << kSlotBits;
+  static constexpr uint64_t kMaxTicks =
+      (uint64_t{1} << (kLevels * kSlotBits)) - 1;
+
+  uint64_t Elapsed() const;
+  void Link(Timer &timer);
+  void Unlink(Timer &timer) noexcept;
+  // Moves the wheel to the current time, firing what expired on the way.
+  void Advance();
+  void Step();
+  void Schedule();
+
+  asio::steady_timer driver_;
+  const std::chrono::milliseconds tick_;
+  const Clock::time_point start_;
+  uint64_t now_{0};
+  size_t size_{0};
+  bool scheduled_{false};
+  std::array<std::array<Timer *, kSlots>, kLevels> slots_{};
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_TIMER_WHEEL_H_
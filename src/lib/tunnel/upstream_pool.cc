@@ -0,0 +1,123 @@
+#include "tunnel/upstream_pool.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "utility/log.h"
+
+namespace socks::tunnel {
+
+UpstreamPool::UpstreamPool(asio::io_context &ctx,
+                           const UpstreamPoolConfig &config)
+    : config_{config}, timer_{ctx} {}
+
+UpstreamPool::~UpstreamPool() = default;
+
+std::string UpstreamPool::Key(std::string_view host, uint16_t port) {
+  return fmt::format("{}:{}", host, port);
+}
+
+bool UpstreamPool::Alive(asio::ip::tcp::socket &socket) {
+  if (!socket.is_open()) return false;
+#ifndef _WIN32
+  // an idle origin has nothing to say, readable means closed or garbage
+  char byte{0};
+  const auto n = ::recv(socket.native_handle(), &byte, 1,
+                        MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#else
+  asio::error_code err;
+  return socket.available(err) == 0 && !err;
+#endif
+}
+
+std::optional<asio::ip::tcp::socket> UpstreamPool::Checkout(
+    std::string_view host, uint16_t port) {
+  const auto it = idle_.find(Key(host, port));
+  if (it == idle_.end()) return std::nullopt;
+
+  const auto deadline = std::chrono::steady_clock::now() - config_.idle_timeout;
+  auto &conns = it->second;
+  std::optional<asio::ip::tcp::socket> found;
+  while (!conns.empty() && !found) {
+    auto idle = std::move(conns.back());
+    conns.pop_back();
+    --idle_count_;
+    if (idle.since > deadline && Alive(idle.socket)) {
+      found.emplace(std::move(idle.socket));
+    } else {
+      asio::error_code err;
+      idle.socket.close(err);
+    }
+  }
+  if (conns.empty()) idle_.erase(it);
+  return found;
+}
+
+void UpstreamPool::Checkin(std::string_view host, uint16_t port,
+                           asio::ip::tcp::socket socket) {
+  asio::error_code err;
+  if (config_.max_idle_per_host == 0 || !socket.is_open()) {
+    socket.close(err);
+    return;
+  }
+  auto &conns = idle_[Key(host, port)];
+  if (conns.size() >= config_.max_idle_per_host ||
+      idle_count_ >= config_.max_idle) {
+    // the oldest of the origin makes room, a full pool refuses newcomers
+    if (conns.empty()) {
+      idle_.erase(Key(host, port));
+      socket.close(err);
+      return;
+    }
+    conns.front().socket.close(err);
+    conns.erase(conns.begin());
+    --idle_count_;
+  }
+  conns.push_back(Idle{std::move(socket), std::chrono::steady_clock::now()});
+  ++idle_count_;
+  Arm();
+}
+
+void UpstreamPool::Arm() {
+  if (armed_) return;
+  armed_ = true;
+  timer_.expires_after(config_.idle_timeout / 2);
+  timer_.async_wait([this](const asio::error_code &err) {
+    if (err) return;
+    armed_ = false;
+    Expire(std::chrono::steady_clock::now());
+    if (idle_count_ > 0) Arm();
+  });
+}
+
+void UpstreamPool::Expire(std::chrono::steady_clock::time_point now) {
+  const auto deadline = now - config_.idle_timeout;
+  size_t expired{0};
+  for (auto it = idle_.begin(); it != idle_.end();) {
+    auto &conns = it->second;
+    // parked in order, the stale ones are at the front
+    const auto end = std::ranges::find_if(
+        conns, [deadline](const Idle &idle) { return idle.since > deadline; });
+    for (auto conn = conns.begin(); conn != end; ++conn) {
+      asio::error_code err;
+      conn->socket.close(err);
+      ++expired;
+    }
+    conns.erase(conns.begin(), end);
+    it = conns.empty() ? idle_.erase(it) : std::next(it);
+  }
+  idle_count_ -= expired;
+  if (expired > 0) {
+    SPDLOG_DEBUG("[tunnel] upstream pool expired, count={}, idle={}", expired,
+                 idle_count_);
+  }
+}
+
+}  // namespace socks::tunnel
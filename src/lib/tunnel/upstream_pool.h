@@ -0,0 +1,65 @@
+#ifndef QUIC_SOCKS_TUNNEL_UPSTREAM_POOL_H_
+#define QUIC_SOCKS_TUNNEL_UPSTREAM_POOL_H_
+
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/steady_timer.hpp>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+struct UpstreamPoolConfig {
+  // idle connections kept per origin and in total, 0 disables pooling
+  size_t max_idle_per_host{8};
+  size_t max_idle{256};
+  std::chrono::seconds idle_timeout{30};
+};
+
+// Idle keep-alive connections to origin servers, keyed by host and port.
+// Sockets are bound to an io_context, so every reactor shard owns a pool and
+// uses it from its own thread only.
+class UpstreamPool : NonCopyable {
+ public:
+  UpstreamPool(asio::io_context &ctx, const UpstreamPoolConfig &config);
+  ~UpstreamPool();
+
+  // Hands out the most recently parked connection to `host`:`port` that is
+  // still open and has nothing unread, connections failing the check are
+  // closed on the way.
+  std::optional<asio::ip::tcp::socket> Checkout(std::string_view host,
+                                                uint16_t port);
+  // Parks `socket` after a complete response, with no request in flight.
+  void Checkin(std::string_view host, uint16_t port,
+               asio::ip::tcp::socket socket);
+
+  [[nodiscard]] size_t Size() const { return idle_count_; }
+
+ private:
+  struct Idle {
+    asio::ip::tcp::socket socket;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  static std::string Key(std::string_view host, uint16_t port);
+  static bool Alive(asio::ip::tcp::socket &socket);
+  void Arm();
+  void Expire(std::chrono::steady_clock::time_point now);
+
+  const UpstreamPoolConfig config_;
+  asio::steady_timer timer_;
+  bool armed_{false};
+  size_t idle_count_{0};
+  // newest connection last
+  std::unordered_map<std::string, std::vector<Idle>> idle_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_UPSTREAM_POOL_H_
@@ -0,0 +1,279 @@
+#include "tunnel/uring.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <asio.hpp>
+#include <atomic>
+#include <cstring>
+#include <utility>
+
+#include "utility/log.h"
+
+namespace socks::tunnel {
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && \
+    defined(IORING_ACCEPT_MULTISHOT)
+
+namespace {
+
+constexpr unsigned kSqEntries = 8;
+// accept bursts larger than this end the multishot accept, see the class
+// comment
+constexpr unsigned kCqEntries = 1024;
+constexpr uint64_t kAccept = 1;
+constexpr uint64_t kCancel = 2;
+
+int Setup(unsigned entries, io_uring_params *params) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int Enter(int fd, unsigned submit, unsigned wait) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, fd, submit, wait,
+                                    wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                                    nullptr, 0));
+}
+
+int Register(int fd, unsigned op, const void *arg, unsigned args) {
+  return static_cast<int>(
+      ::syscall(__NR_io_uring_register, fd, op, arg, args));
+}
+
+template <typename T>
+T *At(void *base, uint32_t offset) {
+  return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+unsigned LoadAcquire(unsigned *value) {
+  return std::atomic_ref<unsigned>{*value}.load(std::memory_order_acquire);
+}
+
+void StoreRelease(unsigned *value, unsigned n) {
+  std::atomic_ref<unsigned>{*value}.store(n, std::memory_order_release);
+}
+
+}  // namespace
+
+// The mapped queues of a ring and the eventfd its completions signal. Only
+// the thread of the acceptor touches it, submissions are never shared.
+struct UringAcceptor::Ring : NonCopyable {
+  explicit Ring(asio::io_context &ctx) : event{ctx} {}
+  ~Ring() {
+    if (sqes != nullptr) ::munmap(sqes, sqes_size);
+    if (queues != nullptr) ::munmap(queues, queues_size);
+    if (fd >= 0) ::close(fd);
+  }
+
+  // Queues `sqe`, returns false when the submission queue is full.
+  bool Push(const io_uring_sqe &sqe) {
+    const auto tail = *sq_tail;
+    if (tail - LoadAcquire(sq_head) >= entries) return false;
+    const auto idx = tail & *sq_mask;
+    sqes[idx] = sqe;
+    sq_array[idx] = idx;
+    StoreRelease(sq_tail, tail + 1);
+    return true;
+  }
+
+  int fd{-1};
+  unsigned entries{0};
+  void *queues{nullptr};
+  size_t queues_size{0};
+  io_uring_sqe *sqes{nullptr};
+  size_t sqes_size{0};
+  unsigned *sq_head{nullptr};
+  unsigned *sq_tail{nullptr};
+  unsigned *sq_mask{nullptr};
+  unsigned *sq_array{nullptr};
+  unsigned *cq_head{nullptr};
+  unsigned *cq_tail{nullptr};
+  unsigned *cq_mask{nullptr};
+  io_uring_cqe *cqes{nullptr};
+  asio::posix::stream_descriptor event;
+};
+
+std::unique_ptr<UringAcceptor> UringAcceptor::Create(
+    asio::io_context &ctx, asio::ip::tcp::acceptor &acceptor) {
+  auto ring = std::make_unique<Ring>(ctx);
+  io_uring_params params{};
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = kCqEntries;
+  ring->fd = Setup(kSqEntries, &params);
+  if (ring->fd < 0 || (params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    SPDLOG_DEBUG("[uring] setup failed, errno={}", errno);
+    return nullptr;
+  }
+  ring->entries = params.sq_entries;
+
+  // the submission and completion rings share one mapping
+  ring->queues_size =
+      std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  auto *queues = ::mmap(nullptr, ring->queues_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (queues == MAP_FAILED) return nullptr;
+  ring->queues = queues;
+  ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  auto *sqes = ::mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return nullptr;
+  ring->sqes = static_cast<io_uring_sqe *>(sqes);
+  ring->sq_head = At<unsigned>(queues, params.sq_off.head);
+  ring->sq_tail = At<unsigned>(queues, params.sq_off.tail);
+  ring->sq_mask = At<unsigned>(queues, params.sq_off.ring_mask);
+  ring->sq_array = At<unsigned>(queues, params.sq_off.array);
+  ring->cq_head = At<unsigned>(queues, params.cq_off.head);
+  ring->cq_tail = At<unsigned>(queues, params.cq_off.tail);
+  ring->cq_mask = At<unsigned>(queues, params.cq_off.ring_mask);
+  ring->cqes = At<io_uring_cqe>(queues, params.cq_off.cqes);
+
+  // the accept refers to the socket by its slot, sparing the fd lookup
+  const int listener = acceptor.native_handle();
+  const int event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event < 0) return nullptr;
+  ring->event.assign(event);
+  if (Register(ring->fd, IORING_REGISTER_FILES, &listener, 1) != 0 ||
+      Register(ring->fd, IORING_REGISTER_EVENTFD, &event, 1) != 0) {
+    SPDLOG_DEBUG("[uring] register failed, errno={}", errno);
+    return nullptr;
+  }
+
+  std::unique_ptr<UringAcceptor> uring{
+      new UringAcceptor{std::move(ring), acceptor.local_endpoint().protocol()}};
+  uring->Arm();
+  return uring;
+}
+
+UringAcceptor::UringAcceptor(std::unique_ptr<Ring> ring,
+                             asio::ip::tcp protocol)
+    : ring_{std::move(ring)}, protocol_{protocol} {}
+
+UringAcceptor::~UringAcceptor() {
+  for (const int fd : ready_) ::close(fd);
+}
+
+void UringAcceptor::Arm() {
+  io_uring_sqe sqe{};
+  sqe.opcode = IORING_OP_ACCEPT;
+  sqe.fd = 0;
+  sqe.flags = IOSQE_FIXED_FILE;
+  sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe.accept_flags = SOCK_CLOEXEC;
+  sqe.user_data = kAccept;
+  if (!ring_->Push(sqe)) {
+    // the submission queue is full, errno tells nothing here
+    error_ = asio::error::no_buffer_space;
+    return;
+  }
+  if (Enter(ring_->fd, 1, 0) < 0) {
+    error_ = asio::error_code{errno, asio::error::get_system_category()};
+    return;
+  }
+  armed_ = true;
+}
+
+bool UringAcceptor::Reap() {
+  auto head = *ring_->cq_head;
+  const auto tail = LoadAcquire(ring_->cq_tail);
+  if (head == tail) return false;
+  for (; head != tail; ++head) {
+    const auto &cqe = ring_->cqes[head & *ring_->cq_mask];
+    if (cqe.user_data != kAccept) continue;
+    if (cqe.res >= 0) {
+      ready_.push_back(cqe.res);
+    } else if (cqe.res != -ECANCELED && !error_) {
+      error_ = asio::error_code{-cqe.res, asio::error::get_system_category()};
+    }
+    if ((cqe.flags & IORING_CQE_F_MORE) == 0) armed_ = false;
+  }
+  StoreRelease(ring_->cq_head, head);
+  // ended by an overflow of the completion queue
+  if (!armed_ && !closed_ && !paused_ && !error_) Arm();
+  return true;
+}
+
+asio::awaitable<asio::ip::tcp::socket> UringAcceptor::AsyncAccept(
+    asio::io_context &ctx) {
+  // after a pause or an error the accept ended with
+  paused_ = false;
+  if (!armed_ && !closed_ && !error_) Arm();
+  while (ready_.empty()) {
+    if (closed_) throw asio::system_error{asio::error::operation_aborted};
+    // reported once, the next call arms the accept again
+    if (error_) throw asio::system_error{std::exchange(error_, {})};
+    if (Reap()) continue;
+    asio::error_code err;
+    co_await ring_->event.async_wait(
+        asio::posix::stream_descriptor::wait_read,
+        asio::redirect_error(asio::use_awaitable, err));
+    // the counter is reset before reaping, completions after that signal
+    // again
+    uint64_t count{0};
+    [[maybe_unused]] const auto n =
+        ::read(ring_->event.native_handle(), &count, sizeof(count));
+  }
+  const int fd = ready_.front();
+  ready_.pop_front();
+  co_return asio::ip::tcp::socket{ctx, protocol_, fd};
+}
+
+void UringAcceptor::Disarm() {
+  io_uring_sqe sqe{};
+  sqe.opcode = IORING_OP_ASYNC_CANCEL;
+  sqe.addr = kAccept;
+  sqe.user_data = kCancel;
+  if (armed_ && ring_->Push(sqe) && Enter(ring_->fd, 1, 0) >= 0) {
+    // the accept posts its last completion once cancelled, connections
+    // accepted up to then are kept
+    while (armed_) {
+      if (!Reap() && Enter(ring_->fd, 0, 1) < 0 && errno != EINTR) break;
+    }
+  }
+}
+
+void UringAcceptor::Pause() {
+  if (closed_ || paused_) return;
+  paused_ = true;
+  Disarm();
+}
+
+void UringAcceptor::Close() {
+  if (closed_) return;
+  closed_ = true;
+  Disarm();
+  // lets go of the listening socket
+  Register(ring_->fd, IORING_UNREGISTER_FILES, nullptr, 0);
+  asio::error_code err;
+  ring_->event.cancel(err);
+}
+
+#else
+
+struct UringAcceptor::Ring {};
+
+std::unique_ptr<UringAcceptor> UringAcceptor::Create(
+    asio::io_context &ctx, asio::ip::tcp::acceptor &acceptor) {
+  return nullptr;
+}
+
+UringAcceptor::~UringAcceptor() = default;
+
+asio::awaitable<asio::ip::tcp::socket> UringAcceptor::AsyncAccept(
+    asio::io_context &ctx) {
+  throw asio::system_error{asio::error::operation_not_supported};
+  co_return asio::ip::tcp::socket{ctx};
+}
+
+void UringAcceptor::Pause() {}
+
+void UringAcceptor::Close() {}
+
+#endif
+
+}  // namespace socks::tunnel
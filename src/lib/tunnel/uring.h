@@ -0,0 +1,79 @@
+#ifndef QUIC_SOCKS_TUNNEL_URING_H_
+#define QUIC_SOCKS_TUNNEL_URING_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/error.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <deque>
+#include <memory>
+
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+enum class IoBackend {
+  // asio's reactor, an accept(2) and a wake up per connection
+  kEpoll,
+  // a multishot accept on an io_uring per listening socket, kEpoll where
+  // the kernel lacks io_uring or multishot accept
+  kIoUring,
+};
+
+// Accepts the connections of a listening socket with one multishot accept
+// on an io_uring of its own. The listening socket is a registered file, and
+// a single wake up of the io thread picks up every connection completed
+// meanwhile. The ring signals an eventfd that asio waits on, so it plugs
+// into the io_context of the thread that owns it.
+//
+// Connections accepted while nobody calls AsyncAccept wait in the
+// completion queue, when it overflows the accept ends and is armed again
+// on the next call. Pause ends it on purpose, leaving new connections to
+// the listen backlog while the caller holds back.
+class UringAcceptor : NonCopyable {
+ public:
+  // Null when io_uring is unavailable. `acceptor` has to be listening on
+  // `ctx` and stay open until Close.
+  static std::unique_ptr<UringAcceptor> Create(
+      asio::io_context &ctx, asio::ip::tcp::acceptor &acceptor);
+
+  ~UringAcceptor();
+
+  // Returns the next connection, bound to `ctx`. Throws operation_aborted
+  // once closed and drained, and the error the accept ended with, EINVAL
+  // among them for a kernel without multishot accept. The call after an
+  // error arms the accept again.
+  asio::awaitable<asio::ip::tcp::socket> AsyncAccept(asio::io_context &ctx);
+  // Cancels the multishot accept until the next AsyncAccept, the
+  // connections accepted already are still returned.
+  void Pause();
+  // Stops accepting, the connections accepted already are still returned.
+  // Call it on the thread of the io_context the acceptor belongs to.
+  void Close();
+
+ private:
+  struct Ring;
+
+  UringAcceptor(std::unique_ptr<Ring> ring, asio::ip::tcp protocol);
+
+  void Arm();
+  // Cancels the multishot accept and waits for its last completion.
+  void Disarm();
+  // Takes the completions off the ring, returns whether there were any.
+  bool Reap();
+
+  std::unique_ptr<Ring> ring_;
+  asio::ip::tcp protocol_;
+  // accepted connections not returned yet
+  std::deque<int> ready_;
+  // the multishot accept is in flight
+  bool armed_{false};
+  // not armed again until the next AsyncAccept
+  bool paused_{false};
+  bool closed_{false};
+  asio::error_code error_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_URING_H_
@@ -0,0 +1,375 @@
+#include "tunnel/zero_copy.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/bpf.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <array>
+#include <optional>
+#include <span>
+
+#include "utility/log.h"
+#include "utility/result.h"
+
+#if defined(__linux__) && !defined(SO_COOKIE)
+#define SO_COOKIE 57
+#endif
+
+namespace socks::tunnel {
+
+#ifdef __linux__
+
+namespace {
+
+constexpr size_t kSpliceChunk = 64 * 1024;
+
+asio::system_error LastError() {
+  return asio::system_error{
+      asio::error_code{errno, asio::error::get_system_category()}};
+}
+
+asio::system_error Error(asio::error::basic_errors err) {
+  return asio::system_error{asio::error::make_error_code(err)};
+}
+
+class Pipe : NonCopyable {
+ public:
+  Pipe() {
+    if (::pipe2(fds_.data(), O_NONBLOCK | O_CLOEXEC) != 0) {
+      throw LastError();
+    }
+    // best effort, one splice moves a whole chunk with a larger pipe
+    ::fcntl(fds_[1], F_SETPIPE_SZ, static_cast<int>(kSpliceChunk));
+  }
+  ~Pipe() {
+    ::close(fds_[0]);
+    ::close(fds_[1]);
+  }
+
+  [[nodiscard]] int ReadEnd() const { return fds_[0]; }
+  [[nodiscard]] int WriteEnd() const { return fds_[1]; }
+
+ private:
+  std::array<int, 2> fds_{-1, -1};
+};
+
+// value of the peer map, keyed by the cookie of the receiving socket
+struct PeerValue {
+  uint64_t cookie;
+  uint64_t bytes;
+};
+
+int Bpf(bpf_cmd cmd, bpf_attr &attr) {
+  return static_cast<int>(::syscall(__NR_bpf, cmd, &attr, sizeof(attr)));
+}
+
+int CreateMap(bpf_map_type type, uint32_t key_size, uint32_t value_size,
+              uint32_t capacity) {
+  bpf_attr attr{};
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = capacity;
+  return Bpf(BPF_MAP_CREATE, attr);
+}
+
+bool UpdateElem(int map_fd, const void *key, const void *value) {
+  bpf_attr attr{};
+  attr.map_fd = map_fd;
+  attr.key = reinterpret_cast<uint64_t>(key);
+  attr.value = reinterpret_cast<uint64_t>(value);
+  attr.flags = BPF_ANY;
+  return Bpf(BPF_MAP_UPDATE_ELEM, attr) == 0;
+}
+
+bool LookupElem(int map_fd, const void *key, void *value) {
+  bpf_attr attr{};
+  attr.map_fd = map_fd;
+  attr.key = reinterpret_cast<uint64_t>(key);
+  attr.value = reinterpret_cast<uint64_t>(value);
+  return Bpf(BPF_MAP_LOOKUP_ELEM, attr) == 0;
+}
+
+void DeleteElem(int map_fd, const void *key) {
+  bpf_attr attr{};
+  attr.map_fd = map_fd;
+  attr.key = reinterpret_cast<uint64_t>(key);
+  Bpf(BPF_MAP_DELETE_ELEM, attr);
+}
+
+int LoadProgram(std::span<const bpf_insn> insns) {
+  static constexpr char kLicense[] = "GPL";
+  bpf_attr attr{};
+  attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+  attr.insns = reinterpret_cast<uint64_t>(insns.data());
+  attr.insn_cnt = static_cast<uint32_t>(insns.size());
+  attr.license = reinterpret_cast<uint64_t>(kLicense);
+  return Bpf(BPF_PROG_LOAD, attr);
+}
+
+bool AttachProgram(int prog_fd, int map_fd, bpf_attach_type type) {
+  bpf_attr attr{};
+  attr.target_fd = static_cast<uint32_t>(map_fd);
+  attr.attach_bpf_fd = static_cast<uint32_t>(prog_fd);
+  attr.attach_type = type;
+  return Bpf(BPF_PROG_ATTACH, attr) == 0;
+}
+
+std::optional<uint64_t> Cookie(int fd) {
+  uint64_t cookie{0};
+  socklen_t len = sizeof(cookie);
+  if (::getsockopt(fd, SOL_SOCKET, SO_COOKIE, &cookie, &len) != 0) {
+    return std::nullopt;
+  }
+  return cookie;
+}
+
+constexpr bpf_insn Insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off,
+                        int32_t imm) {
+  bpf_insn insn{};
+  insn.code = code;
+  insn.dst_reg = dst;
+  insn.src_reg = src;
+  insn.off = off;
+  insn.imm = imm;
+  return insn;
+}
+
+// the stream parser hands every skb to the verdict program as a whole
+constexpr std::array<bpf_insn, 2> kParserProgram{
+    Insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_0, BPF_REG_1,
+         offsetof(__sk_buff, len), 0),
+    Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+};
+
+// Looks up the peer of the receiving socket by cookie, accounts the skb
+// length and redirects it to the egress of the peer. Sockets without peer
+// entry pass the skb to their own receive queue.
+std::array<bpf_insn, 23> VerdictProgram(int sock_fd, int peer_fd) {
+  return {
+      Insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+      Insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+      Insn(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_0, -8, 0),
+      Insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+           peer_fd),
+      Insn(0, 0, 0, 0, 0),
+      Insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+      Insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+      Insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+      Insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 12, 0),
+      Insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_6,
+           offsetof(__sk_buff, len), 0),
+      Insn(BPF_STX | BPF_DW | BPF_XADD, BPF_REG_0, BPF_REG_1,
+           offsetof(PeerValue, bytes), 0),
+      Insn(BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_1, BPF_REG_0,
+           offsetof(PeerValue, cookie), 0),
+      Insn(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_1, -16, 0),
+      Insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+      Insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0,
+           sock_fd),
+      Insn(0, 0, 0, 0, 0),
+      Insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+      Insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+      Insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+      Insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+      Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+      Insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+      Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+}
+
+}  // namespace
+
+bool ZeroCopySupported(ZeroCopyMode mode) { return true; }
+
+asio::awaitable<void> AsyncSplice(asio::ip::tcp::socket &from,
+                                  asio::ip::tcp::socket &to,
+                                  const ByteCounter &on_bytes) {
+  Pipe pipe;
+  from.non_blocking(true);
+  to.non_blocking(true);
+  while (true) {
+    // the handles are re-read every round, the other direction may have
+    // closed either socket in the meantime
+    if (!from.is_open() || !to.is_open()) {
+      throw Error(asio::error::bad_descriptor);
+    }
+    const auto in =
+        ::splice(from.native_handle(), nullptr, pipe.WriteEnd(), nullptr,
+                 kSpliceChunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in == 0) {
+      throw asio::system_error{asio::error::make_error_code(asio::error::eof)};
+    }
+    if (in < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN) throw LastError();
+      co_await from.async_wait(asio::ip::tcp::socket::wait_read,
+                               asio::use_awaitable);
+      continue;
+    }
+
+    for (auto pending = static_cast<size_t>(in); pending > 0;) {
+      if (!to.is_open()) {
+        throw Error(asio::error::bad_descriptor);
+      }
+      const auto out =
+          ::splice(pipe.ReadEnd(), nullptr, to.native_handle(), nullptr,
+                   pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (out < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN) throw LastError();
+        co_await to.async_wait(asio::ip::tcp::socket::wait_write,
+                               asio::use_awaitable);
+        continue;
+      }
+      pending -= static_cast<size_t>(out);
+    }
+    on_bytes(static_cast<size_t>(in));
+  }
+}
+
+std::unique_ptr<SockMap> SockMap::Create(uint32_t capacity) {
+  std::array<int, 4> fds{-1, -1, -1, -1};
+  auto &[sock_fd, peer_fd, parser_fd, verdict_fd] = fds;
+  const auto fail = [&fds](std::string_view step) {
+    SPDLOG_WARN("[tunnel] sockmap unavailable, step={}, errno={}", step,
+                errno);
+    for (const auto fd : fds) {
+      if (fd >= 0) ::close(fd);
+    }
+    return nullptr;
+  };
+
+  sock_fd = CreateMap(BPF_MAP_TYPE_SOCKHASH, sizeof(uint64_t),
+                      sizeof(uint32_t), capacity);
+  if (sock_fd < 0) return fail("sockhash");
+  peer_fd = CreateMap(BPF_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(PeerValue),
+                      capacity);
+  if (peer_fd < 0) return fail("peer map");
+  parser_fd = LoadProgram(kParserProgram);
+  if (parser_fd < 0) return fail("parser program");
+  const auto verdict = VerdictProgram(sock_fd, peer_fd);
+  verdict_fd = LoadProgram(verdict);
+  if (verdict_fd < 0) return fail("verdict program");
+  if (!AttachProgram(parser_fd, sock_fd, BPF_SK_SKB_STREAM_PARSER)) {
+    return fail("attach parser");
+  }
+  if (!AttachProgram(verdict_fd, sock_fd, BPF_SK_SKB_STREAM_VERDICT)) {
+    return fail("attach verdict");
+  }
+
+  SPDLOG_INFO("[tunnel] sockmap loaded, capacity={}", capacity);
+  return std::unique_ptr<SockMap>{
+      new SockMap{sock_fd, peer_fd, parser_fd, verdict_fd}};
+}
+
+SockMap::~SockMap() {
+  ::close(verdict_fd_);
+  ::close(parser_fd_);
+  ::close(peer_fd_);
+  ::close(sock_fd_);
+}
+
+bool SockMap::Insert(asio::ip::tcp::socket &a,
+                     asio::ip::tcp::socket &b) noexcept {
+  const auto a_cookie = Cookie(a.native_handle());
+  const auto b_cookie = Cookie(b.native_handle());
+  if (!a_cookie || !b_cookie) return false;
+
+  // sockets join the sockhash first and only start redirecting once both
+  // peers entries exist, a skb never targets a socket missing from the map
+  const auto a_fd = static_cast<uint32_t>(a.native_handle());
+  const auto b_fd = static_cast<uint32_t>(b.native_handle());
+  const PeerValue a_peer{*b_cookie, 0};
+  const PeerValue b_peer{*a_cookie, 0};
+  if (UpdateElem(sock_fd_, &*a_cookie, &a_fd) &&
+      UpdateElem(sock_fd_, &*b_cookie, &b_fd) &&
+      UpdateElem(peer_fd_, &*a_cookie, &a_peer) &&
+      UpdateElem(peer_fd_, &*b_cookie, &b_peer)) {
+    return true;
+  }
+
+  SPDLOG_WARN("[tunnel] sockmap insert failed, errno={}", errno);
+  for (const auto cookie : {*a_cookie, *b_cookie}) {
+    DeleteElem(peer_fd_, &cookie);
+    DeleteElem(sock_fd_, &cookie);
+  }
+  return false;
+}
+
+asio::awaitable<void> SockMap::AsyncDrain(asio::ip::tcp::socket &from,
+                                          asio::ip::tcp::socket &to,
+                                          const ByteCounter &on_bytes) {
+  const auto cookie = Cookie(from.native_handle());
+  // only bytes queued before the redirection started are read here
+  std::array<char, 4096> buf{};
+  asio::error_code err;
+  try {
+    from.non_blocking(true);
+    while (!err) {
+      co_await from.async_wait(asio::ip::tcp::socket::wait_read,
+                               asio::use_awaitable);
+      const auto len = from.read_some(asio::buffer(buf), err);
+      if (err == asio::error::would_block) {
+        err.clear();
+        continue;
+      }
+      if (len > 0) {
+        co_await asio::async_write(to, asio::buffer(buf, len),
+                                   asio::use_awaitable);
+        on_bytes(len);
+      }
+    }
+  } catch (const asio::system_error &e) {
+    err = e.code();
+  }
+
+  if (cookie) {
+    PeerValue peer{};
+    if (LookupElem(peer_fd_, &*cookie, &peer) && peer.bytes > 0) {
+      on_bytes(peer.bytes);
+    }
+    DeleteElem(peer_fd_, &*cookie);
+    DeleteElem(sock_fd_, &*cookie);
+  }
+  throw asio::system_error{err};
+}
+
+#else
+
+bool ZeroCopySupported(ZeroCopyMode mode) {
+  return mode == ZeroCopyMode::kNone;
+}
+
+asio::awaitable<void> AsyncSplice(asio::ip::tcp::socket &from,
+                                  asio::ip::tcp::socket &to,
+                                  const ByteCounter &on_bytes) {
+  throw SocksException("[tunnel] splice is not supported on this platform");
+  co_return;
+}
+
+std::unique_ptr<SockMap> SockMap::Create(uint32_t capacity) {
+  return nullptr;
+}
+
+SockMap::~SockMap() = default;
+
+bool SockMap::Insert(asio::ip::tcp::socket &a,
+                     asio::ip::tcp::socket &b) noexcept {
+  return false;
+}
+
+asio::awaitable<void> SockMap::AsyncDrain(asio::ip::tcp::socket &from,
+                                          asio::ip::tcp::socket &to,
+                                          const ByteCounter &on_bytes) {
+  throw SocksException("[tunnel] sockmap is not supported on this platform");
+  co_return;
+}
+
+#endif
+
+}  // namespace socks::tunnel
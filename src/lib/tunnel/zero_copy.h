@@ -0,0 +1,69 @@
+#ifndef QUIC_SOCKS_TUNNEL_ZERO_COPY_H_
+#define QUIC_SOCKS_TUNNEL_ZERO_COPY_H_
+
+#include <asio/awaitable.hpp>
+#include <asio/ip/tcp.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "utility/ctor.h"
+
+namespace socks::tunnel {
+
+enum class ZeroCopyMode {
+  // copy every chunk through user space
+  kNone,
+  // socket -> pipe -> socket with splice(2)
+  kSplice,
+  // redirect with an sk_skb verdict program on a sockhash, falls back to
+  // kSplice when the programs can not be loaded
+  kSockMap,
+};
+
+using ByteCounter = std::function<void(size_t)>;
+
+// Whether the running platform is able to relay with `mode`.
+bool ZeroCopySupported(ZeroCopyMode mode);
+
+// Moves bytes from `from` to `to` through a kernel pipe until `from` reaches
+// eof, `on_bytes` is called with every chunk length delivered to `to`.
+asio::awaitable<void> AsyncSplice(asio::ip::tcp::socket &from,
+                                  asio::ip::tcp::socket &to,
+                                  const ByteCounter &on_bytes);
+
+class SockMap : NonCopyable {
+ public:
+  static std::unique_ptr<SockMap> Create(uint32_t capacity = 65536);
+
+  ~SockMap();
+
+  // Redirects everything received on `a` to `b` and vice versa, bytes
+  // already queued on the sockets before insertion stay in user space.
+  // Insert before the tunnel is announced to the client, so that no payload
+  // is queued on either side yet.
+  bool Insert(asio::ip::tcp::socket &a, asio::ip::tcp::socket &b) noexcept;
+
+  // Waits until `from` reaches eof and removes it from the map, forwarding
+  // the bytes that were queued before insertion. `on_bytes` is called with
+  // the forwarded length, including the bytes redirected inside the kernel.
+  asio::awaitable<void> AsyncDrain(asio::ip::tcp::socket &from,
+                                   asio::ip::tcp::socket &to,
+                                   const ByteCounter &on_bytes);
+
+ private:
+  SockMap(int sock_fd, int peer_fd, int parser_fd, int verdict_fd)
+      : sock_fd_{sock_fd},
+        peer_fd_{peer_fd},
+        parser_fd_{parser_fd},
+        verdict_fd_{verdict_fd} {}
+
+  int sock_fd_;
+  int peer_fd_;
+  int parser_fd_;
+  int verdict_fd_;
+};
+
+}  // namespace socks::tunnel
+
+#endif  // QUIC_SOCKS_TUNNEL_ZERO_COPY_H_
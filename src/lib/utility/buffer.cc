@@ -0,0 +1,175 @@
+#include "utility/buffer.h"
+
+#include <array>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace socks {
+
+// Free lists of the calling thread, one per size class. Blocks released on
+// the owner thread go back to `free_` directly, other threads push them
+// onto `returned_`, which the owner collects in one exchange once a list
+// runs dry.
+class BufferPool : NonCopyable {
+  // bytes kept idle per class, beyond that blocks are freed
+  static constexpr size_t kMaxFreeBytes = 16 * 1024 * 1024;
+
+ public:
+  static BufferPool &Local();
+
+  SharedBuffer *Acquire(size_t cls) {
+    auto &free = free_[cls];
+    if (free.empty()) Collect();
+    if (free.empty()) return New(cls);
+    auto *block = free.back();
+    free.pop_back();
+    return block;
+  }
+
+  void Release(SharedBuffer *block) {
+    if (this == local_) {
+      Keep(block);
+      return;
+    }
+    auto *head = returned_.load(std::memory_order_relaxed);
+    do {
+      block->next_ = head;
+    } while (!returned_.compare_exchange_weak(
+        head, block, std::memory_order_release, std::memory_order_relaxed));
+    // the owner thread is gone, nobody else collects the blocks
+    if (closed_.load(std::memory_order_acquire)) DeleteReturned();
+  }
+
+ private:
+  SharedBuffer *New(size_t cls) {
+    auto *memory = ::operator new(
+        sizeof(SharedBuffer) + SharedBuffer::kCapacities[cls],
+        std::align_val_t{alignof(SharedBuffer)});
+    return new (memory) SharedBuffer{this, static_cast<uint8_t>(cls)};
+  }
+
+  static void Delete(SharedBuffer *block) {
+    const auto size = sizeof(SharedBuffer) +
+                      SharedBuffer::kCapacities[block->class_];
+    block->~SharedBuffer();
+    ::operator delete(block, size, std::align_val_t{alignof(SharedBuffer)});
+  }
+
+  void Keep(SharedBuffer *block) {
+    auto &free = free_[block->class_];
+    if (free.size() * SharedBuffer::kCapacities[block->class_] >=
+        kMaxFreeBytes) {
+      Delete(block);
+      return;
+    }
+    free.push_back(block);
+  }
+
+  void Collect() {
+    auto *block = returned_.exchange(nullptr, std::memory_order_acquire);
+    while (block != nullptr) {
+      Keep(std::exchange(block, block->next_));
+    }
+  }
+
+  void DeleteReturned() {
+    auto *block = returned_.exchange(nullptr, std::memory_order_acquire);
+    while (block != nullptr) {
+      Delete(std::exchange(block, block->next_));
+    }
+  }
+
+  void Close() {
+    closed_.store(true, std::memory_order_release);
+    for (auto &free : free_) {
+      for (auto *block : free) Delete(block);
+      free.clear();
+    }
+    DeleteReturned();
+  }
+
+  static thread_local BufferPool *local_;
+
+  std::array<std::vector<SharedBuffer *>, SharedBuffer::kClasses> free_;
+  std::atomic<SharedBuffer *> returned_{nullptr};
+  std::atomic_bool closed_{false};
+};
+
+thread_local BufferPool *BufferPool::local_{nullptr};
+
+BufferPool &BufferPool::Local() {
+  // pools are never destroyed, blocks in flight on other threads may still
+  // point to one after its thread exited
+  struct Guard {
+    BufferPool *pool{new BufferPool};
+    ~Guard() {
+      local_ = nullptr;
+      pool->Close();
+    }
+  };
+  thread_local Guard guard;
+  local_ = guard.pool;
+  return *guard.pool;
+}
+
+BufferSlice::BufferSlice(const BufferSlice &other) noexcept
+    : block_{other.block_}, offset_{other.offset_}, size_{other.size_} {
+  if (block_ != nullptr) block_->refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+BufferSlice::BufferSlice(BufferSlice &&other) noexcept
+    : block_{std::exchange(other.block_, nullptr)},
+      offset_{std::exchange(other.offset_, 0)},
+      size_{std::exchange(other.size_, 0)} {}
+
+BufferSlice &BufferSlice::operator=(const BufferSlice &other) noexcept {
+  if (this != &other) {
+    BufferSlice copy{other};
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+BufferSlice &BufferSlice::operator=(BufferSlice &&other) noexcept {
+  if (this != &other) {
+    Reset();
+    block_ = std::exchange(other.block_, nullptr);
+    offset_ = std::exchange(other.offset_, 0);
+    size_ = std::exchange(other.size_, 0);
+  }
+  return *this;
+}
+
+BufferSlice::~BufferSlice() { Reset(); }
+
+BufferSlice BufferSlice::Acquire(size_t size) {
+  const auto cls = SharedBuffer::ClassOf(size);
+  auto *block = BufferPool::Local().Acquire(cls);
+  block->refs_.store(1, std::memory_order_relaxed);
+  return {block, 0, static_cast<uint32_t>(SharedBuffer::kCapacities[cls])};
+}
+
+BufferSlice BufferSlice::Slice(size_t offset, size_t size) const {
+  BufferSlice slice{*this};
+  slice.offset_ += static_cast<uint32_t>(offset);
+  slice.size_ = static_cast<uint32_t>(size);
+  return slice;
+}
+
+bool BufferSlice::Unique() const {
+  return block_ != nullptr &&
+         block_->refs_.load(std::memory_order_acquire) == 1;
+}
+
+void BufferSlice::Reset() noexcept {
+  if (block_ == nullptr) return;
+  if (block_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    block_->owner_->Release(block_);
+  }
+  block_ = nullptr;
+  offset_ = 0;
+  size_ = 0;
+}
+
+}  // namespace socks
@@ -0,0 +1,108 @@
+#ifndef QUIC_SOCKS_UTILITY_BUFFER_H_
+#define QUIC_SOCKS_UTILITY_BUFFER_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "utility/ctor.h"
+
+namespace socks {
+
+class BufferPool;
+
+// Block owned by the BufferPool of the thread that acquired it, shared
+// between threads through reference counted BufferSlices. Blocks come in a
+// few size classes, the payload follows the header in the same allocation.
+class alignas(64) SharedBuffer : NonCopyable {
+ public:
+  static constexpr size_t kClasses = 3;
+  static constexpr std::array<size_t, kClasses> kCapacities{
+      2 * 1024, 16 * 1024, 64 * 1024};
+  static constexpr size_t kCapacity = kCapacities[1];
+
+  // The smallest class that holds `size`, the largest if none does.
+  static constexpr size_t ClassOf(size_t size) {
+    for (size_t i = 0; i < kClasses; ++i) {
+      if (size <= kCapacities[i]) return i;
+    }
+    return kClasses - 1;
+  }
+
+ private:
+  friend class BufferPool;
+  friend class BufferSlice;
+
+  SharedBuffer(BufferPool *owner, uint8_t cls) : owner_{owner}, class_{cls} {}
+
+  char *data() { return reinterpret_cast<char *>(this + 1); }
+
+  std::atomic_uint32_t refs_{0};
+  BufferPool *owner_;
+  SharedBuffer *next_{nullptr};
+  uint8_t class_;
+};
+
+// Reference counted view into a SharedBuffer. Copies share the block, which
+// returns to its pool once the last slice is gone, on whatever thread.
+class BufferSlice {
+ public:
+  BufferSlice() = default;
+  BufferSlice(const BufferSlice &other) noexcept;
+  BufferSlice(BufferSlice &&other) noexcept;
+  BufferSlice &operator=(const BufferSlice &other) noexcept;
+  BufferSlice &operator=(BufferSlice &&other) noexcept;
+  ~BufferSlice();
+
+  // A slice over a whole block from the pool of the calling thread, of the
+  // smallest class that holds `size`.
+  static BufferSlice Acquire(size_t size = SharedBuffer::kCapacity);
+
+  [[nodiscard]] BufferSlice Slice(size_t offset, size_t size) const;
+
+  [[nodiscard]] char *data() const {
+    return block_ == nullptr ? nullptr : block_->data() + offset_;
+  }
+  [[nodiscard]] size_t size() const { return size_; }
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+  [[nodiscard]] std::string_view View() const { return {data(), size_}; }
+
+  // Whether this is the only reference to the block, i.e. the block can be
+  // written without affecting anyone else.
+  [[nodiscard]] bool Unique() const;
+
+ private:
+  BufferSlice(SharedBuffer *block, uint32_t offset, uint32_t size)
+      : block_{block}, offset_{offset}, size_{size} {}
+
+  void Reset() noexcept;
+
+  SharedBuffer *block_{nullptr};
+  uint32_t offset_{0};
+  uint32_t size_{0};
+};
+
+// Picks the buffer size for the next read of a flow. Reads that fill their
+// buffer step up a class for bulk transfers, ones that use less than a
+// quarter step back down, so interactive flows stay on small blocks.
+class ReadSizer {
+ public:
+  [[nodiscard]] size_t Next() const { return SharedBuffer::kCapacities[cls_]; }
+
+  void Record(size_t read, size_t capacity) {
+    if (read == capacity && cls_ + 1 < SharedBuffer::kClasses) {
+      ++cls_;
+    } else if (read < capacity / 4 && cls_ > 0) {
+      --cls_;
+    }
+  }
+
+ private:
+  size_t cls_{0};
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_UTILITY_BUFFER_H_
@@ -1,6 +1,7 @@
 #include "utility/log.h"
 
 #include <spdlog/async.h>
+#include <spdlog/cfg/env.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
 
@@ -10,8 +11,9 @@ void InitAsyncLogger() {
   spdlog::init_thread_pool(1024, 1);
   auto async_logger = std::make_shared<spdlog::async_logger>(
       "", std::move(stdout_sink), spdlog::thread_pool(),
-      spdlog::async_overflow_policy::block);
+      spdlog::async_overflow_policy::overrun_oldest);
   spdlog::set_default_logger(std::move(async_logger));
-  spdlog::set_level(spdlog::level::debug);
+  spdlog::set_level(spdlog::level::info);
+  spdlog::cfg::load_env_levels();
 }
-}  // namespace socks
\ No newline at end of file
+}  // namespace socks
@@ -5,13 +5,19 @@
 #ifndef QUIC_SOCKS_UTILITY_LOG_H_
 #define QUIC_SOCKS_UTILITY_LOG_H_
 
-#define SPDLOG_ACTIVE_LEVEL 0
+// debug lines are compiled in and filtered at runtime, builds may drop them
+// altogether, per-session detail is left to utility/trace.h
+#ifndef SPDLOG_ACTIVE_LEVEL
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_DEBUG
+#endif
 #include <spdlog/spdlog.h>
 
 #include <iostream>
 
 namespace socks {
 
+// Logs at info, or at the levels of SPDLOG_LEVEL. A slow sink loses the
+// oldest lines rather than stalling the threads that log.
 void InitAsyncLogger();
 
 }  // namespace socks
@@ -0,0 +1,43 @@
+#ifndef QUIC_SOCKS_UTILITY_SIMD_H_
+#define QUIC_SOCKS_UTILITY_SIMD_H_
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <bit>
+#include <cstdint>
+
+namespace socks::simd {
+
+// Returns the first occurrence of `c` in [first, last), or `last`.
+inline const char *FindByte(const char *first, const char *last, char c) {
+#if defined(__AVX2__)
+  const __m256i needle = _mm256_set1_epi8(c);
+  for (; last - first >= 32; first += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+    const auto mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+    if (mask != 0) return first + std::countr_zero(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i needle16 = _mm_set1_epi8(c);
+  for (; last - first >= 16; first += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+    const auto mask = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16)));
+    if (mask != 0) return first + std::countr_zero(mask);
+  }
+#endif
+  for (; first != last; ++first) {
+    if (*first == c) return first;
+  }
+  return last;
+}
+
+}  // namespace socks::simd
+
+#endif  // QUIC_SOCKS_UTILITY_SIMD_H_
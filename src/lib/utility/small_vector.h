@@ -0,0 +1,64 @@
+#ifndef QUIC_SOCKS_UTILITY_SMALL_VECTOR_H_
+#define QUIC_SOCKS_UTILITY_SMALL_VECTOR_H_
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace socks {
+
+// Flat vector keeping up to N trivially copyable elements inline, spills
+// every element to the heap once it grows beyond.
+template <typename T, size_t N>
+class SmallVector {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+ public:
+  using value_type = T;
+  using iterator = T *;
+  using const_iterator = const T *;
+
+  void push_back(const T &value) {
+    if (heap_.empty() && size_ < N) {
+      inline_[size_++] = value;
+      return;
+    }
+    if (heap_.empty()) {
+      heap_.reserve(N * 2);
+      heap_.assign(inline_.begin(), inline_.end());
+    }
+    heap_.push_back(value);
+    ++size_;
+  }
+
+  void clear() {
+    heap_.clear();
+    size_ = 0;
+  }
+
+  [[nodiscard]] size_t size() const { return size_; }
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+
+  T *data() { return heap_.empty() ? inline_.data() : heap_.data(); }
+  const T *data() const {
+    return heap_.empty() ? inline_.data() : heap_.data();
+  }
+
+  T &operator[](size_t i) { return data()[i]; }
+  const T &operator[](size_t i) const { return data()[i]; }
+
+  iterator begin() { return data(); }
+  iterator end() { return data() + size_; }
+  const_iterator begin() const { return data(); }
+  const_iterator end() const { return data() + size_; }
+
+ private:
+  std::array<T, N> inline_{};
+  std::vector<T> heap_;
+  size_t size_{0};
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_UTILITY_SMALL_VECTOR_H_
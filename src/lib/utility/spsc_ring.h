@@ -0,0 +1,69 @@
+#ifndef QUIC_SOCKS_UTILITY_SPSC_RING_H_
+#define QUIC_SOCKS_UTILITY_SPSC_RING_H_
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <vector>
+
+#include "utility/ctor.h"
+
+namespace socks {
+
+// Bounded single producer, single consumer queue. Head and tail live on
+// their own cache lines and each side caches the other's index, so the
+// common case touches no shared line.
+template <typename T>
+class SpscRing : NonCopyable {
+ public:
+  explicit SpscRing(size_t capacity)
+      : slots_(std::bit_ceil(capacity < 2 ? 2 : capacity)),
+        mask_{slots_.size() - 1} {}
+
+  // Producer side, `value` is left untouched when the ring is full.
+  bool TryPush(T &value) {
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ == slots_.size()) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ == slots_.size()) return false;
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side, moves up to `max` elements to the back of `out`.
+  size_t PopBatch(std::vector<T> &out, size_t max) {
+    const auto head = head_.load(std::memory_order_relaxed);
+    if (tail_cache_ == head) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+    }
+    const auto count = std::min(tail_cache_ - head, max);
+    for (size_t i = 0; i < count; ++i) {
+      out.emplace_back(std::move(slots_[(head + i) & mask_]));
+    }
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer side, whether nothing waits to be popped.
+  [[nodiscard]] bool Empty() const {
+    return tail_.load(std::memory_order_acquire) ==
+           head_.load(std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] size_t Capacity() const { return slots_.size(); }
+
+ private:
+  std::vector<T> slots_;
+  const size_t mask_;
+  alignas(64) std::atomic_size_t head_{0};
+  size_t tail_cache_{0};
+  alignas(64) std::atomic_size_t tail_{0};
+  size_t head_cache_{0};
+};
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_UTILITY_SPSC_RING_H_
@@ -0,0 +1,297 @@
+#include "utility/trace.h"
+
+#include <fmt/chrono.h>
+#include <fmt/ostream.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "utility/ctor.h"
+#include "utility/log.h"
+#include "utility/spsc_ring.h"
+
+namespace socks {
+
+namespace detail {
+
+std::atomic_bool tracing{false};
+
+}  // namespace detail
+
+namespace {
+
+constexpr char kMagic[4] = {'Q', 'S', 'T', '1'};
+constexpr size_t kBatchSize = 1024;
+constexpr auto kDropReportInterval = std::chrono::seconds{1};
+
+// Starts the file, relates the steady stamps of the records to wall time.
+struct TraceHeader {
+  char magic[4];
+  uint32_t record_size;
+  int64_t steady;
+  int64_t system;
+};
+
+struct EventInfo {
+  std::string_view name;
+  // unnamed arguments are left out by the decoder
+  std::string_view args[2];
+};
+
+constexpr EventInfo kEvents[] = {
+    // client port
+    {"accept", {"port", {}}},
+    // admission verdict
+    {"reject", {"verdict", {}}},
+    // origin port, whether the connection came from the pool
+    {"connect", {"port", "reused"}},
+    // head and body bytes sent along with it
+    {"request", {"head", "body"}},
+    // status and head bytes
+    {"response", {"status", "head"}},
+    // direction, bytes relayed
+    {"forward", {"outside", "bytes"}},
+    {"close", {}},
+};
+static_assert(std::size(kEvents) == static_cast<size_t>(TraceEvent::kCount));
+
+int64_t Nanoseconds(auto time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+// Owns the rings of the threads that recorded and the writer draining them.
+// Rings live as long as the process, a thread caught recording by
+// StopTracing still has a place to write to.
+class Tracer : NonCopyable {
+ public:
+  ~Tracer() { Stop(); }
+
+  bool Start(const TraceConfig &config) {
+    Stop();
+    out_.open(config.path, std::ios::binary | std::ios::trunc);
+    if (!out_) {
+      SPDLOG_WARN("[trace] open failed, path={}", config.path);
+      return false;
+    }
+    const TraceHeader header{
+        .magic = {kMagic[0], kMagic[1], kMagic[2], kMagic[3]},
+        .record_size = sizeof(TraceRecord),
+        .steady = Nanoseconds(std::chrono::steady_clock::now()),
+        .system = Nanoseconds(std::chrono::system_clock::now())};
+    out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    // records left over by stragglers of an earlier trace
+    {
+      std::lock_guard<std::mutex> lock{rings_mutex_};
+      ring_size_ = config.ring_size;
+      std::vector<TraceRecord> stale;
+      for (auto &ring : rings_) {
+        while (ring->records.PopBatch(stale, kBatchSize) > 0) stale.clear();
+      }
+    }
+    flush_ = config.flush;
+    dropped_.store(0, std::memory_order_relaxed);
+    detail::tracing.store(true, std::memory_order_release);
+    writer_ = std::jthread{[this](std::stop_token stop) { Run(stop); }};
+    SPDLOG_INFO("[trace] started, path={}", config.path);
+    return true;
+  }
+
+  void Stop() {
+    if (!writer_.joinable()) return;
+    detail::tracing.store(false, std::memory_order_release);
+    writer_.request_stop();
+    writer_.join();
+    out_.close();
+  }
+
+  void Record(TraceEvent event, size_t idx, uint64_t arg0, uint64_t arg1) {
+    auto &ring = LocalRing();
+    TraceRecord record{.time = Nanoseconds(std::chrono::steady_clock::now()),
+                       .idx = static_cast<uint32_t>(idx),
+                       .event = static_cast<uint16_t>(event),
+                       .thread = ring.thread,
+                       .args = {arg0, arg1}};
+    if (!ring.records.TryPush(record)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  struct Ring {
+    Ring(size_t size, uint16_t thread) : records{size}, thread{thread} {}
+
+    SpscRing<TraceRecord> records;
+    const uint16_t thread;
+  };
+
+  Ring &LocalRing() {
+    thread_local Ring *cached{nullptr};
+    if (cached != nullptr) return *cached;
+
+    std::lock_guard<std::mutex> lock{rings_mutex_};
+    rings_.emplace_back(std::make_unique<Ring>(
+        ring_size_, static_cast<uint16_t>(rings_.size())));
+    ring_count_.store(rings_.size(), std::memory_order_release);
+    cached = rings_.back().get();
+    return *cached;
+  }
+
+  void Run(std::stop_token stop) {
+    std::vector<TraceRecord> batch;
+    batch.reserve(kBatchSize);
+    std::vector<Ring *> rings;
+    std::mutex mutex;
+    std::condition_variable_any wake;
+    auto last_report = std::chrono::steady_clock::now();
+    while (true) {
+      // the last round after the stop picks up what came in meanwhile
+      const bool stopping = stop.stop_requested();
+      if (rings.size() != ring_count_.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock{rings_mutex_};
+        rings.clear();
+        for (auto &ring : rings_) rings.push_back(ring.get());
+      }
+      for (auto *ring : rings) {
+        while (ring->records.PopBatch(batch, kBatchSize) > 0) {
+          out_.write(reinterpret_cast<const char *>(batch.data()),
+                     static_cast<std::streamsize>(batch.size() *
+                                                  sizeof(TraceRecord)));
+          batch.clear();
+        }
+      }
+      out_.flush();
+
+      const auto now = std::chrono::steady_clock::now();
+      if (now - last_report >= kDropReportInterval) {
+        last_report = now;
+        if (const auto dropped = dropped_.exchange(0); dropped > 0) {
+          SPDLOG_WARN("[trace] rings full, dropped={}", dropped);
+        }
+      }
+      if (stopping) break;
+      std::unique_lock<std::mutex> lock{mutex};
+      wake.wait_for(lock, stop, flush_, [] { return false; });
+    }
+  }
+
+  std::mutex rings_mutex_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::atomic_size_t ring_count_{0};
+  size_t ring_size_{0};
+  std::atomic_size_t dropped_{0};
+
+  // writer thread only while it runs
+  std::ofstream out_;
+  std::chrono::milliseconds flush_{0};
+  std::jthread writer_;
+};
+
+Tracer &Instance() {
+  static Tracer tracer;
+  return tracer;
+}
+
+void PrintText(std::ostream &out, const TraceHeader &header,
+               const TraceRecord &record, const EventInfo &info) {
+  const auto wall = header.system + (record.time - header.steady);
+  const auto seconds = static_cast<std::time_t>(wall / 1'000'000'000);
+  fmt::print(out, "{:%F %T}.{:09} thread={} idx={} {}",
+             fmt::localtime(seconds), wall % 1'000'000'000, record.thread,
+             record.idx, info.name);
+  for (size_t i = 0; i < std::size(info.args); ++i) {
+    if (!info.args[i].empty()) {
+      fmt::print(out, " {}={}", info.args[i], record.args[i]);
+    }
+  }
+  out << '\n';
+}
+
+// Sessions become async slices from accept to close, with the events in
+// between as instants on them.
+void PrintChrome(std::ostream &out, const TraceHeader &header,
+                 const TraceRecord &record, const EventInfo &info,
+                 bool first) {
+  const auto event = static_cast<TraceEvent>(record.event);
+  const char *phase = event == TraceEvent::kAccept  ? "b"
+                      : event == TraceEvent::kClose ? "e"
+                      : event == TraceEvent::kReject ? "i"
+                                                     : "n";
+  const bool slice = event == TraceEvent::kAccept || event == TraceEvent::kClose;
+  fmt::print(out,
+             "{}\n{{\"name\":\"{}\",\"cat\":\"session\",\"ph\":\"{}\","
+             "\"id\":{},\"ts\":{:.3f},\"pid\":1,\"tid\":{},\"args\":{{",
+             first ? "" : ",", slice ? "session" : info.name, phase,
+             record.idx,
+             static_cast<double>(record.time - header.steady) / 1000,
+             record.thread);
+  bool separate{false};
+  for (size_t i = 0; i < std::size(info.args); ++i) {
+    if (info.args[i].empty()) continue;
+    fmt::print(out, "{}\"{}\":{}", separate ? "," : "", info.args[i],
+               record.args[i]);
+    separate = true;
+  }
+  out << "}}";
+}
+
+}  // namespace
+
+namespace detail {
+
+void Record(TraceEvent event, size_t idx, uint64_t arg0, uint64_t arg1) {
+  Instance().Record(event, idx, arg0, arg1);
+}
+
+}  // namespace detail
+
+bool StartTracing(const TraceConfig &config) {
+  return Instance().Start(config);
+}
+
+void StopTracing() { Instance().Stop(); }
+
+bool DecodeTrace(std::istream &in, std::ostream &out, TraceFormat format) {
+  TraceHeader header{};
+  if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.record_size != sizeof(TraceRecord)) {
+    return false;
+  }
+  std::vector<TraceRecord> records;
+  TraceRecord record{};
+  while (in.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+    if (record.event < std::size(kEvents)) records.push_back(record);
+  }
+  // each thread wrote in order, the writer interleaved them by the batch
+  std::stable_sort(records.begin(), records.end(),
+                   [](const TraceRecord &a, const TraceRecord &b) {
+                     return a.time < b.time;
+                   });
+
+  if (format == TraceFormat::kChrome) out << "{\"traceEvents\":[";
+  for (size_t i = 0; i < records.size(); ++i) {
+    const auto &info = kEvents[records[i].event];
+    if (format == TraceFormat::kText) {
+      PrintText(out, header, records[i], info);
+    } else {
+      PrintChrome(out, header, records[i], info, i == 0);
+    }
+  }
+  if (format == TraceFormat::kChrome) {
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  }
+  return true;
+}
+
+}  // namespace socks
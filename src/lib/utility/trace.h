@@ -0,0 +1,76 @@
+#ifndef QUIC_SOCKS_UTILITY_TRACE_H_
+#define QUIC_SOCKS_UTILITY_TRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace socks {
+
+// Points in the life of a session. What the two arguments of each event
+// mean is listed next to its name in trace.cc.
+enum class TraceEvent : uint16_t {
+  kAccept,
+  kReject,
+  kConnect,
+  kRequest,
+  kResponse,
+  kForward,
+  kClose,
+  kCount,
+};
+
+// Written to the trace file as is, in host byte order.
+struct TraceRecord {
+  // steady clock, in nanoseconds
+  int64_t time;
+  // low bits of the session idx
+  uint32_t idx;
+  uint16_t event;
+  uint16_t thread;
+  uint64_t args[2];
+};
+static_assert(sizeof(TraceRecord) == 32);
+
+struct TraceConfig {
+  std::string path;
+  // records buffered per thread until the writer comes by, a thread with a
+  // full ring drops its records
+  size_t ring_size{16384};
+  std::chrono::milliseconds flush{100};
+};
+
+enum class TraceFormat { kText, kChrome };
+
+namespace detail {
+
+extern std::atomic_bool tracing;
+void Record(TraceEvent event, size_t idx, uint64_t arg0, uint64_t arg1);
+
+}  // namespace detail
+
+// Tracing is process wide. Returns false when `config.path` can't be
+// written, starting again restarts with the new file.
+bool StartTracing(const TraceConfig &config);
+// Writes out what was recorded and closes the file.
+void StopTracing();
+
+// Stamps and queues a record on the calling thread, a relaxed load while
+// tracing is off.
+inline void Trace(TraceEvent event, size_t idx, uint64_t arg0 = 0,
+                  uint64_t arg1 = 0) {
+  if (detail::tracing.load(std::memory_order_relaxed)) {
+    detail::Record(event, idx, arg0, arg1);
+  }
+}
+
+// Prints the records of a trace file ordered by time, as text lines or as
+// json for chrome://tracing and Perfetto. Returns false when `in` is no
+// trace.
+bool DecodeTrace(std::istream &in, std::ostream &out, TraceFormat format);
+
+}  // namespace socks
+
+#endif  // QUIC_SOCKS_UTILITY_TRACE_H_
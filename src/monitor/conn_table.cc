@@ -0,0 +1,169 @@
+#include "conn_table.h"
+
+#include <algorithm>
+
+namespace socks {
+
+namespace {
+
+// beyond this many removals in one delta the view is reset instead of told
+// about every row
+constexpr size_t kResetThreshold = 256;
+
+QString FormatEndpoint(const asio::ip::tcp::endpoint &endpoint) {
+  if (endpoint.port() == 0) return {};
+  return QStringLiteral("%1:%2")
+      .arg(QString::fromStdString(endpoint.address().to_string()))
+      .arg(endpoint.port());
+}
+
+QString FormatBytes(uint64_t bytes) {
+  static const char *kUnits[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+  auto value = static_cast<double>(bytes);
+  size_t unit = 0;
+  while (value >= 1024 && unit + 1 < std::size(kUnits)) {
+    value /= 1024;
+    ++unit;
+  }
+  return unit == 0 ? QStringLiteral("%1 B").arg(bytes)
+                   : QStringLiteral("%1 %2").arg(value, 0, 'f', 1).arg(
+                         kUnits[unit]);
+}
+
+}  // namespace
+
+ConnTableModel::ConnTableModel(QObject *parent)
+    : QAbstractTableModel(parent) {}
+
+void ConnTableModel::Apply(const ConnDelta &delta) {
+  std::vector<const ConnSummary *> added;
+  size_t first = rows_.size();
+  size_t last = 0;
+  for (const auto &summary : delta.updated) {
+    const auto it = index_.find(summary.idx);
+    if (it == index_.end()) {
+      added.emplace_back(&summary);
+      continue;
+    }
+    auto &row = rows_[it->second];
+    online_ -= row.online;
+    online_ += summary.online;
+    row = summary;
+    first = std::min(first, it->second);
+    last = std::max(last, it->second);
+  }
+  // one signal for the span of the changed rows, the view repaints what it
+  // shows of it
+  if (first <= last) {
+    emit dataChanged(index(static_cast<int>(first), 0),
+                     index(static_cast<int>(last), kColumns - 1));
+  }
+
+  Remove(delta.removed);
+
+  if (!added.empty()) {
+    const auto begin = static_cast<int>(rows_.size());
+    beginInsertRows({}, begin, begin + static_cast<int>(added.size()) - 1);
+    for (const auto *summary : added) {
+      index_[summary->idx] = rows_.size();
+      rows_.emplace_back(*summary);
+      online_ += summary->online;
+    }
+    endInsertRows();
+  }
+}
+
+void ConnTableModel::Remove(const std::vector<size_t> &removed) {
+  std::vector<size_t> rows;
+  rows.reserve(removed.size());
+  for (const auto idx : removed) {
+    if (auto it = index_.find(idx); it != index_.end()) {
+      rows.emplace_back(it->second);
+      online_ -= rows_[it->second].online;
+      index_.erase(it);
+    }
+  }
+  if (rows.empty()) return;
+  std::sort(rows.begin(), rows.end());
+
+  if (rows.size() > kResetThreshold) {
+    beginResetModel();
+    // the rows gone are no longer indexed, one pass moves the rest up
+    std::erase_if(rows_, [this](const ConnSummary &row) {
+      return !index_.contains(row.idx);
+    });
+    Reindex(rows.front());
+    endResetModel();
+    return;
+  }
+
+  // back to front, so that the rows still to go keep their numbers
+  for (auto row = rows.rbegin(); row != rows.rend(); ++row) {
+    const auto at = static_cast<int>(*row);
+    beginRemoveRows({}, at, at);
+    rows_.erase(rows_.begin() + at);
+    endRemoveRows();
+  }
+  Reindex(rows.front());
+}
+
+void ConnTableModel::Reindex(size_t from) {
+  for (auto row = from; row < rows_.size(); ++row) {
+    index_[rows_[row].idx] = row;
+  }
+}
+
+int ConnTableModel::rowCount(const QModelIndex &parent) const {
+  return parent.isValid() ? 0 : static_cast<int>(rows_.size());
+}
+
+int ConnTableModel::columnCount(const QModelIndex &parent) const {
+  return parent.isValid() ? 0 : kColumns;
+}
+
+QVariant ConnTableModel::data(const QModelIndex &index, int role) const {
+  if (!index.isValid() || index.row() >= static_cast<int>(rows_.size())) {
+    return {};
+  }
+  const auto &row = rows_[index.row()];
+  if (role == Qt::TextAlignmentRole) {
+    return index.column() >= kOutbound
+               ? int(Qt::AlignRight | Qt::AlignVCenter)
+               : int(Qt::AlignLeft | Qt::AlignVCenter);
+  }
+  if (role != Qt::DisplayRole) return {};
+
+  switch (index.column()) {
+    case kIdx:
+      return QString::number(row.idx);
+    case kClient:
+      return FormatEndpoint(row.src);
+    case kHost:
+      return QString::fromStdString(row.host);
+    case kRemote:
+      return FormatEndpoint(row.dst);
+    case kState:
+      return row.online ? QStringLiteral("online") : QStringLiteral("closed");
+    case kOutbound:
+      return FormatBytes(row.outbound_bytes);
+    case kInbound:
+      return FormatBytes(row.inbound_bytes);
+    case kOutboundRate:
+      return FormatBytes(row.outbound_rate) + QStringLiteral("/s");
+    case kInboundRate:
+      return FormatBytes(row.inbound_rate) + QStringLiteral("/s");
+    default:
+      return {};
+  }
+}
+
+QVariant ConnTableModel::headerData(int section, Qt::Orientation orientation,
+                                    int role) const {
+  if (role != Qt::DisplayRole || orientation != Qt::Horizontal) return {};
+  static const char *kHeaders[kColumns] = {
+      "idx", "client", "host", "remote", "state", "out", "in", "out/s", "in/s"};
+  if (section < 0 || section >= kColumns) return {};
+  return QString{kHeaders[section]};
+}
+
+}  // namespace socks
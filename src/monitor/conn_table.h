@@ -0,0 +1,53 @@
+#pragma once
+
+#include <QtCore/QAbstractTableModel>
+#include <unordered_map>
+#include <vector>
+
+#include "observer/network_observer.h"
+
+namespace socks {
+
+// The connections of the proxy, one row each, kept up to date by applying
+// the deltas of the relay. Views only ask for the rows they show, so the
+// cost of a refresh is bound by what changed rather than by the rows held.
+class ConnTableModel : public QAbstractTableModel {
+  Q_OBJECT
+
+ public:
+  enum Column {
+    kIdx,
+    kClient,
+    kHost,
+    kRemote,
+    kState,
+    kOutbound,
+    kInbound,
+    kOutboundRate,
+    kInboundRate,
+    kColumns,
+  };
+
+  explicit ConnTableModel(QObject *parent = Q_NULLPTR);
+
+  // Call on the gui thread.
+  void Apply(const ConnDelta &delta);
+  [[nodiscard]] size_t Online() const { return online_; }
+
+  int rowCount(const QModelIndex &parent) const override;
+  int columnCount(const QModelIndex &parent) const override;
+  QVariant data(const QModelIndex &index, int role) const override;
+  QVariant headerData(int section, Qt::Orientation orientation,
+                      int role) const override;
+
+ private:
+  void Remove(const std::vector<size_t> &removed);
+  void Reindex(size_t from);
+
+  std::vector<ConnSummary> rows_;
+  // row of each connection
+  std::unordered_map<size_t, size_t> index_;
+  size_t online_{0};
+};
+
+}  // namespace socks
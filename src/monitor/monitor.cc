@@ -1,29 +1,31 @@
 #include "monitor.h"
 
 #include <QtWidgets/QHeaderView>
+#include <QtWidgets/QStatusBar>
 
 namespace socks {
 
 Monitor::Monitor(QWidget *parent)
-    : QMainWindow(parent), proxy_{tunnel::HttpProxy::Create(8999)} {
-  ui.Setup(this);
+    : QMainWindow(parent),
+      model_{new ConnTableModel(this)},
+      proxy_{tunnel::HttpProxy::Create(8999)} {
+  ui.Setup(this, model_);
   proxy_->Register(this);
   proxy_->Start();
-
-  ui.AppendTable("192.0.0.1", "8.8.8.8", 52);
 }
 
-void Monitor::Connect(size_t idx, asio::ip::tcp::endpoint src,
-                      asio::ip::tcp::endpoint dst, std::string host) {}
-
-void Monitor::Forward(size_t idx, bool outside, std::string data) {
-  ui.AppendTable(std::to_string(idx), std::to_string(int(outside)),
-                 data.size());
+void Monitor::OnRefresh(const ConnDelta &delta) {
+  QMetaObject::invokeMethod(
+      this,
+      [this, delta] {
+        model_->Apply(delta);
+        ui.ShowOnline(model_->Online(),
+                      static_cast<size_t>(model_->rowCount({})));
+      },
+      Qt::QueuedConnection);
 }
 
-void Monitor::Disconnect(size_t idx) {}
-
-void UiMonitor::Setup(QMainWindow *window) {
+void UiMonitor::Setup(QMainWindow *window, ConnTableModel *model) {
   window->setObjectName(QStringLiteral("Monitor"));
   window->setWindowTitle("Monitor");
   window->resize(800, 600);
@@ -34,27 +36,26 @@ void UiMonitor::Setup(QMainWindow *window) {
   auto *layout = new QVBoxLayout(widget);
   layout->setMargin(0);
 
-  auto *button = new QPushButton(widget);
-  button->setText("Push");
-  layout->addWidget(button);
-
-  table = new QTableWidget(widget);
+  table = new QTableView(widget);
   layout->addWidget(table);
 
-  table->setColumnCount(3);
-  table->setHorizontalHeaderLabels({"src", "dst", "len"});
-  table->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
+  table->setModel(model);
+  // rows of one height let the view place them without measuring each
+  table->verticalHeader()->setSectionResizeMode(QHeaderView::Fixed);
+  table->verticalHeader()->setDefaultSectionSize(
+      table->fontMetrics().height() + 4);
+  table->verticalHeader()->hide();
+  table->horizontalHeader()->setSectionResizeMode(QHeaderView::Interactive);
+  table->horizontalHeader()->setStretchLastSection(true);
+  table->setSelectionBehavior(QAbstractItemView::SelectRows);
+
+  status = new QLabel(window);
+  window->statusBar()->addWidget(status);
+  ShowOnline(0, 0);
 }
 
-void UiMonitor::AppendTable(const std::string &src, const std::string &dst,
-                            size_t len) {
-  table->insertRow(table->rowCount());
-  auto row_len = table->rowCount();
-  table->setItem(row_len - 1, 0,
-                 new QTableWidgetItem(QString::fromStdString(src)));
-  table->setItem(row_len - 1, 1,
-                 new QTableWidgetItem(QString::fromStdString(dst)));
-  table->setItem(row_len - 1, 2, new QTableWidgetItem(QString::number(len)));
+void UiMonitor::ShowOnline(size_t online, size_t rows) {
+  status->setText(QStringLiteral("%1 online, %2 shown").arg(online).arg(rows));
 }
 
 }  // namespace socks
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <QtWidgets/QLabel>
 #include <QtWidgets/QMainWindow>
-#include <QtWidgets/QTableWidget>
+#include <QtWidgets/QTableView>
 
+#include "conn_table.h"
 #include "tunnel/http_proxy.h"
 #include "ui_monitor.h"
 
@@ -10,11 +12,12 @@ namespace socks {
 
 class UiMonitor {
  public:
-  void Setup(QMainWindow *window);
+  void Setup(QMainWindow *window, ConnTableModel *model);
 
-  void AppendTable(const std::string &src, const std::string &dst, size_t len);
+  void ShowOnline(size_t online, size_t rows);
 
-  QTableWidget *table;
+  QTableView *table;
+  QLabel *status;
 };
 
 class Monitor : public QMainWindow, public NetworkObserver {
@@ -24,12 +27,11 @@ class Monitor : public QMainWindow, public NetworkObserver {
   Monitor(QWidget *parent = Q_NULLPTR);
 
  private:
-  void Connect(size_t idx, asio::ip::tcp::endpoint src,
-               asio::ip::tcp::endpoint dst, std::string host) override;
-  void Forward(size_t idx, bool outside, std::string data) override;
-  void Disconnect(size_t idx) override;
+  // Runs on the relay thread, the delta is applied on the gui thread.
+  void OnRefresh(const ConnDelta &delta) override;
 
   UiMonitor ui;
+  ConnTableModel *model_;
   std::shared_ptr<tunnel::HttpProxy> proxy_;
 };
 
@@ -0,0 +1,133 @@
+#include "utility/buffer.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <thread>
+#include <utility>
+
+namespace socks {
+
+TEST(BufferSliceTest, PicksSizeClass) {
+  static_assert(SharedBuffer::ClassOf(0) == 0);
+  static_assert(SharedBuffer::ClassOf(SharedBuffer::kCapacities[1]) == 1);
+  static_assert(SharedBuffer::ClassOf(SharedBuffer::kCapacities[1] + 1) == 2);
+  static_assert(SharedBuffer::ClassOf(SIZE_MAX) == SharedBuffer::kClasses - 1);
+
+  EXPECT_EQ(BufferSlice::Acquire(1).size(), SharedBuffer::kCapacities[0]);
+  EXPECT_EQ(BufferSlice::Acquire(SharedBuffer::kCapacities[0]).size(),
+            SharedBuffer::kCapacities[0]);
+  EXPECT_EQ(BufferSlice::Acquire(SharedBuffer::kCapacities[0] + 1).size(),
+            SharedBuffer::kCapacities[1]);
+  EXPECT_EQ(BufferSlice::Acquire().size(), SharedBuffer::kCapacity);
+  // larger requests get the largest class
+  EXPECT_EQ(BufferSlice::Acquire(1024 * 1024).size(),
+            SharedBuffer::kCapacities[SharedBuffer::kClasses - 1]);
+}
+
+TEST(BufferSliceTest, CountsReferences) {
+  auto buf = BufferSlice::Acquire();
+  EXPECT_TRUE(buf.Unique());
+
+  auto copy = buf;
+  const auto slice = buf.Slice(10, 5);
+  EXPECT_FALSE(buf.Unique());
+  EXPECT_FALSE(slice.Unique());
+  EXPECT_EQ(slice.data(), buf.data() + 10);
+  EXPECT_EQ(slice.size(), 5);
+
+  // moving hands the reference over without counting it twice
+  auto moved = std::move(copy);
+  EXPECT_TRUE(copy.empty());
+  EXPECT_EQ(copy.data(), nullptr);
+  EXPECT_FALSE(copy.Unique());
+  moved = {};
+  EXPECT_FALSE(buf.Unique());
+
+  // the slice alone keeps the block
+  const auto *data = buf.data();
+  buf = BufferSlice{};
+  EXPECT_TRUE(slice.Unique());
+  EXPECT_EQ(slice.data(), data + 10);
+
+  auto assigned = BufferSlice::Acquire();
+  assigned = slice;
+  EXPECT_FALSE(slice.Unique());
+  EXPECT_EQ(assigned.View(), slice.View());
+}
+
+// A released block is the next one handed out of its class, the last slice
+// of it gives it back.
+TEST(BufferSliceTest, ReturnsBlocksToPool) {
+  auto buf = BufferSlice::Acquire();
+  const auto *data = buf.data();
+  auto slice = buf.Slice(0, 1);
+  buf = {};
+  EXPECT_NE(BufferSlice::Acquire().data(), data);
+  slice = {};
+  EXPECT_EQ(BufferSlice::Acquire().data(), data);
+
+  // other classes keep their own blocks
+  EXPECT_NE(BufferSlice::Acquire(1).data(), data);
+  EXPECT_EQ(BufferSlice::Acquire().data(), data);
+}
+
+// A block released on another thread goes back to the pool of the thread
+// that acquired it, which collects it once its free list runs dry.
+TEST(BufferSliceTest, ReturnsBlocksAcrossThreads) {
+  // a fresh thread starts with an empty pool
+  std::thread{[] {
+    auto buf = BufferSlice::Acquire();
+    const auto *data = buf.data();
+    std::thread{[buf = std::move(buf)]() mutable { buf = {}; }}.join();
+    EXPECT_EQ(BufferSlice::Acquire().data(), data);
+  }}.join();
+
+  // blocks of a thread that exited stay valid while in use
+  BufferSlice other;
+  std::thread{[&other] { other = BufferSlice::Acquire(); }}.join();
+  EXPECT_TRUE(other.Unique());
+  other.data()[0] = 'x';
+  other = {};
+}
+
+TEST(ReadSizerTest, GrowsOnFullReads) {
+  ReadSizer sizer;
+  EXPECT_EQ(sizer.Next(), SharedBuffer::kCapacities[0]);
+  for (size_t cls = 1; cls < SharedBuffer::kClasses; ++cls) {
+    sizer.Record(sizer.Next(), sizer.Next());
+    EXPECT_EQ(sizer.Next(), SharedBuffer::kCapacities[cls]);
+  }
+  // the largest class is as far as it goes
+  sizer.Record(sizer.Next(), sizer.Next());
+  EXPECT_EQ(sizer.Next(), SharedBuffer::kCapacities[SharedBuffer::kClasses - 1]);
+
+  // one byte short of full stays
+  sizer = {};
+  sizer.Record(sizer.Next() - 1, sizer.Next());
+  EXPECT_EQ(sizer.Next(), SharedBuffer::kCapacities[0]);
+}
+
+TEST(ReadSizerTest, ShrinksOnSmallReads) {
+  ReadSizer sizer;
+  for (size_t i = 1; i < SharedBuffer::kClasses; ++i) {
+    sizer.Record(sizer.Next(), sizer.Next());
+  }
+  const auto top = SharedBuffer::kClasses - 1;
+
+  // a quarter of the buffer and more stays
+  sizer.Record(SharedBuffer::kCapacities[top] / 4, sizer.Next());
+  EXPECT_EQ(sizer.Next(), SharedBuffer::kCapacities[top]);
+  sizer.Record(SharedBuffer::kCapacities[top] - 1, sizer.Next());
+  EXPECT_EQ(sizer.Next(), SharedBuffer::kCapacities[top]);
+
+  for (size_t cls = top; cls > 0; --cls) {
+    sizer.Record(SharedBuffer::kCapacities[cls] / 4 - 1, sizer.Next());
+    EXPECT_EQ(sizer.Next(), SharedBuffer::kCapacities[cls - 1]);
+  }
+  // the smallest class is as far as it goes
+  sizer.Record(0, sizer.Next());
+  EXPECT_EQ(sizer.Next(), SharedBuffer::kCapacities[0]);
+}
+
+}  // namespace socks
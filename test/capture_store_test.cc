@@ -0,0 +1,78 @@
+#include "observer/capture_store.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <vector>
+
+namespace socks {
+
+namespace {
+
+using std::chrono::milliseconds;
+
+// Events of two connections as two io threads hand them over, in batches
+// whose times overlap, so the store gets them out of time order.
+std::vector<NetworkEvent> Interleaved(std::chrono::steady_clock::time_point at,
+                                      size_t n) {
+  std::vector<NetworkEvent> events;
+  for (size_t i = 0; i < n; ++i) {
+    const size_t idx = i % 2;
+    // the second connection lags a second behind the first
+    const auto time = at + milliseconds{i} - milliseconds{idx * 1000};
+    events.push_back(
+        {.type = NetworkEvent::Type::kForward, .idx = idx, .time = time,
+         .len = i});
+  }
+  return events;
+}
+
+}  // namespace
+
+TEST(CaptureStoreTest, VisitsInterleavedRecords) {
+  const auto dir = testing::TempDir() + "capture_store_test";
+  auto store = CaptureStore::Create({.dir = dir});
+  ASSERT_TRUE(store);
+
+  const auto start = std::chrono::steady_clock::now() - std::chrono::hours{1};
+  const auto sys_start =
+      std::chrono::system_clock::now() - std::chrono::hours{1};
+  const auto events = Interleaved(start, 2000);
+  store->OnEvents(events);
+
+  std::vector<size_t> all;
+  store->Visit(std::chrono::system_clock::time_point::min(),
+               std::chrono::system_clock::time_point::max(),
+               [&all](const CaptureRecord &record) {
+                 all.push_back(record.len);
+               });
+  ASSERT_EQ(all.size(), events.size());
+  for (size_t i = 0; i < all.size(); ++i) EXPECT_EQ(all[i], i);
+
+  // a window of 200ms, the second connection's records of that time were
+  // stored a thousand records after the first's, half a millisecond off
+  // the records leaves room for the clocks read apart
+  const auto window = sys_start + std::chrono::microseconds{199500};
+  size_t visited{0}, second{0};
+  store->Visit(window, window + milliseconds{200},
+               [&](const CaptureRecord &record) {
+                 ++visited;
+                 second += record.idx;
+               });
+  EXPECT_EQ(visited, 200);
+  EXPECT_EQ(second, 100);
+
+  for (size_t idx = 0; idx < 2; ++idx) {
+    size_t records{0};
+    store->Visit(idx, [&records, idx](const CaptureRecord &record) {
+      EXPECT_EQ(record.idx, idx);
+      ++records;
+    });
+    EXPECT_EQ(records, events.size() / 2);
+  }
+
+  store.reset();
+  std::filesystem::remove_all(dir);
+}
+
+}  // namespace socks
@@ -0,0 +1,110 @@
+#include "tunnel/codec.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace socks::tunnel {
+
+namespace {
+
+std::string Flatten(std::span<const asio::const_buffer> buffers) {
+  std::string out;
+  for (const auto &buffer : buffers) {
+    out.append(static_cast<const char *>(buffer.data()), buffer.size());
+  }
+  return out;
+}
+
+std::vector<Frame> DecodeAll(std::string_view data) {
+  std::vector<Frame> frames;
+  Frame frame{};
+  while (FrameDecoder::Decode(data, frame) == FrameDecoder::Status::kDone) {
+    frames.push_back(frame);
+  }
+  EXPECT_TRUE(data.empty());
+  return frames;
+}
+
+}  // namespace
+
+TEST(CodecTest, RoundTrips) {
+  const std::string payload(100000, 'x');
+  FrameEncoder encoder;
+  encoder.Open(1, "example.com:443");
+  encoder.Data(1, asio::buffer(payload));
+  encoder.Window(3, 1 << 20);
+  encoder.Fin(1);
+  encoder.Reset(5, 7);
+
+  const auto bytes = Flatten(encoder.Buffers());
+  EXPECT_EQ(bytes.size(), encoder.Size());
+  const auto frames = DecodeAll(bytes);
+  ASSERT_EQ(frames.size(), 6);
+  EXPECT_EQ(frames[0].kind, FrameKind::kOpen);
+  EXPECT_EQ(frames[0].payload, "example.com:443");
+  // split at the payload limit
+  EXPECT_EQ(frames[1].payload.size(), kMaxFramePayload);
+  EXPECT_EQ(frames[2].payload.size(), payload.size() - kMaxFramePayload);
+  EXPECT_EQ(frames[3].kind, FrameKind::kWindow);
+  EXPECT_EQ(frames[3].stream, 3);
+  EXPECT_EQ(frames[3].value, 1 << 20);
+  EXPECT_EQ(frames[4].kind, FrameKind::kFin);
+  EXPECT_EQ(frames[5].kind, FrameKind::kReset);
+  EXPECT_EQ(frames[5].value, 7);
+}
+
+TEST(CodecTest, ReferencesPayloads) {
+  const std::string payload(1000, 'y');
+  FrameEncoder encoder;
+  encoder.Window(1, 10);
+  encoder.Fin(3);
+  encoder.Data(1, asio::buffer(payload));
+  const auto buffers = encoder.Buffers();
+  // both control frames and the data header share the first buffer
+  ASSERT_EQ(buffers.size(), 2);
+  EXPECT_EQ(buffers[1].data(), payload.data());
+}
+
+TEST(CodecTest, WaitsForWholeFrames) {
+  const std::string payload(300, 'z');
+  FrameEncoder encoder;
+  encoder.Data(9, asio::buffer(payload));
+  const auto bytes = Flatten(encoder.Buffers());
+  for (size_t len = 0; len < bytes.size(); ++len) {
+    std::string_view data{bytes.data(), len};
+    Frame frame{};
+    EXPECT_EQ(FrameDecoder::Decode(data, frame),
+              FrameDecoder::Status::kPartial);
+    EXPECT_EQ(data.size(), len);
+  }
+}
+
+TEST(CodecTest, RefusesMalformedFrames) {
+  Frame frame{};
+  for (const auto &bytes : {std::string{"\x09\x01\x00", 3},
+                            std::string{"\x03\x01\x01x", 4},
+                            std::string{"\x02\x01\x80\x02\x00\x00", 6}}) {
+    std::string_view data{bytes};
+    EXPECT_EQ(FrameDecoder::Decode(data, frame),
+              FrameDecoder::Status::kInvalid);
+  }
+}
+
+TEST(CodecTest, GrantsCreditInBatches) {
+  SendCredit send{1000};
+  RecvCredit recv{1000};
+  send.Consume(1000);
+  EXPECT_EQ(send.Available(), 0);
+  EXPECT_TRUE(recv.OnData(1000));
+  EXPECT_FALSE(RecvCredit{1000}.OnData(1001));
+
+  EXPECT_EQ(recv.OnConsumed(400), 0);
+  const auto increment = recv.OnConsumed(200);
+  EXPECT_EQ(increment, 600);
+  send.Grant(increment);
+  EXPECT_EQ(send.Available(), 600);
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,83 @@
+#include "observer/conn_manager.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+
+namespace socks {
+
+namespace {
+
+const auto kClient = asio::ip::make_address("192.0.2.1");
+const auto kOther = asio::ip::make_address("2001:db8::1");
+
+asio::awaitable<void> Acquire(ConnManager &conns, asio::io_context &ctx,
+                              size_t times, bool &done) {
+  for (size_t i = 0; i < times; ++i) co_await conns.AsyncAcquire(ctx);
+  done = true;
+}
+
+}  // namespace
+
+TEST(ConnManagerTest, LimitsClients) {
+  ConnManager conns{{.max_per_client = 2}};
+  auto [v1, t1] = conns.Admit(kClient);
+  auto [v2, t2] = conns.Admit(kClient);
+  EXPECT_EQ(v1, ConnManager::Verdict::kAdmitted);
+  EXPECT_EQ(v2, ConnManager::Verdict::kAdmitted);
+  auto [v3, t3] = conns.Admit(kClient);
+  EXPECT_EQ(v3, ConnManager::Verdict::kClientFull);
+  EXPECT_FALSE(t3);
+  EXPECT_TRUE(conns.Admit(kOther).second);
+
+  t1 = {};
+  EXPECT_EQ(conns.Size(), 1);
+  EXPECT_TRUE(conns.Admit(kClient).second);
+}
+
+TEST(ConnManagerTest, LimitsClientRate) {
+  ConnManager conns{{.rate_per_client = 2}};
+  // a burst of a second's worth passes, closing doesn't give tokens back
+  EXPECT_TRUE(conns.Admit(kClient).second);
+  EXPECT_TRUE(conns.Admit(kClient).second);
+  EXPECT_EQ(conns.Admit(kClient).first, ConnManager::Verdict::kClientRate);
+  EXPECT_TRUE(conns.Admit(kOther).second);
+  EXPECT_EQ(conns.Size(), 0);
+}
+
+TEST(ConnManagerTest, PausesAcceptingWhileFull) {
+  asio::io_context ctx;
+  ConnManager conns{{.max_connections = 2}};
+  auto [v1, t1] = conns.Admit(kClient);
+  auto [v2, t2] = conns.Admit(kOther);
+  EXPECT_EQ(conns.Admit(kOther).first, ConnManager::Verdict::kFull);
+  EXPECT_FALSE(conns.TryAcquire());
+
+  bool done{false};
+  co_spawn(ctx, Acquire(conns, ctx, 1, done), asio::detached);
+  ctx.run_for(std::chrono::milliseconds{20});
+  EXPECT_FALSE(done);
+
+  // may be released on any thread
+  std::thread{[&t = t1] { t = {}; }}.join();
+  ctx.restart();
+  ctx.run_for(std::chrono::milliseconds{20});
+  EXPECT_TRUE(done);
+  EXPECT_TRUE(conns.TryAcquire());
+  EXPECT_TRUE(conns.Admit(kOther).second);
+}
+
+TEST(ConnManagerTest, PacesAccepting) {
+  asio::io_context ctx;
+  ConnManager conns{{.rate = 100}};
+  bool done{false};
+  const auto start = std::chrono::steady_clock::now();
+  // a second's worth and another 5 at 10ms each
+  co_spawn(ctx, Acquire(conns, ctx, 105, done), asio::detached);
+  ctx.run();
+  EXPECT_TRUE(done);
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds{40});
+}
+
+}  // namespace socks
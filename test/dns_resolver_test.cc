@@ -0,0 +1,260 @@
+#include "tunnel/dns_resolver.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <span>
+
+namespace socks::tunnel {
+
+namespace {
+
+// Answers A queries for example.com, NXDOMAIN for anything else. Answers to
+// big.example.com are truncated over udp and complete over tcp.
+class StandInServer {
+ public:
+  explicit StandInServer(asio::io_context &ctx)
+      : udp_{ctx, {asio::ip::address_v4::loopback(), 0}},
+        tcp_{ctx, {asio::ip::address_v4::loopback(),
+                   udp_.local_endpoint().port()}} {
+    asio::co_spawn(ctx, ServeUdp(), asio::detached);
+    asio::co_spawn(ctx, ServeTcp(), asio::detached);
+  }
+
+  void Stop() {
+    udp_.close();
+    tcp_.close();
+  }
+
+  [[nodiscard]] asio::ip::udp::endpoint Endpoint() const {
+    return udp_.local_endpoint();
+  }
+  std::map<std::string, size_t> queries;
+  size_t tcp_queries{0};
+
+ private:
+  std::vector<uint8_t> Answer(std::span<const uint8_t> query, bool udp) {
+    size_t end = 12;
+    std::string name;
+    while (query[end] != 0) {
+      if (!name.empty()) name.push_back('.');
+      name.append(reinterpret_cast<const char *>(&query[end + 1]), query[end]);
+      end += query[end] + 1;
+    }
+    const uint16_t type = query[end + 1] << 8 | query[end + 2];
+    end += 5;
+    ++queries[name];
+
+    std::vector<uint8_t> out{query.begin(), query.begin() + end};
+    out[2] = 0x81;
+    out[3] = 0x80;
+    out[10] = out[11] = 0;
+    const bool found = name == "example.com" || name == "big.example.com";
+    if (!found) {
+      out[3] |= 3;
+    } else if (name == "big.example.com" && udp) {
+      out[2] |= 0x02;
+    } else if (type == 1) {
+      out[7] = 1;
+      const uint8_t answer[] = {0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0,
+                                60,   0,    4, 10, 0, 0, 1};
+      out.insert(out.end(), std::begin(answer), std::end(answer));
+    }
+    return out;
+  }
+
+  asio::awaitable<void> ServeUdp() {
+    std::array<uint8_t, 1500> buf{};
+    asio::ip::udp::endpoint peer;
+    while (udp_.is_open()) {
+      asio::error_code err;
+      const auto len = co_await udp_.async_receive_from(
+          asio::buffer(buf), peer,
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      const auto out = Answer({buf.data(), len}, true);
+      co_await udp_.async_send_to(asio::buffer(out), peer,
+                                  asio::use_awaitable);
+    }
+  }
+
+  asio::awaitable<void> ServeTcp() {
+    while (tcp_.is_open()) {
+      asio::error_code err;
+      auto socket = co_await tcp_.async_accept(
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      ++tcp_queries;
+      for (size_t i = 0; i < 2; ++i) {
+        std::array<uint8_t, 2> prefix{};
+        co_await asio::async_read(socket, asio::buffer(prefix),
+                                  asio::use_awaitable);
+        std::vector<uint8_t> query(prefix[0] << 8 | prefix[1]);
+        co_await asio::async_read(socket, asio::buffer(query),
+                                  asio::use_awaitable);
+        auto out = Answer(query, false);
+        out.insert(out.begin(), {static_cast<uint8_t>(out.size() >> 8),
+                                 static_cast<uint8_t>(out.size() & 0xff)});
+        co_await asio::async_write(socket, asio::buffer(out),
+                                   asio::use_awaitable);
+      }
+    }
+  }
+
+  asio::ip::udp::socket udp_;
+  asio::ip::tcp::acceptor tcp_;
+};
+
+template <typename F>
+void RunTest(F &&f) {
+  asio::io_context ctx;
+  StandInServer server{ctx};
+  asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        co_await f(server);
+        server.Stop();
+      },
+      asio::detached);
+  ctx.run();
+}
+
+}  // namespace
+
+TEST(DnsResolverTest, CachesAnswers) {
+  RunTest([](StandInServer &server) -> asio::awaitable<void> {
+    DnsResolver resolver{ResolverConfig{.servers = {server.Endpoint()}}};
+    for (size_t i = 0; i < 3; ++i) {
+      auto addresses = co_await resolver.AsyncResolve("Example.COM.");
+      EXPECT_EQ(addresses, DnsResolver::Addresses{
+                               asio::ip::make_address("10.0.0.1")});
+    }
+    EXPECT_EQ(server.queries["example.com"], 2);
+  });
+}
+
+TEST(DnsResolverTest, CoalescesConcurrentLookups) {
+  RunTest([](StandInServer &server) -> asio::awaitable<void> {
+    DnsResolver resolver{ResolverConfig{.servers = {server.Endpoint()}}};
+    auto executor = co_await asio::this_coro::executor;
+    size_t done{0};
+    for (size_t i = 0; i < 50; ++i) {
+      asio::co_spawn(
+          executor,
+          [&]() -> asio::awaitable<void> {
+            auto addresses = co_await resolver.AsyncResolve("example.com");
+            EXPECT_EQ(addresses.size(), 1);
+            ++done;
+          },
+          asio::detached);
+    }
+    asio::steady_timer timer{executor, std::chrono::milliseconds{200}};
+    co_await timer.async_wait(asio::use_awaitable);
+    EXPECT_EQ(done, 50);
+    EXPECT_EQ(server.queries["example.com"], 2);
+  });
+}
+
+TEST(DnsResolverTest, CachesNxDomain) {
+  RunTest([](StandInServer &server) -> asio::awaitable<void> {
+    DnsResolver resolver{ResolverConfig{.servers = {server.Endpoint()}}};
+    for (size_t i = 0; i < 2; ++i) {
+      try {
+        co_await resolver.AsyncResolve("missing.test");
+        ADD_FAILURE();
+      } catch (const asio::system_error &e) {
+        EXPECT_EQ(e.code(), asio::error::host_not_found);
+      }
+    }
+    EXPECT_EQ(server.queries["missing.test"], 2);
+  });
+}
+
+TEST(DnsResolverTest, RetriesTruncatedOverTcp) {
+  RunTest([](StandInServer &server) -> asio::awaitable<void> {
+    DnsResolver resolver{ResolverConfig{.servers = {server.Endpoint()}}};
+    auto addresses = co_await resolver.AsyncResolve("big.example.com");
+    EXPECT_EQ(addresses.size(), 1);
+    EXPECT_EQ(server.tcp_queries, 1);
+  });
+}
+
+TEST(DnsResolverTest, ReturnsLiterals) {
+  RunTest([](StandInServer &server) -> asio::awaitable<void> {
+    DnsResolver resolver{ResolverConfig{.servers = {server.Endpoint()}}};
+    auto addresses = co_await resolver.AsyncResolve("::1");
+    EXPECT_EQ(addresses, DnsResolver::Addresses{asio::ip::make_address("::1")});
+    EXPECT_TRUE(server.queries.empty());
+  });
+}
+
+TEST(DnsResolverTest, AnswersFromHostsFile) {
+  const auto path = testing::TempDir() + "dns_resolver_test_hosts";
+  std::ofstream{path} << "# comment\n"
+                         "10.1.1.1 gateway gw.lan  # trailing comment\n"
+                         "::2\tGateway\n";
+  RunTest([&path](StandInServer &server) -> asio::awaitable<void> {
+    DnsResolver resolver{ResolverConfig{.servers = {server.Endpoint()},
+                                        .hosts_file = path}};
+    auto addresses = co_await resolver.AsyncResolve("GATEWAY.");
+    EXPECT_EQ(addresses,
+              (DnsResolver::Addresses{asio::ip::make_address("10.1.1.1"),
+                                      asio::ip::make_address("::2")}));
+    addresses = co_await resolver.AsyncResolve("gw.lan");
+    EXPECT_EQ(addresses,
+              DnsResolver::Addresses{asio::ip::make_address("10.1.1.1")});
+    EXPECT_TRUE(server.queries.empty());
+  });
+  std::remove(path.c_str());
+}
+
+TEST(DnsResolverTest, AppliesSearchDomains) {
+  RunTest([](StandInServer &server) -> asio::awaitable<void> {
+    DnsResolver resolver{
+        ResolverConfig{.servers = {server.Endpoint()},
+                       .search = {"corp.test", "example.com"}}};
+    // fewer dots than ndots, the search domains go first
+    auto addresses = co_await resolver.AsyncResolve("big");
+    EXPECT_EQ(addresses.size(), 1);
+    EXPECT_EQ(server.queries["big.corp.test"], 2);
+    EXPECT_FALSE(server.queries.contains("big"));
+
+    // as it is first, then with each domain
+    try {
+      co_await resolver.AsyncResolve("missing.test");
+      ADD_FAILURE();
+    } catch (const asio::system_error &e) {
+      EXPECT_EQ(e.code(), asio::error::host_not_found);
+    }
+    EXPECT_EQ(server.queries["missing.test"], 2);
+    EXPECT_EQ(server.queries["missing.test.example.com"], 2);
+
+    // absolute, never with a domain
+    addresses = co_await resolver.AsyncResolve("example.com.");
+    EXPECT_EQ(addresses.size(), 1);
+    EXPECT_FALSE(server.queries.contains("example.com.corp.test"));
+  });
+}
+
+TEST(DnsResolverTest, TimesOut) {
+  RunTest([](StandInServer &server) -> asio::awaitable<void> {
+    // nothing listens there
+    asio::ip::udp::socket silent{co_await asio::this_coro::executor,
+                                 {asio::ip::address_v4::loopback(), 0}};
+    DnsResolver resolver{
+        ResolverConfig{.servers = {silent.local_endpoint()},
+                       .timeout = std::chrono::milliseconds{50},
+                       .attempts = 1}};
+    try {
+      co_await resolver.AsyncResolve("example.com");
+      ADD_FAILURE();
+    } catch (const asio::system_error &e) {
+      EXPECT_EQ(e.code(), asio::error::host_not_found_try_again);
+    }
+  });
+}
+
+}  // namespace socks::tunnel
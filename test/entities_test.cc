@@ -0,0 +1,235 @@
+#include "tunnel/entities.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace socks::tunnel {
+
+namespace {
+
+constexpr std::string_view kRequest =
+    "GET http://example.com/a?b HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Accept:\t*/* \r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+RequestParser::Status ParseRequest(std::string_view head) {
+  RequestParser parser;
+  return parser.Feed(head);
+}
+
+ResponseParser::Status ParseResponse(std::string_view head) {
+  ResponseParser parser;
+  return parser.Feed(head);
+}
+
+// Scans `body` split into pieces of `step` bytes and returns how many bytes
+// belong to it.
+size_t ScanChunked(ChunkedScanner &scanner, std::string_view body,
+                   size_t step) {
+  size_t taken{0};
+  for (size_t i = 0; i < body.size(); i += step) {
+    const auto piece = body.substr(i, step);
+    const auto n = scanner.Feed(piece);
+    taken += n;
+    if (n < piece.size()) break;
+  }
+  return taken;
+}
+
+}  // namespace
+
+// The head arrives split at every offset, the bytes before it are never
+// scanned again and the result is the same as in one piece.
+TEST(HeadParserTest, ResumesAtEveryOffset) {
+  for (size_t split = 0; split < kRequest.size(); ++split) {
+    std::string buf;
+    buf.reserve(kRequest.size());
+    buf.append(kRequest.substr(0, split));
+    RequestParser parser;
+    ASSERT_EQ(parser.Feed(buf), RequestParser::Status::kPartial) << split;
+    buf.append(kRequest.substr(split));
+    ASSERT_EQ(parser.Feed(buf), RequestParser::Status::kDone) << split;
+
+    const auto &entity = parser.Entity();
+    EXPECT_EQ(entity.method, "GET");
+    EXPECT_EQ(entity.uri, "http://example.com/a?b");
+    EXPECT_EQ(entity.ver, "HTTP/1.1");
+    ASSERT_EQ(entity.headers.size(), 3);
+    EXPECT_EQ(entity.FindHeader("host"), "example.com");
+    EXPECT_EQ(entity.FindHeader("Accept"), "*/*");
+    EXPECT_EQ(entity.raw, kRequest);
+  }
+}
+
+TEST(HeadParserTest, StopsAtEmptyLine) {
+  const std::string pipelined = std::string{kRequest} + "GET / HTTP/1.1\r\n";
+  RequestParser parser;
+  ASSERT_EQ(parser.Feed(pipelined), RequestParser::Status::kDone);
+  EXPECT_EQ(parser.Entity().raw, kRequest);
+}
+
+TEST(HeadParserTest, ParsesResponses) {
+  ResponseParser parser;
+  ASSERT_EQ(parser.Feed("HTTP/1.0 404 Not Found\r\nA: b\r\n\r\n"),
+            ResponseParser::Status::kDone);
+  EXPECT_EQ(parser.Entity().ver, "HTTP/1.0");
+  EXPECT_EQ(parser.Entity().status, 404);
+  EXPECT_EQ(parser.Entity().reason, "Not Found");
+
+  // the reason phrase may be empty
+  parser.Reset();
+  ASSERT_EQ(parser.Feed("HTTP/1.1 204\r\n\r\n"),
+            ResponseParser::Status::kDone);
+  EXPECT_EQ(parser.Entity().status, 204);
+  EXPECT_TRUE(parser.Entity().reason.empty());
+}
+
+TEST(HeadParserTest, LimitsHeadSize) {
+  const std::string value(RequestParser::kMaxHeadSize, 'a');
+  std::string head = "GET / HTTP/1.1\r\nX-Large: " + value;
+  RequestParser parser;
+  EXPECT_EQ(parser.Feed(head), RequestParser::Status::kInvalid);
+  EXPECT_EQ(parser.Error(), "head too large");
+
+  // one that ends right at the limit is fine
+  head = "GET / HTTP/1.1\r\nX-Large: ";
+  head.append(RequestParser::kMaxHeadSize - head.size() - 4, 'a');
+  head.append("\r\n\r\n");
+  EXPECT_EQ(ParseRequest(head), RequestParser::Status::kDone);
+  head.insert(head.size() - 4, "a");
+  EXPECT_EQ(ParseRequest(head), RequestParser::Status::kInvalid);
+}
+
+TEST(HeadParserTest, LimitsHeaderCount) {
+  std::string head = "GET / HTTP/1.1\r\n";
+  for (size_t i = 0; i < RequestParser::kMaxHeaders; ++i) {
+    head += "X-Header: " + std::to_string(i) + "\r\n";
+  }
+  RequestParser parser;
+  EXPECT_EQ(parser.Feed(head + "\r\n"), RequestParser::Status::kDone);
+  EXPECT_EQ(parser.Entity().headers.size(), RequestParser::kMaxHeaders);
+
+  parser.Reset();
+  EXPECT_EQ(parser.Feed(head + "X-Header: more\r\n\r\n"),
+            RequestParser::Status::kInvalid);
+  EXPECT_EQ(parser.Error(), "too many headers");
+}
+
+// RFC 9112 section 5.2, a proxy may reject obsolete line folding, and
+// whitespace before the colon is never allowed.
+TEST(HeadParserTest, RejectsObsFold) {
+  EXPECT_EQ(ParseRequest("GET / HTTP/1.1\r\nX-A: a\r\n b\r\n\r\n"),
+            RequestParser::Status::kInvalid);
+  EXPECT_EQ(ParseRequest("GET / HTTP/1.1\r\nX-A: a\r\n\tb: c\r\n\r\n"),
+            RequestParser::Status::kInvalid);
+  EXPECT_EQ(ParseRequest("GET / HTTP/1.1\r\nX-A : a\r\n\r\n"),
+            RequestParser::Status::kInvalid);
+  EXPECT_EQ(ParseRequest("GET / HTTP/1.1\r\n: a\r\n\r\n"),
+            RequestParser::Status::kInvalid);
+}
+
+TEST(HeadParserTest, RejectsMalformedStartLines) {
+  for (const std::string_view head : {
+           "GET /\r\n\r\n",
+           "GET / HTTP/1.1 \r\n\r\n",
+           "get / HTTP/1.1\r\n\r\n",
+           " / HTTP/1.1\r\n\r\n",
+           "GET  HTTP/1.1\r\n\r\n",
+           "GET / HTTP/1.10\r\n\r\n",
+           "GET / HTTPS/1.1\r\n\r\n",
+           "\r\n\r\n",
+       }) {
+    RequestParser parser;
+    EXPECT_EQ(parser.Feed(head), RequestParser::Status::kInvalid) << head;
+    EXPECT_EQ(parser.Error(), "no start line") << head;
+  }
+  for (const std::string_view head : {
+           "HTTP/1.1 20 OK\r\n\r\n",
+           "HTTP/1.1 200OK\r\n\r\n",
+           "HTTP/1.1 2x0 OK\r\n\r\n",
+           "HTTP/11 200 OK\r\n\r\n",
+       }) {
+    EXPECT_EQ(ParseResponse(head), ResponseParser::Status::kInvalid) << head;
+  }
+}
+
+TEST(HeadParserTest, RejectsBareLineFeeds) {
+  RequestParser parser;
+  EXPECT_EQ(parser.Feed("GET / HTTP/1.1\nHost: a\r\n\r\n"),
+            RequestParser::Status::kInvalid);
+  EXPECT_EQ(parser.Error(), "bare line feed");
+  EXPECT_EQ(ParseRequest("GET / HTTP/1.1\r\nHost: a\n\r\n"),
+            RequestParser::Status::kInvalid);
+}
+
+TEST(ChunkedScannerTest, FindsEndOfBody) {
+  constexpr std::string_view kBody = "5\r\nhello\r\n1A\r\n";
+  const std::string body = std::string{kBody} + std::string(26, 'x') +
+                           "\r\n0\r\n\r\n";
+  ChunkedScanner scanner;
+  EXPECT_EQ(scanner.Feed(body + "GET / HTTP/1.1\r\n"), body.size());
+  EXPECT_TRUE(scanner.Done());
+}
+
+// Every split of the body across reads ends it at the same byte.
+TEST(ChunkedScannerTest, ResumesAcrossReads) {
+  const std::string body =
+      "4;ext=1\r\nwiki\r\n10\r\n0123456789abcdef\r\n0\r\nX-T: 1\r\n\r\n";
+  for (size_t step = 1; step <= body.size(); ++step) {
+    ChunkedScanner scanner;
+    EXPECT_EQ(ScanChunked(scanner, body + "next", step), body.size()) << step;
+    EXPECT_TRUE(scanner.Done()) << step;
+  }
+}
+
+TEST(ChunkedScannerTest, SkipsExtensions) {
+  const std::string body =
+      "3;name=value;quoted=\"a;b\"\r\nabc\r\n0 ; last\r\n\r\n";
+  ChunkedScanner scanner;
+  EXPECT_EQ(scanner.Feed(body), body.size());
+  EXPECT_TRUE(scanner.Done());
+}
+
+TEST(ChunkedScannerTest, SkipsTrailers) {
+  const std::string body =
+      "1\r\na\r\n0\r\nExpires: never\r\nX-Checksum: 1\r\n\r\n";
+  ChunkedScanner scanner;
+  EXPECT_EQ(scanner.Feed(body), body.size());
+  EXPECT_TRUE(scanner.Done());
+}
+
+// A size of more than 16 hex digits would overflow, one of 16 fits.
+TEST(ChunkedScannerTest, RejectsSizeOverflow) {
+  ChunkedScanner scanner;
+  EXPECT_EQ(scanner.Feed("ffffffffffffffff\r\nab"), 20);
+  EXPECT_FALSE(scanner.Invalid());
+
+  ChunkedScanner overflow;
+  overflow.Feed("1ffffffffffffffff\r\n");
+  EXPECT_TRUE(overflow.Invalid());
+
+  // leading zeros count as digits too
+  ChunkedScanner zeros;
+  zeros.Feed("00000000000000001\r\n");
+  EXPECT_TRUE(zeros.Invalid());
+}
+
+TEST(ChunkedScannerTest, RejectsMalformedChunks) {
+  for (const std::string_view body : {
+           "\r\n",
+           "x\r\n",
+           "5\r\nhelloX\r\n",
+           "5\r\nhello\rX",
+           "5\nhello\r\n",
+           "0\r\nX-T: 1\rX",
+       }) {
+    ChunkedScanner scanner;
+    scanner.Feed(body);
+    EXPECT_TRUE(scanner.Invalid()) << body;
+  }
+}
+
+}  // namespace socks::tunnel
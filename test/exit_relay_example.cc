@@ -0,0 +1,31 @@
+#include <asio/io_context.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+#include "tunnel/quic_exit.h"
+#include "utility/log.h"
+
+int main() {
+  socks::InitAsyncLogger();
+
+  asio::io_context ctx;
+  // the channel is not encrypted, the relay serves 127.0.0.1 only. The key,
+  // if any, comes from the environment, not the command line other users
+  // can list.
+  socks::tunnel::ExitRelayConfig config;
+  config.endpoint.address(asio::ip::make_address_v4("127.0.0.1"));
+  if (const char *psk = std::getenv("QUIC_SOCKS_PSK"); psk != nullptr) {
+    config.quic.psk = psk;
+  }
+  socks::tunnel::ExitRelay relay{ctx, config};
+  std::thread thread{[&ctx] {
+    const auto guard = asio::make_work_guard(ctx);
+    ctx.run();
+  }};
+
+  std::cin.get();
+  ctx.stop();
+  thread.join();
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include "tunnel/handoff.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+namespace socks::tunnel {
+
+namespace {
+
+std::string UpgradePath() {
+  auto path = (std::filesystem::temp_directory_path() / "quic_socks_upgrade_test")
+                  .string();
+  std::filesystem::remove(path);
+  return path;
+}
+
+}  // namespace
+
+TEST(UpgradeTest, HandsListenersOver) {
+  const auto path = UpgradePath();
+  asio::io_context ctx;
+  asio::ip::tcp::acceptor acceptor{
+      ctx, asio::ip::tcp::endpoint{asio::ip::address_v4::loopback(), 0}};
+  const auto port = acceptor.local_endpoint().port();
+
+  Upgrade old{UpgradeConfig{.path = path}};
+  EXPECT_TRUE(old.Inherited().empty());
+  std::atomic_bool stopped{false};
+  std::atomic_size_t sessions{1};
+  old.Start([&] { return std::vector<int>{acceptor.native_handle()}; },
+            [&] { stopped = true; }, [&] { return sessions.load(); });
+
+  Upgrade next{UpgradeConfig{.path = path}};
+  ASSERT_EQ(next.Inherited().size(), 1);
+  asio::ip::tcp::acceptor inherited{ctx, asio::ip::tcp::v4(),
+                                    next.Inherited()[0]};
+  EXPECT_NE(inherited.native_handle(), acceptor.native_handle());
+  EXPECT_EQ(inherited.local_endpoint().port(), port);
+  EXPECT_FALSE(stopped);
+
+  // the old instance stops accepting on commit and retires once drained
+  next.Start([&] { return std::vector<int>{inherited.native_handle()}; },
+             [] {}, [] { return size_t{0}; });
+  sessions = 0;
+  old.Wait();
+  EXPECT_TRUE(stopped);
+
+  // connections queued on the socket are accepted by the new instance
+  acceptor.close();
+  asio::ip::tcp::socket client{ctx};
+  client.connect({asio::ip::address_v4::loopback(), port});
+  auto accepted = inherited.accept();
+  EXPECT_EQ(accepted.remote_endpoint(), client.local_endpoint());
+}
+
+TEST(UpgradeTest, RetiresOnAnyCommit) {
+  const auto path = UpgradePath();
+  asio::io_context ctx;
+  asio::ip::tcp::acceptor acceptor{
+      ctx, asio::ip::tcp::endpoint{asio::ip::address_v4::loopback(), 0}};
+  std::atomic_bool stopped{false};
+  Upgrade old{UpgradeConfig{.path = path}};
+  old.Start([&] { return std::vector<int>{acceptor.native_handle()}; },
+            [&] { stopped = true; }, [] { return size_t{0}; });
+
+  // one instance holds on to its handoff without committing, another
+  // receives the sockets meanwhile and commits in its own time
+  Upgrade waiting{UpgradeConfig{.path = path}};
+  ASSERT_EQ(waiting.Inherited().size(), 1);
+  asio::ip::tcp::acceptor held{ctx, asio::ip::tcp::v4(),
+                               waiting.Inherited()[0]};
+  Upgrade slow{UpgradeConfig{.path = path}};
+  ASSERT_EQ(slow.Inherited().size(), 1);
+  asio::ip::tcp::acceptor adopted{ctx, asio::ip::tcp::v4(),
+                                  slow.Inherited()[0]};
+  std::this_thread::sleep_for(std::chrono::milliseconds{200});
+  EXPECT_FALSE(stopped);
+
+  slow.Start([&] { return std::vector<int>{adopted.native_handle()}; },
+             [] {}, [] { return size_t{0}; });
+  old.Wait();
+  EXPECT_TRUE(stopped);
+}
+
+TEST(UpgradeTest, RefusesSocketsNotListening) {
+  const auto path = UpgradePath();
+  asio::io_context ctx;
+  asio::ip::udp::socket udp{
+      ctx, asio::ip::udp::endpoint{asio::ip::address_v4::loopback(), 0}};
+  Upgrade old{UpgradeConfig{.path = path}};
+  old.Start([&] { return std::vector<int>{udp.native_handle()}; }, [] {},
+            [] { return size_t{0}; });
+
+  Upgrade next{UpgradeConfig{.path = path}};
+  EXPECT_TRUE(next.Inherited().empty());
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,148 @@
+#include "tunnel/happy_eyeballs.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <thread>
+
+namespace socks::tunnel {
+
+namespace {
+
+template <typename F>
+void RunTest(F &&f) {
+  asio::io_context ctx;
+  asio::co_spawn(ctx, f(ctx), asio::detached);
+  ctx.run();
+}
+
+asio::ip::tcp::endpoint Endpoint(std::string_view address, uint16_t port) {
+  return {asio::ip::make_address(address), port};
+}
+
+// A port of the loopback nothing listens on, connects are refused.
+asio::ip::tcp::endpoint ClosedPort(asio::io_context &ctx) {
+  asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::address_v4::loopback(), 0}};
+  return acceptor.local_endpoint();
+}
+
+// Listens with a backlog that one connection left unaccepted fills, the
+// syns of connects after it are dropped and they hang.
+class StalledListener {
+ public:
+  explicit StalledListener(asio::io_context &ctx)
+      : acceptor_{ctx}, filler_{ctx} {
+    acceptor_.open(asio::ip::tcp::v4());
+    acceptor_.bind({asio::ip::address_v4::loopback(), 0});
+    acceptor_.listen(0);
+    filler_.connect(acceptor_.local_endpoint());
+  }
+
+  [[nodiscard]] asio::ip::tcp::endpoint Endpoint() const {
+    return acceptor_.local_endpoint();
+  }
+  // Accepts what is on the backlog, the filler first, and returns how many
+  // connections that were.
+  size_t Drain() {
+    acceptor_.non_blocking(true);
+    size_t accepted{0};
+    asio::error_code err;
+    while (!err) {
+      acceptor_.accept(err);
+      if (!err) ++accepted;
+    }
+    return accepted;
+  }
+
+ private:
+  asio::ip::tcp::acceptor acceptor_;
+  asio::ip::tcp::socket filler_;
+};
+
+}  // namespace
+
+TEST(HappyEyeballsTest, InterleavesFamilies) {
+  const std::vector<asio::ip::tcp::endpoint> endpoints{
+      Endpoint("10.0.0.1", 1), Endpoint("10.0.0.2", 1), Endpoint("::1", 1),
+      Endpoint("10.0.0.3", 1), Endpoint("::2", 1)};
+  EXPECT_EQ(InterleaveFamilies(endpoints, true),
+            (std::vector{Endpoint("::1", 1), Endpoint("10.0.0.1", 1),
+                         Endpoint("::2", 1), Endpoint("10.0.0.2", 1),
+                         Endpoint("10.0.0.3", 1)}));
+  EXPECT_EQ(InterleaveFamilies(endpoints, false),
+            (std::vector{Endpoint("10.0.0.1", 1), Endpoint("::1", 1),
+                         Endpoint("10.0.0.2", 1), Endpoint("::2", 1),
+                         Endpoint("10.0.0.3", 1)}));
+
+  // a single family keeps its order, whichever is preferred
+  const std::vector<asio::ip::tcp::endpoint> v4{Endpoint("10.0.0.2", 1),
+                                                Endpoint("10.0.0.1", 1)};
+  EXPECT_EQ(InterleaveFamilies(v4, true), v4);
+  EXPECT_EQ(InterleaveFamilies(v4, false), v4);
+  EXPECT_TRUE(InterleaveFamilies({}, true).empty());
+}
+
+// The first address hangs, the next one started after the attempt delay
+// wins and the hanging attempt is cancelled rather than left to complete.
+TEST(HappyEyeballsTest, FirstToAnswerWins) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    StalledListener stalled{ctx};
+    asio::ip::tcp::acceptor alive{ctx, {asio::ip::address_v4::loopback(), 0}};
+    const std::vector endpoints{stalled.Endpoint(), alive.local_endpoint()};
+    const ConnectConfig config{.attempt_delay = std::chrono::milliseconds{50}};
+
+    const auto start = std::chrono::steady_clock::now();
+    auto socket = co_await AsyncConnect(endpoints, config);
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::milliseconds{900});
+    EXPECT_EQ(socket.remote_endpoint(), alive.local_endpoint());
+
+    // a syn still pending would be retransmitted after a second and get
+    // in once the backlog has room
+    EXPECT_EQ(stalled.Drain(), 1);
+    asio::steady_timer timer{ctx, std::chrono::milliseconds{1500}};
+    co_await timer.async_wait(asio::use_awaitable);
+    EXPECT_EQ(stalled.Drain(), 0);
+  });
+}
+
+// A refused attempt doesn't wait out the attempt delay, the next address
+// is tried right away.
+TEST(HappyEyeballsTest, MovesOnFromRefusedAttempt) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    asio::ip::tcp::acceptor alive{ctx, {asio::ip::address_v4::loopback(), 0}};
+    const std::vector endpoints{ClosedPort(ctx), alive.local_endpoint()};
+    const ConnectConfig config{.attempt_delay = std::chrono::seconds{5}};
+
+    const auto start = std::chrono::steady_clock::now();
+    auto socket = co_await AsyncConnect(endpoints, config);
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::seconds{1});
+    EXPECT_EQ(socket.remote_endpoint(), alive.local_endpoint());
+  });
+}
+
+// Every attempt failed, the error of the one failing last is reported.
+TEST(HappyEyeballsTest, ReportsLastError) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    // a link-local address without a scope can't be connected to at all
+    const auto unscoped = Endpoint("fe80::1", 80);
+    const auto closed = ClosedPort(ctx);
+    const std::vector<std::pair<std::vector<asio::ip::tcp::endpoint>,
+                                asio::error_code>>
+        cases{{{unscoped, closed}, asio::error::connection_refused},
+              {{closed, unscoped}, asio::error::invalid_argument}};
+    const ConnectConfig config;
+    for (const auto &[endpoints, expected] : cases) {
+      asio::error_code err;
+      try {
+        co_await AsyncConnect(endpoints, config);
+      } catch (const asio::system_error &e) {
+        err = e.code();
+      }
+      EXPECT_EQ(err, expected);
+    }
+  });
+}
+
+}  // namespace socks::tunnel
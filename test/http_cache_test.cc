@@ -0,0 +1,190 @@
+#include "tunnel/http_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <string>
+#include <vector>
+
+namespace socks::tunnel {
+
+namespace {
+
+using Verdict = HttpCache::Verdict;
+
+constexpr std::string_view kRequest =
+    "GET http://Example.com/a?b HTTP/1.1\r\nHost: example.com\r\n\r\n";
+
+RequestEntity Request(std::string_view raw) {
+  RequestParser parser;
+  EXPECT_EQ(parser.Feed(raw), RequestParser::Status::kDone);
+  return parser.Entity();
+}
+
+// The parser keeps views into `raw`, which has to outlive the entity.
+ResponseEntity Response(const std::string &raw) {
+  ResponseParser parser;
+  EXPECT_EQ(parser.Feed(raw), ResponseParser::Status::kDone);
+  return parser.Entity();
+}
+
+HttpCache::Lookup Lookup(HttpCache &cache, std::string_view raw = kRequest) {
+  asio::io_context ctx;
+  const auto req = Request(raw);
+  const auto key = HttpCache::Key(Uri::Parse(req.uri));
+  std::optional<HttpCache::Lookup> lookup;
+  co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        lookup = co_await cache.AsyncLookup(key, req);
+      },
+      asio::detached);
+  ctx.run();
+  return std::move(*lookup);
+}
+
+}  // namespace
+
+TEST(HttpCacheTest, ParsesDirectivesAndDates) {
+  const std::string raw =
+      "HTTP/1.1 200 OK\r\nCache-Control: no-cache=\"a, b\", max-age=60\r\n"
+      "cache-control: S-MAXAGE=x, private\r\n\r\n";
+  const auto cc = CacheControl::Of(Response(raw).headers);
+  EXPECT_TRUE(cc.no_cache);
+  EXPECT_TRUE(cc.is_private);
+  EXPECT_FALSE(cc.no_store);
+  EXPECT_EQ(cc.max_age, std::chrono::seconds{60});
+  // unparsable counts as stale
+  EXPECT_EQ(cc.s_maxage, std::chrono::seconds{0});
+
+  const auto date = ParseHttpDate("Sun, 06 Nov 1994 08:49:37 GMT");
+  ASSERT_TRUE(date);
+  EXPECT_EQ(std::chrono::system_clock::to_time_t(*date), 784111777);
+  EXPECT_FALSE(ParseHttpDate("Sunday, 06-Nov-94 08:49:37 GMT"));
+  EXPECT_FALSE(ParseHttpDate("Sun, 31 Feb 1994 08:49:37 GMT"));
+}
+
+TEST(HttpCacheTest, ServesStoredResponses) {
+  HttpCache cache{{.capacity = 1 << 20}};
+  auto miss = Lookup(cache);
+  ASSERT_EQ(miss.verdict, Verdict::kMiss);
+  const std::string raw =
+      "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nConnection: "
+      "keep-alive\r\nContent-Length: 5\r\nAge: 10\r\n\r\n";
+  ASSERT_TRUE(miss.fill->Begin(Response(raw)));
+  miss.fill->Append("hel");
+  miss.fill->Append("lo");
+  miss.fill->Commit();
+  EXPECT_EQ(cache.Size(), 1);
+
+  // hosts are matched regardless of case
+  const auto hit = Lookup(
+      cache, "GET http://example.com:80/a?b HTTP/1.1\r\nHost: x\r\n\r\n");
+  ASSERT_EQ(hit.verdict, Verdict::kHit);
+  EXPECT_EQ(*hit.response->body, "hello");
+  EXPECT_EQ(hit.response->head,
+            "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+            "Content-Length: 5\r\n\r\n");
+  EXPECT_EQ(hit.response->Age(CachedResponse::Clock::now()).count(), 10);
+
+  // the client insists on the origin
+  EXPECT_EQ(Lookup(cache, "GET http://example.com/a?b HTTP/1.1\r\n"
+                          "Cache-Control: no-cache\r\n\r\n")
+                .verdict,
+            Verdict::kMiss);
+  EXPECT_FALSE(HttpCache::Admits(
+      Request("GET http://example.com/a?b HTTP/1.1\r\nRange: bytes=0-1\r\n\r\n"),
+      {}));
+
+  cache.Invalidate(HttpCache::Key(Uri::Parse("http://example.com/a?b")));
+  EXPECT_EQ(cache.Size(), 0);
+}
+
+TEST(HttpCacheTest, DropsHeadersNamedInConnection) {
+  HttpCache cache{{.capacity = 1 << 20}};
+  auto miss = Lookup(cache);
+  ASSERT_EQ(miss.verdict, Verdict::kMiss);
+  const std::string raw =
+      "HTTP/1.1 200 OK\r\nConnection: x-trace, X-Hop\r\n"
+      "Cache-Control: max-age=60\r\nX-Trace: 1\r\nx-hop: 2\r\n"
+      "X-Kept: 3\r\nContent-Length: 0\r\n\r\n";
+  ASSERT_TRUE(miss.fill->Begin(Response(raw)));
+  miss.fill->Commit();
+
+  const auto hit = Lookup(cache);
+  ASSERT_EQ(hit.verdict, Verdict::kHit);
+  EXPECT_EQ(hit.response->head,
+            "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+            "X-Kept: 3\r\nContent-Length: 0\r\n\r\n");
+}
+
+TEST(HttpCacheTest, CollapsesConcurrentMisses) {
+  asio::io_context ctx;
+  HttpCache cache{{.capacity = 1 << 20}};
+  const auto req = Request(kRequest);
+  const auto key = HttpCache::Key(Uri::Parse(req.uri));
+  std::vector<Verdict> verdicts;
+  std::unique_ptr<HttpCache::Fill> fill;
+  for (int i = 0; i < 4; ++i) {
+    co_spawn(
+        ctx,
+        [&]() -> asio::awaitable<void> {
+          auto lookup = co_await cache.AsyncLookup(key, req);
+          verdicts.push_back(lookup.verdict);
+          if (lookup.fill) fill = std::move(lookup.fill);
+        },
+        asio::detached);
+  }
+  // the others wait for the one that went to the origin
+  ctx.run_for(std::chrono::milliseconds{50});
+  ctx.restart();
+  ASSERT_EQ(verdicts, std::vector<Verdict>{Verdict::kMiss});
+
+  const std::string raw =
+      "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\nContent-Length: 0\r\n\r\n";
+  ASSERT_TRUE(fill->Begin(Response(raw)));
+  fill->Commit();
+  ctx.run();
+  // stored but stale right away, it's only good for revalidation
+  EXPECT_EQ(verdicts, (std::vector<Verdict>{Verdict::kMiss, Verdict::kPass,
+                                            Verdict::kPass, Verdict::kPass}));
+
+  auto revalidate = Lookup(cache);
+  ASSERT_EQ(revalidate.verdict, Verdict::kRevalidate);
+  EXPECT_EQ(revalidate.response->etag, "\"v1\"");
+  const std::string not_modified =
+      "HTTP/1.1 304 Not Modified\r\nCache-Control: max-age=60\r\n"
+      "Content-Length: 100\r\n\r\n";
+  const auto refreshed = revalidate.fill->Refresh(Response(not_modified));
+  EXPECT_EQ(refreshed->head,
+            "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\nContent-Length: 0\r\n"
+            "Cache-Control: max-age=60\r\n\r\n");
+  EXPECT_EQ(Lookup(cache).verdict, Verdict::kHit);
+}
+
+TEST(HttpCacheTest, PassesWhatItMayNotStore) {
+  HttpCache cache{{.capacity = 1 << 20, .max_object = 4}};
+  auto miss = Lookup(cache);
+  ASSERT_EQ(miss.verdict, Verdict::kMiss);
+  const std::string raw =
+      "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+      "Transfer-Encoding: chunked\r\n\r\n";
+  ASSERT_TRUE(miss.fill->Begin(Response(raw)));
+  // beyond max_object
+  miss.fill->Append("5\r\nhello\r\n0\r\n\r\n");
+  miss.fill->Commit();
+  EXPECT_EQ(cache.Size(), 0);
+  // lookups of it go straight to the origin for a while
+  EXPECT_EQ(Lookup(cache).verdict, Verdict::kPass);
+
+  const auto other = "GET http://example.com/private HTTP/1.1\r\n\r\n";
+  auto fill = std::move(Lookup(cache, other).fill);
+  ASSERT_TRUE(fill);
+  const std::string personal =
+      "HTTP/1.1 200 OK\r\nCache-Control: private, max-age=60\r\n"
+      "Content-Length: 0\r\n\r\n";
+  EXPECT_FALSE(fill->Begin(Response(personal)));
+  EXPECT_EQ(Lookup(cache, other).verdict, Verdict::kPass);
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,418 @@
+#include "tunnel/http_proxy.h"
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <string>
+#include <thread>
+
+namespace socks::tunnel {
+
+namespace {
+
+// Answers each request by its path, `/close` with a body that ends where
+// the connection does, `/reject` with a 417 before the body, `/continue`
+// with a 100 Continue of its own and then an echo of the 5 byte body, and
+// `/quiet` with the echo only. `/stall` is never answered, anything else
+// gets a body of known length.
+class StandInOrigin {
+ public:
+  StandInOrigin() : acceptor_{ctx_, {asio::ip::address_v4::loopback(), 0}} {
+    asio::co_spawn(ctx_, Accept(), asio::detached);
+    thread_ = std::thread{[this] { ctx_.run(); }};
+  }
+  ~StandInOrigin() {
+    asio::post(ctx_, [this] { acceptor_.close(); });
+    ctx_.stop();
+    thread_.join();
+  }
+
+  [[nodiscard]] uint16_t Port() const {
+    return acceptor_.local_endpoint().port();
+  }
+
+ private:
+  asio::awaitable<void> Accept() {
+    while (true) {
+      asio::error_code err;
+      auto socket = co_await acceptor_.async_accept(
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      asio::co_spawn(ctx_, Serve(std::move(socket)), asio::detached);
+    }
+  }
+
+  static asio::awaitable<void> Serve(asio::ip::tcp::socket socket) {
+    asio::error_code err;
+    std::string in;
+    co_await asio::async_read_until(
+        socket, asio::dynamic_buffer(in), "\r\n\r\n",
+        asio::redirect_error(asio::use_awaitable, err));
+    if (err) co_return;
+    const bool stall = in.starts_with("GET /stall ");
+    const bool close = in.starts_with("GET /close ");
+    std::string out;
+    if (close) {
+      out = "HTTP/1.1 200 OK\r\n\r\nfirst";
+    } else if (in.starts_with("POST /reject ")) {
+      out = "HTTP/1.1 417 Expectation Failed\r\nContent-Length: 0\r\n\r\n";
+    } else if (in.starts_with("POST /continue ") ||
+               in.starts_with("POST /quiet ")) {
+      if (in.starts_with("POST /continue ")) {
+        co_await asio::async_write(
+            socket, asio::buffer(kOriginContinue),
+            asio::redirect_error(asio::use_awaitable, err));
+      }
+      auto body = in.substr(in.find("\r\n\r\n") + 4);
+      const auto have = body.size();
+      body.resize(5);
+      co_await asio::async_read(
+          socket, asio::buffer(body.data() + have, body.size() - have),
+          asio::redirect_error(asio::use_awaitable, err));
+      out = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n" + body;
+    } else if (!stall) {
+      out = "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\nsecond";
+    }
+    co_await asio::async_write(socket, asio::buffer(out),
+                               asio::redirect_error(asio::use_awaitable, err));
+    if (close) socket.shutdown(asio::socket_base::shutdown_send, err);
+    std::array<char, 1> eof{};
+    co_await socket.async_read_some(
+        asio::buffer(eof), asio::redirect_error(asio::use_awaitable, err));
+  }
+
+  static constexpr std::string_view kOriginContinue =
+      "HTTP/1.1 100 Continue\r\nServer: origin\r\n\r\n";
+
+  asio::io_context ctx_;
+  asio::ip::tcp::acceptor acceptor_;
+  std::thread thread_;
+};
+
+// A message of either direction, the body decoded from its framing.
+struct Message {
+  std::string head;
+  std::string body;
+};
+
+// Parses a message at the front of `in` framed by Content-Length, chunked
+// without trailers, or neither for no body. Returns its length, 0 while
+// incomplete.
+size_t ParseMessage(std::string_view in, Message &message) {
+  const auto head_end = in.find("\r\n\r\n");
+  if (head_end == std::string_view::npos) return 0;
+  message.head = in.substr(0, head_end + 4);
+  message.body.clear();
+  size_t at = head_end + 4;
+  if (message.head.find("Transfer-Encoding: chunked") != std::string::npos) {
+    while (true) {
+      const auto line_end = in.find("\r\n", at);
+      if (line_end == std::string_view::npos) return 0;
+      const auto size = std::stoul(std::string{in.substr(at)}, nullptr, 16);
+      at = line_end + 2;
+      if (in.size() < at + size + 2) return 0;
+      message.body += in.substr(at, size);
+      at += size + 2;
+      if (size == 0) return at;
+    }
+  }
+  constexpr std::string_view kLength = "Content-Length: ";
+  if (const auto pos = message.head.find(kLength); pos != std::string::npos) {
+    const auto size = std::stoul(message.head.substr(pos + kLength.size()));
+    if (in.size() < at + size) return 0;
+    message.body = in.substr(at, size);
+    at += size;
+  }
+  return at;
+}
+
+// Reads the next message off `socket`, `in` keeps what followed it.
+Message ReadMessage(asio::ip::tcp::socket &socket, std::string &in) {
+  Message message;
+  while (true) {
+    if (const auto len = ParseMessage(in, message)) {
+      in.erase(0, len);
+      return message;
+    }
+    std::array<char, 1024> buf{};
+    const auto len = socket.read_some(asio::buffer(buf));
+    in.append(buf.data(), len);
+  }
+}
+
+// Answers every request of a connection in turn with its name, the path
+// and the request body, chunked for paths under `/chunked` and with a
+// Content-Length otherwise. A request with Connection: close is the last.
+class EchoOrigin {
+ public:
+  explicit EchoOrigin(std::string name)
+      : name_{std::move(name)},
+        acceptor_{ctx_, {asio::ip::address_v4::loopback(), 0}} {
+    asio::co_spawn(ctx_, Accept(), asio::detached);
+    thread_ = std::thread{[this] { ctx_.run(); }};
+  }
+  ~EchoOrigin() {
+    asio::post(ctx_, [this] { acceptor_.close(); });
+    ctx_.stop();
+    thread_.join();
+  }
+
+  [[nodiscard]] uint16_t Port() const {
+    return acceptor_.local_endpoint().port();
+  }
+
+ private:
+  asio::awaitable<void> Accept() {
+    while (true) {
+      asio::error_code err;
+      auto socket = co_await acceptor_.async_accept(
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      asio::co_spawn(ctx_, Serve(std::move(socket)), asio::detached);
+    }
+  }
+
+  asio::awaitable<void> Serve(asio::ip::tcp::socket socket) {
+    std::string in;
+    std::array<char, 1024> buf{};
+    asio::error_code err;
+    while (true) {
+      Message request;
+      size_t len{0};
+      while ((len = ParseMessage(in, request)) == 0) {
+        const auto n = co_await socket.async_read_some(
+            asio::buffer(buf), asio::redirect_error(asio::use_awaitable, err));
+        if (err) co_return;
+        in.append(buf.data(), n);
+      }
+      in.erase(0, len);
+
+      const auto path_start = request.head.find(' ') + 1;
+      const auto path = request.head.substr(
+          path_start, request.head.find(' ', path_start) - path_start);
+      const bool close =
+          request.head.find("Connection: close") != std::string::npos;
+      const auto body = fmt::format("{} {} {}", name_, path, request.body);
+      std::string out = "HTTP/1.1 200 OK\r\n";
+      if (close) out += "Connection: close\r\n";
+      if (path.starts_with("/chunked")) {
+        const auto half = body.size() / 2;
+        out += fmt::format(
+            "Transfer-Encoding: chunked\r\n\r\n{:x}\r\n{}\r\n{:x}\r\n{}\r\n"
+            "0\r\n\r\n",
+            half, body.substr(0, half), body.size() - half, body.substr(half));
+      } else {
+        out += fmt::format("Content-Length: {}\r\n\r\n{}", body.size(), body);
+      }
+      co_await asio::async_write(
+          socket, asio::buffer(out),
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err || close) co_return;
+    }
+  }
+
+  const std::string name_;
+  asio::io_context ctx_;
+  asio::ip::tcp::acceptor acceptor_;
+  std::thread thread_;
+};
+
+uint16_t FreePort() {
+  asio::io_context ctx;
+  asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::tcp::v4(), 0}};
+  return acceptor.local_endpoint().port();
+}
+
+// Everything the proxy sends until it closes the connection.
+std::string ReadAll(asio::ip::tcp::socket &socket) {
+  std::string out;
+  asio::error_code err;
+  asio::read(socket, asio::dynamic_buffer(out), err);
+  EXPECT_EQ(err, asio::error::eof);
+  return out;
+}
+
+// Starts a proxy of one io thread on a free port. A client left waiting
+// would only be let go by the header timeout, it's kept short.
+std::pair<std::shared_ptr<HttpProxy>, uint16_t> StartProxy(
+    const TimeoutConfig &timeouts = {.header = std::chrono::seconds{5}}) {
+  const auto port = FreePort();
+  auto proxy = HttpProxy::Create(HttpProxyConfig{
+      .port = port, .frontend = {.threads = 1, .timeouts = timeouts}});
+  proxy->Start();
+  return {std::move(proxy), port};
+}
+
+// Posts 5 bytes to `path` once told to go on by the 100 Continue expected.
+void PostExpectingContinue(uint16_t port, uint16_t origin,
+                           std::string_view path,
+                           std::string_view expected) {
+  asio::io_context ctx;
+  asio::ip::tcp::socket client{ctx};
+  client.connect({asio::ip::address_v4::loopback(), port});
+  const auto authority = fmt::format("127.0.0.1:{}", origin);
+  asio::write(client, asio::buffer(fmt::format(
+                          "POST http://{0}{1} HTTP/1.1\r\nHost: {0}\r\n"
+                          "Content-Length: 5\r\nExpect: 100-continue\r\n\r\n",
+                          authority, path)));
+  std::string in;
+  const auto len =
+      asio::read_until(client, asio::dynamic_buffer(in), "\r\n\r\n");
+  EXPECT_EQ(in.substr(0, len), expected);
+  in.erase(0, len);
+
+  asio::write(client, asio::buffer(std::string_view{"hello"}));
+  asio::read_until(client, asio::dynamic_buffer(in), "hello");
+  EXPECT_EQ(in, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello");
+}
+
+}  // namespace
+
+TEST(HttpProxyTest, ClosesAfterCloseDelimitedResponse) {
+  StandInOrigin origin;
+  const auto [proxy, port] = StartProxy();
+
+  asio::io_context ctx;
+  asio::ip::tcp::socket client{ctx};
+  client.connect({asio::ip::address_v4::loopback(), port});
+  const auto authority = fmt::format("127.0.0.1:{}", origin.Port());
+  // the second request is forwarded before the first response is relayed
+  const auto requests = fmt::format(
+      "GET http://{0}/close HTTP/1.1\r\nHost: {0}\r\n\r\n"
+      "GET http://{0}/length HTTP/1.1\r\nHost: {0}\r\n\r\n",
+      authority);
+  asio::write(client, asio::buffer(requests));
+  // the body ends where the connection does, nothing may follow it
+  EXPECT_EQ(ReadAll(client), "HTTP/1.1 200 OK\r\n\r\nfirst");
+}
+
+TEST(HttpProxyTest, LetsOriginTurnDownExpectedBody) {
+  StandInOrigin origin;
+  const auto [proxy, port] = StartProxy();
+
+  asio::io_context ctx;
+  asio::ip::tcp::socket client{ctx};
+  client.connect({asio::ip::address_v4::loopback(), port});
+  const auto authority = fmt::format("127.0.0.1:{}", origin.Port());
+  asio::write(client, asio::buffer(fmt::format(
+                          "POST http://{0}/reject HTTP/1.1\r\nHost: {0}\r\n"
+                          "Content-Length: 5\r\nExpect: 100-continue\r\n\r\n",
+                          authority)));
+  // no 100 Continue of the proxy's, and the body that may still come
+  // isn't taken for a request
+  EXPECT_EQ(ReadAll(client),
+            "HTTP/1.1 417 Expectation Failed\r\nContent-Length: 0\r\n\r\n");
+}
+
+TEST(HttpProxyTest, RelaysOriginContinue) {
+  const auto [proxy, port] = StartProxy();
+  // the origin's own, rather than one of the proxy's
+  StandInOrigin eager;
+  PostExpectingContinue(port, eager.Port(), "/continue",
+                        "HTTP/1.1 100 Continue\r\nServer: origin\r\n\r\n");
+  // the proxy's, once the origin kept quiet for a while
+  StandInOrigin quiet;
+  PostExpectingContinue(port, quiet.Port(), "/quiet",
+                        "HTTP/1.1 100 Continue\r\n\r\n");
+}
+
+TEST(HttpProxyTest, ClosesOnStalledOrigin) {
+  StandInOrigin origin;
+  const auto [proxy, port] = StartProxy({.header = std::chrono::seconds{1},
+                                         .idle = std::chrono::seconds{1}});
+
+  asio::io_context ctx;
+  asio::ip::tcp::socket client{ctx};
+  client.connect({asio::ip::address_v4::loopback(), port});
+  const auto authority = fmt::format("127.0.0.1:{}", origin.Port());
+  asio::write(client, asio::buffer(fmt::format(
+                          "GET http://{0}/stall HTTP/1.1\r\nHost: {0}\r\n\r\n",
+                          authority)));
+  // the origin accepted the request and went quiet, the exchange it holds
+  // up doesn't keep the connection forever
+  const auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(ReadAll(client), "");
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds{5});
+}
+
+// Requests to two origins are pipelined with bodies of either framing, the
+// responses of either framing come back in request order.
+TEST(HttpProxyTest, RelaysPipelinedRequests) {
+  EchoOrigin a{"a"};
+  EchoOrigin b{"b"};
+  const auto [proxy, port] = StartProxy();
+
+  asio::io_context ctx;
+  asio::ip::tcp::socket client{ctx};
+  client.connect({asio::ip::address_v4::loopback(), port});
+  const auto to_a = fmt::format("127.0.0.1:{}", a.Port());
+  const auto to_b = fmt::format("127.0.0.1:{}", b.Port());
+  asio::write(
+      client,
+      asio::buffer(fmt::format(
+          "GET http://{0}/one HTTP/1.1\r\nHost: {0}\r\n\r\n"
+          "POST http://{1}/chunked/two HTTP/1.1\r\nHost: {1}\r\n"
+          "Content-Length: 5\r\n\r\nhello"
+          "POST http://{0}/three HTTP/1.1\r\nHost: {0}\r\n"
+          "Transfer-Encoding: chunked\r\n\r\n3\r\nwor\r\n2\r\nld\r\n0\r\n\r\n"
+          "GET http://{1}/chunked/four HTTP/1.1\r\nHost: {1}\r\n\r\n"
+          "POST http://{0}/chunked/five HTTP/1.1\r\nHost: {0}\r\n"
+          "Transfer-Encoding: chunked\r\n\r\n1\r\n!\r\n0\r\n\r\n",
+          to_a, to_b)));
+
+  std::string in;
+  for (const auto &[body, chunked] :
+       std::initializer_list<std::pair<std::string_view, bool>>{
+           {"a /one ", false},
+           {"b /chunked/two hello", true},
+           {"a /three world", false},
+           {"b /chunked/four ", true},
+           {"a /chunked/five !", true}}) {
+    const auto response = ReadMessage(client, in);
+    EXPECT_TRUE(response.head.starts_with("HTTP/1.1 200 OK\r\n"));
+    EXPECT_EQ(response.head.find("chunked") != std::string::npos, chunked)
+        << body;
+    EXPECT_EQ(response.body, body);
+  }
+  EXPECT_TRUE(in.empty());
+
+  // the connection stays open for more
+  asio::write(client, asio::buffer(fmt::format(
+                          "GET http://{0}/six HTTP/1.1\r\nHost: {0}\r\n\r\n",
+                          to_b)));
+  EXPECT_EQ(ReadMessage(client, in).body, "b /six ");
+}
+
+// Connection: close ends the pipeline, the requests behind it are never
+// forwarded.
+TEST(HttpProxyTest, ClosesPipelineOnConnectionClose) {
+  EchoOrigin a{"a"};
+  EchoOrigin b{"b"};
+  const auto [proxy, port] = StartProxy();
+
+  asio::io_context ctx;
+  asio::ip::tcp::socket client{ctx};
+  client.connect({asio::ip::address_v4::loopback(), port});
+  const auto to_a = fmt::format("127.0.0.1:{}", a.Port());
+  const auto to_b = fmt::format("127.0.0.1:{}", b.Port());
+  asio::write(
+      client,
+      asio::buffer(fmt::format(
+          "POST http://{0}/chunked/one HTTP/1.1\r\nHost: {0}\r\n"
+          "Content-Length: 2\r\n\r\nhi"
+          "GET http://{1}/two HTTP/1.1\r\nHost: {1}\r\n"
+          "Connection: close\r\n\r\n"
+          "GET http://{0}/three HTTP/1.1\r\nHost: {0}\r\n\r\n",
+          to_a, to_b)));
+
+  std::string in;
+  EXPECT_EQ(ReadMessage(client, in).body, "a /chunked/one hi");
+  const auto last = ReadMessage(client, in);
+  EXPECT_NE(last.head.find("Connection: close"), std::string::npos);
+  EXPECT_EQ(last.body, "b /two ");
+  in += ReadAll(client);
+  EXPECT_EQ(in, "");
+}
+
+}  // namespace socks::tunnel
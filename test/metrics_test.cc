@@ -0,0 +1,80 @@
+#include "observer/metrics.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+
+namespace socks {
+
+TEST(MetricsTest, BucketsBoundTheirValues) {
+  for (uint64_t value : {0, 1, 7, 8, 9, 15, 16, 17, 1000, 123456789}) {
+    const auto idx = HistogramBuckets::Index(value);
+    EXPECT_LE(HistogramBuckets::Lower(idx), value);
+    EXPECT_GT(HistogramBuckets::Lower(idx + 1), value);
+    // log linear, the bucket is narrow relative to its values
+    EXPECT_LE(HistogramBuckets::Lower(idx + 1) - HistogramBuckets::Lower(idx),
+              std::max<uint64_t>(1, value / 8));
+  }
+  EXPECT_EQ(HistogramBuckets::Index(uint64_t{1} << 62),
+            HistogramBuckets::kSize - 1);
+}
+
+TEST(MetricsTest, MergesThreads) {
+  ThreadMetrics a;
+  ThreadMetrics b;
+  a.opened.Add(3);
+  a.closed.Add();
+  b.opened.Add();
+  a.Forwarded(true, 100);
+  b.Forwarded(false, 50);
+  for (uint64_t us = 1; us <= 100; ++us) {
+    (us % 2 ? a : b).Record(Stage::kConnect, std::chrono::microseconds{us});
+  }
+
+  MetricsSnapshot snapshot;
+  snapshot.Add(a);
+  snapshot.Add(b);
+  EXPECT_EQ(snapshot.opened, 4);
+  EXPECT_EQ(snapshot.closed, 1);
+  EXPECT_EQ(snapshot.outbound_bytes, 100);
+  EXPECT_EQ(snapshot.inbound_bytes, 50);
+  const auto &connect = snapshot.stages[static_cast<size_t>(Stage::kConnect)];
+  EXPECT_EQ(connect.count, 100);
+  EXPECT_EQ(connect.sum, 5050);
+  EXPECT_NEAR(connect.Quantile(0.5), 50, 50 / 8);
+  EXPECT_NEAR(connect.Quantile(0.99), 99, 99 / 8);
+
+  const auto text = snapshot.Render();
+  EXPECT_NE(text.find("quic_socks_sessions_active 3\n"), std::string::npos);
+  EXPECT_NE(text.find("quic_socks_stage_seconds_bucket{stage=\"connect\","
+                      "le=\"0.00025\"} 100\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("quic_socks_stage_seconds_count{stage=\"head\"} 0\n"),
+            std::string::npos);
+}
+
+TEST(MetricsTest, ServesScrapes) {
+  ThreadMetrics metrics;
+  metrics.opened.Add(7);
+  MetricsServer server{0, [&metrics] {
+                         MetricsSnapshot snapshot;
+                         snapshot.Add(metrics);
+                         return snapshot;
+                       }};
+  server.Start();
+
+  asio::io_context ctx;
+  asio::ip::tcp::socket socket{ctx};
+  socket.connect({asio::ip::address_v4::loopback(), server.Port()});
+  asio::write(socket, asio::buffer(std::string_view{
+                          "GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n"}));
+  std::string response;
+  asio::error_code err;
+  asio::read(socket, asio::dynamic_buffer(response), err);
+  EXPECT_EQ(err, asio::error::eof);
+  EXPECT_TRUE(response.starts_with("HTTP/1.1 200 OK\r\n"));
+  EXPECT_NE(response.find("quic_socks_sessions_opened_total 7\n"),
+            std::string::npos);
+}
+
+}  // namespace socks
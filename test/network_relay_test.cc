@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "observer/network_observer.h"
+
+namespace socks {
+
+namespace {
+
+using std::chrono::milliseconds;
+
+// Sums the deltas up the way a viewer does.
+class Summaries : public NetworkObserver {
+ public:
+  void OnRefresh(const ConnDelta &delta) override {
+    std::lock_guard lock{mutex_};
+    for (const auto &summary : delta.updated) rows_[summary.idx] = summary;
+    for (const auto idx : delta.removed) rows_.erase(idx);
+    ++refreshes_;
+  }
+
+  std::unordered_map<size_t, ConnSummary> Rows() {
+    std::lock_guard lock{mutex_};
+    return rows_;
+  }
+  size_t Refreshes() {
+    std::lock_guard lock{mutex_};
+    return refreshes_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<size_t, ConnSummary> rows_;
+  size_t refreshes_{0};
+};
+
+}  // namespace
+
+TEST(NetworkRelayTest, RefreshesSummaries) {
+  Summaries summaries;
+  {
+    NetworkRelay relay{RelayConfig{.refresh = milliseconds{10},
+                                   .linger = std::chrono::seconds{0}}};
+    relay.Register(&summaries);
+    relay.Start();
+
+    const asio::ip::tcp::endpoint client{asio::ip::address_v4::loopback(),
+                                         40000};
+    const asio::ip::tcp::endpoint origin{asio::ip::address_v4::loopback(), 80};
+    relay.Connect(1, client, origin, "example.com");
+    relay.Forward(1, true, std::string_view{"GET / HTTP/1.1\r\n\r\n"});
+    relay.ForwardBytes(1, false, 1000);
+    relay.ForwardBytes(2, true, 10);
+    std::this_thread::sleep_for(milliseconds{50});
+
+    auto rows = summaries.Rows();
+    ASSERT_EQ(rows.size(), 2);
+    EXPECT_EQ(rows[1].host, "example.com");
+    EXPECT_EQ(rows[1].dst, origin);
+    EXPECT_EQ(rows[1].outbound_bytes, 18);
+    EXPECT_EQ(rows[1].inbound_bytes, 1000);
+    EXPECT_TRUE(rows[1].online);
+    // quiet since, the rates came down to 0
+    EXPECT_EQ(rows[1].inbound_rate, 0);
+
+    // nothing changes, nothing is sent
+    const auto refreshes = summaries.Refreshes();
+    std::this_thread::sleep_for(milliseconds{50});
+    EXPECT_EQ(summaries.Refreshes(), refreshes);
+
+    relay.Disconnect(1);
+    std::this_thread::sleep_for(milliseconds{50});
+  }
+  const auto rows = summaries.Rows();
+  EXPECT_EQ(rows.size(), 1);
+  EXPECT_EQ(rows.count(1), 0);
+}
+
+}  // namespace socks
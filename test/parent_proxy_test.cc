@@ -0,0 +1,233 @@
+#include "tunnel/parent_proxy.h"
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <map>
+
+#include "utility/result.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+// Answers each handshake with `status`, then sends the target it was asked
+// for in the same write, the way an origin speaking first would arrive.
+class StandInParent {
+ public:
+  StandInParent(asio::io_context &ctx, ParentProxy::Protocol protocol,
+                std::string status = "200 Connection Established")
+      : acceptor_{ctx, {asio::ip::address_v4::loopback(), 0}},
+        protocol_{protocol},
+        status_{std::move(status)} {
+    asio::co_spawn(ctx, Accept(), asio::detached);
+  }
+
+  void Stop() { acceptor_.close(); }
+
+  [[nodiscard]] ParentProxy Proxy() const {
+    return {.protocol = protocol_,
+            .host = "127.0.0.1",
+            .port = acceptor_.local_endpoint().port()};
+  }
+  size_t handshakes{0};
+
+ private:
+  asio::awaitable<void> Accept() {
+    while (acceptor_.is_open()) {
+      asio::error_code err;
+      auto socket = co_await acceptor_.async_accept(
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      ++handshakes;
+      asio::co_spawn(acceptor_.get_executor(), Serve(std::move(socket)),
+                     asio::detached);
+    }
+  }
+
+  asio::awaitable<void> Serve(asio::ip::tcp::socket socket) {
+    std::string out;
+    if (protocol_ == ParentProxy::Protocol::kHttp) {
+      std::string in;
+      co_await asio::async_read_until(socket, asio::dynamic_buffer(in),
+                                      "\r\n\r\n", asio::use_awaitable);
+      const auto target = in.substr(8, in.find(' ', 8) - 8);
+      out = fmt::format("HTTP/1.1 {}\r\n\r\n{}", status_, target);
+    } else {
+      std::array<uint8_t, 3 + 4 + 256 + 2> in{};
+      co_await asio::async_read(socket, asio::buffer(in.data(), 8),
+                                asio::use_awaitable);
+      EXPECT_EQ(in[6], 0x03);
+      co_await asio::async_read(socket, asio::buffer(in.data() + 8, in[7] + 2),
+                                asio::use_awaitable);
+      const std::string_view host{reinterpret_cast<char *>(in.data() + 8),
+                                  in[7]};
+      const auto port = in[8 + in[7]] << 8 | in[9 + in[7]];
+      const char reply[] = {5, 0, 5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+      out.assign(reply, sizeof(reply));
+      out += fmt::format("{}:{}", host, port);
+    }
+    co_await asio::async_write(socket, asio::buffer(out), asio::use_awaitable);
+    std::array<char, 1> eof{};
+    asio::error_code err;
+    co_await socket.async_read_some(
+        asio::buffer(eof), asio::redirect_error(asio::use_awaitable, err));
+  }
+
+  asio::ip::tcp::acceptor acceptor_;
+  ParentProxy::Protocol protocol_;
+  std::string status_;
+};
+
+template <typename F>
+void RunTest(F &&f) {
+  asio::io_context ctx;
+  asio::co_spawn(ctx, f(ctx), asio::detached);
+  ctx.run();
+}
+
+// What the parent sent past its handshake.
+asio::awaitable<std::string> Greeting(asio::ip::tcp::socket &socket,
+                                      size_t len) {
+  std::string greeting(len, '\0');
+  co_await asio::async_read(socket, asio::buffer(greeting),
+                            asio::use_awaitable);
+  co_return greeting;
+}
+
+}  // namespace
+
+TEST(ParentProxyTest, TunnelsThroughHttpAndSocks5) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    DnsResolver resolver;
+    for (const auto protocol :
+         {ParentProxy::Protocol::kHttp, ParentProxy::Protocol::kSocks5}) {
+      StandInParent parent{ctx, protocol};
+      ParentSelector selector{ParentConfig{.parents = {parent.Proxy()}}};
+      auto socket = co_await AsyncConnectThrough(selector, resolver,
+                                                 "example.com", 443, {});
+      // bytes past the answer stay in the socket
+      EXPECT_EQ(co_await Greeting(socket, 15), "example.com:443");
+      EXPECT_EQ(selector.InFlight(0), 0);
+      EXPECT_GT(selector.Latency(0).count(), 0);
+      parent.Stop();
+    }
+  });
+}
+
+TEST(ParentProxyTest, FailsOverToReachableParent) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    DnsResolver resolver;
+    StandInParent alive{ctx, ParentProxy::Protocol::kHttp};
+    // nothing listens there any more
+    asio::ip::tcp::acceptor closed{ctx, {asio::ip::address_v4::loopback(), 0}};
+    const ParentProxy dead{.host = "127.0.0.1",
+                           .port = closed.local_endpoint().port()};
+    closed.close();
+
+    ParentSelector selector{
+        ParentConfig{.parents = {dead, alive.Proxy()}, .max_attempts = 2}};
+    for (size_t i = 0; i < 4; ++i) {
+      auto socket = co_await AsyncConnectThrough(selector, resolver, "::1",
+                                                 80, {});
+      EXPECT_EQ(co_await Greeting(socket, 8), "[::1]:80");
+    }
+    EXPECT_EQ(alive.handshakes, 4);
+    EXPECT_EQ(selector.InFlight(0), 0);
+    EXPECT_EQ(selector.InFlight(1), 0);
+    // down until the cooldown passed, only the other parent is left
+    EXPECT_EQ(selector.Pick(std::vector<size_t>{1}), 0);
+    EXPECT_EQ(selector.Pick({}), 1);
+    alive.Stop();
+  });
+}
+
+// An answer that isn't http is the parent's fault, not the target's, the
+// next parent takes over and the garbled one sits out the cooldown.
+TEST(ParentProxyTest, FailsOverOnGarbledAnswer) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    DnsResolver resolver;
+    StandInParent garbled{ctx, ParentProxy::Protocol::kHttp, "2OO OK"};
+    StandInParent alive{ctx, ParentProxy::Protocol::kHttp};
+    ParentSelector selector{
+        ParentConfig{.parents = {garbled.Proxy(), alive.Proxy()}}};
+    // the pick is random until the garbled one was tried
+    for (size_t i = 0; i < 20; ++i) {
+      auto socket = co_await AsyncConnectThrough(selector, resolver,
+                                                 "example.com", 443, {});
+      EXPECT_EQ(co_await Greeting(socket, 15), "example.com:443");
+    }
+    EXPECT_EQ(garbled.handshakes, 1);
+    EXPECT_EQ(alive.handshakes, 20);
+    EXPECT_EQ(selector.InFlight(0) + selector.InFlight(1), 0);
+    EXPECT_EQ(selector.Latency(0).count(), 0);
+    garbled.Stop();
+    alive.Stop();
+  });
+}
+
+TEST(ParentProxyTest, RefusalIsNotFailedOver) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    DnsResolver resolver;
+    StandInParent first{ctx, ParentProxy::Protocol::kHttp, "502 Bad Gateway"};
+    StandInParent second{ctx, ParentProxy::Protocol::kHttp,
+                         "502 Bad Gateway"};
+    ParentSelector selector{
+        ParentConfig{.parents = {first.Proxy(), second.Proxy()}}};
+    EXPECT_THROW(co_await AsyncConnectThrough(selector, resolver,
+                                              "example.com", 443, {}),
+                 SocksException);
+    EXPECT_EQ(first.handshakes + second.handshakes, 1);
+    EXPECT_EQ(selector.InFlight(0) + selector.InFlight(1), 0);
+    first.Stop();
+    second.Stop();
+  });
+}
+
+TEST(ParentProxyTest, PrefersFastParents) {
+  ParentSelector selector{ParentConfig{
+      .parents = {{.host = "a", .port = 1}, {.host = "b", .port = 1}}}};
+  const auto latency = [](size_t parent) {
+    return parent == 0 ? std::chrono::milliseconds{1}
+                       : std::chrono::milliseconds{10};
+  };
+  // an unmeasured one counts with the latency of the measured ones
+  while (selector.Latency(0).count() == 0 || selector.Latency(1).count() == 0) {
+    const auto parent = *selector.Pick({});
+    selector.Succeeded(parent, latency(parent));
+  }
+  std::map<size_t, size_t> picks;
+  for (size_t i = 0; i < 100; ++i) {
+    const auto parent = *selector.Pick({});
+    ++picks[parent];
+    selector.Refused(parent);
+  }
+  EXPECT_EQ(picks[0], 100);
+
+  // handshakes in flight weigh against a parent, 100 of them make the fast
+  // one score well past the slow one
+  for (size_t i = 0; i < 100; ++i) ASSERT_TRUE(selector.Pick({}));
+  EXPECT_GT(selector.InFlight(1), 0);
+
+  EXPECT_FALSE(selector.Pick(std::vector<size_t>{0, 1}));
+}
+
+TEST(ParentProxyTest, SpreadsBurstBeforeFirstHandshake) {
+  ParentSelector selector{ParentConfig{
+      .parents = {{.host = "a", .port = 1}, {.host = "b", .port = 1}}}};
+  for (size_t i = 0; i < 20; ++i) ASSERT_TRUE(selector.Pick({}));
+  // no latency is known, handshakes in flight alone weigh
+  EXPECT_EQ(selector.InFlight(0), 10);
+  EXPECT_EQ(selector.InFlight(1), 10);
+
+  // a measured parent doesn't hand the burst to the unmeasured one either
+  for (size_t i = 0; i < 10; ++i) {
+    selector.Succeeded(0, std::chrono::milliseconds{5});
+  }
+  for (size_t i = 0; i < 20; ++i) ASSERT_TRUE(selector.Pick({}));
+  EXPECT_EQ(selector.InFlight(0), 15);
+  EXPECT_EQ(selector.InFlight(1), 15);
+}
+
+}  // namespace socks::tunnel
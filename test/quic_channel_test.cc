@@ -0,0 +1,237 @@
+#include "channel/quic_channel.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <string>
+
+namespace socks {
+
+namespace {
+
+const asio::ip::udp::endpoint kLoopback{asio::ip::address_v4::loopback(), 0};
+
+std::string Pattern(size_t len, size_t seed) {
+  std::string data(len, '\0');
+  for (size_t i = 0; i < len; ++i) {
+    data[i] = static_cast<char>((i * 31 + seed) & 0xff);
+  }
+  return data;
+}
+
+asio::awaitable<std::string> ReadAll(QuicStream &stream) {
+  std::string data;
+  std::array<char, 16384> buf{};
+  while (true) {
+    const auto len = co_await stream.AsyncReadSome(asio::buffer(buf));
+    if (len == 0) co_return data;
+    data.append(buf.data(), len);
+  }
+}
+
+// Echoes every stream of every channel it accepts.
+asio::awaitable<void> Echo(QuicListener &listener) {
+  const auto executor = co_await asio::this_coro::executor;
+  const auto serve = [](std::shared_ptr<QuicStream> stream)
+      -> asio::awaitable<void> {
+    std::array<char, 16384> buf{};
+    while (true) {
+      const auto len = co_await stream->AsyncReadSome(asio::buffer(buf));
+      if (len == 0) break;
+      co_await stream->AsyncWrite(asio::buffer(buf.data(), len));
+    }
+    stream->Shutdown();
+  };
+  try {
+    while (true) {
+      auto channel = co_await listener.AsyncAccept();
+      asio::co_spawn(
+          executor,
+          [channel, executor, serve]() -> asio::awaitable<void> {
+            while (true) {
+              auto stream = co_await channel->AsyncAccept();
+              asio::co_spawn(executor, serve(std::move(stream)),
+                             asio::detached);
+            }
+          },
+          asio::detached);
+    }
+  } catch (const asio::system_error &) {
+  }
+}
+
+asio::awaitable<void> Exchange(QuicChannel &channel, const std::string &data) {
+  auto stream = co_await channel.AsyncOpen();
+  co_await stream->AsyncWrite(asio::buffer(data));
+  stream->Shutdown();
+  EXPECT_EQ(co_await ReadAll(*stream), data);
+}
+
+// Relays datagrams between the first client it hears from and a server,
+// dropping every `drop_every`th one in each direction.
+class LossyForwarder {
+ public:
+  LossyForwarder(asio::io_context &ctx, asio::ip::udp::endpoint server,
+                 size_t drop_every)
+      : socket_{ctx, kLoopback},
+        upstream_{ctx, kLoopback},
+        server_{server},
+        drop_every_{drop_every} {
+    asio::co_spawn(ctx, Relay(socket_, upstream_, true), asio::detached);
+    asio::co_spawn(ctx, Relay(upstream_, socket_, false), asio::detached);
+  }
+
+  void Stop() {
+    socket_.close();
+    upstream_.close();
+  }
+
+  [[nodiscard]] asio::ip::udp::endpoint Endpoint() const {
+    return socket_.local_endpoint();
+  }
+  size_t dropped{0};
+
+ private:
+  asio::awaitable<void> Relay(asio::ip::udp::socket &from,
+                              asio::ip::udp::socket &to, bool outbound) {
+    std::array<char, 65536> buf{};
+    size_t count{0};
+    asio::ip::udp::endpoint peer;
+    while (from.is_open()) {
+      asio::error_code err;
+      const auto len = co_await from.async_receive_from(
+          asio::buffer(buf), peer,
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      if (outbound) client_ = peer;
+      if (++count % drop_every_ == 0) {
+        ++dropped;
+        continue;
+      }
+      to.send_to(asio::buffer(buf.data(), len), outbound ? server_ : client_,
+                 0, err);
+    }
+  }
+
+  asio::ip::udp::socket socket_;
+  asio::ip::udp::socket upstream_;
+  asio::ip::udp::endpoint server_;
+  asio::ip::udp::endpoint client_;
+  size_t drop_every_;
+};
+
+template <typename F>
+void RunTest(F &&f) {
+  asio::io_context ctx;
+  QuicListener listener{ctx, kLoopback};
+  asio::co_spawn(ctx, Echo(listener), asio::detached);
+  asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        co_await f(ctx, listener);
+        listener.Close();
+      },
+      asio::detached);
+  ctx.run();
+}
+
+}  // namespace
+
+TEST(QuicChannelTest, EchoesConcurrentStreams) {
+  RunTest([](asio::io_context &ctx,
+             QuicListener &listener) -> asio::awaitable<void> {
+    auto channel = co_await QuicChannel::AsyncConnect(listener.LocalEndpoint());
+    size_t done{0};
+    for (size_t i = 0; i < 32; ++i) {
+      asio::co_spawn(
+          ctx,
+          [&, i]() -> asio::awaitable<void> {
+            co_await Exchange(*channel, Pattern(256 * 1024, i));
+            ++done;
+          },
+          asio::detached);
+    }
+    asio::steady_timer timer{ctx};
+    while (done < 32) {
+      timer.expires_after(std::chrono::milliseconds{10});
+      co_await timer.async_wait(asio::use_awaitable);
+    }
+    EXPECT_EQ(channel->Stats().packets_lost, 0);
+    channel->Close();
+  });
+}
+
+TEST(QuicChannelTest, SendsEarlyDataWithTicket) {
+  RunTest([](asio::io_context &ctx,
+             QuicListener &listener) -> asio::awaitable<void> {
+    auto first = co_await QuicChannel::AsyncConnect(listener.LocalEndpoint());
+    co_await Exchange(*first, "hello");
+    const auto ticket = first->Ticket();
+    EXPECT_TRUE(ticket);
+    first->Close();
+
+    const QuicConfig config;
+    auto second = co_await QuicChannel::AsyncConnect(listener.LocalEndpoint(),
+                                                     config, ticket);
+    co_await Exchange(*second, Pattern(4096, 1));
+    EXPECT_TRUE(second->EarlyDataAccepted());
+    second->Close();
+
+    // tickets are single use, data of a replay is sent again as 1-RTT
+    auto third = co_await QuicChannel::AsyncConnect(listener.LocalEndpoint(),
+                                                    config, ticket);
+    co_await Exchange(*third, Pattern(4096, 2));
+    EXPECT_FALSE(third->EarlyDataAccepted());
+    third->Close();
+  });
+}
+
+TEST(QuicChannelTest, RecoversFromLoss) {
+  RunTest([](asio::io_context &ctx,
+             QuicListener &listener) -> asio::awaitable<void> {
+    LossyForwarder forwarder{ctx, listener.LocalEndpoint(), 20};
+    auto channel = co_await QuicChannel::AsyncConnect(forwarder.Endpoint());
+    co_await Exchange(*channel, Pattern(1024 * 1024, 3));
+    EXPECT_GT(forwarder.dropped, 0);
+    EXPECT_GT(channel->Stats().packets_lost, 0);
+    channel->Close();
+    forwarder.Stop();
+  });
+}
+
+TEST(QuicChannelTest, FollowsClientMigration) {
+  RunTest([](asio::io_context &ctx,
+             QuicListener &listener) -> asio::awaitable<void> {
+    auto channel = co_await QuicChannel::AsyncConnect(listener.LocalEndpoint());
+    auto stream = co_await channel->AsyncOpen();
+    const auto data = Pattern(512 * 1024, 4);
+    co_await stream->AsyncWrite(asio::buffer(data.data(), data.size() / 2));
+    channel->Migrate();
+    co_await stream->AsyncWrite(
+        asio::buffer(data.data() + data.size() / 2, data.size() / 2));
+    stream->Shutdown();
+    EXPECT_EQ(co_await ReadAll(*stream), data);
+    channel->Close();
+  });
+}
+
+TEST(QuicChannelTest, TimesOutWithoutServer) {
+  asio::io_context ctx;
+  // nothing answers there
+  asio::ip::udp::socket silent{ctx, kLoopback};
+  asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        const QuicConfig config{.idle_timeout = std::chrono::milliseconds{300}};
+        try {
+          co_await QuicChannel::AsyncConnect(silent.local_endpoint(), config);
+          ADD_FAILURE();
+        } catch (const asio::system_error &e) {
+          EXPECT_EQ(e.code(), asio::error::timed_out);
+        }
+      },
+      asio::detached);
+  ctx.run();
+}
+
+}  // namespace socks
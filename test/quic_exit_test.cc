@@ -0,0 +1,85 @@
+#include "tunnel/quic_exit.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+
+#include "utility/result.h"
+
+namespace socks::tunnel {
+
+namespace {
+
+const asio::ip::udp::endpoint kLoopback{asio::ip::address_v4::loopback(), 0};
+
+// Opens a tunnel to `target` through `relay` by a client of `config`,
+// returns the error the open failed with.
+asio::awaitable<asio::error_code> Open(asio::io_context &ctx,
+                                       ExitRelay &relay,
+                                       const asio::ip::tcp::endpoint &target,
+                                       const QuicConfig &config) {
+  ExitClient client{ctx, relay.LocalEndpoint(), config};
+  try {
+    auto stream = co_await client.AsyncOpen(target.address().to_string(),
+                                            target.port());
+    stream->Shutdown();
+  } catch (const asio::system_error &e) {
+    co_return e.code();
+  }
+  co_return asio::error_code{};
+}
+
+template <typename F>
+void RunTest(F &&f) {
+  asio::io_context ctx;
+  asio::co_spawn(ctx, f(ctx), asio::detached);
+  ctx.run();
+}
+
+}  // namespace
+
+TEST(QuicExitTest, RefusesInternalTargets) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    asio::ip::tcp::acceptor target{ctx, {asio::ip::address_v4::loopback(), 0}};
+    const QuicConfig client;
+    ExitRelay strict{ctx, {.endpoint = kLoopback}};
+    EXPECT_EQ(co_await Open(ctx, strict, target.local_endpoint(), client),
+              asio::error::access_denied);
+    strict.Close();
+
+    ExitRelay open{ctx, {.endpoint = kLoopback, .allow_internal = true}};
+    EXPECT_FALSE(co_await Open(ctx, open, target.local_endpoint(), client));
+    open.Close();
+    target.close();
+  });
+}
+
+TEST(QuicExitTest, TurnsAwayClientsWithoutKey) {
+  RunTest([](asio::io_context &ctx) -> asio::awaitable<void> {
+    asio::ip::tcp::acceptor target{ctx, {asio::ip::address_v4::loopback(), 0}};
+    ExitRelay relay{ctx, {.endpoint = kLoopback,
+                          .quic = {.psk = "secret"},
+                          .allow_internal = true}};
+    const QuicConfig none, guess{.psk = "guess"}, secret{.psk = "secret"};
+    EXPECT_TRUE(co_await Open(ctx, relay, target.local_endpoint(), none));
+    EXPECT_TRUE(co_await Open(ctx, relay, target.local_endpoint(), guess));
+    EXPECT_FALSE(co_await Open(ctx, relay, target.local_endpoint(), secret));
+    relay.Close();
+    target.close();
+  });
+}
+
+TEST(QuicExitTest, BindsLoopbackOnly) {
+  asio::io_context ctx;
+  EXPECT_THROW(
+      (ExitRelay{ctx, {.endpoint = {asio::ip::address_v4::any(), 0}}}),
+      SocksException);
+  // a key doesn't help, it crosses the wire in the clear
+  EXPECT_THROW((ExitRelay{ctx, {.endpoint = {asio::ip::address_v4::any(), 0},
+                                .quic = {.psk = "secret"}}}),
+               SocksException);
+  ExitRelay relay{ctx, {.endpoint = {asio::ip::address_v6::loopback(), 0}}};
+  relay.Close();
+}
+
+}  // namespace socks::tunnel
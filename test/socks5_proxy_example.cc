@@ -0,0 +1,14 @@
+#include <iostream>
+
+#include "tunnel/socks5_proxy.h"
+#include "utility/log.h"
+
+int main(int argc, char **argv) {
+  socks::InitAsyncLogger();
+
+  const auto proxy = socks::tunnel::Socks5Proxy::Create({});
+  proxy->Start();
+
+  std::cin.get();
+  return 0;
+}
@@ -0,0 +1,281 @@
+#include "tunnel/socks5_proxy.h"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <asio.hpp>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace socks::tunnel {
+
+namespace {
+
+// Echoes what every connection sends on `address`, and every datagram
+// received on the same port.
+class EchoOrigin {
+ public:
+  explicit EchoOrigin(const asio::ip::address &address)
+      : acceptor_{ctx_, {address, 0}},
+        udp_{ctx_, {address, acceptor_.local_endpoint().port()}} {
+    asio::co_spawn(ctx_, Accept(), asio::detached);
+    asio::co_spawn(ctx_, EchoDatagrams(), asio::detached);
+    thread_ = std::thread{[this] { ctx_.run(); }};
+  }
+  ~EchoOrigin() {
+    asio::post(ctx_, [this] {
+      acceptor_.close();
+      udp_.close();
+    });
+    ctx_.stop();
+    thread_.join();
+  }
+
+  [[nodiscard]] uint16_t Port() const {
+    return acceptor_.local_endpoint().port();
+  }
+
+ private:
+  asio::awaitable<void> Accept() {
+    while (true) {
+      asio::error_code err;
+      auto socket = co_await acceptor_.async_accept(
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      asio::co_spawn(ctx_, Echo(std::move(socket)), asio::detached);
+    }
+  }
+
+  static asio::awaitable<void> Echo(asio::ip::tcp::socket socket) {
+    std::array<char, 1024> buf{};
+    asio::error_code err;
+    while (true) {
+      const auto len = co_await socket.async_read_some(
+          asio::buffer(buf), asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      co_await asio::async_write(
+          socket, asio::buffer(buf.data(), len),
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+    }
+  }
+
+  asio::awaitable<void> EchoDatagrams() {
+    std::array<char, 1024> buf{};
+    asio::ip::udp::endpoint peer;
+    asio::error_code err;
+    while (true) {
+      const auto len = co_await udp_.async_receive_from(
+          asio::buffer(buf), peer,
+          asio::redirect_error(asio::use_awaitable, err));
+      if (err) co_return;
+      co_await udp_.async_send_to(
+          asio::buffer(buf.data(), len), peer,
+          asio::redirect_error(asio::use_awaitable, err));
+    }
+  }
+
+  asio::io_context ctx_;
+  asio::ip::tcp::acceptor acceptor_;
+  asio::ip::udp::socket udp_;
+  std::thread thread_;
+};
+
+uint16_t FreePort() {
+  asio::io_context ctx;
+  asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::tcp::v4(), 0}};
+  return acceptor.local_endpoint().port();
+}
+
+using Bytes = std::vector<uint8_t>;
+
+// [atyp][address][port] of an ip address.
+Bytes AddressOf(const asio::ip::address &address, uint16_t port) {
+  Bytes out;
+  if (address.is_v4()) {
+    out.push_back(0x01);
+    const auto bytes = address.to_v4().to_bytes();
+    out.insert(out.end(), bytes.begin(), bytes.end());
+  } else {
+    out.push_back(0x04);
+    const auto bytes = address.to_v6().to_bytes();
+    out.insert(out.end(), bytes.begin(), bytes.end());
+  }
+  out.push_back(static_cast<uint8_t>(port >> 8));
+  out.push_back(static_cast<uint8_t>(port & 0xff));
+  return out;
+}
+
+Bytes DomainOf(std::string_view host, uint16_t port) {
+  Bytes out{0x03, static_cast<uint8_t>(host.size())};
+  out.insert(out.end(), host.begin(), host.end());
+  out.push_back(static_cast<uint8_t>(port >> 8));
+  out.push_back(static_cast<uint8_t>(port & 0xff));
+  return out;
+}
+
+class Socks5ProxyTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    std::ofstream{hosts_} << "127.0.0.1 origin.test\n";
+    port_ = FreePort();
+    proxy_ = Socks5Proxy::Create(Socks5ProxyConfig{
+        .port = port_,
+        .frontend = {.threads = 1,
+                     .resolver = {.hosts_file = hosts_},
+                     .timeouts = {.header = std::chrono::seconds{5}}}});
+    proxy_->Start();
+  }
+  void TearDown() override {
+    proxy_.reset();
+    std::remove(hosts_.c_str());
+  }
+
+  // Connects to the proxy and agrees on no authentication.
+  asio::ip::tcp::socket Greet() {
+    asio::ip::tcp::socket socket{ctx_};
+    socket.connect({asio::ip::address_v4::loopback(), port_});
+    asio::write(socket, asio::buffer(Bytes{0x05, 0x01, 0x00}));
+    std::array<uint8_t, 2> selected{};
+    asio::read(socket, asio::buffer(selected));
+    EXPECT_EQ(selected, (std::array<uint8_t, 2>{0x05, 0x00}));
+    return socket;
+  }
+
+  // Sends `command` for `address` and returns the reply code, the address
+  // bound by the proxy is left in `bound`.
+  static uint8_t Request(asio::ip::tcp::socket &socket, uint8_t command,
+                         const Bytes &address,
+                         asio::ip::udp::endpoint *bound = nullptr) {
+    Bytes request{0x05, command, 0x00};
+    request.insert(request.end(), address.begin(), address.end());
+    asio::write(socket, asio::buffer(request));
+    std::array<uint8_t, 4> head{};
+    asio::read(socket, asio::buffer(head));
+    EXPECT_EQ(head[0], 0x05);
+    Bytes rest(head[3] == 0x01 ? 4 + 2 : 16 + 2);
+    asio::read(socket, asio::buffer(rest));
+    if (bound != nullptr && head[3] == 0x01) {
+      asio::ip::address_v4::bytes_type ip;
+      std::copy_n(rest.begin(), 4, ip.begin());
+      *bound = {asio::ip::address_v4{ip},
+                static_cast<uint16_t>(rest[4] << 8 | rest[5])};
+    }
+    return head[1];
+  }
+
+  static std::string Echo(asio::ip::tcp::socket &socket,
+                          std::string_view payload) {
+    asio::write(socket, asio::buffer(payload));
+    std::string out(payload.size(), '\0');
+    asio::read(socket, asio::buffer(out));
+    return out;
+  }
+
+  const std::string hosts_ = testing::TempDir() + "socks5_proxy_test_hosts";
+  asio::io_context ctx_;
+  uint16_t port_{0};
+  std::shared_ptr<Socks5Proxy> proxy_;
+};
+
+TEST_F(Socks5ProxyTest, ConnectsToIpv4) {
+  EchoOrigin origin{asio::ip::address_v4::loopback()};
+  auto socket = Greet();
+  const auto reply = Request(
+      socket, 0x01, AddressOf(asio::ip::address_v4::loopback(), origin.Port()));
+  EXPECT_EQ(reply, 0x00);
+  EXPECT_EQ(Echo(socket, "ping"), "ping");
+}
+
+TEST_F(Socks5ProxyTest, ConnectsToIpv6) {
+  EchoOrigin origin{asio::ip::address_v6::loopback()};
+  auto socket = Greet();
+  const auto reply = Request(
+      socket, 0x01, AddressOf(asio::ip::address_v6::loopback(), origin.Port()));
+  EXPECT_EQ(reply, 0x00);
+  EXPECT_EQ(Echo(socket, "ping"), "ping");
+}
+
+TEST_F(Socks5ProxyTest, ConnectsToDomain) {
+  EchoOrigin origin{asio::ip::address_v4::loopback()};
+  auto socket = Greet();
+  EXPECT_EQ(Request(socket, 0x01, DomainOf("origin.test", origin.Port())),
+            0x00);
+  EXPECT_EQ(Echo(socket, "ping"), "ping");
+}
+
+// The payload sent right behind the request reaches the origin as well.
+TEST_F(Socks5ProxyTest, RelaysEarlyPayload) {
+  EchoOrigin origin{asio::ip::address_v4::loopback()};
+  asio::ip::tcp::socket socket{ctx_};
+  socket.connect({asio::ip::address_v4::loopback(), port_});
+  Bytes all{0x05, 0x01, 0x00, 0x05, 0x01, 0x00};
+  const auto address =
+      AddressOf(asio::ip::address_v4::loopback(), origin.Port());
+  all.insert(all.end(), address.begin(), address.end());
+  all.insert(all.end(), {'p', 'i', 'n', 'g'});
+  asio::write(socket, asio::buffer(all));
+  std::array<uint8_t, 2 + 4 + 4 + 2 + 4> answer{};
+  asio::read(socket, asio::buffer(answer));
+  EXPECT_EQ(answer[3], 0x00);
+  EXPECT_EQ(std::string(answer.end() - 4, answer.end()), "ping");
+}
+
+TEST_F(Socks5ProxyTest, ClosesOnBadVersion) {
+  asio::ip::tcp::socket socket{ctx_};
+  socket.connect({asio::ip::address_v4::loopback(), port_});
+  asio::write(socket, asio::buffer(Bytes{0x04, 0x01, 0x00}));
+  std::array<uint8_t, 2> answer{};
+  asio::error_code err;
+  const auto len = asio::read(socket, asio::buffer(answer), err);
+  EXPECT_EQ(len, 0);
+  EXPECT_EQ(err, asio::error::eof);
+}
+
+TEST_F(Socks5ProxyTest, RejectsUnsupportedCommand) {
+  auto socket = Greet();
+  EXPECT_EQ(Request(socket, 0x02,
+                    AddressOf(asio::ip::address_v4::loopback(), 80)),
+            0x07);
+}
+
+// Datagrams carry their target in a header, the answers come back with
+// the header of their source. A fragment is dropped, the datagram behind
+// it still goes through.
+TEST_F(Socks5ProxyTest, AssociatesUdp) {
+  EchoOrigin origin{asio::ip::address_v4::loopback()};
+  auto socket = Greet();
+  asio::ip::udp::endpoint bound;
+  EXPECT_EQ(Request(socket, 0x03, AddressOf(asio::ip::address_v4::any(), 0),
+                    &bound),
+            0x00);
+  ASSERT_NE(bound.port(), 0);
+
+  asio::ip::udp::socket udp{ctx_, {asio::ip::address_v4::loopback(), 0}};
+  const auto target =
+      AddressOf(asio::ip::address_v4::loopback(), origin.Port());
+  Bytes fragment{0x00, 0x00, 0x01};
+  fragment.insert(fragment.end(), target.begin(), target.end());
+  fragment.insert(fragment.end(), {'f', 'r', 'a', 'g'});
+  udp.send_to(asio::buffer(fragment), bound);
+  Bytes datagram{0x00, 0x00, 0x00};
+  datagram.insert(datagram.end(), target.begin(), target.end());
+  datagram.insert(datagram.end(), {'h', 'e', 'l', 'l', 'o'});
+  udp.send_to(asio::buffer(datagram), bound);
+
+  std::array<uint8_t, 64> answer{};
+  asio::ip::udp::endpoint from;
+  const auto len = udp.receive_from(asio::buffer(answer), from);
+  EXPECT_EQ(from, bound);
+  EXPECT_EQ(Bytes(answer.begin(), answer.begin() + len), datagram);
+
+  // the association ends with the control connection
+  socket.close();
+}
+
+}  // namespace
+
+}  // namespace socks::tunnel
@@ -0,0 +1,173 @@
+#include "coro/task.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <stdexcept>
+#include <vector>
+
+#include "coro/asio_task.h"
+#include "coro/waiter_list.h"
+#include "coro/when_all.h"
+
+namespace socks {
+
+namespace {
+
+Task<int> Value(int value) { co_return value; }
+
+Task<int> Sum(int n) {
+  int sum{0};
+  for (int i = 0; i < n; ++i) sum += co_await Value(1);
+  co_return sum;
+}
+
+Task<void> Fail() {
+  throw std::runtime_error{"failed"};
+  co_return;
+}
+
+Task<void> Mark(bool &started) {
+  started = true;
+  co_return;
+}
+
+Task<void> Connect(asio::io_context &ctx, asio::ip::tcp::endpoint endpoint) {
+  asio::ip::tcp::socket socket{ctx};
+  co_await socket.async_connect(endpoint, use_task);
+}
+
+Task<void> Sleep(asio::io_context &ctx, int ms, std::vector<int> &done) {
+  asio::steady_timer timer{ctx, std::chrono::milliseconds{ms}};
+  co_await timer.async_wait(use_task);
+  done.push_back(ms);
+}
+
+size_t CachedFrames() {
+  size_t cached{0};
+  for (auto size = FramePool::kMinClass; size <= FramePool::kMaxClass;
+       size *= 2) {
+    cached += FramePool::Cached(size);
+  }
+  return cached;
+}
+
+Task<size_t> Wait(asio::io_context &ctx) {
+  asio::steady_timer timer{ctx, std::chrono::milliseconds{1}};
+  co_await timer.async_wait(use_task);
+  co_return co_await Sum(3);
+}
+
+}  // namespace
+
+TEST(TaskTest, StartsWhenAwaited) {
+  bool started{false};
+  auto task = Mark(started);
+  EXPECT_FALSE(started);
+
+  asio::io_context ctx;
+  AsyncRun(ctx, std::move(task), asio::detached);
+  ctx.run();
+  EXPECT_TRUE(started);
+}
+
+TEST(TaskTest, ResumesSynchronousChainsWithoutRecursion) {
+  asio::io_context ctx;
+  int result{0};
+  AsyncRun(ctx, Sum(10000), [&result](std::exception_ptr e, int sum) {
+    EXPECT_FALSE(e);
+    result = sum;
+  });
+  ctx.run();
+  EXPECT_EQ(result, 10000);
+}
+
+TEST(TaskTest, RunsAsioOperations) {
+  asio::io_context ctx;
+  size_t result{0};
+  asio::co_spawn(
+      ctx,
+      [&ctx, &result]() -> asio::awaitable<void> {
+        result = co_await AsyncRun(ctx, Wait(ctx), asio::use_awaitable);
+        EXPECT_THROW(co_await AsyncRun(ctx, Fail(), asio::use_awaitable),
+                     std::runtime_error);
+      },
+      asio::detached);
+  ctx.run();
+  EXPECT_EQ(result, 3);
+}
+
+TEST(TaskTest, ThrowsOperationErrors) {
+  asio::io_context ctx;
+  asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::tcp::v4(), 0}};
+  const auto endpoint = acceptor.local_endpoint();
+  acceptor.close();
+
+  std::exception_ptr error;
+  AsyncRun(ctx, Connect(ctx, endpoint),
+           [&error](std::exception_ptr e) { error = e; });
+  ctx.run();
+  EXPECT_THROW(std::rethrow_exception(error), asio::system_error);
+}
+
+TEST(TaskTest, JoinsTasks) {
+  asio::io_context ctx;
+  std::vector<int> done;
+  bool joined{false};
+  AsyncRun(ctx, WhenAll(Sleep(ctx, 5, done), Sleep(ctx, 1, done), Fail()),
+           [&](std::exception_ptr e) {
+             joined = true;
+             // the failure surfaces once the others are done too
+             EXPECT_TRUE(e);
+             EXPECT_EQ(done, (std::vector<int>{1, 5}));
+           });
+  ctx.run();
+  EXPECT_TRUE(joined);
+}
+
+TEST(TaskTest, ReusesFrames) {
+  asio::io_context ctx;
+  AsyncRun(ctx, Sum(10), asio::detached);
+  ctx.run();
+  const auto cached = CachedFrames();
+  EXPECT_GT(cached, 0);
+
+  // the same frames are taken and given back again
+  AsyncRun(ctx, Sum(10), asio::detached);
+  ctx.restart();
+  ctx.run();
+  EXPECT_EQ(CachedFrames(), cached);
+}
+
+TEST(WaiterListTest, WakesEveryWaiterOnce) {
+  asio::io_context ctx;
+  WaiterList waiters;
+  bool ready{false};
+  size_t parked{0};
+  size_t done{0};
+  for (size_t i = 0; i < 3; ++i) {
+    asio::co_spawn(
+        ctx,
+        [&]() -> asio::awaitable<void> {
+          while (!ready) {
+            ++parked;
+            co_await waiters.Wait();
+          }
+          ++done;
+        },
+        asio::detached);
+  }
+  // parking one waiter leaves the others alone
+  ctx.poll();
+  EXPECT_EQ(waiters.Size(), 3);
+  EXPECT_EQ(parked, 3);
+
+  ready = true;
+  waiters.NotifyAll();
+  ctx.run();
+  EXPECT_EQ(done, 3);
+  EXPECT_EQ(parked, 3);
+  EXPECT_EQ(waiters.Size(), 0);
+}
+
+}  // namespace socks
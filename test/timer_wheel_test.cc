@@ -0,0 +1,60 @@
+#include "tunnel/timer_wheel.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <vector>
+
+namespace socks::tunnel {
+
+using std::chrono::milliseconds;
+
+TEST(TimerWheelTest, FiresInOrder) {
+  asio::io_context ctx;
+  TimerWheel wheel{ctx, milliseconds{1}};
+  std::vector<int> fired;
+  TimerWheel::Timer late{[&fired] { fired.push_back(2); }};
+  TimerWheel::Timer early{[&fired] { fired.push_back(1); }};
+  // beyond the first level, fired after a cascade
+  TimerWheel::Timer cascaded{[&fired] { fired.push_back(3); }};
+  wheel.Arm(late, milliseconds{20});
+  wheel.Arm(early, milliseconds{5});
+  wheel.Arm(cascaded, milliseconds{100});
+  EXPECT_EQ(wheel.Size(), 3);
+
+  ctx.run();
+  EXPECT_EQ(fired, (std::vector<int>{1, 2, 3}));
+  EXPECT_EQ(wheel.Size(), 0);
+  EXPECT_GE(wheel.Now(), 100);
+}
+
+TEST(TimerWheelTest, CancelsAndRearms) {
+  asio::io_context ctx;
+  TimerWheel wheel{ctx, milliseconds{1}};
+  size_t fired{0};
+  TimerWheel::Timer cancelled{[&fired] { ++fired; }};
+  TimerWheel::Timer rearmed{[&fired] { fired += 10; }};
+  wheel.Arm(cancelled, milliseconds{5});
+  wheel.Arm(rearmed, milliseconds{5});
+  cancelled.Cancel();
+  wheel.Arm(rearmed, milliseconds{10});
+  EXPECT_FALSE(cancelled.Armed());
+  EXPECT_EQ(wheel.Size(), 1);
+
+  ctx.run();
+  EXPECT_EQ(fired, 10);
+}
+
+TEST(TimerWheelTest, TimersOutliveTheWheel) {
+  asio::io_context ctx;
+  TimerWheel::Timer timer{[] {}};
+  {
+    TimerWheel wheel{ctx};
+    wheel.Arm(timer, milliseconds{1000});
+    EXPECT_TRUE(timer.Armed());
+  }
+  EXPECT_FALSE(timer.Armed());
+  ctx.run();
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,32 @@
+#include <fstream>
+#include <iostream>
+#include <string_view>
+
+#include "utility/trace.h"
+
+int main(int argc, char **argv) {
+  auto format = socks::TraceFormat::kText;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg{argv[i]};
+    if (arg == "--chrome") {
+      format = socks::TraceFormat::kChrome;
+    } else if (path == nullptr && !arg.starts_with("--")) {
+      path = argv[i];
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (path == nullptr) {
+    std::cerr << "usage: trace_decode [--chrome] TRACE\n";
+    return 1;
+  }
+
+  std::ifstream in{path, std::ios::binary};
+  if (!socks::DecodeTrace(in, std::cout, format)) {
+    std::cerr << path << " is no trace\n";
+    return 1;
+  }
+  return 0;
+}
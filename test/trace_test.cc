@@ -0,0 +1,64 @@
+#include "utility/trace.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+namespace socks {
+
+namespace {
+
+std::string Decode(const std::string &path, TraceFormat format) {
+  std::ifstream in{path, std::ios::binary};
+  std::ostringstream out;
+  EXPECT_TRUE(DecodeTrace(in, out, format));
+  return out.str();
+}
+
+}  // namespace
+
+TEST(TraceTest, DecodesRecordsOfAllThreads) {
+  const auto path =
+      (std::filesystem::temp_directory_path() / "quic_socks_trace_test")
+          .string();
+  Trace(TraceEvent::kAccept, 1, 40000);  // not tracing yet
+  ASSERT_TRUE(StartTracing({.path = path}));
+  Trace(TraceEvent::kAccept, 7, 40000);
+  std::thread{[] {
+    Trace(TraceEvent::kConnect, 7, 80, 1);
+    Trace(TraceEvent::kForward, 7, 1, 512);
+  }}.join();
+  Trace(TraceEvent::kClose, 7);
+  StopTracing();
+  Trace(TraceEvent::kClose, 1);
+
+  const auto text = Decode(path, TraceFormat::kText);
+  EXPECT_EQ(std::count(text.begin(), text.end(), '\n'), 4);
+  EXPECT_NE(text.find("idx=7 accept port=40000\n"), std::string::npos);
+  EXPECT_NE(text.find("idx=7 connect port=80 reused=1\n"), std::string::npos);
+  EXPECT_NE(text.find("idx=7 forward outside=1 bytes=512\n"),
+            std::string::npos);
+  // in order of time
+  EXPECT_LT(text.find("accept"), text.find("connect"));
+  EXPECT_LT(text.find("forward"), text.find("close"));
+  EXPECT_EQ(text.find("idx=1"), std::string::npos);
+
+  const auto chrome = Decode(path, TraceFormat::kChrome);
+  EXPECT_TRUE(chrome.starts_with("{\"traceEvents\":["));
+  EXPECT_NE(chrome.find("\"name\":\"session\",\"cat\":\"session\",\"ph\":\"b\""),
+            std::string::npos);
+  EXPECT_NE(chrome.find("\"ph\":\"e\""), std::string::npos);
+  EXPECT_NE(chrome.find("\"args\":{\"outside\":1,\"bytes\":512}"),
+            std::string::npos);
+
+  std::istringstream garbage{"not a trace at all, not even close"};
+  std::ostringstream out;
+  EXPECT_FALSE(DecodeTrace(garbage, out, TraceFormat::kText));
+  std::filesystem::remove(path);
+}
+
+}  // namespace socks
@@ -0,0 +1,186 @@
+#include "tunnel/upstream_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <asio.hpp>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace socks::tunnel {
+
+namespace {
+
+// Accepts connections on the loopback and keeps the server side of them.
+class StandInOrigin {
+ public:
+  explicit StandInOrigin(asio::io_context &ctx)
+      : ctx_{ctx}, acceptor_{ctx, {asio::ip::address_v4::loopback(), 0}} {}
+
+  // Connects to the origin, returns the client side and its local endpoint,
+  // the server side stays in `Peer()`.
+  std::pair<asio::ip::tcp::socket, asio::ip::tcp::endpoint> Connect() {
+    asio::ip::tcp::socket client{ctx_};
+    client.connect(acceptor_.local_endpoint());
+    peers_.push_back(acceptor_.accept());
+    auto local = client.local_endpoint();
+    return {std::move(client), local};
+  }
+
+  asio::ip::tcp::socket &Peer(size_t index) { return peers_[index]; }
+
+  // Whether the client side of the `index`th connection was closed, with a
+  // reset if it had unread data.
+  bool Closed(size_t index) {
+    std::array<char, 1> byte{};
+    asio::error_code err;
+    peers_[index].read_some(asio::buffer(byte), err);
+    return err == asio::error::eof || err == asio::error::connection_reset;
+  }
+
+ private:
+  asio::io_context &ctx_;
+  asio::ip::tcp::acceptor acceptor_;
+  std::vector<asio::ip::tcp::socket> peers_;
+};
+
+}  // namespace
+
+// Connections are handed out per host and port, the newest first.
+TEST(UpstreamPoolTest, ReusesPerOrigin) {
+  asio::io_context ctx;
+  StandInOrigin origin{ctx};
+  UpstreamPool pool{ctx, {}};
+  auto [a1, a1_local] = origin.Connect();
+  auto [a2, a2_local] = origin.Connect();
+  auto [b, b_local] = origin.Connect();
+  pool.Checkin("a.test", 80, std::move(a1));
+  pool.Checkin("a.test", 80, std::move(a2));
+  pool.Checkin("b.test", 80, std::move(b));
+  EXPECT_EQ(pool.Size(), 3);
+
+  EXPECT_FALSE(pool.Checkout("a.test", 443));
+  EXPECT_FALSE(pool.Checkout("c.test", 80));
+  auto socket = pool.Checkout("a.test", 80);
+  ASSERT_TRUE(socket);
+  EXPECT_EQ(socket->local_endpoint(), a2_local);
+  socket = pool.Checkout("a.test", 80);
+  ASSERT_TRUE(socket);
+  EXPECT_EQ(socket->local_endpoint(), a1_local);
+  EXPECT_FALSE(pool.Checkout("a.test", 80));
+
+  socket = pool.Checkout("b.test", 80);
+  ASSERT_TRUE(socket);
+  EXPECT_EQ(socket->local_endpoint(), b_local);
+  EXPECT_EQ(pool.Size(), 0);
+
+  // a closed socket isn't parked
+  socket->close();
+  pool.Checkin("b.test", 80, std::move(*socket));
+  EXPECT_EQ(pool.Size(), 0);
+}
+
+TEST(UpstreamPoolTest, ExpiresIdleConnections) {
+  asio::io_context ctx;
+  StandInOrigin origin{ctx};
+  UpstreamPool pool{ctx, {.idle_timeout = std::chrono::seconds{1}}};
+  auto [conn, local] = origin.Connect();
+  pool.Checkin("a.test", 80, std::move(conn));
+
+  // the timer checks every half timeout, the connection is gone after at
+  // most one and a half
+  ctx.run_for(std::chrono::milliseconds{700});
+  EXPECT_EQ(pool.Size(), 1);
+  ctx.run_for(std::chrono::milliseconds{1000});
+  EXPECT_EQ(pool.Size(), 0);
+  EXPECT_TRUE(origin.Closed(0));
+  EXPECT_FALSE(pool.Checkout("a.test", 80));
+}
+
+// Checkout doesn't rely on the timer, a connection past the timeout is
+// never handed out.
+TEST(UpstreamPoolTest, SkipsExpiredOnCheckout) {
+  asio::io_context ctx;
+  StandInOrigin origin{ctx};
+  UpstreamPool pool{ctx, {.idle_timeout = std::chrono::seconds{1}}};
+  auto [conn, local] = origin.Connect();
+  pool.Checkin("a.test", 80, std::move(conn));
+  std::this_thread::sleep_for(std::chrono::milliseconds{1100});
+  EXPECT_FALSE(pool.Checkout("a.test", 80));
+  EXPECT_EQ(pool.Size(), 0);
+  EXPECT_TRUE(origin.Closed(0));
+}
+
+// A full origin drops its oldest connection for the new one, a full pool
+// only makes room within the origin checking in.
+TEST(UpstreamPoolTest, CapsIdleConnections) {
+  asio::io_context ctx;
+  StandInOrigin origin{ctx};
+  UpstreamPool pool{ctx, {.max_idle_per_host = 2, .max_idle = 3}};
+  auto [a1, a1_local] = origin.Connect();
+  auto [a2, a2_local] = origin.Connect();
+  auto [a3, a3_local] = origin.Connect();
+  pool.Checkin("a.test", 80, std::move(a1));
+  pool.Checkin("a.test", 80, std::move(a2));
+  pool.Checkin("a.test", 80, std::move(a3));
+  EXPECT_EQ(pool.Size(), 2);
+  EXPECT_TRUE(origin.Closed(0));
+
+  auto [b1, b1_local] = origin.Connect();
+  auto [c, c_local] = origin.Connect();
+  auto [b2, b2_local] = origin.Connect();
+  pool.Checkin("b.test", 80, std::move(b1));
+  pool.Checkin("c.test", 80, std::move(c));
+  EXPECT_EQ(pool.Size(), 3);
+  EXPECT_TRUE(origin.Closed(4));
+  pool.Checkin("b.test", 80, std::move(b2));
+  EXPECT_EQ(pool.Size(), 3);
+  EXPECT_TRUE(origin.Closed(3));
+
+  auto socket = pool.Checkout("b.test", 80);
+  ASSERT_TRUE(socket);
+  EXPECT_EQ(socket->local_endpoint(), b2_local);
+  EXPECT_FALSE(pool.Checkout("b.test", 80));
+  EXPECT_FALSE(pool.Checkout("c.test", 80));
+  socket = pool.Checkout("a.test", 80);
+  ASSERT_TRUE(socket);
+  EXPECT_EQ(socket->local_endpoint(), a3_local);
+}
+
+TEST(UpstreamPoolTest, DisablesPooling) {
+  asio::io_context ctx;
+  StandInOrigin origin{ctx};
+  UpstreamPool pool{ctx, {.max_idle_per_host = 0}};
+  auto [conn, local] = origin.Connect();
+  pool.Checkin("a.test", 80, std::move(conn));
+  EXPECT_EQ(pool.Size(), 0);
+  EXPECT_TRUE(origin.Closed(0));
+  EXPECT_FALSE(pool.Checkout("a.test", 80));
+}
+
+// Connections the origin closed, or sent something on while idle, are
+// closed on checkout and the next one is tried.
+TEST(UpstreamPoolTest, SkipsClosedConnections) {
+  asio::io_context ctx;
+  StandInOrigin origin{ctx};
+  UpstreamPool pool{ctx, {}};
+  auto [alive, alive_local] = origin.Connect();
+  auto [garbled, garbled_local] = origin.Connect();
+  auto [closed, closed_local] = origin.Connect();
+  pool.Checkin("a.test", 80, std::move(alive));
+  pool.Checkin("a.test", 80, std::move(garbled));
+  pool.Checkin("a.test", 80, std::move(closed));
+
+  asio::write(origin.Peer(1), asio::buffer("HTTP/1.1 408 Timeout\r\n\r\n"));
+  origin.Peer(2).close();
+  // the data and the fin are on the loopback once write and close return
+  auto socket = pool.Checkout("a.test", 80);
+  ASSERT_TRUE(socket);
+  EXPECT_EQ(socket->local_endpoint(), alive_local);
+  EXPECT_EQ(pool.Size(), 0);
+  EXPECT_TRUE(origin.Closed(1));
+  EXPECT_FALSE(pool.Checkout("a.test", 80));
+}
+
+}  // namespace socks::tunnel
@@ -0,0 +1,86 @@
+#include "tunnel/uring.h"
+
+#include <gtest/gtest.h>
+
+#include <asio.hpp>
+#include <optional>
+#include <vector>
+
+namespace socks::tunnel {
+
+TEST(UringAcceptorTest, AcceptsUntilClosed) {
+  asio::io_context ctx;
+  asio::ip::tcp::acceptor acceptor{
+      ctx, asio::ip::tcp::endpoint{asio::ip::address_v4::loopback(), 0}};
+  auto uring = UringAcceptor::Create(ctx, acceptor);
+  if (!uring) GTEST_SKIP() << "io_uring unavailable";
+
+  // connected before anybody accepts, picked up in one go
+  std::vector<asio::ip::tcp::socket> clients;
+  for (int i = 0; i < 3; ++i) {
+    clients.emplace_back(ctx).connect(acceptor.local_endpoint());
+  }
+  std::vector<asio::ip::tcp::endpoint> accepted;
+  bool aborted{false};
+  co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        try {
+          while (true) {
+            auto socket = co_await uring->AsyncAccept(ctx);
+            accepted.push_back(socket.remote_endpoint());
+            if (accepted.size() == clients.size()) uring->Close();
+          }
+        } catch (const asio::system_error &e) {
+          aborted = e.code() == asio::error::operation_aborted;
+        }
+      },
+      asio::detached);
+  ctx.run();
+
+  ASSERT_EQ(accepted.size(), clients.size());
+  for (size_t i = 0; i < clients.size(); ++i) {
+    EXPECT_EQ(accepted[i], clients[i].local_endpoint());
+  }
+  EXPECT_TRUE(aborted);
+
+  // closed, the listening socket accepts on its own again
+  asio::ip::tcp::socket late{ctx};
+  late.connect(acceptor.local_endpoint());
+  EXPECT_EQ(acceptor.accept().remote_endpoint(), late.local_endpoint());
+}
+
+TEST(UringAcceptorTest, LeavesBacklogAloneWhilePaused) {
+  asio::io_context ctx;
+  asio::ip::tcp::acceptor acceptor{
+      ctx, asio::ip::tcp::endpoint{asio::ip::address_v4::loopback(), 0}};
+  auto uring = UringAcceptor::Create(ctx, acceptor);
+  if (!uring) GTEST_SKIP() << "io_uring unavailable";
+
+  // not taken in by the ring, the listening socket still has it
+  uring->Pause();
+  asio::ip::tcp::socket waiting{ctx};
+  waiting.connect(acceptor.local_endpoint());
+  acceptor.non_blocking(true);
+  asio::error_code err;
+  const auto backlog = acceptor.accept(err);
+  ASSERT_FALSE(err);
+  EXPECT_EQ(backlog.remote_endpoint(), waiting.local_endpoint());
+
+  // armed again by the next accept
+  asio::ip::tcp::socket client{ctx};
+  client.connect(acceptor.local_endpoint());
+  std::optional<asio::ip::tcp::endpoint> accepted;
+  co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto socket = co_await uring->AsyncAccept(ctx);
+        accepted = socket.remote_endpoint();
+        uring->Close();
+      },
+      asio::detached);
+  ctx.run();
+  EXPECT_EQ(accepted, client.local_endpoint());
+}
+
+}  // namespace socks::tunnel